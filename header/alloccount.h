@@ -0,0 +1,16 @@
+#ifndef ALLOCCOUNT_H
+#define ALLOCCOUNT_H
+
+// Counts the allocations made through the global operator new, which
+// alloccount.cpp replaces, for checking that code meant to run every frame
+// does not allocate, see testAllocations. Only the calling thread is
+// counted, so worker threads and the GL driver do not get in the way.
+
+// Starts counting from zero on the calling thread
+void startAllocCount();
+
+// Stops counting and returns the number of allocations since
+// startAllocCount
+long stopAllocCount();
+
+#endif
@@ -0,0 +1,89 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <string>
+#include <vector>
+
+#include "glsupport.h"
+#include "rigtform.h"
+
+// A framebuffer with color and depth renderbuffers, to draw the scene at a
+// size independent of the window
+class OffscreenTarget : Noncopyable {
+  public:
+    OffscreenTarget(int width, int height);
+
+    // Binds the framebuffer and sets the viewport to its size
+    void bind();
+
+    int getWidth() const { return width_; }
+    int getHeight() const { return height_; }
+
+  private:
+    GlFramebuffer fbo_;
+    GlRenderbuffer color_, depth_;
+    int width_, height_;
+};
+
+// The scene the batch mode renders, implemented by the application. Every
+// method is called with a current context.
+class BatchScene {
+  public:
+    virtual ~BatchScene() {}
+
+    // Loads the OpenGL extensions, and sets up the GL state, materials and
+    // scene graph. Throws runtime_error on error.
+    virtual void init() = 0;
+
+    // Releases what init() set up that needs the context, before it goes
+    virtual void cleanup() = 0;
+
+    // Eye frame and environment index of the first frame of the
+    // application, after init()
+    virtual RigTForm getDefaultView() = 0;
+    virtual int getDefaultEnvironment() = 0;
+
+    // Switches to environment `env', waiting until it is loaded
+    virtual void loadEnvironment(int env) = 0;
+
+    // Clears the bound framebuffer of `width' x `height' pixels and draws
+    // the scene seen from `eye' into it
+    virtual void draw(const RigTForm &eye, int width, int height) = 0;
+};
+
+// What --batch renders, see parseBatchOptions
+struct BatchOptions {
+    std::string outDir;
+    std::vector<RigTForm> views; // eye frames, the default one if empty
+    std::vector<int> envs;       // indices into envNames, the default one if empty
+    std::vector<std::string> envNames;
+    int width, height;
+    std::string format;          // file extension, see getCaptureFormat
+    int numProcesses;
+
+    BatchOptions() : width(1024), height(768), format("png"), numProcesses(1) {}
+};
+
+// Parses the arguments following --batch:
+//
+//   OUT_DIR [--view tx,ty,tz[,qw,qx,qy,qz]]... [--env NAME|INDEX]...
+//           [--size WxH] [--format ppm|png|pfm] [--processes N]
+//
+// Every view is rendered in every environment, NAME being one of
+// `envNames'. Views are eye frames in world coordinates, translation then
+// rotation quaternion. Throws runtime_error on invalid arguments.
+BatchOptions parseBatchOptions(int argc, char *argv[],
+                               const std::vector<std::string> &envNames);
+
+// Renders `options' without a window, through a HeadlessContext, and
+// writes the images to options.outDir as ENV_viewNNNN.FORMAT. Prints the
+// render time of every frame, from the start of drawing to glFinish.
+//
+// With options.numProcesses > 1 the views are spread over that many child
+// processes, each with its own context, since the GL state of the scene is
+// global. Must then be called before any thread or context is created.
+// Returns false if rendering failed in a child process, and throws
+// runtime_error if it failed in this one.
+bool runBatch(const BatchOptions &options, BatchScene &scene);
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "batch.h"
+#include "geometry.h"
+#include "material.h"
+#include "matrix4.h"
+
+// Benchmarks of the renderer, run from the command line, see main(). They
+// print their timings to cout, and throw runtime_error if the optimized
+// path they time gives different results than the reference one. Also the
+// tests of what the benchmarks cannot check, which print their results and
+// return whether they passed.
+
+// What benchDraw draws, taken from the scene of the application
+struct BenchDrawScene {
+    Geometry *model;
+    Material *modelMaterial;
+    Matrix4 modelMatrix;
+    Material *material; // of the small meshes and the queued shapes
+    Geometry *cube, *sphere;
+};
+
+// Times `n' draws through Material::draw: of the pbr model, once resolving
+// uniforms through binding plans and once by name through the sorted entries
+// of Uniforms (not the std::map it used to be), and of thousands of small
+// meshes, once with the cached vertex array objects and once specifying the
+// vertex arrays on every draw. Then times submitting a render queue of
+// thousands of shapes sharing their meshes, with and without instancing.
+// The environment and the PerFrame block must be set up.
+void benchDraw(const BenchDrawScene &scene, int n);
+
+// Times world frame queries on a synthetic graph of `numNodes' rbt nodes,
+// each with 8 children, by traversal and through the cached world rbts.
+// Between rounds of queries some rbts change, as in an animated scene.
+// Then times computing every world rbt each round, as drawing the whole
+// graph does, by traversal and with a FlatHierarchy, moving a subtree
+// every round to exercise its incremental rebuild. Needs no GL context.
+void benchScene(int numNodes);
+
+// Times evaluating a frame of `numNodes' animated nodes from 8 random key
+// frames, the way interpolate() used to, finding the segment in the list,
+// copying its frames and calling slerp() per node, and with a KeyFrameTrack.
+// Needs no GL context.
+void benchKeyFrames(int numNodes);
+
+// Times drawing and capturing `n' frames of `scene' at 1920x1080 in each
+// capture format, through FrameCapture and, for comparison, reading back and
+// writing every frame on the render thread. Frames go to capture/bench/.
+void benchCapture(BatchScene &scene, int n);
+
+// Initializes `scene' in a HeadlessContext and draws a few frames of it to
+// warm up its caches, then counts the allocations, see alloccount.h, of
+// `n' frames. A frame draws the scene, then puts per draw values and
+// textures into a Uniforms kept across frames and copies it, as drawing
+// and materials do. Returns whether none of them allocated.
+bool testAllocations(BatchScene &scene, int n);
+
+#endif
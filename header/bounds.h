@@ -0,0 +1,65 @@
+#ifndef BOUNDS_H
+#define BOUNDS_H
+
+#include <limits>
+
+#include "cvec.h"
+#include "matrix4.h"
+
+// Object space bounds of a geometry: an axis aligned box, and a sphere
+// around the center of the box containing all vertices. Empty bounds mean
+// unknown, and are never culled.
+struct Bounds {
+    Cvec3 boxMin, boxMax;
+    Cvec3 center;
+    double radius;
+
+    Bounds()
+        : boxMin(std::numeric_limits<double>::max()),
+          boxMax(-std::numeric_limits<double>::max()), radius(-1) {}
+
+    bool isEmpty() const { return radius < 0; }
+
+    // Bounds of the `p' member of the `numVertices' vertices
+    template <typename Vertex>
+    static Bounds make(const Vertex *vertices, int numVertices) {
+        Bounds b;
+        if (numVertices <= 0)
+            return b;
+        for (int i = 0; i < numVertices; ++i) {
+            for (int k = 0; k < 3; ++k) {
+                const double x = vertices[i].p[k];
+                b.boxMin[k] = x < b.boxMin[k] ? x : b.boxMin[k];
+                b.boxMax[k] = x > b.boxMax[k] ? x : b.boxMax[k];
+            }
+        }
+        b.center = (b.boxMin + b.boxMax) * 0.5;
+        double radius2 = 0;
+        for (int i = 0; i < numVertices; ++i) {
+            const Cvec3 d = Cvec3(vertices[i].p[0], vertices[i].p[1], vertices[i].p[2]) - b.center;
+            radius2 = norm2(d) > radius2 ? norm2(d) : radius2;
+        }
+        b.radius = std::sqrt(radius2);
+        return b;
+    }
+};
+
+// The six planes of a view frustum, for culling bounds outside of it
+class Frustum {
+  public:
+    // Frustum of the clip volume of `projViewMatrix', a projection matrix
+    // times a view matrix, with its planes in world space
+    explicit Frustum(const Matrix4 &projViewMatrix);
+
+    // Whether `bounds', placed by `modelMatrix', may be in the frustum.
+    // Tries the bounding sphere first and the box only when the sphere
+    // straddles a plane. Always true for empty bounds.
+    bool intersects(const Bounds &bounds, const Matrix4 &modelMatrix) const;
+
+  private:
+    // inside where dot(normal, p) + d >= 0, with unit normals
+    Cvec3 normals_[6];
+    double d_[6];
+};
+
+#endif
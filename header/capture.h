@@ -0,0 +1,108 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <condition_variable>
+#include <deque>
+#include <iosfwd>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "glsupport.h"
+
+// Image formats of captured frames, chosen by the file extension
+enum CaptureFormat {
+    CAPTURE_PPM, // .ppm, 8-bit binary RGB
+    CAPTURE_PNG, // .png, 8-bit RGB, stored without compression
+    CAPTURE_PFM  // .pfm, 32-bit float RGB, unclamped
+};
+
+// Throws runtime_error if the extension of `filename' is none of the above
+CaptureFormat getCaptureFormat(const std::string &filename);
+
+// Bytes per pixel read back for `format': RGBA8, or RGB32F for CAPTURE_PFM
+int getCapturePixelSize(CaptureFormat format);
+
+// Encodes `pixels', as glReadPixels returns them for `format' (bottom row
+// first, no row padding), to `os'
+void writeCaptureImage(std::ostream &os, CaptureFormat format, int width,
+                       int height, const char *pixels);
+
+// Captures frames without stalling the render thread. capture() starts an
+// asynchronous copy of the read framebuffer into one of a ring of pixel
+// pack buffers and fences it. poll() hands the buffers whose copy is done
+// to a writer thread, which flips, encodes and writes them out.
+//
+// Frames are never dropped: when every pack buffer is in flight capture()
+// waits for the oldest one, and when the writer falls behind by too many
+// frames handing another one over waits for it to catch up.
+class FrameCapture : Noncopyable {
+  public:
+    FrameCapture();
+
+    // Waits for every frame captured to be written
+    ~FrameCapture();
+
+    // Queues the capture of the `width' x `height' pixels at the bottom left
+    // of the read framebuffer, to be written to `filename', whose directory
+    // is created if needed
+    void capture(int width, int height, const std::string &filename);
+
+    // Hands over the frames whose copy is done, without waiting. Throws
+    // runtime_error if writing a frame failed.
+    void poll();
+
+    // Waits until every frame captured is written. Throws like poll().
+    void flush();
+
+    // Whether frames are still being copied, which poll() has to hand over
+    bool hasFramesInFlight() const { return numInFlight_ > 0; }
+
+    // Frames captured but not written yet
+    int getNumPending() const;
+
+    int getNumWritten() const;
+
+  private:
+    enum { NUM_SLOTS = 3, MAX_QUEUED = 8 };
+
+    struct Frame {
+        CaptureFormat format;
+        int width, height;
+        std::string filename;
+        std::vector<char> pixels;
+    };
+
+    // a pack buffer and the frame being copied into it
+    struct Slot {
+        GlBufferObject pbo;
+        int capacity; // bytes
+        GLsync fence;
+        Frame frame;
+    };
+
+    Slot slots_[NUM_SLOTS];
+    int first_, numInFlight_;
+
+    // Hands slots_[first_] over, after waiting for its copy if `wait'.
+    // Returns false if not waiting and the copy is not done.
+    bool handOver(bool wait);
+
+    void writerLoop();
+    void throwWriteError();
+
+    // frames to write, pixel buffers to reuse, and what the writer is up to,
+    // all guarded by mutex_
+    mutable std::mutex mutex_;
+    std::condition_variable queuedCv_, writtenCv_;
+    std::deque<Frame> queue_;
+    std::vector<std::vector<char>> freePixels_;
+    int numWriting_, numWritten_;
+    std::string error_;
+    bool quit_;
+
+    std::thread writer_;
+};
+
+#endif
@@ -16,15 +16,25 @@ extern std::shared_ptr<Material> g_overridingMaterial;
 
 // takes a projection matrix and send to the the shaders
 inline void sendProjectionMatrix(Uniforms &uniforms, const Matrix4 &projMatrix) {
-    uniforms.put("uProjMatrix", projMatrix);
+    static const UniformKey key("uProjMatrix");
+    uniforms.put(key, projMatrix);
 }
 
 inline void sendViewMatrix(Uniforms &uniforms, const Matrix4 &viewMatrix) {
-    uniforms.put("uViewMatrix", viewMatrix);
+    static const UniformKey key("uViewMatrix");
+    uniforms.put(key, viewMatrix);
 }
 
 inline void sendModelMatrix(Uniforms &uniforms, const Matrix4 &modelMatrix) {
-    uniforms.put("uModelMatrix", modelMatrix);
+    static const UniformKey key("uModelMatrix");
+    uniforms.put(key, modelMatrix);
+}
+
+// takes the pick id of what is drawn next, see SgShapeNode::getPickId. The
+// uniform is an int, which the shaders turn back into the unsigned id.
+inline void sendPickId(Uniforms &uniforms, unsigned int pickId) {
+    static const UniformKey key("uPickId");
+    uniforms.put(key, int(pickId));
 }
 
 #endif
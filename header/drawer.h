@@ -1,20 +1,52 @@
 #ifndef DRAWER_H
 #define DRAWER_H
 
-#include <vector>
-
+#include "bounds.h"
 #include "common.h"
 #include "scenegraph.h"
+#include "smallvector.h"
 #include "uniforms.h"
 
+// Whether the shape, placed by `modelMat', may be visible in `frustum'.
+// Shapes without a geometry, and the sky, which is drawn around the eye
+// whatever its model matrix, always may.
+inline bool isInFrustum(SgShapeNode &shapeNode, const Matrix4 &modelMat,
+                        const Frustum &frustum) {
+    const Geometry *geometry = shapeNode.getGeometry();
+    const Material *material = shapeNode.getMaterial();
+    if (!geometry || (material && material->getRenderPass() == RENDER_PASS_SKY))
+        return true;
+    return frustum.intersects(geometry->getBounds(), modelMat);
+}
+
 class Drawer : public SgNodeVisitor {
   protected:
-    std::vector<RigTForm> rbtStack_;
+    // inline up to the depth of most graphs, so that drawing a frame does
+    // not allocate
+    SmallVector<RigTForm, 16> rbtStack_;
     Uniforms &uniforms_;
 
+    const Frustum *frustum_;
+    int numVisible_, numCulled_;
+
+    // Whether the shape is outside the frustum, counting it either way.
+    // Never without a frustum.
+    bool cull(SgShapeNode &shapeNode, const Matrix4 &modelMat) {
+        if (frustum_ && !isInFrustum(shapeNode, modelMat, *frustum_)) {
+            ++numCulled_;
+            return true;
+        }
+        ++numVisible_;
+        return false;
+    }
+
   public:
-    Drawer(const RigTForm &initialRbt, Uniforms &uniforms)
-        : rbtStack_(1, initialRbt), uniforms_(uniforms) {}
+    // Shapes outside of `frustum', if given, are skipped
+    Drawer(const RigTForm &initialRbt, Uniforms &uniforms,
+           const Frustum *frustum = NULL)
+        : uniforms_(uniforms), frustum_(frustum), numVisible_(0), numCulled_(0) {
+        rbtStack_.push_back(initialRbt);
+    }
 
     virtual bool visit(SgTransformNode &node) {
         rbtStack_.push_back(rbtStack_.back() * node.getRbt());
@@ -28,7 +60,10 @@ class Drawer : public SgNodeVisitor {
 
     virtual bool visit(SgShapeNode &shapeNode) {
         const Matrix4 modelMat = rigTFormToMatrix(rbtStack_.back()) * shapeNode.getAffineMatrix();
+        if (cull(shapeNode, modelMat))
+            return true;
         sendModelMatrix(uniforms_, modelMat);
+        sendPickId(uniforms_, shapeNode.getPickId());
         shapeNode.draw(uniforms_);
         return true;
     }
@@ -36,6 +71,10 @@ class Drawer : public SgNodeVisitor {
     virtual bool postVisit(SgShapeNode &shapeNode) { return true; }
 
     Uniforms &getUniforms() { return uniforms_; }
+
+    // Shapes visited that were drawn or queued, and skipped
+    int getNumVisible() const { return numVisible_; }
+    int getNumCulled() const { return numCulled_; }
 };
 
 #endif
@@ -0,0 +1,98 @@
+#ifndef FLATHIERARCHY_H
+#define FLATHIERARCHY_H
+
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "matrix4.h"
+#include "renderqueue.h"
+#include "rigtform.h"
+#include "scenegraph.h"
+#include "uniforms.h"
+
+// A compiled copy of the transform hierarchy below a root node, for
+// computing the world rbts of many nodes at once.
+//
+// The transform nodes are stored in structure of arrays form: the parent
+// index, and the translation and rotation quaternion of the local and world
+// rbts, one array per component. Parents come before their children, so
+// update() computes all world rbts in one linear pass over the arrays,
+// with no virtual calls and no rbt stack.
+//
+// The hierarchy listens to addChild/removeChild below the root: an added
+// subtree is appended to the arrays, and a removed one is marked dead and
+// compacted away once dead entries outnumber live ones.
+class FlatHierarchy : public SgTopologyListener {
+  public:
+    // `root' must not have a parent, and has no other topology listener
+    // while the hierarchy exists
+    FlatHierarchy(shared_ptr<SgTransformNode> root);
+    virtual ~FlatHierarchy();
+
+    // Reads the rbts of the transform nodes changed since the last update,
+    // computes every world rbt, and stores them into the nodes whose cached
+    // one is out of date, see SgTransformNode::getWorldRbt
+    void update();
+
+    // Pushes the shapes with a geometry and material to `queue', like a
+    // RenderQueueDrawer with an identity initial rbt would, and draws the
+    // others right away. Shapes outside of `frustum', if given, are
+    // skipped. Uses the world rbts of the last update.
+    void pushShapes(RenderQueue &queue, Uniforms &uniforms,
+                    const Matrix4 &viewMatrix, const Frustum *frustum = NULL);
+
+    // Shapes pushed or drawn, and skipped, by the last pushShapes
+    int getNumVisible() const { return numVisible_; }
+    int getNumCulled() const { return numCulled_; }
+
+    // Live transform nodes and shape nodes
+    int getNumTransforms() const { return nodes_.size() - numDeadTransforms_; }
+    int getNumShapes() const { return shapes_.size() - numDeadShapes_; }
+
+    virtual void onChildAdded(SgTransformNode &parent, SgNode &child);
+    virtual void onChildRemoved(SgTransformNode &parent, SgNode &child);
+
+  private:
+    // One array per component of an array of rbts
+    struct RbtArrays {
+        std::vector<double> tx, ty, tz;
+        std::vector<double> qw, qx, qy, qz;
+
+        void resize(int n);
+        void set(int i, const RigTForm &rbt);
+        RigTForm get(int i) const;
+    };
+
+    struct Shape {
+        int transform; // index of the parent transform node
+        SgShapeNode *node; // NULL once removed
+    };
+
+    shared_ptr<SgTransformNode> root_;
+
+    // the transform nodes, the root first. Removed ones are NULL.
+    std::vector<SgTransformNode *> nodes_;
+    std::vector<int> parents_; // -1 for the root
+    RbtArrays local_, world_;
+
+    std::vector<Shape> shapes_;
+
+    std::unordered_map<SgTransformNode *, int> transformIndices_;
+    std::unordered_map<SgShapeNode *, int> shapeIndices_;
+
+    int numDeadTransforms_, numDeadShapes_;
+    int numVisible_, numCulled_;
+
+    // Clears the arrays and appends the whole tree of the root
+    void rebuild();
+
+    // Appends `node' and its descendants in depth first order, with
+    // `parent' the index of the transform node it is a child of
+    void append(SgNode &node, int parent);
+
+    // Marks `node' and its descendants dead
+    void remove(SgNode &node);
+};
+
+#endif
@@ -9,9 +9,12 @@
 #include <stdexcept>
 #include <memory>
 
+#include "bounds.h"
 #include "cvec.h"
 #include "glsupport.h"
 #include "geometrymaker.h"
+#include "matrix4.h"
+#include "meshbvh.h"
 
 // An abstract class that encapsulates geometry data that provides vertex attributes and
 // know how to draw itself.
@@ -20,13 +23,70 @@ public:
   // return names of vertex attributes provided by this geometry
   virtual const std::vector<std::string>& getVertexAttribNames() = 0;
 
+  // return an id of the list of vertex attribute names, the same for all
+  // geometries providing the same names in the same order. Callers use it to
+  // cache what they derive from the names.
+  virtual int getVertexAttribLayout() {
+    return internVertexAttribLayout(getVertexAttribNames());
+  }
+
   // Draw the geometry. attribIndices[i] corresponds to the index of the
   // shader vertex attribute location that the i-th vertex attribute provided
   // by this geometry should bind to. It can be -1 to indicate that this stream is
-  // not used. The caller is responsible for enable/disable vertex attribute arrays.
-  virtual void draw(int attribIndices[]) = 0;
+  // not used. The geometry binds a vertex array object with exactly the used
+  // vertex attribute arrays enabled, and leaves it bound.
+  virtual void draw(const int attribIndices[]) = 0;
+
+  // Same as draw, but draws `instanceCount' instances in one call, reading
+  // the vertex attributes with a divisor (see VertexFormat) per instance.
+  // Throws if the geometry does not support instancing.
+  virtual void drawInstanced(const int attribIndices[], int instanceCount) {
+    throw std::runtime_error("Geometry does not support instanced drawing");
+  }
 
   virtual ~Geometry() {}
+
+  // Object space bounds of the vertices, used for frustum culling. Empty
+  // unless set, e.g. by the uploads of the Simple*Geometry types below.
+  const Bounds& getBounds() const {
+    return bounds_;
+  }
+
+  void setBounds(const Bounds& bounds) {
+    bounds_ = bounds;
+  }
+
+  // Hierarchy over the triangles for casting rays against them on the CPU,
+  // see Picker. Built on the first call after setBvhSource, so geometries
+  // no ray is cast against never pay for it. NULL unless set, e.g. by the
+  // uploads of the Simple*Geometry types below.
+  const std::shared_ptr<MeshBvh>& getBvh() const {
+    if (bvhSource_) {
+      bvh_ = std::make_shared<MeshBvh>(*bvhSource_);
+      bvhSource_.reset();
+    }
+    return bvh_;
+  }
+
+  void setBvh(const std::shared_ptr<MeshBvh>& bvh) {
+    bvh_ = bvh;
+    bvhSource_.reset();
+  }
+
+  // Marks the hierarchy out of date, for the next getBvh to build it from
+  // `source'
+  void setBvhSource(const std::shared_ptr<MeshBvh::Source>& source) {
+    bvh_.reset();
+    bvhSource_ = source;
+  }
+
+  // id of `names' for getVertexAttribLayout, interned on first use
+  static int internVertexAttribLayout(const std::vector<std::string>& names);
+
+protected:
+  Bounds bounds_;
+  mutable std::shared_ptr<MeshBvh> bvh_;
+  mutable std::shared_ptr<MeshBvh::Source> bvhSource_;
 };
 
 
@@ -46,19 +106,30 @@ public:
 // a list of attribute descriptions
 class VertexFormat {
 public:
-  // Parameters that you would pass into glVertexAttribPointer
+  // Parameters that you would pass into glVertexAttribPointer, and
+  // glVertexAttribDivisor. A matrix attribute takes `columns' consecutive
+  // attribute locations, one per column of `size' components. An integer
+  // attribute is passed with glVertexAttribIPointer instead, for shader
+  // inputs of integer type.
   struct AttribDesc {
     std::string name;
     GLint size;
     GLenum type;
     GLboolean normalized;
     int offset;
-
-    AttribDesc(const std::string& _name, GLint _size, GLenum _type, GLboolean _normalized, int _offset)
-      : name(_name), size(_size), type(_type), normalized(_normalized), offset(_offset) {
+    int divisor; // 0 for per vertex, n to advance once every n instances
+    int columns;
+    bool integer;
+
+    AttribDesc(const std::string& _name, GLint _size, GLenum _type, GLboolean _normalized, int _offset,
+               int _divisor, int _columns, bool _integer)
+      : name(_name), size(_size), type(_type), normalized(_normalized), offset(_offset),
+        divisor(_divisor), columns(_columns), integer(_integer) {
       assert(_name != "");   // some basic sanity checks
       assert(_size > 0);
       assert(_offset >= 0);
+      assert(_divisor >= 0);
+      assert(_columns > 0);
     }
   };
 
@@ -66,8 +137,9 @@ public:
   VertexFormat(int vertexSize) : vertexSize_(vertexSize) {}
 
   // append a new attrib description
-  VertexFormat& put(const std::string& name, GLint size, GLenum type, GLboolean normalized, int offset) {
-    AttribDesc ad(name, size, type, normalized, offset);
+  VertexFormat& put(const std::string& name, GLint size, GLenum type, GLboolean normalized, int offset,
+                    int divisor = 0, int columns = 1, bool integer = false) {
+    AttribDesc ad(name, size, type, normalized, offset, divisor, columns, integer);
     if (name2Idx_.find(name) == name2Idx_.end()) {
       name2Idx_[name] = attribDescs_.size();
       attribDescs_.push_back(ad);
@@ -96,13 +168,49 @@ public:
     return i == name2Idx_.end() ? -1 : i->second;
   }
 
-  // Calls glVertexAttribPointer with appropirate arguments to bind the attribute
-  // indexed by 'attribIndex' within this VertexFormat to vertex attribute location
-  // specified by 'glAttribLocation'
+  // Calls glVertexAttrib(I)Pointer and glVertexAttribDivisor with appropirate arguments to bind
+  // the attribute indexed by 'attribIndex' within this VertexFormat to vertex attribute location
+  // specified by 'glAttribLocation', and the following ones for the other columns of a matrix
   void setGlVertexAttribPointer(int attribIndex, int glAttribLocation) const {
     assert(glAttribLocation >= 0);
     const AttribDesc &ad = attribDescs_[attribIndex];
-    glVertexAttribPointer(glAttribLocation, ad.size, ad.type, ad.normalized, vertexSize_, reinterpret_cast<const GLvoid*>(ad.offset));
+    const int columnSize = ad.size * getGlTypeSize(ad.type);
+    for (int i = 0; i < ad.columns; ++i) {
+      const GLvoid* pointer = reinterpret_cast<const GLvoid*>(ad.offset + i * columnSize);
+      if (ad.integer)
+        glVertexAttribIPointer(glAttribLocation + i, ad.size, ad.type, vertexSize_, pointer);
+      else
+        glVertexAttribPointer(glAttribLocation + i, ad.size, ad.type, ad.normalized, vertexSize_,
+                              pointer);
+      // always set, a vertex array object may be reused with other formats
+      glVertexAttribDivisor(glAttribLocation + i, ad.divisor);
+    }
+  }
+
+  // Whether any attribute is read per instance
+  bool hasInstanceAttribs() const {
+    for (size_t i = 0; i < attribDescs_.size(); ++i) {
+      if (attribDescs_[i].divisor > 0)
+        return true;
+    }
+    return false;
+  }
+
+  // Size in bytes of one component of type 'type'
+  static int getGlTypeSize(GLenum type) {
+    switch (type) {
+    case GL_BYTE:
+    case GL_UNSIGNED_BYTE:
+      return 1;
+    case GL_SHORT:
+    case GL_UNSIGNED_SHORT:
+    case GL_HALF_FLOAT:
+      return 2;
+    case GL_DOUBLE:
+      return 8;
+    default:
+      return 4;
+    }
   }
 
 private:
@@ -137,7 +245,7 @@ public:
   template<typename Vertex>
   void upload(const Vertex* vertices, int length, bool dynamicUsage = false) {
     assert(sizeof(Vertex) == format_.getVertexSize());
-    glBindBuffer(GL_ARRAY_BUFFER, *this);
+    GlStateCache::getSingleton().bindBuffer(GL_ARRAY_BUFFER, *this);
     length_ = length;
 
     const int size = sizeof(Vertex) * length;
@@ -182,15 +290,18 @@ public:
     assert((format_ == GL_UNSIGNED_BYTE && sizeof(Index) == 1) ||
            (format_ == GL_UNSIGNED_SHORT && sizeof(Index) == 2) ||
            (format_ == GL_UNSIGNED_INT && sizeof(Index) == 4));
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, *this);
+    // The element array binding belongs to the bound vertex array object,
+    // which may be the cached one of some other geometry. Upload through a
+    // target that is not vertex array state instead.
+    glBindBuffer(GL_COPY_WRITE_BUFFER, *this);
     length_ = length;
     const int size = sizeof(Index) * length;
     if (dynamicUsage) {
-      glBufferData(GL_ELEMENT_ARRAY_BUFFER, size, NULL, GL_DYNAMIC_DRAW);
-      glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, 0, size, indices);
+      glBufferData(GL_COPY_WRITE_BUFFER, size, NULL, GL_DYNAMIC_DRAW);
+      glBufferSubData(GL_COPY_WRITE_BUFFER, 0, size, indices);
     }
     else {
-      glBufferData(GL_ELEMENT_ARRAY_BUFFER, size, indices, GL_STATIC_DRAW);
+      glBufferData(GL_COPY_WRITE_BUFFER, size, indices, GL_STATIC_DRAW);
     }
 #ifndef NDEBUG
     checkGlErrors();
@@ -208,6 +319,10 @@ public:
 // To draw its self, it binds all the vertex attributes that it is wired to, and calls
 // the suitable OpenGL calls to draw either indexed or non-index geometry. There are optimizations
 // to call glBindBuffer only once for each distince FormattedVbo it wires to.
+//
+// The bindings are recorded in a vertex array object per assignment of shader attribute
+// locations, built on the first draw with it. Later draws with the same locations only
+// bind that vertex array object. Changing the wiring or the index buffer drops them.
 
 class BufferObjectGeometry : public Geometry {
 public:
@@ -229,6 +344,10 @@ public:
   // Same names are used for each attribute.
   BufferObjectGeometry& wire(std::shared_ptr<FormattedVbo> source);
 
+  // Returns the FormattedVbo the vertex attribute 'targetAttribName' is wired to, or a null
+  // shared_ptr if there is no such attribute
+  std::shared_ptr<FormattedVbo> getWiredVbo(const std::string& targetAttribName) const;
+
   // Set the index buffer to be used. Pass in a null shared_ptr to mean non-indexed. Default is non-indexed
   BufferObjectGeometry& indexedBy(std::shared_ptr<FormattedIbo> ib);
 
@@ -251,7 +370,14 @@ public:
 
   // Methods declared by Geometry
   virtual const std::vector<std::string>& getVertexAttribNames();
-  virtual void draw(int attribIndices[]);
+  virtual int getVertexAttribLayout();
+  virtual void draw(const int attribIndices[]);
+  virtual void drawInstanced(const int attribIndices[], int instanceCount);
+
+  // Whether draw uses the cached vertex array objects (the default), or binds
+  // all buffers and attribute pointers again on every draw. Only meant for
+  // benchmarking the two.
+  static void setUseVaoCache(bool enabled);
 
 private:
   typedef std::map<std::string, std::pair<std::shared_ptr<FormattedVbo>, std::string> > Wiring;
@@ -261,25 +387,52 @@ private:
   Wiring wiring_;
   std::shared_ptr<FormattedIbo> ib_;
 
+  // A vertex array object set up for one assignment of attribute locations
+  struct CachedVao {
+    std::vector<int> attribIndices;
+    std::shared_ptr<GlArrayObject> vao;
+  };
+
+  // few per geometry, searched linearly
+  std::vector<CachedVao> vaos_;
+
+  static bool useVaoCache_;
+
   // Internal struct for optimized vb binding order
   struct PerVbWiring {
     // Use bare pointers since shared_ptrs are maintained by wiring_, hence
     // we do not need to worry about keeping it getting freed
     const FormattedVbo* vb;
 
+    // whether the format of vb has per instance attributes. Such vbs do
+    // not limit the number of vertices drawn.
+    bool perInstance;
+
     // A map from (attribute index in vb) --> relative index within BufferObjectGeometry's
     // exposed vertex attributes
     std::vector<std::pair<int, int> > vb2GeoIdx;
 
-    PerVbWiring(const FormattedVbo* _vb) : vb(_vb) {}
+    PerVbWiring(const FormattedVbo* _vb)
+      : vb(_vb), perInstance(_vb->getVertexFormat().hasInstanceAttribs()) {}
   };
 
   std::vector<PerVbWiring> perVbWirings_;
   std::vector<std::string> vertexAttribNames_;
+  int vertexAttribLayout_;
 
   // Setups up perVbWiring_ and vertexAttribNames_. Gets called whenever wiringChanged_ is true
   // and we need to draw or return list of vertex attributes.
   void processWiring();
+
+  // Binds the buffers, sets the attribute pointers and enables the attribute arrays in the
+  // bound vertex array object
+  void specifyVertexArrays(const int attribIndices[]);
+
+  // Binds the vertex array object for attribIndices, creating it if needed
+  void bindVertexArrays(const int attribIndices[]);
+
+  // Number of vertices to draw without index buffer
+  int getNumVertices() const;
 };
 
 
@@ -456,6 +609,8 @@ public:
 
   void upload(const Vertex* vertices, int numVertices) {
     vbo->upload(vertices, numVertices, true);
+    setBounds(Bounds::make(vertices, numVertices));
+    setBvhSource(std::make_shared<MeshBvh::Source>(vertices, numVertices, (const unsigned int*)NULL, 0));
   }
 };
 
@@ -482,8 +637,18 @@ public:
   }
 
   void upload(const Vertex* vertices, const Index* indices, int numVertices, int numIndices) {
+    // of all vertices, whether indexed or not
+    upload(vertices, indices, numVertices, numIndices, Bounds::make(vertices, numVertices));
+  }
+
+  // Same, with the bounds of the vertices already known, e.g. from the mesh
+  // cache
+  void upload(const Vertex* vertices, const Index* indices, int numVertices, int numIndices,
+              const Bounds& bounds) {
     vbo->upload(vertices, numVertices, true);
     ibo->upload(indices, numIndices, true);
+    setBounds(bounds);
+    setBvhSource(std::make_shared<MeshBvh::Source>(vertices, numVertices, indices, numIndices));
   }
 
 private:
@@ -500,6 +665,32 @@ private:
 };
 
 
+// Per instance data of instanced draws: the column major model matrix,
+// read through the aModelMatrix attribute of the INSTANCED shader variants
+struct InstanceModelMatrix {
+  GLfloat m[16];
+
+  static const VertexFormat FORMAT;
+
+  InstanceModelMatrix() {}
+
+  InstanceModelMatrix(const Matrix4& modelMatrix) {
+    modelMatrix.writeToColumnMajorMatrix(m);
+  }
+};
+
+// Per instance pick id of instanced draws, read through the aPickId
+// attribute of the INSTANCED shader variants, see IdPicker
+struct InstancePickId {
+  GLuint id;
+
+  static const VertexFormat FORMAT;
+
+  InstancePickId() {}
+
+  InstancePickId(GLuint _id) : id(_id) {}
+};
+
 typedef SimpleUnindexedGeometry<VertexPX> SimpleGeometryPX;
 typedef SimpleUnindexedGeometry<VertexPN> SimpleGeometryPN;
 typedef SimpleUnindexedGeometry<VertexPNX> SimpleGeometryPNX;
@@ -510,4 +701,10 @@ typedef SimpleIndexedGeometry<VertexPN, unsigned short> SimpleIndexedGeometryPN;
 typedef SimpleIndexedGeometry<VertexPNX, unsigned short> SimpleIndexedGeometryPNX;
 typedef SimpleIndexedGeometry<VertexPNTBX, unsigned short> SimpleIndexedGeometryPNTBX;
 
+// 32-bit indexed versions, for meshes with more than 65536 vertices
+typedef SimpleIndexedGeometry<VertexPX, unsigned int> SimpleIndexedGeometryPX32;
+typedef SimpleIndexedGeometry<VertexPN, unsigned int> SimpleIndexedGeometryPN32;
+typedef SimpleIndexedGeometry<VertexPNX, unsigned int> SimpleIndexedGeometryPNX32;
+typedef SimpleIndexedGeometry<VertexPNTBX, unsigned int> SimpleIndexedGeometryPNTBX32;
+
 #endif
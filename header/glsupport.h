@@ -3,6 +3,7 @@
 
 #include <iostream>
 #include <stdexcept>
+#include <unordered_map>
 
 #define GLEW_STATIC
 
@@ -51,6 +52,90 @@ class Noncopyable {
     const Noncopyable &operator=(const Noncopyable &);
 };
 
+// Shadow of the GL binding state: the current program, VAO, array and uniform
+// buffers, the 2D and cube map texture of each texture unit, and, per VAO,
+// the element buffer and the enabled vertex attribute arrays. Binding what
+// is already bound is skipped. Material, Geometry, Texture and the wrappers
+// below all bind through it; code that changes these bindings directly must
+// call invalidate() afterwards.
+//
+// A VAO seen for the first time is assumed to be in its initial state, i.e.
+// no element buffer and no attribute array enabled.
+class GlStateCache : Noncopyable {
+  public:
+    // GL calls issued and skipped since the last resetCounters()
+    struct Counters {
+        unsigned int issued, skipped;
+    };
+
+    static GlStateCache &getSingleton();
+
+    // Forgets all shadowed state, so the next bind of everything is issued
+    void invalidate();
+
+    void useProgram(GLuint program);
+    void bindVertexArray(GLuint vao);
+
+    // Only GL_ARRAY_BUFFER, GL_ELEMENT_ARRAY_BUFFER and GL_UNIFORM_BUFFER
+    // are shadowed, other targets are passed through
+    void bindBuffer(GLenum target, GLuint buffer);
+
+    void activeTexture(int unit);
+
+    // Binds `texture' to the active texture unit. Only GL_TEXTURE_2D and
+    // GL_TEXTURE_CUBE_MAP are shadowed.
+    void bindTexture(GLenum target, GLuint texture);
+
+    // Binds `texture' to `unit', switching the active unit only if the
+    // binding changes
+    void bindTexture(int unit, GLenum target, GLuint texture);
+
+    // Enables exactly the vertex attribute arrays of the bound VAO whose
+    // location has its bit set in `mask'
+    void setEnabledVertexAttribArrays(unsigned int mask);
+
+    // Called by the wrappers below when they delete a GL object, as GL then
+    // drops the bindings of it
+    void forgetProgram(GLuint program);
+    void forgetVertexArray(GLuint vao);
+    void forgetBuffer(GLuint buffer);
+    void forgetTexture(GLuint texture);
+
+    const Counters &getCounters() const { return counters_; }
+    void resetCounters() { counters_.issued = counters_.skipped = 0; }
+
+  private:
+    enum { MAX_TEXTURE_UNITS = 32 };
+
+    // binding value meaning not known
+    static const GLuint UNKNOWN = 0xFFFFFFFFu;
+
+    struct VaoState {
+        GLuint elementBuffer;
+        unsigned int enabledAttribs;
+        bool attribsKnown;
+    };
+
+    GLuint program_, vao_, arrayBuffer_, uniformBuffer_;
+    int activeUnit_; // -1 if not known
+    GLuint textures2D_[MAX_TEXTURE_UNITS], texturesCube_[MAX_TEXTURE_UNITS];
+
+    // the current one is vaos_[vao_], unless vao_ is UNKNOWN
+    std::unordered_map<GLuint, VaoState> vaos_;
+    GLint maxVertexAttribs_;
+
+    Counters counters_;
+
+    GlStateCache();
+
+    // Shadow of the binding of `target' on `unit', NULL if not shadowed
+    GLuint *getTextureBinding(int unit, GLenum target);
+
+    // Counts the call and returns whether it is needed, i.e. whether
+    // `binding' differs from `value'. Updates `binding' in that case.
+    bool update(GLuint &binding, GLuint value);
+};
+
 // Light wrapper around a GL shader (can be geometry/vertex/fragment shader)
 // handle. Automatically allocates and deallocates. Can be casted to GLuint.
 class GlShader : Noncopyable {
@@ -85,7 +170,10 @@ class GlProgram : Noncopyable {
         checkGlErrors();
     }
 
-    ~GlProgram() { glDeleteProgram(handle_); }
+    ~GlProgram() {
+        GlStateCache::getSingleton().forgetProgram(handle_);
+        glDeleteProgram(handle_);
+    }
 
     // Casts to GLuint so can be used directly by glUseProgram and so on
     operator GLuint() const { return handle_; }
@@ -103,7 +191,10 @@ class GlTexture : Noncopyable {
         checkGlErrors();
     }
 
-    ~GlTexture() { glDeleteTextures(1, &handle_); }
+    ~GlTexture() {
+        GlStateCache::getSingleton().forgetTexture(handle_);
+        glDeleteTextures(1, &handle_);
+    }
 
     // Casts to GLuint so can be used directly by glBindTexture and so on
     operator GLuint() const { return handle_; }
@@ -121,7 +212,10 @@ class GlBufferObject : Noncopyable {
         checkGlErrors();
     }
 
-    ~GlBufferObject() { glDeleteBuffers(1, &handle_); }
+    ~GlBufferObject() {
+        GlStateCache::getSingleton().forgetBuffer(handle_);
+        glDeleteBuffers(1, &handle_);
+    }
 
     // Casts to GLuint so can be used directly glBindBuffer and so on
     operator GLuint() const { return handle_; }
@@ -139,12 +233,51 @@ class GlArrayObject : Noncopyable {
         checkGlErrors();
     }
 
-    ~GlArrayObject() { glDeleteVertexArrays(1, &handle_); }
+    ~GlArrayObject() {
+        GlStateCache::getSingleton().forgetVertexArray(handle_);
+        glDeleteVertexArrays(1, &handle_);
+    }
 
     // Casts to GLuint so can be used directly glBindBuffer and so on
     operator GLuint() const { return handle_; }
 };
 
+// Light wrapper around a GL framebuffer object handle that automatically
+// allocates and deallocates. Can be casted to a GLuint.
+class GlFramebuffer : Noncopyable {
+  protected:
+    GLuint handle_;
+
+  public:
+    GlFramebuffer() {
+        glGenFramebuffers(1, &handle_);
+        checkGlErrors();
+    }
+
+    ~GlFramebuffer() { glDeleteFramebuffers(1, &handle_); }
+
+    // Casts to GLuint so can be used directly by glBindFramebuffer and so on
+    operator GLuint() const { return handle_; }
+};
+
+// Light wrapper around a GL renderbuffer object handle that automatically
+// allocates and deallocates. Can be casted to a GLuint.
+class GlRenderbuffer : Noncopyable {
+  protected:
+    GLuint handle_;
+
+  public:
+    GlRenderbuffer() {
+        glGenRenderbuffers(1, &handle_);
+        checkGlErrors();
+    }
+
+    ~GlRenderbuffer() { glDeleteRenderbuffers(1, &handle_); }
+
+    // Casts to GLuint so can be used directly by glBindRenderbuffer and so on
+    operator GLuint() const { return handle_; }
+};
+
 // Safe versions of various functions that handle GLSL shader attributes
 // and variables: These mainly issue a warning when specified attributes
 // and variables do not exist in the compiled GLSL program (e.g., due to
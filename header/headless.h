@@ -0,0 +1,31 @@
+#ifndef HEADLESS_H
+#define HEADLESS_H
+
+#include "glsupport.h"
+
+// An OpenGL 3.3 core context made current without a window, for rendering
+// into framebuffer objects on machines without a display. Created through
+// EGL, preferring Mesa's surfaceless platform, which needs neither a display
+// server nor a GPU (llvmpipe), then the first EGL device, then the default
+// display. Throws runtime_error if no context can be created.
+class HeadlessContext : Noncopyable {
+  public:
+    HeadlessContext();
+    ~HeadlessContext();
+
+    // GL_RENDERER of the context, e.g. to tell llvmpipe from a GPU
+    const char *getRenderer() const;
+
+  private:
+    // Creates and makes current the context, on the initialized display_
+    void init();
+
+    // Destroys whatever of the display, surface and context was created
+    void release();
+
+    // EGLDisplay, EGLSurface and EGLContext, kept opaque so that the EGL
+    // headers stay out of the rest of the code
+    void *display_, *surface_, *context_;
+};
+
+#endif
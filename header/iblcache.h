@@ -0,0 +1,123 @@
+#ifndef IBLCACHE_H
+#define IBLCACHE_H
+
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <ostream>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// On-disk cache for the results of the image based lighting precompute
+// (environment cubemap, irradiance map and SH, prefilter mip chain and BRDF
+// LUT).
+//
+// Entries are content addressed: the key is a hash over everything that
+// affects the output (the HDR file, capture sizes and shader sources), so a
+// stale entry can never be picked up. Pixel data is kept as raw half floats,
+// exactly as read back from the RGB16F/RG16F textures.
+
+// Incremental 64-bit FNV-1a hash used to build cache keys
+class IblCacheKey {
+    uint64_t hash_;
+
+  public:
+    IblCacheKey() : hash_(14695981039346656037ULL) {}
+
+    IblCacheKey &add(const void *data, size_t len);
+
+    IblCacheKey &add(int value) { return add(&value, sizeof(value)); }
+
+    IblCacheKey &add(const std::string &str) {
+        return add(str.data(), str.size());
+    }
+
+    // Hash the content of a file. Throws runtime_error if it cannot be read.
+    IblCacheKey &addFile(const char *filename);
+
+    uint64_t value() const { return hash_; }
+};
+
+// One texture: `faces' is 6 for a cubemap and 1 for a 2D texture. mips[i]
+// holds mip level i for all faces in GL_TEXTURE_CUBE_MAP_POSITIVE_X + face
+// order, each face being (width >> i) * (height >> i) * channels halfs.
+struct IblCacheImage {
+    int faces;
+    int channels;
+    int width, height;
+    std::vector<std::vector<unsigned short> > mips;
+
+    IblCacheImage() : faces(0), channels(0), width(0), height(0) {}
+
+    // An image that was not computed, e.g. the irradiance map when the
+    // renderer only uses the SH irradiance
+    bool empty() const { return mips.empty(); }
+
+    size_t getMipSize(int mip) const {
+        return size_t(faces) * std::max(width >> mip, 1) *
+               std::max(height >> mip, 1) * channels;
+    }
+};
+
+// Per environment results. The BRDF LUT does not depend on the environment
+// and lives in its own asset, see readBrdfLUT/writeBrdfLUT.
+struct IblCacheEntry {
+    IblCacheImage envCubemap;
+    IblCacheImage irradianceMap;
+    IblCacheImage prefilterMap;
+
+    // 9 RGB coefficients of the diffuse irradiance, see projectIrradianceSH
+    // in iblcpu.h
+    std::vector<float> irradianceSH;
+};
+
+// Face sizes of the precomputed cubemaps and number of prefilter mip levels.
+// Shared by the renderer and iblbake since they are part of the cache key.
+const int IBL_ENV_SIZE = 1024;
+const int IBL_IRRADIANCE_SIZE = 32;
+const int IBL_PREFILTER_SIZE = 128;
+const int IBL_PREFILTER_MIPS = 5;
+
+// Key of the cache entry for the given HDR: hashes the file together with
+// the sizes above and the sources of the precompute shaders, so editing any
+// of them invalidates the cached results. Throws runtime_error if one of the
+// files cannot be read.
+uint64_t makeIblCacheKey(const std::string &hdrPath);
+
+// Returns the path of the cache file for the given key inside `dir'
+std::string getIblCachePath(const std::string &dir, uint64_t key);
+
+// Reads a cache entry. Returns false if the file does not exist, is corrupt,
+// or was written for a different key.
+bool readIblCache(const std::string &filename, uint64_t key,
+                  IblCacheEntry &entry);
+
+// Writes a cache entry, creating `filename's directory if needed. The file
+// is written under a temporary name and renamed into place, so readers never
+// see a partial entry. Throws runtime_error on error.
+void writeIblCache(const std::string &filename, uint64_t key,
+                   const IblCacheEntry &entry);
+
+// The split-sum BRDF LUT only depends on the BRDF model, so it is generated
+// once (by the GPU, or offline by `iblbake --brdf-lut') and shipped as a
+// versioned asset. readBrdfLUT returns false if the file is missing, corrupt
+// or was written by an older version of the BRDF integration.
+bool readBrdfLUT(const std::string &filename, IblCacheImage &lut);
+
+// Throws runtime_error on error
+void writeBrdfLUT(const std::string &filename, const IblCacheImage &lut);
+
+// Writes a cache file atomically, creating its directory if needed:
+// `writeContent' fills a temporary file which is then renamed into place, so
+// readers never see a partial file. Also used by the mesh cache. Throws
+// runtime_error on error.
+void writeCacheFile(const std::string &filename,
+                    const std::function<void(std::ostream &)> &writeContent);
+
+// Conversion between 32-bit floats and the IEEE half floats stored in the
+// cache. Out of range values are clamped to infinity, denormals are kept.
+unsigned short floatToHalf(float f);
+float halfToFloat(unsigned short h);
+
+#endif
@@ -0,0 +1,101 @@
+#ifndef IBLCPU_H
+#define IBLCPU_H
+
+#include <vector>
+
+#include "cvec.h"
+#include "threadpool.h"
+
+// CPU implementations of the image based lighting precompute. These mirror
+// the GLSL versions in shaders/ function by function, so that results baked
+// offline can be used in place of the GPU ones.
+
+// Van der Corpus radical inverse in base 2, see shaders/brdf.fshader
+inline float radicalInverseVdC(unsigned int bits) {
+    bits = (bits << 16u) | (bits >> 16u);
+    bits = ((bits & 0x55555555u) << 1u) | ((bits & 0xAAAAAAAAu) >> 1u);
+    bits = ((bits & 0x33333333u) << 2u) | ((bits & 0xCCCCCCCCu) >> 2u);
+    bits = ((bits & 0x0F0F0F0Fu) << 4u) | ((bits & 0xF0F0F0F0u) >> 4u);
+    bits = ((bits & 0x00FF00FFu) << 8u) | ((bits & 0xFF00FF00u) >> 8u);
+    return float(bits) * 2.3283064365386963e-10f; // / 0x100000000
+}
+
+// i-th point of an N point Hammersley set
+inline Cvec2f hammersley(unsigned int i, unsigned int n) {
+    return Cvec2f(float(i) / float(n), radicalInverseVdC(i));
+}
+
+// GGX importance sampled halfway vector around the normal `n'
+Cvec3f importanceSampleGGX(const Cvec2f &xi, const Cvec3f &n, float roughness);
+
+// Split-sum scale and bias to F0, the CPU twin of IntegrateBRDF() in
+// shaders/brdf.fshader
+Cvec2f integrateBRDF(float NdotV, float roughness, int sampleCount = 1024);
+
+// Fills `lut' with width * height RG pairs, rows bottom to top as expected by
+// glTexImage2D. Texel (x, y) holds integrateBRDF at its center, i.e.
+// NdotV = (x + 0.5) / width and roughness = (y + 0.5) / height, exactly what
+// the GPU version rasterizes. Rows are spread over the pool.
+void generateBrdfLUT(int width, int height, std::vector<float> &lut,
+                     ThreadPool &pool = ThreadPool::getSingleton());
+
+// An equirectangular RGB float image, rows bottom to top (i.e. loaded with
+// stbi_set_flip_vertically_on_load(true), like prepareIBL in main.cpp does)
+struct EquirectImage {
+    int width, height;
+    std::vector<float> rgb;
+
+    EquirectImage() : width(0), height(0) {}
+
+    // Bilinear lookup in direction `dir', with the mapping used by
+    // shaders/equirect2cubemap.fshader
+    Cvec3f sample(const Cvec3f &dir) const;
+};
+
+// A cubemap of size x size RGB float faces, in GL_TEXTURE_CUBE_MAP_POSITIVE_X
+// + i order, each face stored with rows in glTexImage2D order
+struct CpuCubemap {
+    int size;
+    std::vector<float> faces[6];
+
+    CpuCubemap() : size(0) {}
+
+    void resize(int size);
+
+    // Direction through the center of texel (x, y) of `face', following the
+    // GL cubemap face selection rules. Not normalized.
+    static Cvec3f getTexelDir(int face, int x, int y, int size);
+
+    // Bilinear lookup in direction `dir'. Filtering does not cross face
+    // edges but clamps to them.
+    Cvec3f sample(const Cvec3f &dir) const;
+};
+
+// CPU twin of shaders/equirect2cubemap.fshader
+void bakeEnvCubemap(const EquirectImage &src, int size, CpuCubemap &dst,
+                    ThreadPool &pool = ThreadPool::getSingleton());
+
+// CPU twin of shaders/irradiance_conv.fshader
+void bakeIrradianceMap(const CpuCubemap &env, int size, CpuCubemap &dst,
+                       ThreadPool &pool = ThreadPool::getSingleton());
+
+// CPU twin of shaders/prefilter.fshader for one mip level. Like the GPU
+// version, samples are taken from level 0 of the environment map.
+void bakePrefilterMap(const CpuCubemap &env, int size, float roughness,
+                      CpuCubemap &dst, int sampleCount = 1024,
+                      ThreadPool &pool = ThreadPool::getSingleton());
+
+// Projects the radiance of `src' onto the 9 real spherical harmonics of
+// bands 0-2 and convolves it with the clamped cosine lobe, in one parallel
+// pass over the pixels. The SH basis constants and the 1 / PI scale of
+// irradiance_conv.fshader are folded into the coefficients, so the
+// irradiance in direction n = (x, y, z) is
+//
+//   sh[0] + sh[1] y + sh[2] z + sh[3] x + sh[4] xy + sh[5] yz
+//         + sh[6] (3z^2 - 1) + sh[7] xz + sh[8] (x^2 - y^2)
+//
+// as evaluated by EvalIrradianceSH() in shaders/pbr.fshader.
+void projectIrradianceSH(const EquirectImage &src, Cvec3f sh[9],
+                         ThreadPool &pool = ThreadPool::getSingleton());
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef IDPICKER_H
+#define IDPICKER_H
+
+#include "glsupport.h"
+
+// Picks shapes by the pick id the shaders write to a second color output
+// (see SgShapeNode::getPickId), rendered in the same pass as the image.
+// Between begin() and end() the scene is drawn into an offscreen
+// framebuffer with an R32UI id attachment beside the color and depth ones,
+// multisampled like the window so the color can be blitted to it.
+//
+// Reading a pixel back never stalls: read() resolves it into a pixel pack
+// buffer and fences the copy, and pollResult() hands the id out a frame or
+// more later, once the fence has signaled. Reads complete in the order they
+// were queued.
+class IdPicker : Noncopyable {
+  public:
+    struct Result {
+        unsigned int pickId; // 0 for the background
+        int tag;             // as passed to read()
+    };
+
+    IdPicker();
+    ~IdPicker();
+
+    // Binds the offscreen framebuffer, sized to `width' x `height' pixels,
+    // and clears it, the ids to 0. The window framebuffer must be bound.
+    void begin(int width, int height);
+
+    // Copies the color to the window framebuffer, and binds it again
+    void end();
+
+    // Queues a read of the id at pixel (x, y) from the bottom left, of what
+    // was drawn between the last begin() and end(). Returns false, without
+    // reading, if too many reads are in flight or (x, y) is outside.
+    bool read(int x, int y, int tag);
+
+    // Takes the oldest read if its copy is done, without waiting. Returns
+    // false if there is none.
+    bool pollResult(Result &result);
+
+    bool hasPendingReads() const { return numPending_ > 0; }
+
+  private:
+    enum { NUM_SLOTS = 4 };
+
+    struct Slot {
+        GlBufferObject pbo; // one GLuint
+        GLsync fence;
+        int tag;
+    };
+
+    GlFramebuffer fbo_, resolveFbo_;
+    GlRenderbuffer color_, ids_, depth_;
+    GlRenderbuffer resolvedId_; // one pixel
+    int width_, height_;
+
+    // ring of reads in flight, from slots_[first_]
+    Slot slots_[NUM_SLOTS];
+    int first_, numPending_;
+};
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef KEYFRAMETRACK_H
+#define KEYFRAMETRACK_H
+
+#include <list>
+#include <vector>
+
+#include "rigtform.h"
+
+// A compiled copy of a sequence of key frames, each with one rbt per
+// animated node, for playing them back like slerp() does.
+//
+// Segment s goes from frame s + 1 to frame s + 2, with frames s and s + 3
+// shaping the tangents. The Bezier control points of every node, t_d and
+// t_e for the translation and r_d and r_e for the rotation in its (angle,
+// axis) form, are computed once by build(), and stored as the coefficients
+// of the cubic polynomial in alpha they define. Evaluating a frame is then
+// an O(1) segment lookup and one pass over the nodes, with a sin and a cos
+// per node instead of the atan2s of powerq and quat2sk.
+//
+// The coefficients are stored in structure of arrays form: each segment is
+// a contiguous block of rows, one per channel and power of alpha, with one
+// entry per node.
+class KeyFrameTrack {
+  public:
+    KeyFrameTrack() : numNodes_(0), numSegments_(0) {}
+
+    // Compiles `frames'. Throws runtime_error if their numbers of rbts
+    // differ. Fewer than 4 frames give no segment.
+    void build(const std::list<std::vector<RigTForm>> &frames);
+
+    // Frames can be evaluated for 0 <= t < getNumSegments()
+    int getNumSegments() const { return numSegments_; }
+    int getNumNodes() const { return numNodes_; }
+
+    // Stores the rbts of every node at time `t', in segments, to `rbts'.
+    // `t' is clamped to the range of the track, which must not be empty.
+    void evaluate(double t, std::vector<RigTForm> &rbts) const;
+
+  private:
+    // the channels interpolated, translation then the (angle, axis) form of
+    // the rotation, see quat2sk
+    enum { TX, TY, TZ, S, KX, KY, KZ, NUM_CHANNELS };
+
+    // rows of a segment: the coefficients of alpha^0..3 of each channel
+    enum { NUM_ROWS = NUM_CHANNELS * 4 };
+
+    int numNodes_, numSegments_;
+
+    // numSegments_ blocks of NUM_ROWS rows of numNodes_ coefficients
+    std::vector<double> coeffs_;
+};
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include <cstddef>
+#include <string>
+
+// A whole file mapped read only into memory
+class MappedFile {
+  public:
+    MappedFile();
+    ~MappedFile();
+
+    // Returns false if the file cannot be opened or mapped. Empty files map
+    // to a NULL pointer with size 0.
+    bool open(const std::string &filename);
+    void close();
+
+    bool isOpen() const { return isOpen_; }
+
+    const char *getData() const { return static_cast<const char *>(data_); }
+    size_t getSize() const { return size_; }
+
+    // Hints that the whole file is about to be read, so the kernel can start
+    // paging it in
+    void willNeed() const;
+
+  private:
+    void *data_;
+    size_t size_;
+    bool isOpen_;
+
+    MappedFile(const MappedFile &);
+    const MappedFile &operator=(const MappedFile &);
+};
+
+#endif
@@ -16,29 +16,112 @@
 
 struct GlProgramDesc;
 
+// Render passes, submitted in this order by RenderQueue
+static const int RENDER_PASS_OPAQUE = 0;
+static const int RENDER_PASS_SKY = 1; // depth at the far plane, drawn last
+
 class Material {
   public:
     Material(const std::string &vsFilename, const std::string &fsFilename);
 
+    // A copy gets an id of its own
+    Material(const Material &m);
+    Material &operator=(const Material &m);
+
     void draw(Geometry &geometry, const Uniforms &extraUniforms);
 
+    // Sets the program drawInstanced uses, with the same uniforms and render
+    // states. Typically the INSTANCED variants of the material's shaders,
+    // which read the model matrix from the aModelMatrix attribute.
+    void setInstancedShaders(const std::string &vsFilename,
+                             const std::string &fsFilename);
+
+    bool isInstanceable() const { return (bool)instancedProgramDesc_; }
+
+    // Draws `instanceCount' instances of `geometry' in one call, with the
+    // per instance attributes wired into it. Throws if no instanced shaders
+    // were set.
+    void drawInstanced(Geometry &geometry, const Uniforms &extraUniforms,
+                       int instanceCount);
+
     Uniforms &getUniforms() { return uniforms_; }
     const Uniforms &getUniforms() const { return uniforms_; }
 
     RenderStates &getRenderStates() { return renderStates_; }
     const RenderStates &getRenderStates() const { return renderStates_; }
 
+    int getRenderPass() const { return renderPass_; }
+    void setRenderPass(int renderPass) { renderPass_ = renderPass; }
+
+    // Distinct for every Material instance
+    int getId() const { return id_; }
+
+    // GL name of the linked program, shared by materials built from the
+    // same shaders
+    GLuint getProgram() const;
+
+    // Hash of the GL textures among uniforms_, equal for materials that
+    // bind the same textures to the same names
+    unsigned int getTextureSetHash() const;
+
     /* These allow you to provide GLSL sources inline. */
     static void addInlineSource(const std::string &filename, int len,
                                 const char *content);
     static void removeInlineSource(const std::string &filename);
 
+    // Binds the uniform block `blockName' of every program, already linked or
+    // not, to `bindingPoint'. The block must take `dataSize' bytes, the size
+    // of its std140 image on the CPU side.
+    static void setUniformBlockBinding(const std::string &blockName,
+                                       int bindingPoint, int dataSize);
+
+    // Whether draw resolves uniforms through cached binding plans (the
+    // default) or looks each one up by name on every draw, interning the
+    // name and searching the sorted entries of the Uniforms. Only meant for
+    // benchmarking the two.
+    static void setUseBindingPlans(bool enabled);
+
   protected:
     std::shared_ptr<GlProgramDesc> programDesc_;
+    std::shared_ptr<GlProgramDesc> instancedProgramDesc_; // may be null
 
     Uniforms uniforms_;
 
     RenderStates renderStates_;
+
+    int renderPass_;
+
+    int id_;
+
+    static int nextId_;
+
+    static bool useBindingPlans_;
+
+    // Draws with `programDesc', instanced if `instanceCount' > 0
+    void draw(GlProgramDesc &programDesc, Geometry &geometry,
+              const Uniforms &extraUniforms, int instanceCount);
+
+    // Finds the value of shader uniform `uniform' of `programDesc' in
+    // uniforms_, then in `extraUniforms'. Sets `source' to 0 or 1
+    // respectively and `entry' to the index of the value there.
+    void findUniform(const GlProgramDesc &programDesc, int uniform,
+                     const Uniforms &extraUniforms, int &source,
+                     int &entry) const;
+
+    // Index of the binding plan for the current layouts of uniforms_ and
+    // `extraUniforms' in the plans of `programDesc', built if needed
+    int getBindingPlan(GlProgramDesc &programDesc,
+                       const Uniforms &extraUniforms);
+
+    // Index of the attribute wiring for the vertex attribute layout of
+    // `geometry' in the attribWirings of `programDesc', built if needed
+    int getAttribWiring(GlProgramDesc &programDesc, Geometry &geometry);
+
+    // Sends entry `entry' of `uniforms' to shader uniform `uniform',
+    // binding textures from `textureUnit' on
+    static void applyUniform(const GlProgramDesc &programDesc, int uniform,
+                             const Uniforms &uniforms, int entry,
+                             int &textureUnit, int maxTextureImageUnits);
 };
 
 #endif
@@ -0,0 +1,66 @@
+#ifndef MESH_H
+#define MESH_H
+
+#include <vector>
+
+#include "geometry.h"
+#include "objparser.h"
+
+// CPU side triangle mesh: unique vertices and a 32-bit index buffer with
+// three indices per triangle. Imported meshes are processed in this form
+// before they are uploaded.
+struct MeshData {
+    std::vector<VertexPNX> vertices;
+    std::vector<unsigned int> indices;
+
+    // Tangent frame of each vertex, see generateTangents. Empty if the mesh
+    // has none, then it is uploaded as VertexPNX instead of VertexPNTBX.
+    std::vector<Cvec3f> tangents, binormals;
+
+    bool hasTangents() const { return !tangents.empty(); }
+
+    size_t getVertexSize() const {
+        return hasTangents() ? sizeof(VertexPNTBX) : sizeof(VertexPNX);
+    }
+
+    // Interleaves the vertices with their tangent frames
+    void getTangentVertices(std::vector<VertexPNTBX> &out) const {
+        out.resize(vertices.size());
+        for (size_t i = 0; i < vertices.size(); ++i) {
+            out[i] = VertexPNTBX(vertices[i].p, vertices[i].n, tangents[i],
+                                 binormals[i], vertices[i].x);
+        }
+    }
+
+    // Size of the buffers uploaded for this mesh by makeMeshGeometry in
+    // model.h
+    size_t getVboBytes() const { return vertices.size() * getVertexSize(); }
+    size_t getIboBytes() const {
+        return indices.size() *
+               (vertices.size() <= 0x10000 ? sizeof(unsigned short)
+                                           : sizeof(unsigned int));
+    }
+};
+
+// Loads an .obj with parseObj and indexes it with makeMeshData. Throws
+// runtime_error if the file cannot be loaded.
+void loadObjMesh(const char *filePath, MeshData &mesh);
+
+// Merges the face corners of `obj' that share the same position, normal and
+// texture coordinate into one vertex. Vertices are numbered in order of first
+// use.
+void makeMeshData(const ObjData &obj, MeshData &mesh);
+
+// Generates per vertex tangents from the texture coordinates, in the spirit
+// of MikkTSpace: the tangent of each triangle, along +u, is projected into
+// the tangent plane of each corner's normal and averaged weighted by the
+// corner angle. Corners whose UV mapping is mirrored relative to the others
+// of a vertex get a vertex of their own, so the handedness never gets
+// averaged away at mirror seams. The binormal is the unit vector
+// -sign * cross(n, t) with sign the UV handedness, i.e. it points along -v,
+// which is the green channel convention of our normal maps (and of the
+// dFdx/dFdy frame in shaders/pbr.fshader). Vertices without usable texture
+// coordinates get an arbitrary frame around their normal.
+void generateTangents(MeshData &mesh);
+
+#endif
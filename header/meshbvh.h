@@ -0,0 +1,80 @@
+#ifndef MESHBVH_H
+#define MESHBVH_H
+
+#include <memory>
+#include <vector>
+
+#include "cvec.h"
+
+// A bounding volume hierarchy over the triangles of a mesh, for casting rays
+// against it on the CPU. Built top down, splitting each node where the
+// surface area heuristic, evaluated over the triangle centroids in a few
+// bins per axis, is lowest. Rays are in the object space of the mesh.
+class MeshBvh {
+  public:
+    struct Hit {
+        double t; // the hit is at origin + t * dir
+
+        // index of the triangle, i.e. of its first index divided by 3
+        int triangle;
+
+        // barycentric coordinates of the hit point for the second and third
+        // corners of the triangle
+        float u, v;
+    };
+
+    // `indices' holds three vertex indices per triangle. If it is empty,
+    // each three consecutive positions make a triangle.
+    MeshBvh(const std::vector<Cvec3f> &positions,
+            const std::vector<unsigned int> &indices);
+
+    // What a hierarchy is built from, copied out of the vertex arrays of a
+    // mesh so that the build can wait until a ray is cast against it
+    struct Source {
+        std::vector<Cvec3f> positions;
+        std::vector<unsigned int> indices;
+
+        // The `p' members of `vertices', indexed by `triangles' if it is not
+        // NULL
+        template <typename Vertex, typename Index>
+        Source(const Vertex *vertices, int numVertices, const Index *triangles, int numIndices)
+            : positions(numVertices), indices(triangles, triangles ? triangles + numIndices : triangles) {
+            for (int i = 0; i < numVertices; ++i) {
+                positions[i] = vertices[i].p;
+            }
+        }
+    };
+
+    explicit MeshBvh(const Source &source) : MeshBvh(source.positions, source.indices) {}
+
+    // Finds the nearest hit of the ray origin + t * dir with 0 < t < tMax,
+    // from either side of the triangles. Returns false if there is none.
+    bool intersect(const Cvec3 &origin, const Cvec3 &dir, double tMax,
+                   Hit &hit) const;
+
+    int getNumTriangles() const { return triangles_.size(); }
+    int getNumNodes() const { return nodes_.size(); }
+
+  private:
+    // 32 bytes. An inner node has count 0 and its children at first and
+    // first + 1, a leaf has triangles_[first, first + count).
+    struct Node {
+        float boxMin[3];
+        int first;
+        float boxMax[3];
+        int count;
+    };
+
+    // stored in leaf order, as one corner and the two edges from it
+    struct Triangle {
+        Cvec3f v0, e1, e2;
+        int id;
+    };
+
+    std::vector<Node> nodes_;
+    std::vector<Triangle> triangles_;
+
+    struct Builder;
+};
+
+#endif
@@ -0,0 +1,94 @@
+#ifndef MESHCACHE_H
+#define MESHCACHE_H
+
+#include <cstddef>
+#include <stdint.h>
+#include <string>
+
+#include "bounds.h"
+#include "cvec.h"
+#include "mappedfile.h"
+#include "mesh.h"
+
+// On-disk cache of processed meshes, so startup does not have to parse and
+// optimize the .obj text every time.
+//
+// A cache file holds the vertex array, in one of the vertex formats below,
+// and the index buffer exactly as they are uploaded, plus the bounds of the
+// mesh and the hash of the source it was made from. Like the IBL cache,
+// entries are content addressed by that hash, so an edited .obj never picks
+// up a stale entry. Files are memory mapped and uploaded from the mapping.
+//
+// Hashing a large .obj takes most of the time of a cached load, so the hash
+// is remembered in a small stamp file next to the entries, along with the
+// size and modification time of the .obj it was computed from.
+
+enum MeshCacheVertexFormat {
+    MESH_CACHE_PNX = 0,  // VertexPNX
+    MESH_CACHE_PNTBX = 1 // VertexPNTBX
+};
+
+// Hashes the given .obj together with the version of the mesh processing.
+// Throws runtime_error if the file cannot be read.
+uint64_t hashMeshSource(const std::string &objPath);
+
+// Key of the cache entry for the given .obj, hashMeshSource of it. The
+// stamp file of `objPath' in `dir' is used instead while the size and
+// modification time of the file match it, and rewritten otherwise. Throws
+// runtime_error if the file cannot be read.
+uint64_t makeMeshCacheKey(const std::string &objPath, const std::string &dir);
+
+// Returns the path of the cache file for the given key inside `dir'
+std::string getMeshCachePath(const std::string &dir, uint64_t key);
+
+// The processing whose results are cached: loads the .obj with loadObjMesh,
+// generates its tangents, runs the meshopt.h passes on it and reports the
+// savings on stdout. Throws runtime_error if the file cannot be loaded.
+void importObjMesh(const char *objPath, MeshData &mesh);
+
+// Writes `mesh' as a PNTBX entry if it has tangents, PNX otherwise, with
+// 16-bit indices when all vertices can be addressed with them, like
+// makeMeshGeometry. The file is written under a temporary name and renamed
+// into place. Throws runtime_error on error.
+void writeMeshCache(const std::string &filename, uint64_t key,
+                    const MeshData &mesh);
+
+struct MeshCacheHeader;
+
+// A read only mapping of a cache file. The vertex and index arrays point
+// into the mapping, and stay valid until the file is closed.
+class MeshCacheFile {
+  public:
+    MeshCacheFile();
+    ~MeshCacheFile();
+
+    // Maps `filename'. Returns false if the file does not exist, is corrupt,
+    // or was written for a different key.
+    bool open(const std::string &filename, uint64_t key);
+    void close();
+
+    bool isOpen() const { return header_ != NULL; }
+
+    MeshCacheVertexFormat getVertexFormat() const;
+    int getVertexCount() const;
+    int getIndexCount() const;
+    int getIndexSize() const; // 2 or 4 bytes
+
+    const void *getVertices() const;
+    const void *getIndices() const;
+
+    // Bounds of the vertices, as Bounds::make computes them
+    Bounds getBounds() const;
+
+    // FNV-1a hash of the source .obj
+    uint64_t getSourceHash() const;
+
+  private:
+    MappedFile file_;
+    const MeshCacheHeader *header_;
+
+    MeshCacheFile(const MeshCacheFile &);
+    const MeshCacheFile &operator=(const MeshCacheFile &);
+};
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef MESHOPT_H
+#define MESHOPT_H
+
+#include "mesh.h"
+
+// Optimization passes for MeshData, run on the CPU before upload. They only
+// reorder triangles and vertices, the rendered result is unchanged.
+//
+// The usual order is optimizeVertexCache, then optimizeOverdraw (which
+// keeps most of the cache locality), then optimizeVertexFetch.
+
+// Average cache miss ratio: vertex shader invocations per triangle with a
+// FIFO post-transform cache of `cacheSize' entries. 3 is the worst case,
+// about 0.6 the best one can do on regular meshes.
+float computeACMR(const MeshData &mesh, int cacheSize = 16);
+
+// Reorders the triangles for post-transform vertex cache reuse, with Tom
+// Forsyth's "Linear-Speed Vertex Cache Optimisation"
+void optimizeVertexCache(MeshData &mesh);
+
+// Splits the triangle order produced by optimizeVertexCache into clusters
+// and sorts them so the outward facing ones come first, which lets early-Z
+// reject more of the triangles drawn later (Sander et al., "Fast Triangle
+// Reordering for Vertex Locality and Reduced Overdraw"). Clusters end where
+// the cache is cold anyway, or once their ACMR from a cold cache is within
+// `threshold' times that of the whole mesh. A higher threshold gives more,
+// smaller clusters: better overdraw for a worse ACMR.
+void optimizeOverdraw(MeshData &mesh, float threshold = 1.05f);
+
+// Renumbers the vertices in order of first use by the index buffer, so the
+// vertex fetches walk memory linearly. Unused vertices are dropped.
+void optimizeVertexFetch(MeshData &mesh);
+
+#endif
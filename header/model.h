@@ -1,60 +1,91 @@
 #ifndef MODEL_H
 #define MODEL_H
 
+#include <iostream>
 #include <memory>
+#include <stdexcept>
+#include <string>
 
-#include "tiny_obj_loader.h"
 #include "geometry.h"
+#include "mesh.h"
+#include "meshcache.h"
 
 using namespace std;
 
-shared_ptr<Geometry> loadObj(const char *filePath) {
-    tinyobj::attrib_t attrib;
-    vector<tinyobj::shape_t> shapes;
-    vector<tinyobj::material_t> materials;
-
-    std::string err;
-    bool ret = tinyobj::LoadObj(&attrib, &shapes, &materials, &err, filePath);
-
-    if (!err.empty()) {
-        cerr << "ERR: " << err << endl;
+template <typename Vertex>
+static shared_ptr<Geometry> makeMeshGeometry(const MeshData &mesh, const Vertex *vertices) {
+    if (mesh.vertices.size() <= 0x10000) {
+        const vector<unsigned short> indices(mesh.indices.begin(), mesh.indices.end());
+        return make_shared<SimpleIndexedGeometry<Vertex, unsigned short> >(
+            vertices, &indices[0], mesh.vertices.size(), indices.size());
     }
+    return make_shared<SimpleIndexedGeometry<Vertex, unsigned int> >(
+        vertices, &mesh.indices[0], mesh.vertices.size(), mesh.indices.size());
+}
 
-    if (!ret) {
-        cerr << "Failed to load/parse .obj.\n";
-        assert(false);
+// Indexed geometry for `mesh', VertexPNTBX if it has tangents. Uses 16-bit
+// indices when all vertices can be addressed with them, 32-bit ones
+// otherwise.
+shared_ptr<Geometry> makeMeshGeometry(const MeshData &mesh) {
+    if (mesh.hasTangents()) {
+        vector<VertexPNTBX> vertices;
+        mesh.getTangentVertices(vertices);
+        return makeMeshGeometry(mesh, &vertices[0]);
     }
+    return makeMeshGeometry(mesh, &mesh.vertices[0]);
+}
 
-    auto vertices = vector<VertexPNX>();
-
-    for (const auto& shape : shapes) {
-        for (const auto& index : shape.mesh.indices) {
-
-            VertexPNX vertex;
+template <typename Vertex>
+static shared_ptr<Geometry> makeMeshGeometry(const MeshCacheFile &file) {
+    const Vertex *vertices = static_cast<const Vertex *>(file.getVertices());
+    if (file.getIndexSize() == 2) {
+        auto geometry = make_shared<SimpleIndexedGeometry<Vertex, unsigned short> >();
+        geometry->upload(vertices, static_cast<const unsigned short *>(file.getIndices()),
+                         file.getVertexCount(), file.getIndexCount(), file.getBounds());
+        return geometry;
+    }
+    auto geometry = make_shared<SimpleIndexedGeometry<Vertex, unsigned int> >();
+    geometry->upload(vertices, static_cast<const unsigned int *>(file.getIndices()),
+                     file.getVertexCount(), file.getIndexCount(), file.getBounds());
+    return geometry;
+}
 
-            vertex.p = Cvec3f(
-                    attrib.vertices[3 * index.vertex_index + 0],
-                    attrib.vertices[3 * index.vertex_index + 1],
-                    attrib.vertices[3 * index.vertex_index + 2]
-            );
+// Indexed geometry uploaded straight from a mapped cache file
+shared_ptr<Geometry> makeMeshGeometry(const MeshCacheFile &file) {
+    if (file.getVertexFormat() == MESH_CACHE_PNTBX)
+        return makeMeshGeometry<VertexPNTBX>(file);
+    return makeMeshGeometry<VertexPNX>(file);
+}
 
-            vertex.x = Cvec2f(
-                    attrib.texcoords[2 * index.texcoord_index + 0],
-                    attrib.texcoords[2 * index.texcoord_index + 1]
-            );
+// Loads an .obj through the mesh cache in `cacheDir': maps the cached entry
+// if there is one, otherwise imports the .obj and caches the result
+shared_ptr<Geometry> loadObj(const char *filePath, const string &cacheDir) {
+    uint64_t key = 0;
+    string cachePath;
+    try {
+        key = makeMeshCacheKey(filePath, cacheDir);
+        cachePath = getMeshCachePath(cacheDir, key);
+    } catch (const runtime_error &e) {
+        cerr << "WARN: " << e.what() << ", the mesh will not be cached" << endl;
+    }
 
-            vertex.n = Cvec3f(
-                    attrib.normals[3 * index.normal_index + 0],
-                    attrib.normals[3 * index.normal_index + 1],
-                    attrib.normals[3 * index.normal_index + 2]
-            );
+    MeshCacheFile file;
+    if (!cachePath.empty() && file.open(cachePath, key)) {
+        cout << filePath << ": loaded " << file.getVertexCount() << " vertices and "
+             << file.getIndexCount() << " indices from " << cachePath << endl;
+        return makeMeshGeometry(file);
+    }
 
-            // Not using indices here for simplicity
-            vertices.push_back(vertex);
+    MeshData mesh;
+    importObjMesh(filePath, mesh);
+    if (!cachePath.empty()) {
+        try {
+            writeMeshCache(cachePath, key, mesh);
+        } catch (const runtime_error &e) {
+            cerr << "WARN: " << e.what() << ", the mesh will not be cached" << endl;
         }
     }
-
-    return make_shared<SimpleGeometryPNX>(vertices.data(), vertices.size());
+    return makeMeshGeometry(mesh);
 }
 
 shared_ptr<Material> loadPBRTextures(const Material &prototype, const char *texDir, const char *imgType) {
@@ -0,0 +1,43 @@
+#ifndef OBJPARSER_H
+#define OBJPARSER_H
+
+#include <string>
+#include <vector>
+
+#include "threadpool.h"
+
+// Zero based indices of the position, normal and texture coordinate of a
+// face corner, -1 for a missing normal or texture coordinate. Same meaning
+// as tinyobj::index_t.
+struct ObjIndex {
+    int vertex, normal, texcoord;
+};
+
+// The parts of an .obj used by the renderer: the attribute arrays and the
+// triangulated faces of all groups, in file order
+struct ObjData {
+    std::vector<float> vertices;  // x y z
+    std::vector<float> normals;   // x y z
+    std::vector<float> texcoords; // u v
+    std::vector<ObjIndex> indices; // 3 per triangle
+};
+
+// Parses an .obj with the pool. The file is mapped and split into chunks on
+// line boundaries; the v, vn, vt and f records of each chunk are parsed
+// concurrently into per chunk arrays, which are then copied into place at
+// offsets given by a prefix sum over the chunk sizes.
+//
+// Numbers, relative indices and the triangle fans of polygons are handled
+// exactly like tinyobj 1.0.6 does, so the result is bit for bit the one of
+// parseObjTinyObj (`meshconv --verify' checks that). Unlike tinyobj, faces
+// are never dropped on a group change. Other records (materials, groups,
+// smoothing, lines) are ignored. Throws runtime_error if the file cannot be
+// read.
+void parseObj(const std::string &filename, ObjData &obj,
+              ThreadPool &pool = ThreadPool::getSingleton());
+
+// The reference single threaded path through tinyobj::LoadObj. Throws
+// runtime_error if the file cannot be loaded.
+void parseObjTinyObj(const std::string &filename, ObjData &obj);
+
+#endif
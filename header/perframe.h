@@ -0,0 +1,80 @@
+#ifndef PERFRAME_H
+#define PERFRAME_H
+
+#include "cvec.h"
+#include "glsupport.h"
+#include "matrix4.h"
+
+// Lights in the PerFrame block, MAX_LIGHTS in the shaders
+static const int PER_FRAME_MAX_LIGHTS = 16;
+
+// Uniform buffer binding point the PerFrame block is read from
+static const int PER_FRAME_BINDING = 0;
+
+// CPU image of the std140 PerFrame uniform block declared in pbr.vshader,
+// pbr.fshader, basic-gl3.vshader and skybox.vshader:
+//
+//   layout (std140) uniform PerFrame {
+//       mat4 uProjMatrix;
+//       mat4 uViewMatrix;
+//       int uHoverPickId;
+//       vec3 uCameraPos;
+//       int uNumLights;
+//       vec3 uLightPositions[MAX_LIGHTS];
+//       vec3 uLightColors[MAX_LIGHTS];
+//   };
+//
+// The declarations must stay in sync; Material::setUniformBlockBinding
+// checks that the sizes agree.
+struct PerFrameBlock {
+    GLfloat projMatrix[16]; // column major
+    GLfloat viewMatrix[16];
+    // pick id of the shape to highlight, see IdPicker. std140 aligns the
+    // vec3 that follows to 16 bytes.
+    GLint hoverPickId;
+    GLint padding[3];
+    GLfloat cameraPos[3];
+    GLint numLights;
+    // std140 pads every element of a vec3 array to 16 bytes
+    GLfloat lightPositions[PER_FRAME_MAX_LIGHTS][4];
+    GLfloat lightColors[PER_FRAME_MAX_LIGHTS][4];
+
+    void setProjMatrix(const Matrix4 &m) { m.writeToColumnMajorMatrix(projMatrix); }
+    void setViewMatrix(const Matrix4 &m) { m.writeToColumnMajorMatrix(viewMatrix); }
+
+    void setCameraPos(const Cvec3 &p) {
+        for (int i = 0; i < 3; ++i)
+            cameraPos[i] = GLfloat(p[i]);
+    }
+
+    void setLight(int light, const Cvec3 &position, const Cvec3 &color) {
+        for (int i = 0; i < 3; ++i) {
+            lightPositions[light][i] = GLfloat(position[i]);
+            lightColors[light][i] = GLfloat(color[i]);
+        }
+        lightPositions[light][3] = lightColors[light][3] = 0;
+    }
+};
+
+// The uniform buffer holding the PerFrame block, shared by all programs
+class PerFrameBuffer {
+    GlBufferObject ubo_;
+
+  public:
+    PerFrameBuffer() {
+        GlStateCache::getSingleton().bindBuffer(GL_UNIFORM_BUFFER, ubo_);
+        glBufferData(GL_UNIFORM_BUFFER, sizeof(PerFrameBlock), NULL,
+                     GL_DYNAMIC_DRAW);
+        // also binds the generic binding point, which already holds ubo_
+        glBindBufferBase(GL_UNIFORM_BUFFER, PER_FRAME_BINDING, ubo_);
+        checkGlErrors();
+    }
+
+    // Uploads `block' in one call; draws issued afterwards read it
+    void update(const PerFrameBlock &block) {
+        GlStateCache::getSingleton().bindBuffer(GL_UNIFORM_BUFFER, ubo_);
+        glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(PerFrameBlock), &block);
+    }
+};
+
+#endif
@@ -1,42 +1,74 @@
 #ifndef PICKER_H
 #define PICKER_H
 
-#include <map>
 #include <memory>
-#include <stdexcept>
 #include <vector>
 
-#include "common.h"
 #include "cvec.h"
-#include "drawer.h"
-#include "ppm.h"
+#include "meshbvh.h"
+#include "rigtform.h"
 #include "scenegraph.h"
 
+// Finds the shape nearest along a ray, e.g. the one under the mouse, by
+// casting the ray against the MeshBvh of each geometry on the CPU. The ray
+// is taken into the object space of each shape, through the accumulated
+// rbts and its affine matrix, so the hierarchies never change with the
+// scene. Shapes without a hierarchy, and the sky, cannot be picked.
 class Picker : public SgNodeVisitor {
-    std::vector<shared_ptr<SgNode>> nodeStack_;
+    std::vector<SgTransformNode *> nodeStack_;
+    std::vector<RigTForm> rbtStack_;
 
-    typedef std::map<int, shared_ptr<SgRbtNode>> IdToRbtNodeMap;
-    IdToRbtNodeMap idToRbtNode_;
+    Cvec3 origin_, dir_;
 
-    int idCounter_;
+    // nearest hit so far
+    bool hit_;
+    MeshBvh::Hit nearest_;
+    shared_ptr<SgRbtNode> rbtNode_;
 
-    Drawer drawer_;
+  public:
+    // The ray is origin + t * dir for t > 0, in world coordinates. As for
+    // Drawer, `initialRbt' is the world frame the visited root is relative
+    // to.
+    Picker(const RigTForm &initialRbt, const Cvec3 &origin, const Cvec3 &dir);
+
+    virtual bool visit(SgTransformNode &node);
+    virtual bool postVisit(SgTransformNode &node);
+    virtual bool visit(SgShapeNode &node);
+
+    // Whether the ray hit any shape
+    bool hasHit() const { return hit_; }
 
-    void addToMap(int id, shared_ptr<SgRbtNode> node);
-    shared_ptr<SgRbtNode> find(int id);
+    // The rbt node nearest above the shape hit, or NULL if there is no hit
+    // or no such node
+    shared_ptr<SgRbtNode> getRbtNode() const { return rbtNode_; }
 
-    Cvec3 idToColor(int id);
-    int colorToId(const PackedPixel &p);
+    // Where the ray hit, in world coordinates
+    Cvec3 getHitPoint() const { return origin_ + dir_ * nearest_.t; }
+
+    // Index of the triangle hit in the geometry of the shape, -1 if none
+    int getTriangle() const { return hit_ ? nearest_.triangle : -1; }
+};
+
+// Finds the shape node with a given pick id, as read back by IdPicker, and
+// the rbt node nearest above it
+class PickIdFinder : public SgNodeVisitor {
+    std::vector<SgTransformNode *> nodeStack_;
+
+    unsigned int pickId_;
+    bool found_;
+    shared_ptr<SgRbtNode> rbtNode_;
 
   public:
-    Picker(const RigTForm &initialRbt, Uniforms &uniforms);
+    explicit PickIdFinder(unsigned int pickId) : pickId_(pickId), found_(false) {}
 
     virtual bool visit(SgTransformNode &node);
     virtual bool postVisit(SgTransformNode &node);
     virtual bool visit(SgShapeNode &node);
-    virtual bool postVisit(SgShapeNode &node);
 
-    shared_ptr<SgRbtNode> getRbtNodeAtXY(int x, int y);
+    bool hasFound() const { return found_; }
+
+    // NULL if the shape was not found or has no rbt node above it
+    shared_ptr<SgRbtNode> getRbtNode() const { return rbtNode_; }
 };
 
 #endif
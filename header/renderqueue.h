@@ -0,0 +1,169 @@
+#ifndef RENDERQUEUE_H
+#define RENDERQUEUE_H
+
+#include <cstdint>
+#include <vector>
+
+#include "drawer.h"
+#include "geometry.h"
+#include "material.h"
+#include "matrix4.h"
+#include "uniforms.h"
+
+// One draw, recorded during scene traversal to be issued later
+struct DrawPacket {
+    // from the most significant bits down: render pass (2), program (10),
+    // texture set hash (12), material id (16), depth (24). Sorting by it
+    // groups draws by state and orders each group front to back.
+    uint64_t sortKey;
+    Matrix4 modelMatrix;
+    Geometry *geometry;
+    Material *material;
+    unsigned int pickId; // see SgShapeNode::getPickId
+};
+
+// Decouples scene traversal from GL submission: draws are pushed in scene
+// graph order, radix sorted by DrawPacket::sortKey, then submitted. The
+// buffers are kept between frames, so a queue reused every frame stops
+// allocating once it has seen its largest frame.
+//
+// When submitting in sorted order, draws of the same BufferObjectGeometry
+// with the same instanceable material (see Material::setInstancedShaders)
+// are batched into one instanced draw. Their model matrices and pick ids go
+// to InstanceModelMatrix and InstancePickId buffers wired into the geometry
+// as aModelMatrix and aPickId on first use.
+class RenderQueue {
+  public:
+    // State changes between consecutive draws, counting the first draw as
+    // a change
+    struct Stats {
+        int draws;
+        int programChanges, textureSetChanges, materialChanges;
+    };
+
+    RenderQueue()
+        : instancing_(true), unsortedStats_(), sortedStats_(), drawCalls_(0) {}
+
+    static uint64_t makeSortKey(int renderPass, GLuint program,
+                                unsigned int textureSetHash, int materialId,
+                                float depth);
+
+    // Removes all packets
+    void clear();
+
+    // `depth' is the distance of the draw in front of the eye
+    void push(Geometry &geometry, Material &material,
+              const Matrix4 &modelMatrix, float depth, unsigned int pickId = 0);
+
+    int size() const { return packets_.size(); }
+
+    // Sorts the packets pushed since clear by key. Stable, so equal keys
+    // keep their push order.
+    void sort();
+
+    // Draws the packets in sorted order, or in push order if `sorted' is
+    // false, putting each model matrix and pick id into `uniforms' first
+    void submit(Uniforms &uniforms, bool sorted = true);
+
+    // Whether sorted submission batches draws into instanced ones, on by
+    // default
+    void setInstancing(bool enabled) { instancing_ = enabled; }
+
+    // GL draw calls issued by the last submit
+    int getNumDrawCalls() const { return drawCalls_; }
+
+    // Changes in push order and in sorted order of the packets last sorted
+    const Stats &getUnsortedStats() const { return unsortedStats_; }
+    const Stats &getSortedStats() const { return sortedStats_; }
+
+  protected:
+    struct SortItem {
+        uint64_t key;
+        uint32_t packet; // index in packets_
+    };
+
+    std::vector<DrawPacket> packets_;
+    std::vector<SortItem> order_, scratch_;
+
+    bool instancing_;
+
+    // An instanceable packet, at `position' in order_
+    struct InstanceItem {
+        Geometry *geometry;
+        Material *material;
+        int position;
+
+        // Whether `other' goes in the same instanced draw
+        bool batchesWith(const InstanceItem &other) const {
+            return geometry == other.geometry && material == other.material;
+        }
+    };
+
+    // scratch of submit: which packets were drawn, the instanceable packets
+    // bucketed by geometry, the run of instanceItems_ each position starts,
+    // and the model matrices and pick ids of an instanced batch
+    std::vector<char> drawn_;
+    std::vector<InstanceItem> instanceItems_;
+    std::vector<int> runs_;
+    std::vector<InstanceModelMatrix> instances_;
+    std::vector<InstancePickId> instancePickIds_;
+
+    Stats unsortedStats_, sortedStats_;
+    int drawCalls_;
+
+    // Sorts the instanceable packets of each group of order_ sharing their
+    // key above the depth to instanceItems_ by geometry, material and
+    // position, and sets runs_[i] to the start of the run of at least two
+    // items with the geometry and material of position i if it is the first
+    // of them, -1 otherwise. O(n log n) however the geometries alternate.
+    void findInstanceRuns();
+
+    // Draws the run of instanceItems_ starting at `run' in one instanced
+    // draw
+    void submitInstanced(Uniforms &uniforms, int run);
+
+    // Counts the changes between consecutive packets of `items'
+    void countChanges(const std::vector<SortItem> &items, Stats &stats) const;
+};
+
+// Distance in front of the eye of the origin of `modelMatrix', the depth
+// RenderQueue::push expects
+inline float getViewDepth(const Matrix4 &viewMatrix, const Matrix4 &modelMatrix) {
+    // eye space z, negative in front of the eye
+    double z = 0;
+    for (int k = 0; k < 4; ++k) {
+        z += viewMatrix(2, k) * modelMatrix(k, 3);
+    }
+    return float(-z);
+}
+
+// A Drawer that queues the shapes it visits instead of drawing them. Shapes
+// without a geometry and material to queue are drawn right away.
+class RenderQueueDrawer : public Drawer {
+    RenderQueue &queue_;
+    Matrix4 viewMatrix_;
+
+  public:
+    // `viewMatrix' is only used for the depths of the draws
+    RenderQueueDrawer(const RigTForm &initialRbt, Uniforms &uniforms,
+                      RenderQueue &queue, const Matrix4 &viewMatrix,
+                      const Frustum *frustum = NULL)
+        : Drawer(initialRbt, uniforms, frustum), queue_(queue),
+          viewMatrix_(viewMatrix) {}
+
+    virtual bool visit(SgShapeNode &shapeNode) {
+        Geometry *geometry = shapeNode.getGeometry();
+        Material *material = shapeNode.getMaterial();
+        if (!geometry || !material)
+            return Drawer::visit(shapeNode);
+
+        const Matrix4 modelMat = rigTFormToMatrix(rbtStack_.back()) * shapeNode.getAffineMatrix();
+        if (cull(shapeNode, modelMat))
+            return true;
+        queue_.push(*geometry, *material, modelMat, getViewDepth(viewMatrix_, modelMat),
+                    shapeNode.getPickId());
+        return true;
+    }
+};
+
+#endif
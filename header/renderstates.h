@@ -8,6 +8,7 @@
 // - glPolygonMode  (Default: GL_FRONT_AND_BACK, GL_FILL)
 // - glBlendFunc    (Default: GL_ONE, GL_ZERO)
 // - glCullFace     (Default: GL_BACK)
+// - glDepthFunc    (Default: GL_LESS)
 //
 // The following flags for glEnable/glDisable are supported
 //
@@ -18,6 +19,7 @@ class RenderStates {
     GLenum glFrontAndBack;                     // for polygonMode
     GLenum glBlendSrcFactor, glBlendDstFactor; // for blendFunc
     GLenum glCullFaceMode;                     // for cullFace
+    GLenum glDepthFuncMode;                    // for depthFunc
     unsigned int flags;
 
   public:
@@ -26,6 +28,7 @@ class RenderStates {
     RenderStates &polygonMode(GLenum face, GLenum mode);
     RenderStates &blendFunc(GLenum sfactor, GLenum dfactor);
     RenderStates &cullFace(GLenum mode);
+    RenderStates &depthFunc(GLenum func);
 
     RenderStates &enable(GLenum target);
     RenderStates &disable(GLenum target);
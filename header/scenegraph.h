@@ -14,13 +14,19 @@
 
 using namespace std;
 
+class FlatHierarchy;
 class SgNodeVisitor;
+class SgTransformNode;
 
 class SgNode : public enable_shared_from_this<SgNode>, Noncopyable {
   public:
     virtual bool accept(SgNodeVisitor &vistor) = 0;
     virtual ~SgNode() {}
 
+    // The transform node this node was added to, or NULL. A node has at
+    // most one parent.
+    SgTransformNode *getParent() const { return parent_; }
+
     // Two nodes are equal if and only if they're the same, i.e.,
     // having the same in memory address
     bool operator==(const SgNode &other) const { return this == &other; }
@@ -28,7 +34,23 @@ class SgNode : public enable_shared_from_this<SgNode>, Noncopyable {
     bool operator!=(const SgNode &other) const { return !(*this == other); }
 
   protected:
-    SgNode() {}
+    SgNode() : parent_(NULL) {}
+
+  private:
+    friend class SgTransformNode;
+
+    SgTransformNode *parent_; // owns this node through its children
+};
+
+// Told about every child added to or removed from the tree below the
+// transform node it is set on, see SgTransformNode::setTopologyListener.
+// Called after the change, while the child is still alive.
+class SgTopologyListener {
+  public:
+    virtual ~SgTopologyListener() {}
+
+    virtual void onChildAdded(SgTransformNode &parent, SgNode &child) = 0;
+    virtual void onChildRemoved(SgTransformNode &parent, SgNode &child) = 0;
 };
 
 //
@@ -36,11 +58,20 @@ class SgNode : public enable_shared_from_this<SgNode>, Noncopyable {
 // rigid body transform to represent its frame with respect to
 // the parent frame
 //
+// The frame with respect to the root, the product of the rbts from the root
+// down, is cached. It is recomputed lazily after an rbt on the path changes,
+// so that asking for it again costs O(1), and at most O(depth) after a
+// change.
+//
 class SgTransformNode : public SgNode {
   public:
+    SgTransformNode()
+        : worldRbtDirty_(true), rbtChanged_(true), topologyListener_(NULL) {}
+
     virtual bool accept(SgNodeVisitor &visitor);
     virtual RigTForm getRbt() = 0;
 
+    // Throws if `child' already has a parent
     void addChild(shared_ptr<SgNode> child);
     void removeChild(shared_ptr<SgNode> child);
 
@@ -48,8 +79,42 @@ class SgTransformNode : public SgNode {
 
     shared_ptr<SgNode> getChild(int i) { return children_[i]; }
 
+    // The rbts of the ancestors, root first, times getRbt()
+    const RigTForm &getWorldRbt();
+
+    // Marks the world rbt of this node and of its descendants out of date.
+    // Subclasses call it whenever getRbt() changes.
+    void invalidateWorldRbt();
+
+    // Only the listener of the root of the tree is told about changes, so
+    // it must be set on a node without a parent. NULL to unset.
+    void setTopologyListener(SgTopologyListener *listener) {
+        topologyListener_ = listener;
+    }
+
   private:
+    friend class FlatHierarchy; // computes world rbts in bulk
+
     std::vector<shared_ptr<SgNode>> children_;
+
+    RigTForm worldRbt_;
+
+    // Once the world rbt of a node is out of date, so are those of its
+    // descendants. invalidateWorldRbt relies on it to stop early.
+    bool worldRbtDirty_;
+
+    // Set by invalidateWorldRbt, i.e. whenever getRbt() changes, and only
+    // cleared by FlatHierarchy, which reads the rbts of the nodes with it
+    // set. worldRbtDirty_ cannot tell, as getWorldRbt clears it.
+    bool rbtChanged_;
+
+    SgTopologyListener *topologyListener_;
+
+    // invalidateWorldRbt without marking the rbt changed
+    void markWorldRbtDirty();
+
+    // The listener of the root of the tree this node is in, or NULL
+    SgTopologyListener *findTopologyListener();
 };
 
 //
@@ -60,8 +125,26 @@ class SgShapeNode : public SgNode {
   public:
     virtual bool accept(SgNodeVisitor &visitor);
 
+    // Id written to the pick id buffer where the shape is drawn, see
+    // IdPicker. Unique among the shape nodes created, and never 0, which
+    // stands for the background.
+    unsigned int getPickId() const { return pickId_; }
+
     virtual Matrix4 getAffineMatrix() = 0;
     virtual void draw(const Uniforms &uniforms) = 0;
+
+    // The geometry and material draw() uses, so that the draw can be queued
+    // and issued later, see RenderQueue. NULL if draw() does something else.
+    virtual Geometry *getGeometry() { return NULL; }
+    virtual Material *getMaterial() { return NULL; }
+
+  protected:
+    SgShapeNode() : pickId_(nextPickId_++) {}
+
+  private:
+    unsigned int pickId_;
+
+    static unsigned int nextPickId_;
 };
 
 // Visitor class for the scene graph nodes. If any of the
@@ -76,10 +159,21 @@ class SgNodeVisitor {
     virtual bool postVisit(SgShapeNode &node) { return true; }
 };
 
+// Frame of the ancestor `offsetFromDestination' levels above `destination'
+// with respect to `source', which must be an ancestor of both. The rbt of
+// `source' itself is not included. Goes up the parent links and uses the
+// cached world rbts, O(depth).
 RigTForm getPathAccumRbt(shared_ptr<SgTransformNode> source,
                          shared_ptr<SgTransformNode> destination,
                          int offsetFromDestination = 0);
 
+// Same as getPathAccumRbt, but found by traversing the graph from `source'
+// with a visitor, O(number of nodes). Only meant for checking and
+// benchmarking getPathAccumRbt.
+RigTForm getPathAccumRbtByTraversal(shared_ptr<SgTransformNode> source,
+                                    shared_ptr<SgTransformNode> destination,
+                                    int offsetFromDestination = 0);
+
 //----------------------------------------------------
 // Concrete scene graph node implementations follow
 //----------------------------------------------------
@@ -99,7 +193,10 @@ class SgRbtNode : public SgTransformNode {
 
     virtual RigTForm getRbt() { return rbt_; }
 
-    void setRbt(const RigTForm &rbt) { rbt_ = rbt; }
+    void setRbt(const RigTForm &rbt) {
+        rbt_ = rbt;
+        invalidateWorldRbt();
+    }
 
   private:
     RigTForm rbt_;
@@ -136,10 +233,14 @@ class SgGeometryShapeNode : public SgShapeNode {
     }
 
     virtual void draw(const Uniforms &uniforms) {
-        if (g_overridingMaterial)
-            g_overridingMaterial->draw(*geometry, uniforms);
-        else
-            material->draw(*geometry, uniforms);
+        getMaterial()->draw(*geometry, uniforms);
+    }
+
+    virtual Geometry *getGeometry() { return geometry.get(); }
+
+    virtual Material *getMaterial() {
+        return g_overridingMaterial ? g_overridingMaterial.get()
+                                    : material.get();
     }
 };
 
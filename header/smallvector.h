@@ -0,0 +1,111 @@
+#ifndef SMALLVECTOR_H
+#define SMALLVECTOR_H
+
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+// A vector of trivially copyable elements that stores up to N of them inside
+// the object itself and only goes to the heap beyond that. Elements are
+// moved with memcpy, and the ones added by resize are left uninitialized.
+template <typename T, int N> class SmallVector {
+    T *data_;
+    int size_, capacity_;
+    T inline_[N];
+
+  public:
+    SmallVector() : data_(inline_), size_(0), capacity_(N) {}
+
+    SmallVector(const SmallVector &v) : data_(inline_), size_(0), capacity_(N) {
+        *this = v;
+    }
+
+    ~SmallVector() {
+        if (data_ != inline_)
+            free(data_);
+    }
+
+    SmallVector &operator=(const SmallVector &v) {
+        if (this != &v) {
+            resize(v.size_);
+            memcpy(data_, v.data_, sizeof(T) * v.size_);
+        }
+        return *this;
+    }
+
+    int size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+    // true while the elements are stored inside the object
+    bool isInline() const { return data_ == inline_; }
+
+    T &operator[](int i) {
+        assert(i >= 0 && i < size_);
+        return data_[i];
+    }
+    const T &operator[](int i) const {
+        assert(i >= 0 && i < size_);
+        return data_[i];
+    }
+
+    T *begin() { return data_; }
+    T *end() { return data_ + size_; }
+    const T *begin() const { return data_; }
+    const T *end() const { return data_ + size_; }
+
+    void reserve(int capacity) {
+        if (capacity <= capacity_)
+            return;
+        capacity = capacity > 2 * capacity_ ? capacity : 2 * capacity_;
+        T *data = static_cast<T *>(
+            isInline() ? malloc(sizeof(T) * capacity)
+                       : realloc(data_, sizeof(T) * capacity));
+        if (data == NULL)
+            throw std::bad_alloc();
+        if (isInline())
+            memcpy(data, inline_, sizeof(T) * size_);
+        data_ = data;
+        capacity_ = capacity;
+    }
+
+    void resize(int size) {
+        reserve(size);
+        size_ = size;
+    }
+
+    void clear() { size_ = 0; }
+
+    T &back() {
+        assert(size_ > 0);
+        return data_[size_ - 1];
+    }
+    const T &back() const {
+        assert(size_ > 0);
+        return data_[size_ - 1];
+    }
+
+    void pop_back() {
+        assert(size_ > 0);
+        --size_;
+    }
+
+    void push_back(const T &v) {
+        const T copy = v; // v may live in the storage reserve moves
+        reserve(size_ + 1);
+        data_[size_++] = copy;
+    }
+
+    // Inserts `v' before index `i' and returns a pointer to it
+    T *insert(int i, const T &v) {
+        assert(i >= 0 && i <= size_);
+        const T copy = v;
+        reserve(size_ + 1);
+        memmove(data_ + i + 1, data_ + i, sizeof(T) * (size_ - i));
+        data_[i] = copy;
+        ++size_;
+        return data_ + i;
+    }
+};
+
+#endif
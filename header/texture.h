@@ -16,9 +16,12 @@ public:
     // intended usage by GLSL shader
     virtual GLenum getSamplerType() const = 0;
 
+    // The target the texture binds to, e.g. GL_TEXTURE_2D
+    virtual GLenum getTarget() const = 0;
+
     // Binds the texture. (The caller is responsible for setting the active
     // texture unit)
-    virtual void bind() const = 0;
+    void bind() const { GlStateCache::getSingleton().bindTexture(getTarget(), tex); }
 
     virtual ~Texture() {}
 
@@ -36,7 +39,7 @@ public:
 
     GLenum getSamplerType() const { return GL_SAMPLER_2D; }
 
-    void bind() const { glBindTexture(GL_TEXTURE_2D, tex); }
+    GLenum getTarget() const { return GL_TEXTURE_2D; }
 };
 
 class CubeMapTexture : public Texture {
@@ -46,7 +49,7 @@ public:
 
     GLenum getSamplerType() const { return GL_SAMPLER_CUBE; }
 
-    void bind() const { glBindTexture(GL_TEXTURE_CUBE_MAP, tex); }
+    GLenum getTarget() const { return GL_TEXTURE_CUBE_MAP; }
 };
 
 #endif
@@ -0,0 +1,66 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of worker threads for data parallel CPU work.
+//
+// parallelFor splits the task range into one contiguous chunk per worker.
+// Each worker drains its own chunk front to back, and once it is empty it
+// steals remaining tasks from the chunks of the other workers, so uneven
+// task costs still keep every core busy while neighbouring tasks mostly run
+// on the same thread.
+class ThreadPool {
+  public:
+    // numThreads counts the calling thread, which always takes part in the
+    // work. 0 means one thread per hardware core.
+    explicit ThreadPool(int numThreads = 0);
+    ~ThreadPool();
+
+    int getNumThreads() const { return numThreads_; }
+
+    // Calls fn(task, worker) for every task in [0, numTasks) and returns when
+    // all of them are done. `worker' is in [0, getNumThreads()) and can be
+    // used to index per thread scratch data. Calls from different threads
+    // are serialized; calling parallelFor from inside a task is not allowed.
+    void parallelFor(int numTasks, const std::function<void(int, int)> &fn);
+
+    // A process wide pool with one thread per hardware core
+    static ThreadPool &getSingleton();
+
+  private:
+    // Per worker chunk of tasks. Padded to a cache line so that workers
+    // popping tasks do not contend on each other's counters.
+    struct Chunk {
+        std::atomic<int> next;
+        int end;
+        char padding[64 - sizeof(std::atomic<int>) - sizeof(int)];
+    };
+
+    const int numThreads_;
+    std::vector<std::thread> threads_;
+    std::unique_ptr<Chunk[]> chunks_;
+
+    std::mutex callMutex_; // serializes parallelFor calls
+
+    std::mutex mutex_;
+    std::condition_variable wakeCv_, doneCv_;
+    const std::function<void(int, int)> *job_;
+    unsigned int generation_;
+    int pendingWorkers_;
+    bool quit_;
+
+    void workerLoop(int worker);
+    void runTasks(int worker);
+
+    ThreadPool(const ThreadPool &);
+    const ThreadPool &operator=(const ThreadPool &);
+};
+
+#endif
@@ -1,7 +1,7 @@
 #ifndef UNIFORMS_H
 #define UNIFORMS_H
 
-#include <map>
+#include <cstring>
 #include <memory>
 #include <stdexcept>
 #include <string>
@@ -10,56 +10,12 @@
 #include "cvec.h"
 #include "glsupport.h"
 #include "matrix4.h"
+#include "smallvector.h"
 #include "texture.h"
 
 // Private namespace for some helper functions. You should ignore this unless
 // you are interested in the internal implementation.
 namespace _helper {
-inline void genericGlUniformi(GLint location, int i) {
-    ::glUniform1i(location, i);
-}
-inline void genericGlUniformf(GLint location, float f) {
-    ::glUniform1f(location, f);
-}
-inline void genericGlUniformv(GLint location, int size, const GLint *v) {
-    ::glUniform1iv(location, size, v);
-}
-inline void genericGlUniformv(GLint location, int size, const GLfloat *v) {
-    ::glUniform1fv(location, size, v);
-}
-inline void genericGlUniformv(GLint location, int size, const Cvec<int, 1> *v) {
-    ::glUniform1iv(location, size, &v[0][0]);
-}
-inline void genericGlUniformv(GLint location, int size, const Cvec<int, 2> *v) {
-    ::glUniform2iv(location, size, &v[0][0]);
-}
-inline void genericGlUniformv(GLint location, int size, const Cvec<int, 3> *v) {
-    ::glUniform3iv(location, size, &v[0][0]);
-}
-inline void genericGlUniformv(GLint location, int size, const Cvec<int, 4> *v) {
-    ::glUniform4iv(location, size, &v[0][0]);
-}
-inline void genericGlUniformv(GLint location, int size,
-                              const Cvec<float, 1> *v) {
-    ::glUniform1fv(location, size, &v[0][0]);
-}
-inline void genericGlUniformv(GLint location, int size,
-                              const Cvec<float, 2> *v) {
-    ::glUniform2fv(location, size, &v[0][0]);
-}
-inline void genericGlUniformv(GLint location, int size,
-                              const Cvec<float, 3> *v) {
-    ::glUniform3fv(location, size, &v[0][0]);
-}
-inline void genericGlUniformv(GLint location, int size,
-                              const Cvec<float, 4> *v) {
-    ::glUniform4fv(location, size, &v[0][0]);
-}
-inline void genericGlUniformMatrix4v(GLint location, int size,
-                                     const Cvec<float, 16> *m) {
-    ::glUniformMatrix4fv(location, size, GL_FALSE, &m[0][0]);
-}
-
 template <typename T, int n>
 inline GLenum getTypeForCvec(); // should replace with STATIC_ASSERT
 
@@ -77,6 +33,24 @@ template <> inline GLenum getTypeForCvec<bool, 3>() { return GL_BOOL_VEC3; }
 template <> inline GLenum getTypeForCvec<bool, 4>() { return GL_BOOL_VEC4; }
 } // namespace _helper
 
+// A uniform name interned to its integer ID. Constructing one looks the name
+// up in a hash table, so code that puts the same name over and over should
+// keep the key around, e.g. in a static:
+//
+//   static const UniformKey uModelMatrix("uModelMatrix");
+//   uniforms.put(uModelMatrix, modelMatrix);
+//
+// Names convert to keys implicitly, so uniforms.put("name", val) still works.
+class UniformKey {
+    int id_;
+
+  public:
+    UniformKey(const char *name);
+    UniformKey(const std::string &name);
+
+    int getId() const { return id_; }
+};
+
 // The Uniforms keeps a map from strings to values
 //
 // Currently the value can be of the following type:
@@ -90,252 +64,188 @@ template <> inline GLenum getTypeForCvec<bool, 4>() { return GL_BOOL_VEC4; }
 //
 // A Uniforms instance will start off empty, and you can use
 // its put member function to populate it.
+//
+// Names are interned to integer IDs shared by all instances, and the set of
+// IDs an instance holds (its layout) is interned too. Material::draw uses
+// the layouts to cache which value goes to which shader uniform, see
+// material.cpp.
+//
+// Values are packed into flat arrays that live inside the instance until
+// they outgrow it. Putting a name again overwrites its value in place, so
+// once every name has been put, e.g. after the first frame, put does not
+// allocate, and neither does copying an instance whose values fit inside
+// it.
 
 class Uniforms {
   public:
-    Uniforms &put(const std::string &name, int value) {
-        Cvec<int, 1> v(value);
-        valueMap[name].reset(new CvecsValue<int, 1>(&v, 1));
-        return *this;
+    Uniforms() : numInlineTextures_(0), layout_(0) {}
+
+    Uniforms &put(const UniformKey &key, int value) {
+        return put(key, &value, 1);
     }
 
-    Uniforms &put(const std::string &name, float value) {
-        Cvec<float, 1> v(value);
-        valueMap[name].reset(new CvecsValue<float, 1>(&v, 1));
-        return *this;
+    Uniforms &put(const UniformKey &key, float value) {
+        return put(key, &value, 1);
     }
 
-    Uniforms &put(const std::string &name, const Matrix4 &value) {
-        valueMap[name].reset(new Matrix4sValue(&value, 1));
-        return *this;
+    Uniforms &put(const UniformKey &key, const Matrix4 &value) {
+        return put(key, &value, 1);
     }
 
-    Uniforms &put(const std::string &name,
+    Uniforms &put(const UniformKey &key,
                   const std::shared_ptr<Texture> &value) {
-        valueMap[name].reset(new TexturesValue(&value, 1));
-        return *this;
+        return put(key, &value, 1);
     }
 
     template <int n>
-    Uniforms &put(const std::string &name, const Cvec<int, n> &v) {
-        valueMap[name].reset(new CvecsValue<int, n>(&v, 1));
-        return *this;
+    Uniforms &put(const UniformKey &key, const Cvec<int, n> &v) {
+        return put(key, &v, 1);
     }
 
     template <int n>
-    Uniforms &put(const std::string &name, const Cvec<float, n> &v) {
-        valueMap[name].reset(new CvecsValue<float, n>(&v, 1));
-        return *this;
+    Uniforms &put(const UniformKey &key, const Cvec<float, n> &v) {
+        return put(key, &v, 1);
     }
 
     template <int n>
-    Uniforms &put(const std::string &name, const Cvec<double, n> &v) {
-        Cvec<float, n> u;
-        for (int i = 0; i < n; ++i) {
-            u[i] = float(v[i]);
-        }
-        valueMap[name].reset(new CvecsValue<float, n>(&u, 1));
-        return *this;
+    Uniforms &put(const UniformKey &key, const Cvec<double, n> &v) {
+        return put(key, &v, 1);
     }
 
-    Uniforms &put(const std::string &name, const int *values, int count) {
-        valueMap[name].reset(new CvecsValue<int, 1>(
-            reinterpret_cast<const Cvec<int, 1> *>(values), count));
+    Uniforms &put(const UniformKey &key, const int *values, int count) {
+        memcpy(putWords(key, GL_INT, count, count), values,
+               sizeof(GLint) * count);
         return *this;
     }
 
-    Uniforms &put(const std::string &name, const float *values, int count) {
-        valueMap[name].reset(new CvecsValue<float, 1>(
-            reinterpret_cast<const Cvec<float, 1> *>(values), count));
+    Uniforms &put(const UniformKey &key, const float *values, int count) {
+        memcpy(putWords(key, GL_FLOAT, count, count), values,
+               sizeof(GLfloat) * count);
         return *this;
     }
 
-    Uniforms &put(const std::string &name, const Matrix4 *values, int count) {
-        valueMap[name].reset(new Matrix4sValue(values, count));
+    Uniforms &put(const UniformKey &key, const Matrix4 *values, int count) {
+        GLuint *words = putWords(key, GL_FLOAT_MAT4, count, 16 * count);
+        for (int i = 0; i < count; ++i) {
+            GLfloat m[16];
+            values[i].writeToColumnMajorMatrix(m);
+            memcpy(words + 16 * i, m, sizeof(m));
+        }
         return *this;
     }
 
-    Uniforms &put(const std::string &name,
-                  const std::shared_ptr<Texture> *values, int count) {
-        valueMap[name].reset(new TexturesValue(values, count));
-        return *this;
-    }
+    Uniforms &put(const UniformKey &key,
+                  const std::shared_ptr<Texture> *values, int count);
 
     template <int n>
-    Uniforms &put(const std::string &name, const Cvec<int, n> *v, int count) {
-        valueMap[name].reset(new CvecsValue<int, n>(v, count));
+    Uniforms &put(const UniformKey &key, const Cvec<int, n> *v, int count) {
+        memcpy(putWords(key, _helper::getTypeForCvec<int, n>(), count,
+                        n * count),
+               &v[0][0], sizeof(GLint) * n * count);
         return *this;
     }
 
     template <int n>
-    Uniforms &put(const std::string &name, const Cvec<float, n> *v, int count) {
-        valueMap[name].reset(new CvecsValue<float, n>(v, count));
+    Uniforms &put(const UniformKey &key, const Cvec<float, n> *v, int count) {
+        memcpy(putWords(key, _helper::getTypeForCvec<float, n>(), count,
+                        n * count),
+               &v[0][0], sizeof(GLfloat) * n * count);
         return *this;
     }
 
     template <int n>
-    Uniforms &put(const std::string &name, const Cvec<double, n> *v,
+    Uniforms &put(const UniformKey &key, const Cvec<double, n> *v,
                   int count) {
-        valueMap[name].reset(new CvecsValue<float, n>(v, count));
+        GLuint *words = putWords(key, _helper::getTypeForCvec<float, n>(),
+                                 count, n * count);
+        for (int i = 0; i < count; ++i) {
+            for (int d = 0; d < n; ++d) {
+                const GLfloat f = GLfloat(v[i][d]);
+                memcpy(words + n * i + d, &f, sizeof(f));
+            }
+        }
         return *this;
     }
 
     // Future work: add put for different sized matrices, and array of basic
     // types
-  protected:
-    // Ghastly implementation details follow. Viewer be warned.
-
-    friend class Material;
-    class ValueHolder;
-    class Value;
 
-    typedef std::map<std::string, ValueHolder> ValueMap;
+    // ID of `name', interned on first use
+    static int getId(const std::string &name);
 
-    ValueMap valueMap;
+    // ID of `name' if it was ever interned, -1 otherwise
+    static int findId(const std::string &name);
 
-    const Value *get(const std::string &name) const {
-        std::map<std::string, ValueHolder>::const_iterator i =
-            valueMap.find(name);
-        return i == valueMap.end() ? NULL : i->second.get();
-    }
+    // ID of the set of names held, equal for instances holding the same
+    // names. Changes only when a new name is put.
+    int getLayout() const { return layout_; }
 
-    class ValueHolder {
-        Value *value_;
-
-      public:
-        ValueHolder() : value_(NULL) {}
-        ValueHolder(Value *value) : value_(value) {}
-        ValueHolder(const ValueHolder &u)
-            : value_(u.value_ ? u.value_->clone() : NULL) {}
-        ~ValueHolder() {
-            if (value_)
-                delete value_;
-        }
-        void reset(Value *value) {
-            if (value_)
-                delete value_;
-            value_ = value;
-        }
+  protected:
+    friend class Material;
 
-        Value *get() const { return value_; }
+    struct Entry {
+        int id;
 
-        ValueHolder &operator=(const ValueHolder &u) {
-            reset(u.value_ ? u.value_->clone() : NULL);
-            return *this;
-        }
-    };
-
-    class Value {
-      public:
-        // One of the uniform type as returned by glGetActiveUniform, used for
-        // matching
-        const GLenum type;
+        // One of the uniform type as returned by glGetActiveUniform, used
+        // for matching
+        GLenum type;
 
         // 1 for non-array type, otherwise the number of elements in the array
-        const GLint size;
-
-        virtual Value *clone() const = 0;
-        virtual ~Value() {}
-
-        // If type is one of GL_SAMPLER_*, the getTextures should provide a
-        // pointer to the array of shared_ptr<Texture> stored by the uniform.
-        // And apply should use the boundTexUnits argument as the argument for
-        // glUniform*.
-        //
-        // Otherwise, boundTexUnit should be ignored and whatever values
-        // contained in the Value instance should be set to given location.
-        //
-        // `count' specifies how many actural uniforms are specified by the
-        // shader, and should be used as input parameter to glUniform*
-        virtual void apply(GLint location, GLsizei count,
-                           const GLint *boundTexUnits) const = 0;
-        virtual const std::shared_ptr<Texture> *getTextures() const {
-            return NULL;
-        };
-
-      protected:
-        Value(GLenum aType, GLint aSize) : type(aType), size(aSize) {}
+        int size;
+
+        // Where the value starts in the texture slots if type is one of
+        // GL_SAMPLER_*, in words_ otherwise, and how many textures or words
+        // are set aside for it there
+        int offset, capacity;
     };
 
-    template <typename T, int n> class CvecsValue : public Value {
-        std::vector<Cvec<T, n>> vs_;
+    // sorted by id
+    SmallVector<Entry, 8> entries_;
 
-      public:
-        CvecsValue(const Cvec<T, n> *vs, int size)
-            : Value(_helper::getTypeForCvec<T, n>(), size), vs_(vs, vs + size) {
-            assert(size > 0);
-        }
+    // raw bits of the int and float values. Matrices are column major.
+    SmallVector<GLuint, 64> words_;
 
-        // construct from Cvecs of another type
-        template <typename S>
-        CvecsValue(const Cvec<S, n> *vs, int size)
-            : Value(_helper::getTypeForCvec<T, n>(), size), vs_(size) {
-            assert(size > 0);
-            for (int i = 0; i < size; ++i) {
-                for (int d = 0; d < n; ++d) {
-                    vs_[i][d] = T(vs[i][d]);
-                }
-            }
-        }
+    // the texture slots: [0, INLINE_TEXTURES) in inlineTextures_, of which
+    // numInlineTextures_ are taken, and the ones after in moreTextures_. The
+    // slots of an entry are all in one of the two.
+    enum { INLINE_TEXTURES = 8 };
+    std::shared_ptr<Texture> inlineTextures_[INLINE_TEXTURES];
+    std::vector<std::shared_ptr<Texture>> moreTextures_;
+    int numInlineTextures_;
 
-        virtual Value *clone() const { return new CvecsValue(*this); }
+    // interned id set of entries_
+    int layout_;
 
-        virtual void apply(GLint location, GLsizei count,
-                           const GLint *boundTexUnit) const {
-            assert(count <= size);
-            _helper::genericGlUniformv(location, count, &vs_[0]);
-        }
-    };
+    static bool isSamplerType(GLenum type);
 
-    class Matrix4sValue : public Value {
-        // we use cvecs here instead of matrix4s here since matrix4
-        // doesn't allow double element (yet), and to pass the data
-        // into glUniformMatrix4fv, we need to have the internal buffer
-        // to be typed float.
-        std::vector<Cvec<float, 16>> ms_;
-
-      public:
-        Matrix4sValue(const Matrix4 *m, int size)
-            : Value(GL_FLOAT_MAT4, size), ms_(size) {
-            assert(size > 0);
-            for (int i = 0; i < size; ++i) {
-                m[i].writeToColumnMajorMatrix(&ms_[i][0]);
-            }
-        }
+    // Index of the entry with the given id in entries_, inserted if needed
+    int getEntryIndex(int id);
 
-        virtual Value *clone() const { return new Matrix4sValue(*this); }
+    // Sets the type and size of the entry of `key' and returns where its
+    // `numWords' words go
+    GLuint *putWords(const UniformKey &key, GLenum type, int size,
+                     int numWords);
 
-        virtual void apply(GLint location, GLsizei count,
-                           const GLint *boundTexUnit) const {
-            assert(count <= size);
-            _helper::genericGlUniformMatrix4v(location, count, &ms_[0]);
-        }
-    };
+    // Index of the entry with the given name in entries_, or -1
+    int findEntry(const std::string &name) const;
 
-    class TexturesValue : public Value {
-        std::vector<std::shared_ptr<Texture>> texs_;
+    const Entry &getEntry(int entry) const { return entries_[entry]; }
 
-      public:
-        TexturesValue(const std::shared_ptr<Texture> *tex, int size)
-            : Value(tex[0]->getSamplerType(), size), texs_(tex, tex + size) {
-            assert(size > 0);
-            for (int i = 0; i < size; ++i) {
-                assert(tex[i]->getSamplerType() == type);
-            }
-        }
+    const GLuint *getWords(const Entry &e) const { return &words_[e.offset]; }
 
-        virtual Value *clone() const { return new TexturesValue(*this); }
+    const std::shared_ptr<Texture> *getTextures(const Entry &e) const {
+        return e.offset < INLINE_TEXTURES ? &inlineTextures_[e.offset]
+                                          : &moreTextures_[e.offset - INLINE_TEXTURES];
+    }
 
-        virtual void apply(GLint location, GLsizei count,
-                           const GLint *boundTexUnits) const {
-            assert(count <= size);
-            _helper::genericGlUniformv(location, count, boundTexUnits);
-        }
+    std::shared_ptr<Texture> *getTextures(const Entry &e) {
+        return e.offset < INLINE_TEXTURES ? &inlineTextures_[e.offset]
+                                          : &moreTextures_[e.offset - INLINE_TEXTURES];
+    }
 
-        virtual const std::shared_ptr<Texture> *getTextures() const {
-            return &texs_[0];
-        }
-    };
+    // Sets aside `count' texture slots for `e', releasing the textures of
+    // its old ones, which are left unused
+    void reserveTextures(Entry &e, int count);
 };
 
 #endif
@@ -0,0 +1,41 @@
+#include <cstdlib>
+#include <new>
+
+#include "alloccount.h"
+
+using namespace std;
+
+static thread_local bool t_counting = false;
+static thread_local long t_count = 0;
+
+void startAllocCount() {
+    t_count = 0;
+    t_counting = true;
+}
+
+long stopAllocCount() {
+    t_counting = false;
+    return t_count;
+}
+
+// The replacements of the global operator new and delete. new[] and the
+// sized and array deletes default to these.
+
+void *operator new(size_t size) {
+    if (t_counting)
+        ++t_count;
+    void *p = malloc(size ? size : 1);
+    if (!p)
+        throw bad_alloc();
+    return p;
+}
+
+void *operator new(size_t size, const nothrow_t &) noexcept {
+    if (t_counting)
+        ++t_count;
+    return malloc(size ? size : 1);
+}
+
+void operator delete(void *p) noexcept { free(p); }
+
+void operator delete(void *p, const nothrow_t &) noexcept { free(p); }
@@ -0,0 +1,183 @@
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <stdexcept>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "batch.h"
+#include "capture.h"
+#include "headless.h"
+
+using namespace std;
+
+OffscreenTarget::OffscreenTarget(int width, int height) : width_(width), height_(height) {
+    glBindRenderbuffer(GL_RENDERBUFFER, color_);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    glBindRenderbuffer(GL_RENDERBUFFER, depth_);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo_);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, color_);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depth_);
+    const GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    if (status != GL_FRAMEBUFFER_COMPLETE)
+        throw runtime_error("OffscreenTarget: framebuffer incomplete");
+}
+
+void OffscreenTarget::bind() {
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo_);
+    glViewport(0, 0, width_, height_);
+}
+
+BatchOptions parseBatchOptions(int argc, char *argv[], const vector<string> &envNames) {
+    BatchOptions options;
+    options.envNames = envNames;
+    if (argc < 1 || argv[0][0] == '-')
+        throw runtime_error("--batch: expected an output directory");
+    options.outDir = argv[0];
+
+    for (int i = 1; i < argc; ++i) {
+        const string arg = argv[i];
+        if (i + 1 >= argc)
+            throw runtime_error("--batch: missing value of " + arg);
+        const char *value = argv[++i];
+
+        if (arg == "--view") {
+            double t[3], q[4] = {1, 0, 0, 0};
+            const int n = sscanf(value, "%lf,%lf,%lf,%lf,%lf,%lf,%lf",
+                                 &t[0], &t[1], &t[2], &q[0], &q[1], &q[2], &q[3]);
+            if (n != 3 && n != 7)
+                throw runtime_error(string("--batch: invalid view ") + value);
+            options.views.push_back(RigTForm(Cvec3(t[0], t[1], t[2]),
+                                             normalize(Quat(q[0], q[1], q[2], q[3]))));
+        } else if (arg == "--env") {
+            const int numEnvs = envNames.size();
+            int env = -1;
+            for (int j = 0; j < numEnvs; ++j) {
+                if (envNames[j] == value)
+                    env = j;
+            }
+            if (env < 0 && isdigit(value[0]))
+                env = atoi(value);
+            if (env < 0 || env >= numEnvs)
+                throw runtime_error(string("--batch: unknown environment ") + value);
+            options.envs.push_back(env);
+        } else if (arg == "--size") {
+            if (sscanf(value, "%dx%d", &options.width, &options.height) != 2 ||
+                options.width <= 0 || options.height <= 0)
+                throw runtime_error(string("--batch: invalid size ") + value);
+        } else if (arg == "--format") {
+            options.format = value;
+            getCaptureFormat("." + options.format);
+        } else if (arg == "--processes") {
+            options.numProcesses = atoi(value);
+            if (options.numProcesses <= 0)
+                throw runtime_error(string("--batch: invalid number of processes ") + value);
+        } else {
+            throw runtime_error("--batch: unknown option " + arg);
+        }
+    }
+    return options;
+}
+
+// Renders the views whose index modulo `numShards' is `shard' in every
+// environment of `options'
+static void renderShare(const BatchOptions &options, BatchScene &scene, int shard, int numShards) {
+    HeadlessContext context;
+    scene.init();
+
+    const vector<RigTForm> views =
+        options.views.empty() ? vector<RigTForm>(1, scene.getDefaultView()) : options.views;
+    const vector<int> envs =
+        options.envs.empty() ? vector<int>(1, scene.getDefaultEnvironment()) : options.envs;
+    if (int(views.size()) <= shard) {
+        scene.cleanup();
+        return; // more processes than views
+    }
+
+    cout << "process " << shard << " rendering on " << context.getRenderer() << endl;
+    double totalMs = 0;
+    int numFrames = 0;
+    {
+        OffscreenTarget target(options.width, options.height);
+        FrameCapture capture;
+        for (size_t e = 0; e < envs.size(); ++e) {
+            scene.loadEnvironment(envs[e]);
+
+            for (size_t v = shard; v < views.size(); v += numShards) {
+                const auto start = chrono::steady_clock::now();
+                target.bind();
+                scene.draw(views[v], options.width, options.height);
+                glFinish();
+                const double ms =
+                    chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+                char filename[64];
+                snprintf(filename, sizeof(filename), "_view%04d.", int(v));
+                const string path =
+                    options.outDir + "/" + options.envNames[envs[e]] + filename + options.format;
+                capture.capture(options.width, options.height, path);
+                capture.poll();
+
+                cout << path << ": " << ms << " ms" << endl;
+                totalMs += ms;
+                ++numFrames;
+            }
+        }
+        capture.flush();
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
+    scene.cleanup();
+
+    cout << "process " << shard << ": " << numFrames << " frames at "
+         << options.width << "x" << options.height << ", " << totalMs / numFrames
+         << " ms/frame on average" << endl;
+}
+
+// Renders `options' in options.numProcesses child processes and waits for
+// them. Returns false if any of them failed.
+static bool forkBatch(const BatchOptions &options, BatchScene &scene) {
+    vector<pid_t> children;
+    for (int i = 0; i < options.numProcesses; ++i) {
+        cout.flush();
+        const pid_t pid = fork();
+        if (pid < 0)
+            throw runtime_error("--batch: cannot fork");
+        if (pid == 0) {
+            int status = 0;
+            try {
+                renderShare(options, scene, i, options.numProcesses);
+            } catch (const runtime_error &e) {
+                cout << "process " << i << ": " << e.what() << endl;
+                status = 1;
+            }
+            cout.flush();
+            _exit(status);
+        }
+        children.push_back(pid);
+    }
+
+    bool ok = true;
+    for (size_t i = 0; i < children.size(); ++i) {
+        int status = 0;
+        waitpid(children[i], &status, 0);
+        ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
+    return ok;
+}
+
+bool runBatch(const BatchOptions &options, BatchScene &scene) {
+    const auto start = chrono::steady_clock::now();
+    bool ok = true;
+    if (options.numProcesses > 1)
+        ok = forkBatch(options, scene);
+    else
+        renderShare(options, scene, 0, 1);
+    cout << "batch done in "
+         << chrono::duration<double>(chrono::steady_clock::now() - start).count() << " s" << endl;
+    return ok;
+}
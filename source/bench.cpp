@@ -0,0 +1,397 @@
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+#include "alloccount.h"
+#include "bench.h"
+#include "capture.h"
+#include "common.h"
+#include "flathierarchy.h"
+#include "geometrymaker.h"
+#include "headless.h"
+#include "iblcache.h"
+#include "keyframetrack.h"
+#include "renderqueue.h"
+#include "sgutils.h"
+
+using namespace std;
+
+// Calls `draw' for draws 0 to n - 1, after one untimed warm up call, and
+// prints draws/sec and the GL binds issued and skipped per draw. Each call of
+// `draw' counts as `drawsPerCall' draws.
+static void timeDraws(const char *name, int n, const function<void(int)> &draw,
+                      int drawsPerCall = 1) {
+    // builds whatever is cached on first use outside the timed loop
+    draw(0);
+    glFinish();
+
+    GlStateCache::getSingleton().resetCounters();
+    const auto start = chrono::steady_clock::now();
+    for (int i = 0; i < n; ++i) {
+        draw(i);
+    }
+    glFinish();
+    const double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    const GlStateCache::Counters &glCalls = GlStateCache::getSingleton().getCounters();
+    const double draws = double(n) * drawsPerCall;
+    cout << name << ": " << draws << " draws in " << seconds * 1000
+         << " ms, " << draws / seconds << " draws/sec, "
+         << glCalls.issued / draws << " binds issued and "
+         << glCalls.skipped / draws << " skipped per draw" << endl;
+}
+
+void benchDraw(const BenchDrawScene &scene, int n) {
+    Uniforms uniforms;
+    sendPickId(uniforms, 0);
+
+    Geometry &geometry = *scene.model;
+    Material &material = *scene.modelMaterial;
+    const Matrix4 modelMat = scene.modelMatrix;
+
+    // like Drawer, put the model matrix for every draw
+    const function<void(int)> drawModel = [&](int) {
+        sendModelMatrix(uniforms, modelMat);
+        material.draw(geometry, uniforms);
+    };
+    // by name is the fallback of Material::draw, which interns each name and
+    // searches the sorted entries of the Uniforms; the std::map of values
+    // Uniforms used to be is not timed
+    Material::setUseBindingPlans(false);
+    timeDraws("pbr model, uniforms by name (interned id, sorted entry search)", n, drawModel);
+    Material::setUseBindingPlans(true);
+    timeDraws("pbr model, binding plans", n, drawModel);
+
+    // small cubes with their own buffers, in a grid in front of the camera
+    const int numMeshes = 4096, gridSize = 64;
+    int ibLen, vbLen;
+    getCubeVbIbLen(vbLen, ibLen);
+    vector<VertexPNX> vtx(vbLen);
+    vector<unsigned short> idx(ibLen);
+    makeCube(0.05, vtx.begin(), idx.begin());
+
+    vector<shared_ptr<Geometry>> meshes(numMeshes);
+    vector<Matrix4> meshMats(numMeshes);
+    for (int i = 0; i < numMeshes; ++i) {
+        meshes[i].reset(new SimpleIndexedGeometryPNX(&vtx[0], &idx[0], vbLen, ibLen));
+        meshMats[i] = Matrix4::makeTranslation(
+                Cvec3(i % gridSize - gridSize / 2, i / gridSize - gridSize / 2, -50) * 0.1);
+    }
+
+    const function<void(int)> drawMeshes = [&](int i) {
+        sendModelMatrix(uniforms, meshMats[i % numMeshes]);
+        scene.material->draw(*meshes[i % numMeshes], uniforms);
+    };
+    BufferObjectGeometry::setUseVaoCache(false);
+    timeDraws("small meshes, vertex arrays per draw", n, drawMeshes);
+    BufferObjectGeometry::setUseVaoCache(true);
+    timeDraws("small meshes, cached vertex arrays", n, drawMeshes);
+
+    // a queue of 16384 shapes sharing two meshes and one material, as the
+    // scene would submit them
+    const int numInstances = 16384;
+    RenderQueue queue;
+    for (int i = 0; i < numInstances; ++i) {
+        const Matrix4 modelMat = Matrix4::makeTranslation(
+                Cvec3(i % 128 - 64, i / 128 - 64, -100) * 0.1);
+        queue.push(i % 2 ? *scene.sphere : *scene.cube, *scene.material, modelMat, 10);
+    }
+    queue.sort();
+    const int numSubmits = max(10, n / numInstances);
+    const function<void(int)> submitQueue = [&](int) { queue.submit(uniforms); };
+    queue.setInstancing(false);
+    timeDraws("queued shapes, one draw call each", numSubmits, submitQueue, numInstances);
+    queue.setInstancing(true);
+    timeDraws("queued shapes, instanced", numSubmits, submitQueue, numInstances);
+    cout << "instanced submit: " << queue.getNumDrawCalls() << " draw calls for "
+         << numInstances << " shapes" << endl;
+
+    checkGlErrors();
+}
+
+// Collects the world rbt of every transform node, in traversal order
+class WorldRbtCollector : public SgNodeVisitor {
+    vector<RigTForm> rbtStack_;
+
+  public:
+    vector<SgTransformNode *> nodes;
+    vector<RigTForm> worldRbts;
+
+    virtual bool visit(SgTransformNode &node) {
+        rbtStack_.push_back(rbtStack_.empty() ? node.getRbt() : rbtStack_.back() * node.getRbt());
+        nodes.push_back(&node);
+        worldRbts.push_back(rbtStack_.back());
+        return true;
+    }
+
+    virtual bool postVisit(SgTransformNode &node) {
+        rbtStack_.pop_back();
+        return true;
+    }
+};
+
+void benchScene(int numNodes) {
+    shared_ptr<SgRootNode> root(new SgRootNode());
+    vector<shared_ptr<SgRbtNode>> nodes(numNodes);
+    srand(1);
+    for (int i = 0; i < numNodes; ++i) {
+        nodes[i].reset(new SgRbtNode(RigTForm(Cvec3(rand() % 100, rand() % 100, rand() % 100) * 0.01,
+                                              Quat::makeYRotation(rand() % 360))));
+        if (i == 0)
+            root->addChild(nodes[i]);
+        else
+            nodes[(i - 1) / 8]->addChild(nodes[i]);
+    }
+
+    const int numRounds = 10, queriesPerRound = 100, changesPerRound = numNodes / 100;
+    vector<int> queries(numRounds * queriesPerRound), changes(numRounds * changesPerRound);
+    for (size_t i = 0; i < queries.size(); ++i) {
+        queries[i] = rand() % numNodes;
+    }
+    for (size_t i = 0; i < changes.size(); ++i) {
+        changes[i] = rand() % numNodes;
+    }
+
+    vector<RigTForm> results[2];
+    const char *names[] = {"traversal from the root", "cached world rbts"};
+    for (int method = 0; method < 2; ++method) {
+        const auto start = chrono::steady_clock::now();
+        for (int round = 0; round < numRounds; ++round) {
+            for (int i = 0; i < changesPerRound; ++i) {
+                SgRbtNode &node = *nodes[changes[round * changesPerRound + i]];
+                node.setRbt(node.getRbt());
+            }
+            for (int i = 0; i < queriesPerRound; ++i) {
+                const shared_ptr<SgRbtNode> &node = nodes[queries[round * queriesPerRound + i]];
+                results[method].push_back(method == 0 ? getPathAccumRbtByTraversal(root, node)
+                                                      : getPathAccumRbt(root, node));
+            }
+        }
+        const double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << names[method] << ": " << queries.size() << " queries, " << changes.size()
+             << " rbt changes in " << seconds * 1000 << " ms, "
+             << seconds * 1e6 / queries.size() << " us/query" << endl;
+    }
+
+    for (size_t i = 0; i < queries.size(); ++i) {
+        const Cvec3 d = results[0][i].getTranslation() - results[1][i].getTranslation();
+        if (norm2(d) > 1e-12)
+            throw runtime_error("benchScene: cached world rbt differs from traversal");
+    }
+
+    auto start = chrono::steady_clock::now();
+    FlatHierarchy flat(root);
+    const double buildSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    double seconds[2] = {0, 0};
+    for (int round = 0; round < numRounds; ++round) {
+        for (int i = 0; i < changesPerRound; ++i) {
+            SgRbtNode &node = *nodes[changes[round * changesPerRound + i]];
+            node.setRbt(node.getRbt());
+        }
+        const int moved = queries[round];
+        if (moved > 0) {
+            nodes[(moved - 1) / 8]->removeChild(nodes[moved]);
+            nodes[(moved - 1) / 8]->addChild(nodes[moved]);
+        }
+
+        WorldRbtCollector collector;
+        start = chrono::steady_clock::now();
+        root->accept(collector);
+        const auto traversed = chrono::steady_clock::now();
+        flat.update();
+        seconds[0] += chrono::duration<double>(traversed - start).count();
+        seconds[1] += chrono::duration<double>(chrono::steady_clock::now() - traversed).count();
+
+        // the world rbts cached by the update
+        for (size_t i = 0; i < collector.nodes.size(); ++i) {
+            const Cvec3 d = collector.worldRbts[i].getTranslation() -
+                            collector.nodes[i]->getWorldRbt().getTranslation();
+            if (norm2(d) > 1e-12)
+                throw runtime_error("benchScene: flat hierarchy world rbt differs from traversal");
+        }
+    }
+    cout << "flat hierarchy built in " << buildSeconds * 1000 << " ms" << endl;
+    cout << "all world rbts, " << numRounds << " rounds: traversal " << seconds[0] * 1000
+         << " ms, flat hierarchy " << seconds[1] * 1000 << " ms" << endl;
+}
+
+void benchKeyFrames(int numNodes) {
+    const int numKeyFrames = 8, numFrames = 600;
+    list<vector<RigTForm>> keyFrames;
+    srand(1);
+    for (int k = 0; k < numKeyFrames; ++k) {
+        vector<RigTForm> frame(numNodes);
+        for (int i = 0; i < numNodes; ++i) {
+            frame[i] = RigTForm(Cvec3(rand() % 100, rand() % 100, rand() % 100) * 0.01,
+                                normalize(Quat(rand() % 100 + 1, rand() % 100 - 50,
+                                               rand() % 100 - 50, rand() % 100 - 50)));
+        }
+        keyFrames.push_back(frame);
+    }
+    const double endTime = numKeyFrames - 3;
+
+    vector<RigTForm> results[2];
+    auto start = chrono::steady_clock::now();
+    for (int frame = 0; frame < numFrames; ++frame) {
+        const double t = endTime * frame / numFrames;
+        int cnt = -1;
+        vector<RigTForm> F1, F2, F_1, F_2;
+        for (auto i = keyFrames.begin(); i != keyFrames.end(); ++i, ++cnt) {
+            if (cnt == floor(t) - 1) {
+                F_1 = *i;
+                F1 = *(++i);
+                F2 = *(++i);
+                F_2 = *(++i);
+                break;
+            }
+        }
+        results[0].resize(numNodes);
+        for (int i = 0; i < numNodes; ++i) {
+            results[0][i] = slerp(t - floor(t), F1[i], F2[i], F_1[i], F_2[i]);
+        }
+    }
+    const double slerpSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    start = chrono::steady_clock::now();
+    KeyFrameTrack track;
+    track.build(keyFrames);
+    const double buildSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    start = chrono::steady_clock::now();
+    for (int frame = 0; frame < numFrames; ++frame) {
+        track.evaluate(endTime * frame / numFrames, results[1]);
+    }
+    const double trackSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    // both hold the last frame
+    for (int i = 0; i < numNodes; ++i) {
+        const Cvec3 d = results[0][i].getTranslation() - results[1][i].getTranslation();
+        const Quat q = results[0][i].getRotation() - results[1][i].getRotation();
+        if (norm2(d) > 1e-12 || norm2(q) > 1e-12)
+            throw runtime_error("benchKeyFrames: key frame track differs from slerp");
+    }
+
+    cout << numNodes << " animated nodes, " << numKeyFrames << " key frames, " << numFrames
+         << " frames" << endl;
+    cout << "slerp: " << slerpSeconds * 1000 / numFrames << " ms/frame" << endl;
+    cout << "key frame track: built in " << buildSeconds * 1000 << " ms, "
+         << trackSeconds * 1000 / numFrames << " ms/frame" << endl;
+}
+
+void benchCapture(BatchScene &scene, int n) {
+    scene.loadEnvironment(scene.getDefaultEnvironment());
+    const RigTForm view = scene.getDefaultView();
+
+    // an offscreen target, as the window may be smaller
+    const int width = 1920, height = 1080;
+    OffscreenTarget target(width, height);
+    target.bind();
+
+    FrameCapture frameCapture;
+    const function<void()> drawFrame = [&] { scene.draw(view, width, height); };
+    static const char *const EXTENSIONS[] = {"ppm", "png", "pfm"};
+    vector<char> pixels;
+    for (int format = 0; format < 3; ++format) {
+        const string ext = EXTENSIONS[format];
+        const int pixelSize = getCapturePixelSize(CaptureFormat(format));
+        const auto getFilename = [&](int i) {
+            char filename[64];
+            snprintf(filename, sizeof(filename), "capture/bench/frame_%05d.", i);
+            return filename + ext;
+        };
+
+        drawFrame();
+        glFinish();
+        auto start = chrono::steady_clock::now();
+        for (int i = 0; i < n; ++i) {
+            drawFrame();
+            pixels.resize(width * height * pixelSize);
+            if (format == CAPTURE_PFM)
+                glReadPixels(0, 0, width, height, GL_RGB, GL_FLOAT, &pixels[0]);
+            else
+                glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, &pixels[0]);
+            writeCacheFile(getFilename(i), [&](ostream &os) {
+                writeCaptureImage(os, CaptureFormat(format), width, height, &pixels[0]);
+            });
+        }
+        const double blocking = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        start = chrono::steady_clock::now();
+        for (int i = 0; i < n; ++i) {
+            drawFrame();
+            frameCapture.capture(width, height, getFilename(i));
+            frameCapture.poll();
+        }
+        frameCapture.flush();
+        const double async = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        cout << ext << " at " << width << "x" << height << ": " << n / blocking
+             << " frames/sec blocking, " << n / async << " frames/sec with FrameCapture" << endl;
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+bool testAllocations(BatchScene &scene, int n) {
+    HeadlessContext context;
+    scene.init();
+    scene.loadEnvironment(scene.getDefaultEnvironment());
+
+    long total = 0;
+    {
+        const RigTForm view = scene.getDefaultView();
+        const int width = 320, height = 240;
+        OffscreenTarget target(width, height);
+        target.bind();
+
+        // as many textures as the pbr materials hold
+        static const UniformKey TEXTURE_KEYS[] = {
+            "uAlbedoMap", "uNormalMap", "uMetallicMap", "uRoughnessMap",
+            "uAoMap", "uIrradianceMap", "uPrefilterMap", "uBrdfLUT"};
+        const int numTextures = sizeof(TEXTURE_KEYS) / sizeof(TEXTURE_KEYS[0]);
+        vector<shared_ptr<Texture>> textures;
+        for (int i = 0; i < numTextures; ++i) {
+            textures.push_back(make_shared<ImageTexture>());
+        }
+
+        Uniforms uniforms;
+        const auto drawFrame = [&](int frame) {
+            scene.draw(view, width, height);
+            sendModelMatrix(uniforms, Matrix4::makeTranslation(Cvec3(frame, 0, 0)));
+            sendPickId(uniforms, frame);
+            for (int i = 0; i < numTextures; ++i) {
+                uniforms.put(TEXTURE_KEYS[i], textures[(i + frame) % numTextures]);
+            }
+            const Uniforms copy(uniforms);
+            uniforms = copy;
+        };
+
+        // builds the caches of the first frames
+        for (int i = 0; i < 3; ++i) {
+            drawFrame(i);
+        }
+        glFinish();
+
+        for (int i = 0; i < n; ++i) {
+            startAllocCount();
+            drawFrame(i);
+            const long count = stopAllocCount();
+            if (count != 0)
+                cout << "frame " << i << ": " << count << " allocations" << endl;
+            total += count;
+        }
+        glFinish();
+    }
+    scene.cleanup();
+
+    cout << "steady state frames: " << total << " allocations in " << n << " frames, "
+         << (total == 0 ? "OK" : "FAILED") << endl;
+    return total == 0;
+}
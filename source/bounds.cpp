@@ -0,0 +1,66 @@
+#include <cmath>
+
+#include "bounds.h"
+
+using namespace std;
+
+Frustum::Frustum(const Matrix4 &projViewMatrix) {
+    // A point is in the clip volume when -w <= x, y, z <= w, so each plane
+    // is the last row of the matrix plus or minus one of the others
+    const Matrix4 &m = projViewMatrix;
+    for (int i = 0; i < 6; ++i) {
+        const int row = i / 2;
+        const double sign = i % 2 == 0 ? 1 : -1;
+        Cvec3 n;
+        for (int k = 0; k < 3; ++k) {
+            n[k] = m(3, k) + sign * m(row, k);
+        }
+        const double d = m(3, 3) + sign * m(row, 3);
+        const double len = norm(n);
+        normals_[i] = n / len;
+        d_[i] = d / len;
+    }
+}
+
+bool Frustum::intersects(const Bounds &bounds, const Matrix4 &modelMatrix) const {
+    if (bounds.isEmpty())
+        return true;
+    const Matrix4 &m = modelMatrix;
+
+    const Cvec3 center = Cvec3(m * Cvec4(bounds.center, 1));
+    // a scaled sphere stays within the sphere scaled by the longest column
+    double scale2 = 0;
+    for (int c = 0; c < 3; ++c) {
+        const double column2 = norm2(Cvec3(m(0, c), m(1, c), m(2, c)));
+        scale2 = column2 > scale2 ? column2 : scale2;
+    }
+    const double radius = bounds.radius * sqrt(scale2);
+
+    bool straddles = false;
+    for (int i = 0; i < 6; ++i) {
+        const double dist = dot(normals_[i], center) + d_[i];
+        if (dist < -radius)
+            return false;
+        straddles = straddles || dist < radius;
+    }
+    if (!straddles)
+        return true;
+
+    // the world space box around the transformed box, by its center and
+    // half extents
+    const Cvec3 boxCenter = Cvec3(m * Cvec4((bounds.boxMin + bounds.boxMax) * 0.5, 1));
+    const Cvec3 halfSize = (bounds.boxMax - bounds.boxMin) * 0.5;
+    Cvec3 extents;
+    for (int r = 0; r < 3; ++r) {
+        for (int c = 0; c < 3; ++c) {
+            extents[r] += abs(m(r, c)) * halfSize[c];
+        }
+    }
+    for (int i = 0; i < 6; ++i) {
+        const Cvec3 &n = normals_[i];
+        const double reach = abs(n[0]) * extents[0] + abs(n[1]) * extents[1] + abs(n[2]) * extents[2];
+        if (dot(n, boxCenter) + d_[i] < -reach)
+            return false;
+    }
+    return true;
+}
@@ -0,0 +1,386 @@
+#include <algorithm>
+#include <cstring>
+#include <ostream>
+#include <stdexcept>
+#include <stdint.h>
+
+#include "capture.h"
+#include "iblcache.h"
+
+using namespace std;
+
+CaptureFormat getCaptureFormat(const string &filename) {
+    const size_t dot = filename.rfind('.');
+    const string ext = dot == string::npos ? "" : filename.substr(dot + 1);
+    if (ext == "ppm")
+        return CAPTURE_PPM;
+    if (ext == "png")
+        return CAPTURE_PNG;
+    if (ext == "pfm")
+        return CAPTURE_PFM;
+    throw runtime_error("getCaptureFormat: unknown image format of " + filename);
+}
+
+int getCapturePixelSize(CaptureFormat format) {
+    return format == CAPTURE_PFM ? 3 * sizeof(float) : 4;
+}
+
+// Top row first, RGBA to RGB
+static void getRgbRow(int width, int height, const char *pixels, int row, char *rgb) {
+    const char *src = pixels + size_t(height - 1 - row) * width * 4;
+    for (int i = 0; i < width; ++i) {
+        rgb[3 * i] = src[4 * i];
+        rgb[3 * i + 1] = src[4 * i + 1];
+        rgb[3 * i + 2] = src[4 * i + 2];
+    }
+}
+
+static void writePpm(ostream &os, int width, int height, const char *pixels) {
+    os << "P6\n" << width << " " << height << "\n255\n";
+    vector<char> rgb(3 * width);
+    for (int row = 0; row < height; ++row) {
+        getRgbRow(width, height, pixels, row, &rgb[0]);
+        os.write(&rgb[0], rgb.size());
+    }
+}
+
+// PFM keeps the bottom row first, as read back. The negative scale marks
+// little endian floats.
+static void writePfm(ostream &os, int width, int height, const char *pixels) {
+    os << "PF\n" << width << " " << height << "\n-1.0\n";
+    os.write(pixels, size_t(width) * height * 3 * sizeof(float));
+}
+
+// Tables of the CRC-32 used by PNG, built on first use. values[k][n] is the
+// CRC of byte n followed by k zero bytes, so eight bytes are folded in per
+// step.
+struct Crc32Table {
+    uint32_t values[8][256];
+
+    Crc32Table() {
+        for (uint32_t n = 0; n < 256; ++n) {
+            uint32_t c = n;
+            for (int k = 0; k < 8; ++k) {
+                c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            }
+            values[0][n] = c;
+        }
+        for (int k = 1; k < 8; ++k) {
+            for (int n = 0; n < 256; ++n) {
+                const uint32_t c = values[k - 1][n];
+                values[k][n] = values[0][c & 0xff] ^ (c >> 8);
+            }
+        }
+    }
+};
+
+static uint32_t updateCrc32(uint32_t crc, const char *data, size_t len) {
+    static const Crc32Table table;
+    const uint32_t(*t)[256] = table.values;
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(data);
+    crc = ~crc;
+    for (; len >= 8; p += 8, len -= 8) {
+        const uint32_t lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | uint32_t(p[3]) << 24);
+        crc = t[7][lo & 0xff] ^ t[6][lo >> 8 & 0xff] ^ t[5][lo >> 16 & 0xff] ^ t[4][lo >> 24] ^
+              t[3][p[4]] ^ t[2][p[5]] ^ t[1][p[6]] ^ t[0][p[7]];
+    }
+    for (; len > 0; ++p, --len) {
+        crc = t[0][(crc ^ *p) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+// Adds `data' to the two sums of an Adler-32 checksum, taking them modulo
+// 65521 only as often as needed to keep them from overflowing
+static void updateAdler32(uint32_t &a, uint32_t &b, const char *data, size_t len) {
+    const size_t MAX_RUN = 5552;
+    while (len > 0) {
+        const size_t n = min(len, MAX_RUN);
+        for (size_t i = 0; i < n; ++i) {
+            a += (unsigned char)data[i];
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+        data += n;
+        len -= n;
+    }
+}
+
+// Writes a PNG chunk of known length in pieces, with its CRC at the end
+class PngChunkWriter {
+    ostream &os_;
+    uint32_t crc_;
+
+  public:
+    PngChunkWriter(ostream &os, const char type[4], uint32_t length) : os_(os), crc_(0) {
+        writeBigEndian(length);
+        crc_ = updateCrc32(crc_, type, 4);
+        os_.write(type, 4);
+    }
+
+    void write(const char *data, size_t len) {
+        crc_ = updateCrc32(crc_, data, len);
+        os_.write(data, len);
+    }
+
+    void write(uint32_t value) {
+        const char bytes[4] = {char(value >> 24), char(value >> 16), char(value >> 8), char(value)};
+        write(bytes, 4);
+    }
+
+    void finish() { writeBigEndian(crc_); }
+
+  private:
+    void writeBigEndian(uint32_t value) {
+        const char bytes[4] = {char(value >> 24), char(value >> 16), char(value >> 8), char(value)};
+        os_.write(bytes, 4);
+    }
+};
+
+// The image data is a zlib stream of stored deflate blocks: the frames are
+// written at the rate they are rendered, which compressing would not keep up
+// with on one thread
+static void writePng(ostream &os, int width, int height, const char *pixels) {
+    static const char SIGNATURE[8] = {'\x89', 'P', 'N', 'G', '\r', '\n', '\x1a', '\n'};
+    os.write(SIGNATURE, 8);
+
+    PngChunkWriter header(os, "IHDR", 13);
+    header.write(width);
+    header.write(height);
+    const char format[5] = {8, 2, 0, 0, 0}; // 8-bit RGB, no interlacing
+    header.write(format, 5);
+    header.finish();
+
+    // every row starts with filter type 0, none
+    const size_t rowSize = 1 + 3 * size_t(width);
+    const size_t rawSize = rowSize * height;
+    const size_t MAX_BLOCK = 65535;
+    const size_t numBlocks = max<size_t>(1, (rawSize + MAX_BLOCK - 1) / MAX_BLOCK);
+    const size_t dataSize = 2 + 5 * numBlocks + rawSize + 4;
+    if (dataSize > 0x7fffffff)
+        throw runtime_error("writeCaptureImage: image too large for PNG");
+
+    PngChunkWriter data(os, "IDAT", uint32_t(dataSize));
+    const char zlibHeader[2] = {0x78, 0x01};
+    data.write(zlibHeader, 2);
+
+    uint32_t adlerA = 1, adlerB = 0;
+    vector<char> row(rowSize, 0);
+    size_t written = 0, blockLeft = 0;
+    for (int r = 0; r < height; ++r) {
+        getRgbRow(width, height, pixels, r, &row[1]);
+        updateAdler32(adlerA, adlerB, &row[0], rowSize);
+
+        // the row split across as many blocks as it straddles
+        for (size_t pos = 0; pos < rowSize;) {
+            if (blockLeft == 0) {
+                blockLeft = min(MAX_BLOCK, rawSize - written);
+                const bool last = written + blockLeft == rawSize;
+                const uint16_t len = uint16_t(blockLeft), nlen = uint16_t(~len);
+                const char blockHeader[5] = {char(last), char(len), char(len >> 8),
+                                             char(nlen), char(nlen >> 8)};
+                data.write(blockHeader, 5);
+            }
+            const size_t n = min(blockLeft, rowSize - pos);
+            data.write(&row[pos], n);
+            pos += n;
+            written += n;
+            blockLeft -= n;
+        }
+    }
+    if (rawSize == 0) {
+        const char emptyBlock[5] = {1, 0, 0, char(0xff), char(0xff)};
+        data.write(emptyBlock, 5);
+    }
+    data.write(adlerB << 16 | adlerA);
+    data.finish();
+
+    PngChunkWriter end(os, "IEND", 0);
+    end.finish();
+}
+
+void writeCaptureImage(ostream &os, CaptureFormat format, int width, int height,
+                       const char *pixels) {
+    switch (format) {
+    case CAPTURE_PPM:
+        writePpm(os, width, height, pixels);
+        break;
+    case CAPTURE_PNG:
+        writePng(os, width, height, pixels);
+        break;
+    case CAPTURE_PFM:
+        writePfm(os, width, height, pixels);
+        break;
+    }
+}
+
+FrameCapture::FrameCapture()
+    : first_(0), numInFlight_(0), numWriting_(0), numWritten_(0), quit_(false) {
+    for (int i = 0; i < NUM_SLOTS; ++i) {
+        slots_[i].capacity = 0;
+        slots_[i].fence = 0;
+    }
+    writer_ = thread(&FrameCapture::writerLoop, this);
+}
+
+FrameCapture::~FrameCapture() {
+    try {
+        flush();
+    } catch (const runtime_error &) {
+        // already reported by an earlier poll()
+    }
+    {
+        lock_guard<mutex> lock(mutex_);
+        quit_ = true;
+    }
+    queuedCv_.notify_all();
+    writer_.join();
+}
+
+void FrameCapture::capture(int width, int height, const string &filename) {
+    const CaptureFormat format = getCaptureFormat(filename);
+    if (numInFlight_ == NUM_SLOTS)
+        handOver(true);
+
+    Slot &slot = slots_[(first_ + numInFlight_) % NUM_SLOTS];
+    const int size = width * height * getCapturePixelSize(format);
+    GlStateCache::getSingleton().bindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+    if (slot.capacity < size) {
+        glBufferData(GL_PIXEL_PACK_BUFFER, size, NULL, GL_STREAM_READ);
+        slot.capacity = size;
+    }
+    if (format == CAPTURE_PFM)
+        glReadPixels(0, 0, width, height, GL_RGB, GL_FLOAT, 0);
+    else
+        glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+    GlStateCache::getSingleton().bindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    slot.frame.format = format;
+    slot.frame.width = width;
+    slot.frame.height = height;
+    slot.frame.filename = filename;
+    ++numInFlight_;
+}
+
+void FrameCapture::poll() {
+    while (numInFlight_ > 0 && handOver(false)) {
+    }
+    throwWriteError();
+}
+
+void FrameCapture::flush() {
+    while (numInFlight_ > 0) {
+        handOver(true);
+    }
+    unique_lock<mutex> lock(mutex_);
+    writtenCv_.wait(lock, [this] { return queue_.empty() && numWriting_ == 0; });
+    lock.unlock();
+    throwWriteError();
+}
+
+int FrameCapture::getNumPending() const {
+    lock_guard<mutex> lock(mutex_);
+    return numInFlight_ + int(queue_.size()) + numWriting_;
+}
+
+int FrameCapture::getNumWritten() const {
+    lock_guard<mutex> lock(mutex_);
+    return numWritten_;
+}
+
+bool FrameCapture::handOver(bool wait) {
+    Slot &slot = slots_[first_];
+    for (;;) {
+        const GLenum status = glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT,
+                                               wait ? 1000000000 : 0);
+        if (status == GL_WAIT_FAILED)
+            throw runtime_error("FrameCapture: waiting for the fence failed");
+        if (status != GL_TIMEOUT_EXPIRED)
+            break;
+        if (!wait)
+            return false;
+    }
+    glDeleteSync(slot.fence);
+    slot.fence = 0;
+
+    // a buffer from a frame already written, once the writer has room
+    Frame &frame = slot.frame;
+    {
+        unique_lock<mutex> lock(mutex_);
+        writtenCv_.wait(lock, [this] { return int(queue_.size()) < MAX_QUEUED; });
+        if (!freePixels_.empty()) {
+            frame.pixels.swap(freePixels_.back());
+            freePixels_.pop_back();
+        }
+    }
+
+    const int size = frame.width * frame.height * getCapturePixelSize(frame.format);
+    frame.pixels.resize(size);
+    GlStateCache::getSingleton().bindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+    const void *pixels = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size, GL_MAP_READ_BIT);
+    if (pixels)
+        memcpy(&frame.pixels[0], pixels, size);
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    GlStateCache::getSingleton().bindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    {
+        lock_guard<mutex> lock(mutex_);
+        queue_.push_back(Frame());
+        queue_.back().format = frame.format;
+        queue_.back().width = frame.width;
+        queue_.back().height = frame.height;
+        queue_.back().filename.swap(frame.filename);
+        queue_.back().pixels.swap(frame.pixels);
+    }
+    queuedCv_.notify_one();
+
+    first_ = (first_ + 1) % NUM_SLOTS;
+    --numInFlight_;
+    if (!pixels)
+        throw runtime_error("FrameCapture: cannot map the pixel pack buffer");
+    return true;
+}
+
+void FrameCapture::writerLoop() {
+    unique_lock<mutex> lock(mutex_);
+    for (;;) {
+        queuedCv_.wait(lock, [this] { return quit_ || !queue_.empty(); });
+        if (queue_.empty())
+            return;
+
+        Frame frame;
+        swap(frame, queue_.front());
+        queue_.pop_front();
+        ++numWriting_;
+        lock.unlock();
+
+        string error;
+        try {
+            writeCacheFile(frame.filename, [&](ostream &os) {
+                writeCaptureImage(os, frame.format, frame.width, frame.height, &frame.pixels[0]);
+            });
+        } catch (const runtime_error &e) {
+            error = e.what();
+        }
+
+        lock.lock();
+        --numWriting_;
+        ++numWritten_;
+        if (error_.empty())
+            error_ = error;
+        freePixels_.push_back(vector<char>());
+        freePixels_.back().swap(frame.pixels);
+        writtenCv_.notify_all();
+    }
+}
+
+void FrameCapture::throwWriteError() {
+    lock_guard<mutex> lock(mutex_);
+    if (error_.empty())
+        return;
+    const string error = error_;
+    error_.clear();
+    throw runtime_error("FrameCapture: " + error);
+}
@@ -0,0 +1,208 @@
+#include <stdexcept>
+#include <vector>
+
+#include "flathierarchy.h"
+
+using namespace std;
+
+void FlatHierarchy::RbtArrays::resize(int n) {
+    tx.resize(n);
+    ty.resize(n);
+    tz.resize(n);
+    qw.resize(n);
+    qx.resize(n);
+    qy.resize(n);
+    qz.resize(n);
+}
+
+void FlatHierarchy::RbtArrays::set(int i, const RigTForm &rbt) {
+    const Cvec3 t = rbt.getTranslation();
+    const Quat q = rbt.getRotation();
+    tx[i] = t[0];
+    ty[i] = t[1];
+    tz[i] = t[2];
+    qw[i] = q[0];
+    qx[i] = q[1];
+    qy[i] = q[2];
+    qz[i] = q[3];
+}
+
+RigTForm FlatHierarchy::RbtArrays::get(int i) const {
+    return RigTForm(Cvec3(tx[i], ty[i], tz[i]), Quat(qw[i], qx[i], qy[i], qz[i]));
+}
+
+FlatHierarchy::FlatHierarchy(shared_ptr<SgTransformNode> root)
+    : root_(root), numDeadTransforms_(0), numDeadShapes_(0), numVisible_(0),
+      numCulled_(0) {
+    if (root->getParent())
+        throw runtime_error("FlatHierarchy: root has a parent");
+    rebuild();
+    root_->setTopologyListener(this);
+}
+
+FlatHierarchy::~FlatHierarchy() { root_->setTopologyListener(NULL); }
+
+void FlatHierarchy::rebuild() {
+    nodes_.clear();
+    parents_.clear();
+    shapes_.clear();
+    transformIndices_.clear();
+    shapeIndices_.clear();
+    numDeadTransforms_ = numDeadShapes_ = 0;
+    append(*root_, -1);
+}
+
+void FlatHierarchy::append(SgNode &node, int parent) {
+    SgShapeNode *shape = dynamic_cast<SgShapeNode *>(&node);
+    if (shape) {
+        Shape s;
+        s.transform = parent;
+        s.node = shape;
+        shapeIndices_[shape] = shapes_.size();
+        shapes_.push_back(s);
+        return;
+    }
+
+    SgTransformNode *transform = dynamic_cast<SgTransformNode *>(&node);
+    if (!transform)
+        return;
+
+    const int index = nodes_.size();
+    transformIndices_[transform] = index;
+    nodes_.push_back(transform);
+    parents_.push_back(parent);
+    local_.resize(index + 1);
+    world_.resize(index + 1);
+    local_.set(index, transform->getRbt());
+    transform->rbtChanged_ = false;
+
+    for (int i = 0, n = transform->getNumChildren(); i < n; ++i) {
+        append(*transform->getChild(i), index);
+    }
+}
+
+void FlatHierarchy::remove(SgNode &node) {
+    SgShapeNode *shape = dynamic_cast<SgShapeNode *>(&node);
+    if (shape) {
+        unordered_map<SgShapeNode *, int>::iterator i = shapeIndices_.find(shape);
+        if (i != shapeIndices_.end()) {
+            shapes_[i->second].node = NULL;
+            shapeIndices_.erase(i);
+            ++numDeadShapes_;
+        }
+        return;
+    }
+
+    SgTransformNode *transform = dynamic_cast<SgTransformNode *>(&node);
+    if (!transform)
+        return;
+
+    unordered_map<SgTransformNode *, int>::iterator i = transformIndices_.find(transform);
+    if (i != transformIndices_.end()) {
+        nodes_[i->second] = NULL;
+        transformIndices_.erase(i);
+        ++numDeadTransforms_;
+    }
+    for (int c = 0, n = transform->getNumChildren(); c < n; ++c) {
+        remove(*transform->getChild(c));
+    }
+}
+
+void FlatHierarchy::onChildAdded(SgTransformNode &parent, SgNode &child) {
+    unordered_map<SgTransformNode *, int>::const_iterator i = transformIndices_.find(&parent);
+    if (i == transformIndices_.end())
+        throw runtime_error("FlatHierarchy: parent of the added node is unknown");
+    append(child, i->second);
+}
+
+void FlatHierarchy::onChildRemoved(SgTransformNode &parent, SgNode &child) {
+    remove(child);
+    // dead transforms are still computed by update, dead shapes skipped
+    if (numDeadTransforms_ > getNumTransforms() || numDeadShapes_ > getNumShapes())
+        rebuild();
+}
+
+void FlatHierarchy::update() {
+    const int n = nodes_.size();
+
+    for (int i = 0; i < n; ++i) {
+        SgTransformNode *node = nodes_[i];
+        if (node && node->rbtChanged_) {
+            local_.set(i, node->getRbt());
+            node->rbtChanged_ = false;
+        }
+    }
+
+    world_.tx[0] = local_.tx[0];
+    world_.ty[0] = local_.ty[0];
+    world_.tz[0] = local_.tz[0];
+    world_.qw[0] = local_.qw[0];
+    world_.qx[0] = local_.qx[0];
+    world_.qy[0] = local_.qy[0];
+    world_.qz[0] = local_.qz[0];
+
+    // world = parent world * local, i.e. t = pt + pq * lt and q = pq * lq.
+    // Every node is computed, which costs less than testing which need it.
+    const int *parents = parents_.data();
+    const double *ltx = local_.tx.data(), *lty = local_.ty.data(), *ltz = local_.tz.data();
+    const double *lqw = local_.qw.data(), *lqx = local_.qx.data(), *lqy = local_.qy.data(),
+                 *lqz = local_.qz.data();
+    double *wtx = world_.tx.data(), *wty = world_.ty.data(), *wtz = world_.tz.data();
+    double *wqw = world_.qw.data(), *wqx = world_.qx.data(), *wqy = world_.qy.data(),
+           *wqz = world_.qz.data();
+    for (int i = 1; i < n; ++i) {
+        const int p = parents[i];
+        const double pw = wqw[p], px = wqx[p], py = wqy[p], pz = wqz[p];
+
+        // pq * lt for a unit pq: lt + w c + u x c, with c = 2 u x lt
+        const double cx = 2 * (py * ltz[i] - pz * lty[i]);
+        const double cy = 2 * (pz * ltx[i] - px * ltz[i]);
+        const double cz = 2 * (px * lty[i] - py * ltx[i]);
+        wtx[i] = wtx[p] + ltx[i] + pw * cx + (py * cz - pz * cy);
+        wty[i] = wty[p] + lty[i] + pw * cy + (pz * cx - px * cz);
+        wtz[i] = wtz[p] + ltz[i] + pw * cz + (px * cy - py * cx);
+
+        const double lw = lqw[i], lx = lqx[i], ly = lqy[i], lz = lqz[i];
+        wqw[i] = pw * lw - (px * lx + py * ly + pz * lz);
+        wqx[i] = lx * pw + px * lw + (py * lz - pz * ly);
+        wqy[i] = ly * pw + py * lw + (pz * lx - px * lz);
+        wqz[i] = lz * pw + pz * lw + (px * ly - py * lx);
+    }
+
+    // the cached world rbts that are not dirty are already right
+    for (int i = 0; i < n; ++i) {
+        SgTransformNode *node = nodes_[i];
+        if (node && node->worldRbtDirty_) {
+            node->worldRbt_ = world_.get(i);
+            node->worldRbtDirty_ = false;
+        }
+    }
+}
+
+void FlatHierarchy::pushShapes(RenderQueue &queue, Uniforms &uniforms,
+                               const Matrix4 &viewMatrix, const Frustum *frustum) {
+    numVisible_ = numCulled_ = 0;
+    for (size_t i = 0; i < shapes_.size(); ++i) {
+        SgShapeNode *node = shapes_[i].node;
+        if (!node)
+            continue;
+
+        const Matrix4 modelMat =
+            rigTFormToMatrix(world_.get(shapes_[i].transform)) * node->getAffineMatrix();
+        if (frustum && !isInFrustum(*node, modelMat, *frustum)) {
+            ++numCulled_;
+            continue;
+        }
+        ++numVisible_;
+        Geometry *geometry = node->getGeometry();
+        Material *material = node->getMaterial();
+        if (geometry && material) {
+            queue.push(*geometry, *material, modelMat, getViewDepth(viewMatrix, modelMat),
+                       node->getPickId());
+        } else {
+            sendModelMatrix(uniforms, modelMat);
+            sendPickId(uniforms, node->getPickId());
+            node->draw(uniforms);
+        }
+    }
+}
@@ -1,6 +1,9 @@
+#include <algorithm>
 #include <cstddef>
+#include <map>
 #include <stdexcept>
 #include <string>
+#include <vector>
 
 #include "geometry.h"
 
@@ -29,8 +32,28 @@ const VertexFormat VertexPNTBX::FORMAT =
         .put("aBinormal", 3, GL_FLOAT, GL_FALSE, offsetof(VertexPNTBX, b))
         .put("aTexCoord", 2, GL_FLOAT, GL_FALSE, offsetof(VertexPNX, x));
 
+const VertexFormat InstanceModelMatrix::FORMAT =
+    VertexFormat(sizeof(InstanceModelMatrix))
+        .put("aModelMatrix", 4, GL_FLOAT, GL_FALSE, 0, 1, 4);
+
+const VertexFormat InstancePickId::FORMAT =
+    VertexFormat(sizeof(InstancePickId))
+        .put("aPickId", 1, GL_UNSIGNED_INT, GL_FALSE, 0, 1, 1, true);
+
+int Geometry::internVertexAttribLayout(const vector<string> &names) {
+    static map<vector<string>, int> layouts;
+    return layouts.insert(make_pair(names, int(layouts.size()))).first->second;
+}
+
+bool BufferObjectGeometry::useVaoCache_ = true;
+
+void BufferObjectGeometry::setUseVaoCache(bool enabled) {
+    useVaoCache_ = enabled;
+}
+
 BufferObjectGeometry::BufferObjectGeometry()
-    : wiringChanged_(true), primitiveType_(GL_TRIANGLES) {}
+    : wiringChanged_(true), primitiveType_(GL_TRIANGLES),
+      vertexAttribLayout_(-1) {}
 
 BufferObjectGeometry &
 BufferObjectGeometry::wire(const string &targetAttribName,
@@ -56,9 +79,16 @@ BufferObjectGeometry::wire(shared_ptr<FormattedVbo> source) {
     return *this;
 }
 
+shared_ptr<FormattedVbo>
+BufferObjectGeometry::getWiredVbo(const string &targetAttribName) const {
+    Wiring::const_iterator i = wiring_.find(targetAttribName);
+    return i == wiring_.end() ? shared_ptr<FormattedVbo>() : i->second.first;
+}
+
 BufferObjectGeometry &
 BufferObjectGeometry::indexedBy(shared_ptr<FormattedIbo> ib) {
     ib_ = ib;
+    vaos_.clear();
     return *this;
 }
 
@@ -89,35 +119,107 @@ const vector<string> &BufferObjectGeometry::getVertexAttribNames() {
     return vertexAttribNames_;
 }
 
-void BufferObjectGeometry::draw(int attribIndices[]) {
+int BufferObjectGeometry::getVertexAttribLayout() {
+    if (wiringChanged_)
+        processWiring();
+    return vertexAttribLayout_;
+}
+
+void BufferObjectGeometry::draw(const int attribIndices[]) {
+    bindVertexArrays(attribIndices);
+
+    if (isIndexed()) {
+        glDrawElements(primitiveType_, ib_->length(), ib_->getIndexFormat(), 0);
+    } else if (!perVbWirings_.empty()) {
+        glDrawArrays(primitiveType_, 0, getNumVertices());
+    }
+}
+
+void BufferObjectGeometry::drawInstanced(const int attribIndices[],
+                                         int instanceCount) {
+    bindVertexArrays(attribIndices);
+
+    if (isIndexed()) {
+        glDrawElementsInstanced(primitiveType_, ib_->length(),
+                                ib_->getIndexFormat(), 0, instanceCount);
+    } else if (!perVbWirings_.empty()) {
+        glDrawArraysInstanced(primitiveType_, 0, getNumVertices(),
+                              instanceCount);
+    }
+}
+
+void BufferObjectGeometry::bindVertexArrays(const int attribIndices[]) {
     if (wiringChanged_)
         processWiring();
 
-    const unsigned int UNDEFINED_VB_LEN = 0xFFFFFFFF;
-    unsigned int vboLen = UNDEFINED_VB_LEN;
+    GlStateCache &glState = GlStateCache::getSingleton();
+
+    if (useVaoCache_) {
+        const size_t numAttribs = vertexAttribNames_.size();
+        size_t i = 0;
+        for (; i < vaos_.size(); ++i) {
+            if (equal(vaos_[i].attribIndices.begin(),
+                      vaos_[i].attribIndices.end(), attribIndices))
+                break;
+        }
+        if (i < vaos_.size()) {
+            glState.bindVertexArray(*vaos_[i].vao);
+        } else {
+            CachedVao cached;
+            cached.attribIndices.assign(attribIndices,
+                                        attribIndices + numAttribs);
+            cached.vao.reset(new GlArrayObject());
+            glState.bindVertexArray(*cached.vao);
+            specifyVertexArrays(attribIndices);
+            vaos_.push_back(cached);
+        }
+    } else {
+        // one vertex array object shared by all geometries, never deleted
+        // as it may outlive the GL context
+        static GlArrayObject *sharedVao = new GlArrayObject();
+        glState.bindVertexArray(*sharedVao);
+        specifyVertexArrays(attribIndices);
+    }
+}
+
+int BufferObjectGeometry::getNumVertices() const {
+    int vboLen = -1;
+    for (size_t i = 0; i < perVbWirings_.size(); ++i) {
+        if (perVbWirings_[i].perInstance)
+            continue;
+        const int len = perVbWirings_[i].vb->length();
+        vboLen = vboLen < 0 ? len : min(vboLen, len);
+    }
+    return max(vboLen, 0);
+}
+
+void BufferObjectGeometry::specifyVertexArrays(const int attribIndices[]) {
+    GlStateCache &glState = GlStateCache::getSingleton();
+    unsigned int enabledAttribs = 0;
 
     // bind the vertex buffer and set vertex attribute pointers
     for (int i = 0, n = perVbWirings_.size(); i < n; ++i) {
         const PerVbWiring &pvw = perVbWirings_[i];
         const VertexFormat &vfd = pvw.vb->getVertexFormat();
 
-        glBindBuffer(GL_ARRAY_BUFFER, *(pvw.vb));
-
-        vboLen = min(vboLen, (unsigned int)pvw.vb->length());
+        glState.bindBuffer(GL_ARRAY_BUFFER, *(pvw.vb));
 
         for (size_t j = 0; j < pvw.vb2GeoIdx.size(); ++j) {
             int loc = attribIndices[pvw.vb2GeoIdx[j].second];
-            if (loc >= 0)
+            if (loc >= 0) {
+                const int columns = vfd.getAttrib(pvw.vb2GeoIdx[j].first).columns;
+                assert(loc + columns <= 32);
                 vfd.setGlVertexAttribPointer(pvw.vb2GeoIdx[j].first, loc);
+                for (int c = 0; c < columns; ++c) {
+                    enabledAttribs |= 1u << (loc + c);
+                }
+            }
         }
     }
+    glState.setEnabledVertexAttribArrays(enabledAttribs);
 
-    if (isIndexed()) {
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, *ib_);
-        glDrawElements(primitiveType_, ib_->length(), ib_->getIndexFormat(), 0);
-    } else if (vboLen != UNDEFINED_VB_LEN) {
-        glDrawArrays(primitiveType_, 0, vboLen);
-    }
+    if (isIndexed())
+        glState.bindBuffer(GL_ELEMENT_ARRAY_BUFFER, *ib_);
 }
 
 void BufferObjectGeometry::processWiring() {
@@ -151,5 +253,7 @@ void BufferObjectGeometry::processWiring() {
 
         vertexAttribNames_.push_back(i->first);
     }
+    vertexAttribLayout_ = internVertexAttribLayout(vertexAttribNames_);
+    vaos_.clear();
     wiringChanged_ = false;
 }
@@ -1,3 +1,4 @@
+#include <cassert>
 #include <fstream>
 #include <iostream>
 #include <stdexcept>
@@ -19,6 +20,193 @@ void checkGlErrors() {
     }
 }
 
+const GLuint GlStateCache::UNKNOWN;
+
+GlStateCache::GlStateCache() : maxVertexAttribs_(0) {
+    invalidate();
+    resetCounters();
+}
+
+GlStateCache &GlStateCache::getSingleton() {
+    // never destroyed, as GL objects held by globals forget themselves here
+    // when they are destroyed at exit
+    static GlStateCache *cache = new GlStateCache();
+    return *cache;
+}
+
+void GlStateCache::invalidate() {
+    program_ = vao_ = arrayBuffer_ = uniformBuffer_ = UNKNOWN;
+    activeUnit_ = -1;
+    for (int i = 0; i < MAX_TEXTURE_UNITS; ++i) {
+        textures2D_[i] = texturesCube_[i] = UNKNOWN;
+    }
+    for (unordered_map<GLuint, VaoState>::iterator i = vaos_.begin();
+         i != vaos_.end(); ++i) {
+        i->second.elementBuffer = UNKNOWN;
+        i->second.attribsKnown = false;
+    }
+}
+
+bool GlStateCache::update(GLuint &binding, GLuint value) {
+    if (binding == value) {
+        ++counters_.skipped;
+        return false;
+    }
+    ++counters_.issued;
+    binding = value;
+    return true;
+}
+
+void GlStateCache::useProgram(GLuint program) {
+    if (update(program_, program))
+        glUseProgram(program);
+}
+
+void GlStateCache::bindVertexArray(GLuint vao) {
+    if (update(vao_, vao)) {
+        glBindVertexArray(vao);
+        if (vaos_.find(vao) == vaos_.end()) {
+            VaoState initial = {0, 0, true};
+            vaos_[vao] = initial;
+        }
+    }
+}
+
+void GlStateCache::bindBuffer(GLenum target, GLuint buffer) {
+    GLuint *binding = NULL;
+    switch (target) {
+    case GL_ARRAY_BUFFER:
+        binding = &arrayBuffer_;
+        break;
+    case GL_UNIFORM_BUFFER:
+        binding = &uniformBuffer_;
+        break;
+    case GL_ELEMENT_ARRAY_BUFFER:
+        if (vao_ != UNKNOWN)
+            binding = &vaos_[vao_].elementBuffer;
+        break;
+    default:;
+    }
+
+    if (binding == NULL) {
+        ++counters_.issued;
+        glBindBuffer(target, buffer);
+    } else if (update(*binding, buffer)) {
+        glBindBuffer(target, buffer);
+    }
+}
+
+void GlStateCache::activeTexture(int unit) {
+    if (activeUnit_ == unit) {
+        ++counters_.skipped;
+        return;
+    }
+    ++counters_.issued;
+    activeUnit_ = unit;
+    glActiveTexture(GL_TEXTURE0 + unit);
+}
+
+GLuint *GlStateCache::getTextureBinding(int unit, GLenum target) {
+    if (unit < 0 || unit >= MAX_TEXTURE_UNITS)
+        return NULL;
+    switch (target) {
+    case GL_TEXTURE_2D:
+        return &textures2D_[unit];
+    case GL_TEXTURE_CUBE_MAP:
+        return &texturesCube_[unit];
+    default:
+        return NULL;
+    }
+}
+
+void GlStateCache::bindTexture(GLenum target, GLuint texture) {
+    GLuint *binding = getTextureBinding(activeUnit_, target);
+    if (binding == NULL) {
+        ++counters_.issued;
+        glBindTexture(target, texture);
+    } else if (update(*binding, texture)) {
+        glBindTexture(target, texture);
+    }
+}
+
+void GlStateCache::bindTexture(int unit, GLenum target, GLuint texture) {
+    GLuint *binding = getTextureBinding(unit, target);
+    if (binding != NULL && *binding == texture) {
+        ++counters_.skipped;
+        return;
+    }
+    activeTexture(unit);
+    bindTexture(target, texture);
+}
+
+void GlStateCache::setEnabledVertexAttribArrays(unsigned int mask) {
+    // the VAO must have been bound through the cache
+    assert(vao_ != UNKNOWN);
+
+    VaoState &vao = vaos_[vao_];
+    if (!vao.attribsKnown) {
+        if (maxVertexAttribs_ == 0)
+            glGetIntegerv(GL_MAX_VERTEX_ATTRIBS, &maxVertexAttribs_);
+        // force every location below to be set
+        vao.enabledAttribs = ~mask;
+        if (maxVertexAttribs_ < 32)
+            vao.enabledAttribs &= (1u << maxVertexAttribs_) - 1;
+        vao.attribsKnown = true;
+    }
+
+    unsigned int changed = vao.enabledAttribs ^ mask;
+    if (changed == 0) {
+        ++counters_.skipped;
+        return;
+    }
+    for (GLuint i = 0; changed != 0; ++i, changed >>= 1) {
+        if (changed & 1) {
+            ++counters_.issued;
+            if (mask & (1u << i))
+                glEnableVertexAttribArray(i);
+            else
+                glDisableVertexAttribArray(i);
+        }
+    }
+    vao.enabledAttribs = mask;
+}
+
+void GlStateCache::forgetProgram(GLuint program) {
+    // a deleted program stays in use until another one is, but its name may
+    // then be reused
+    if (program_ == program)
+        program_ = UNKNOWN;
+}
+
+void GlStateCache::forgetVertexArray(GLuint vao) {
+    vaos_.erase(vao);
+    if (vao_ == vao)
+        vao_ = 0;
+}
+
+void GlStateCache::forgetBuffer(GLuint buffer) {
+    if (arrayBuffer_ == buffer)
+        arrayBuffer_ = 0;
+    if (uniformBuffer_ == buffer)
+        uniformBuffer_ = 0;
+    // GL only unbinds it from the current VAO, others keep a dangling
+    // binding that may alias a new buffer with the same name
+    for (unordered_map<GLuint, VaoState>::iterator i = vaos_.begin();
+         i != vaos_.end(); ++i) {
+        if (i->second.elementBuffer == buffer)
+            i->second.elementBuffer = i->first == vao_ ? 0 : UNKNOWN;
+    }
+}
+
+void GlStateCache::forgetTexture(GLuint texture) {
+    for (int i = 0; i < MAX_TEXTURE_UNITS; ++i) {
+        if (textures2D_[i] == texture)
+            textures2D_[i] = 0;
+        if (texturesCube_[i] == texture)
+            texturesCube_[i] = 0;
+    }
+}
+
 // Dump text file into a character vector, throws exception on error
 static void readTextFile(const char *fn, vector<char> &data) {
     // Sets ios::binary bit to prevent end of line translation, so that the
@@ -0,0 +1,135 @@
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include "headless.h"
+
+using namespace std;
+
+#ifdef __MAC__
+
+HeadlessContext::HeadlessContext() : display_(NULL), surface_(NULL), context_(NULL) {
+    throw runtime_error("HeadlessContext: EGL is not available on this platform");
+}
+
+HeadlessContext::~HeadlessContext() {}
+
+const char *HeadlessContext::getRenderer() const { return ""; }
+
+#else
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+// Whether the space separated `extensions' has `name'
+static bool hasExtension(const char *extensions, const char *name) {
+    if (!extensions)
+        return false;
+    const size_t len = strlen(name);
+    for (const char *p = extensions; (p = strstr(p, name)) != NULL; p += len) {
+        if ((p == extensions || p[-1] == ' ') && (p[len] == ' ' || p[len] == '\0'))
+            return true;
+    }
+    return false;
+}
+
+static EGLDisplay getDisplay() {
+    const char *clientExtensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+
+    EGLDisplay display = EGL_NO_DISPLAY;
+    if (getPlatformDisplay && hasExtension(clientExtensions, "EGL_MESA_platform_surfaceless"))
+        display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+
+    if (display == EGL_NO_DISPLAY && getPlatformDisplay &&
+        hasExtension(clientExtensions, "EGL_EXT_platform_device")) {
+        PFNEGLQUERYDEVICESEXTPROC queryDevices =
+            (PFNEGLQUERYDEVICESEXTPROC)eglGetProcAddress("eglQueryDevicesEXT");
+        EGLDeviceEXT device;
+        EGLint numDevices = 0;
+        if (queryDevices && queryDevices(1, &device, &numDevices) && numDevices > 0)
+            display = getPlatformDisplay(EGL_PLATFORM_DEVICE_EXT, device, NULL);
+    }
+
+    if (display == EGL_NO_DISPLAY)
+        display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    return display;
+}
+
+HeadlessContext::HeadlessContext()
+    : display_(EGL_NO_DISPLAY), surface_(EGL_NO_SURFACE), context_(EGL_NO_CONTEXT) {
+    EGLDisplay display = getDisplay();
+    EGLint major, minor;
+    if (display == EGL_NO_DISPLAY || !eglInitialize(display, &major, &minor))
+        throw runtime_error("HeadlessContext: cannot initialize an EGL display");
+    display_ = display;
+
+    // the destructor does not run if the constructor throws
+    try {
+        init();
+    } catch (...) {
+        release();
+        throw;
+    }
+}
+
+void HeadlessContext::init() {
+    EGLDisplay display = display_;
+    if (!eglBindAPI(EGL_OPENGL_API))
+        throw runtime_error("HeadlessContext: EGL display does not support OpenGL");
+
+    // without a surface when the display allows it, as everything is drawn
+    // into framebuffer objects, otherwise with a one pixel pbuffer
+    const char *extensions = eglQueryString(display, EGL_EXTENSIONS);
+    const bool surfaceless = hasExtension(extensions, "EGL_KHR_surfaceless_context") &&
+                             hasExtension(extensions, "EGL_KHR_no_config_context");
+    EGLConfig config = EGL_NO_CONFIG_KHR;
+    if (!surfaceless) {
+        const EGLint configAttribs[] = {EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+                                        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+                                        EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8,
+                                        EGL_DEPTH_SIZE, 24, EGL_NONE};
+        EGLint numConfigs = 0;
+        if (!eglChooseConfig(display, configAttribs, &config, 1, &numConfigs) || numConfigs == 0)
+            throw runtime_error("HeadlessContext: no EGL config for OpenGL pbuffers");
+
+        const EGLint pbufferAttribs[] = {EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE};
+        surface_ = eglCreatePbufferSurface(display, config, pbufferAttribs);
+        if (surface_ == EGL_NO_SURFACE)
+            throw runtime_error("HeadlessContext: cannot create an EGL pbuffer");
+    }
+
+    const EGLint contextAttribs[] = {EGL_CONTEXT_MAJOR_VERSION, 3,
+                                     EGL_CONTEXT_MINOR_VERSION, 3,
+                                     EGL_CONTEXT_OPENGL_PROFILE_MASK,
+                                     EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+                                     EGL_NONE};
+    context_ = eglCreateContext(display, config, EGL_NO_CONTEXT, contextAttribs);
+    if (context_ == EGL_NO_CONTEXT)
+        throw runtime_error("HeadlessContext: cannot create an OpenGL 3.3 core context");
+    if (!eglMakeCurrent(display, surface_, surface_, context_))
+        throw runtime_error("HeadlessContext: cannot make the context current");
+}
+
+HeadlessContext::~HeadlessContext() { release(); }
+
+void HeadlessContext::release() {
+    if (display_ == EGL_NO_DISPLAY)
+        return;
+    eglMakeCurrent(display_, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    if (context_ != EGL_NO_CONTEXT)
+        eglDestroyContext(display_, context_);
+    if (surface_ != EGL_NO_SURFACE)
+        eglDestroySurface(display_, surface_);
+    eglTerminate(display_);
+    display_ = EGL_NO_DISPLAY;
+    surface_ = EGL_NO_SURFACE;
+    context_ = EGL_NO_CONTEXT;
+}
+
+const char *HeadlessContext::getRenderer() const {
+    return reinterpret_cast<const char *>(glGetString(GL_RENDERER));
+}
+
+#endif
@@ -0,0 +1,278 @@
+#include <cassert>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "iblcache.h"
+
+using namespace std;
+
+static const char kMagic[8] = {'P', 'B', 'R', 'I', 'B', 'L', '\0', '\0'};
+static const char kBrdfLUTMagic[8] = {'P', 'B', 'R', 'L', 'U', 'T', '\0', '\0'};
+
+// Bump whenever the layout of the file or the meaning of its content changes
+static const uint32_t kVersion = 3;
+
+// Bump whenever the BRDF integration (shaders/brdf.fshader, iblcpu.cpp) changes
+static const uint32_t kBrdfLUTVersion = 1;
+
+IblCacheKey &IblCacheKey::add(const void *data, size_t len) {
+    const unsigned char *p = static_cast<const unsigned char *>(data);
+    for (size_t i = 0; i < len; ++i) {
+        hash_ ^= p[i];
+        hash_ *= 1099511628211ULL;
+    }
+    return *this;
+}
+
+IblCacheKey &IblCacheKey::addFile(const char *filename) {
+    ifstream ifs(filename, ios::binary);
+    if (!ifs)
+        throw runtime_error(string("Cannot open file ") + filename);
+
+    vector<char> buffer(1 << 16);
+    while (ifs) {
+        ifs.read(&buffer[0], buffer.size());
+        add(&buffer[0], ifs.gcount());
+    }
+    return *this;
+}
+
+// Shaders taking part in the GPU precompute
+static const char *const kIblShaders[] = {
+    "./shaders/cubemap.vshader", "./shaders/equirect2cubemap.fshader",
+    "./shaders/irradiance_conv.fshader", "./shaders/prefilter.fshader"};
+
+uint64_t makeIblCacheKey(const string &hdrPath) {
+    IblCacheKey key;
+    key.addFile(hdrPath.c_str());
+    key.add(IBL_ENV_SIZE)
+        .add(IBL_IRRADIANCE_SIZE)
+        .add(IBL_PREFILTER_SIZE)
+        .add(IBL_PREFILTER_MIPS);
+    for (int i = 0, n = sizeof(kIblShaders) / sizeof(kIblShaders[0]); i < n;
+         ++i) {
+        key.addFile(kIblShaders[i]);
+    }
+    return key.value();
+}
+
+string getIblCachePath(const string &dir, uint64_t key) {
+    char name[32];
+    snprintf(name, sizeof(name), "ibl-%016llx.bin", (unsigned long long)key);
+    return dir + "/" + name;
+}
+
+template <typename T> static void writePod(ostream &os, const T &v) {
+    os.write(reinterpret_cast<const char *>(&v), sizeof(T));
+}
+
+template <typename T> static bool readPod(istream &is, T &v) {
+    return bool(is.read(reinterpret_cast<char *>(&v), sizeof(T)));
+}
+
+static void writeImage(ostream &os, const IblCacheImage &image) {
+    writePod(os, int32_t(image.faces));
+    writePod(os, int32_t(image.channels));
+    writePod(os, int32_t(image.width));
+    writePod(os, int32_t(image.height));
+    writePod(os, int32_t(image.mips.size()));
+    for (int i = 0, n = image.mips.size(); i < n; ++i) {
+        assert(image.mips[i].size() == image.getMipSize(i));
+        os.write(reinterpret_cast<const char *>(&image.mips[i][0]),
+                 image.mips[i].size() * sizeof(unsigned short));
+    }
+}
+
+static bool readImage(istream &is, IblCacheImage &image) {
+    int32_t faces, channels, width, height, numMips;
+    if (!readPod(is, faces) || !readPod(is, channels) || !readPod(is, width) ||
+        !readPod(is, height) || !readPod(is, numMips))
+        return false;
+
+    if (faces == 0 && channels == 0 && width == 0 && height == 0 &&
+        numMips == 0) {
+        image = IblCacheImage();
+        return true;
+    }
+
+    // reject anything that doesn't look like something we have written
+    if ((faces != 1 && faces != 6) || channels < 1 || channels > 4 ||
+        width <= 0 || height <= 0 || numMips <= 0 || numMips > 16)
+        return false;
+
+    image.faces = faces;
+    image.channels = channels;
+    image.width = width;
+    image.height = height;
+    image.mips.resize(numMips);
+    for (int i = 0; i < numMips; ++i) {
+        image.mips[i].resize(image.getMipSize(i));
+        if (!is.read(reinterpret_cast<char *>(&image.mips[i][0]),
+                     image.mips[i].size() * sizeof(unsigned short)))
+            return false;
+    }
+    return true;
+}
+
+bool readIblCache(const string &filename, uint64_t key, IblCacheEntry &entry) {
+    ifstream ifs(filename.c_str(), ios::binary);
+    if (!ifs)
+        return false;
+
+    char magic[8];
+    uint32_t version;
+    uint64_t fileKey;
+    if (!ifs.read(magic, sizeof(magic)) || memcmp(magic, kMagic, 8) != 0 ||
+        !readPod(ifs, version) || version != kVersion ||
+        !readPod(ifs, fileKey) || fileKey != key)
+        return false;
+
+    if (!readImage(ifs, entry.envCubemap) || entry.envCubemap.empty() ||
+        !readImage(ifs, entry.irradianceMap) ||
+        !readImage(ifs, entry.prefilterMap) || entry.prefilterMap.empty())
+        return false;
+
+    entry.irradianceSH.resize(27);
+    return bool(ifs.read(reinterpret_cast<char *>(&entry.irradianceSH[0]),
+                         entry.irradianceSH.size() * sizeof(float)));
+}
+
+// Creates every missing directory leading to `filename'
+static void makeParentDirs(const string &filename) {
+    for (size_t pos = filename.find('/', 1); pos != string::npos;
+         pos = filename.find('/', pos + 1)) {
+        const string dir = filename.substr(0, pos);
+        if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST)
+            throw runtime_error("Cannot create directory " + dir);
+    }
+}
+
+void writeCacheFile(const string &filename,
+                    const function<void(ostream &)> &writeContent) {
+    makeParentDirs(filename);
+
+    const string tmpFilename = filename + ".tmp";
+    {
+        ofstream ofs(tmpFilename.c_str(), ios::binary);
+        if (!ofs)
+            throw runtime_error("Cannot open file " + tmpFilename);
+
+        writeContent(ofs);
+
+        if (!ofs)
+            throw runtime_error("Failed writing " + tmpFilename);
+    }
+
+    if (rename(tmpFilename.c_str(), filename.c_str()) != 0) {
+        remove(tmpFilename.c_str());
+        throw runtime_error("Cannot rename " + tmpFilename + " to " + filename);
+    }
+}
+
+void writeIblCache(const string &filename, uint64_t key,
+                   const IblCacheEntry &entry) {
+    writeCacheFile(filename, [&](ostream &os) {
+        os.write(kMagic, sizeof(kMagic));
+        writePod(os, kVersion);
+        writePod(os, key);
+        writeImage(os, entry.envCubemap);
+        writeImage(os, entry.irradianceMap);
+        writeImage(os, entry.prefilterMap);
+        assert(entry.irradianceSH.size() == 27);
+        os.write(reinterpret_cast<const char *>(&entry.irradianceSH[0]),
+                 entry.irradianceSH.size() * sizeof(float));
+    });
+}
+
+bool readBrdfLUT(const string &filename, IblCacheImage &lut) {
+    ifstream ifs(filename.c_str(), ios::binary);
+    if (!ifs)
+        return false;
+
+    char magic[8];
+    uint32_t version;
+    if (!ifs.read(magic, sizeof(magic)) ||
+        memcmp(magic, kBrdfLUTMagic, 8) != 0 || !readPod(ifs, version) ||
+        version != kBrdfLUTVersion)
+        return false;
+
+    return readImage(ifs, lut) && lut.faces == 1 && lut.channels == 2;
+}
+
+void writeBrdfLUT(const string &filename, const IblCacheImage &lut) {
+    writeCacheFile(filename, [&](ostream &os) {
+        os.write(kBrdfLUTMagic, sizeof(kBrdfLUTMagic));
+        writePod(os, kBrdfLUTVersion);
+        writeImage(os, lut);
+    });
+}
+
+unsigned short floatToHalf(float f) {
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+
+    const uint32_t sign = (x >> 16) & 0x8000;
+    const int exp = (x >> 23) & 0xff;
+    uint32_t mant = x & 0x7fffff;
+
+    if (exp == 0xff) // inf or nan
+        return sign | 0x7c00 | (mant ? 0x200 : 0);
+
+    const int e = exp - 127 + 15;
+    if (e >= 0x1f) // too large, clamp to inf
+        return sign | 0x7c00;
+
+    // round to nearest even on the bits shifted out
+    if (e <= 0) {
+        if (e < -10) // too small even for a denormal
+            return sign;
+        mant |= 0x800000;
+        const int shift = 14 - e;
+        uint32_t h = mant >> shift;
+        const uint32_t rem = mant & ((1u << shift) - 1), halfway = 1u << (shift - 1);
+        if (rem > halfway || (rem == halfway && (h & 1)))
+            ++h;
+        return sign | h;
+    }
+
+    uint32_t h = (uint32_t(e) << 10) | (mant >> 13);
+    const uint32_t rem = mant & 0x1fff;
+    if (rem > 0x1000 || (rem == 0x1000 && (h & 1)))
+        ++h; // a carry into the exponent correctly rounds up to inf
+    return sign | h;
+}
+
+float halfToFloat(unsigned short h) {
+    const uint32_t sign = uint32_t(h & 0x8000) << 16;
+    int exp = (h >> 10) & 0x1f;
+    uint32_t mant = h & 0x3ff;
+
+    uint32_t x;
+    if (exp == 0x1f) {
+        x = sign | 0x7f800000 | (mant << 13);
+    } else if (exp == 0 && mant == 0) {
+        x = sign;
+    } else {
+        if (exp == 0) { // denormal, normalize it
+            exp = 1;
+            while (!(mant & 0x400)) {
+                mant <<= 1;
+                --exp;
+            }
+            mant &= 0x3ff;
+        }
+        x = sign | (uint32_t(exp - 15 + 127) << 23) | (mant << 13);
+    }
+
+    float f;
+    memcpy(&f, &x, sizeof(f));
+    return f;
+}
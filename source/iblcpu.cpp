@@ -0,0 +1,469 @@
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "iblcpu.h"
+
+using namespace std;
+
+static const float PI = 3.14159265359f;
+
+// Cubemaps are baked in square tiles of TILE_SIZE texels, one pool task each
+static const int TILE_SIZE = 8;
+
+Cvec3f importanceSampleGGX(const Cvec2f &xi, const Cvec3f &n, float roughness) {
+    const float a = roughness * roughness;
+
+    const float phi = 2.0f * PI * xi[0];
+    const float cosTheta = sqrt((1.0f - xi[1]) / (1.0f + (a * a - 1.0f) * xi[1]));
+    const float sinTheta = sqrt(1.0f - cosTheta * cosTheta);
+
+    // from spherical coordinates to cartesian coordinates - halfway vector
+    const Cvec3f h(cos(phi) * sinTheta, sin(phi) * sinTheta, cosTheta);
+
+    // from tangent-space H vector to world-space sample vector
+    const Cvec3f up = fabs(n[2]) < 0.999f ? Cvec3f(0, 0, 1) : Cvec3f(1, 0, 0);
+    const Cvec3f tangent = normalize(cross(up, n));
+    const Cvec3f bitangent = cross(n, tangent);
+
+    return normalize(tangent * h[0] + bitangent * h[1] + n * h[2]);
+}
+
+// Note that we use a different k for IBL
+static float geometrySchlickGGX(float NdotV, float roughness) {
+    const float k = (roughness * roughness) / 2.0f;
+    return NdotV / (NdotV * (1.0f - k) + k);
+}
+
+Cvec2f integrateBRDF(float NdotV, float roughness, int sampleCount) {
+    const Cvec3f v(sqrt(1.0f - NdotV * NdotV), 0.0f, NdotV);
+    const Cvec3f n(0, 0, 1);
+
+    float a = 0.0f, b = 0.0f;
+    for (int i = 0; i < sampleCount; ++i) {
+        const Cvec3f h = importanceSampleGGX(hammersley(i, sampleCount), n, roughness);
+        const Cvec3f l = normalize(h * (2.0f * dot(v, h)) - v);
+
+        const float NdotL = max(l[2], 0.0f);
+        const float NdotH = max(h[2], 0.0f);
+        const float VdotH = max(dot(v, h), 0.0f);
+
+        if (NdotL > 0.0f) {
+            const float g = geometrySchlickGGX(NdotV, roughness) *
+                            geometrySchlickGGX(NdotL, roughness);
+            const float gVis = (g * VdotH) / (NdotH * NdotV);
+            const float fc = pow(1.0f - VdotH, 5.0f);
+
+            a += (1.0f - fc) * gVis;
+            b += fc * gVis;
+        }
+    }
+    return Cvec2f(a / sampleCount, b / sampleCount);
+}
+
+void generateBrdfLUT(int width, int height, vector<float> &lut,
+                     ThreadPool &pool) {
+    lut.resize(size_t(width) * height * 2);
+    pool.parallelFor(height, [&](int y, int) {
+        for (int x = 0; x < width; ++x) {
+            const Cvec2f r = integrateBRDF((x + 0.5f) / width, (y + 0.5f) / height);
+            lut[2 * (size_t(y) * width + x) + 0] = r[0];
+            lut[2 * (size_t(y) * width + x) + 1] = r[1];
+        }
+    });
+}
+
+//---------------------------------------------------------------------------
+// Direction <-> texel mappings and filtered lookups
+//---------------------------------------------------------------------------
+
+// Bilinear lookup at texel space position (fx, fy) in a RGB image, with
+// GL_CLAMP_TO_EDGE semantics
+static inline Cvec3f fetchBilinear(const float *rgb, int width, int height,
+                                   float fx, float fy) {
+    fx = min(max(fx, 0.0f), float(width - 1));
+    fy = min(max(fy, 0.0f), float(height - 1));
+    const int x0 = int(fx), y0 = int(fy);
+    const int x1 = min(x0 + 1, width - 1), y1 = min(y0 + 1, height - 1);
+    const float wx = fx - x0, wy = fy - y0;
+
+    const float *p00 = rgb + 3 * (size_t(y0) * width + x0);
+    const float *p10 = rgb + 3 * (size_t(y0) * width + x1);
+    const float *p01 = rgb + 3 * (size_t(y1) * width + x0);
+    const float *p11 = rgb + 3 * (size_t(y1) * width + x1);
+
+    Cvec3f r;
+    for (int c = 0; c < 3; ++c) {
+        const float top = p00[c] + (p10[c] - p00[c]) * wx;
+        const float bottom = p01[c] + (p11[c] - p01[c]) * wx;
+        r[c] = top + (bottom - top) * wy;
+    }
+    return r;
+}
+
+Cvec3f EquirectImage::sample(const Cvec3f &dir) const {
+    // same constants as SampleSphericalMap() in equirect2cubemap.fshader
+    const Cvec3f v = normalize(dir);
+    const float u = atan2(v[2], v[0]) * 0.1591f + 0.5f;
+    const float t = asin(max(-1.0f, min(1.0f, v[1]))) * 0.3183f + 0.5f;
+    return fetchBilinear(&rgb[0], width, height, u * width - 0.5f,
+                         t * height - 0.5f);
+}
+
+void CpuCubemap::resize(int newSize) {
+    size = newSize;
+    for (int i = 0; i < 6; ++i) {
+        faces[i].assign(size_t(size) * size * 3, 0.0f);
+    }
+}
+
+Cvec3f CpuCubemap::getTexelDir(int face, int x, int y, int size) {
+    const float s = 2.0f * (x + 0.5f) / size - 1.0f;
+    const float t = 2.0f * (y + 0.5f) / size - 1.0f;
+    switch (face) {
+    case 0: return Cvec3f(1, -t, -s);
+    case 1: return Cvec3f(-1, -t, s);
+    case 2: return Cvec3f(s, 1, t);
+    case 3: return Cvec3f(s, -1, -t);
+    case 4: return Cvec3f(s, -t, 1);
+    default: return Cvec3f(-s, -t, -1);
+    }
+}
+
+// Face selection of the GL spec: picks the major axis and returns the face
+// index together with the (s, t) coordinates in [0, 1] within that face
+static inline int projectToCubeFace(float x, float y, float z, float &s,
+                                    float &t) {
+    const float ax = fabs(x), ay = fabs(y), az = fabs(z);
+    int face;
+    float ma, sc, tc;
+    if (ax >= ay && ax >= az) {
+        face = x > 0 ? 0 : 1;
+        ma = ax;
+        sc = x > 0 ? -z : z;
+        tc = -y;
+    } else if (ay >= az) {
+        face = y > 0 ? 2 : 3;
+        ma = ay;
+        sc = x;
+        tc = y > 0 ? z : -z;
+    } else {
+        face = z > 0 ? 4 : 5;
+        ma = az;
+        sc = z > 0 ? x : -x;
+        tc = -y;
+    }
+    s = 0.5f * (sc / ma + 1.0f);
+    t = 0.5f * (tc / ma + 1.0f);
+    return face;
+}
+
+static inline Cvec3f fetchCubeFace(const CpuCubemap &cube, int face, float s,
+                                   float t) {
+    return fetchBilinear(&cube.faces[face][0], cube.size, cube.size,
+                         s * cube.size - 0.5f, t * cube.size - 0.5f);
+}
+
+Cvec3f CpuCubemap::sample(const Cvec3f &dir) const {
+    float s, t;
+    const int face = projectToCubeFace(dir[0], dir[1], dir[2], s, t);
+    return fetchCubeFace(*this, face, s, t);
+}
+
+//---------------------------------------------------------------------------
+// Sample sets and the SIMD kernels working on them
+//---------------------------------------------------------------------------
+
+// Tangent space sample directions with weights, stored as structure of
+// arrays and padded with zero weight samples to a multiple of 4 so the
+// kernels below can always work on 4 lanes
+struct SampleSet {
+    vector<float> x, y, z, w;
+
+    void push(float sx, float sy, float sz, float sw) {
+        x.push_back(sx);
+        y.push_back(sy);
+        z.push_back(sz);
+        w.push_back(sw);
+    }
+
+    void pad() {
+        while (x.size() % 4)
+            push(0, 0, 1, 0);
+    }
+
+    int size() const { return x.size(); }
+};
+
+#if defined(__SSE2__)
+
+// 4-wide RadicalInverse_VdC
+static inline __m128 radicalInverseVdC4(__m128i bits) {
+    const __m128i m1 = _mm_set1_epi32(0x55555555), m2 = _mm_set1_epi32(0x33333333),
+                  m4 = _mm_set1_epi32(0x0F0F0F0F), m8 = _mm_set1_epi32(0x00FF00FF);
+    bits = _mm_or_si128(_mm_slli_epi32(bits, 16), _mm_srli_epi32(bits, 16));
+    bits = _mm_or_si128(_mm_slli_epi32(_mm_and_si128(bits, m1), 1),
+                        _mm_and_si128(_mm_srli_epi32(bits, 1), m1));
+    bits = _mm_or_si128(_mm_slli_epi32(_mm_and_si128(bits, m2), 2),
+                        _mm_and_si128(_mm_srli_epi32(bits, 2), m2));
+    bits = _mm_or_si128(_mm_slli_epi32(_mm_and_si128(bits, m4), 4),
+                        _mm_and_si128(_mm_srli_epi32(bits, 4), m4));
+    bits = _mm_or_si128(_mm_slli_epi32(_mm_and_si128(bits, m8), 8),
+                        _mm_and_si128(_mm_srli_epi32(bits, 8), m8));
+
+    // SSE2 only converts signed integers: convert the two 16 bit halves
+    // separately, both exactly, so the sum is rounded once like float(bits)
+    const __m128 hi = _mm_cvtepi32_ps(_mm_srli_epi32(bits, 16));
+    const __m128 lo = _mm_cvtepi32_ps(_mm_and_si128(bits, _mm_set1_epi32(0xFFFF)));
+    const __m128 f = _mm_add_ps(_mm_mul_ps(hi, _mm_set1_ps(65536.0f)), lo);
+    return _mm_mul_ps(f, _mm_set1_ps(2.3283064365386963e-10f));
+}
+
+static inline __m128 select4(__m128 mask, __m128 a, __m128 b) {
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+// 4-wide projectToCubeFace
+static inline void projectToCubeFace4(__m128 x, __m128 y, __m128 z,
+                                      int face[4], float s[4], float t[4]) {
+    const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f),
+                 half = _mm_set1_ps(0.5f);
+    const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+    const __m128 ax = _mm_and_ps(x, absMask), ay = _mm_and_ps(y, absMask),
+                 az = _mm_and_ps(z, absMask);
+
+    const __m128 isX = _mm_and_ps(_mm_cmpge_ps(ax, ay), _mm_cmpge_ps(ax, az));
+    const __m128 isY = _mm_andnot_ps(isX, _mm_cmpge_ps(ay, az));
+    const __m128 xPos = _mm_cmpgt_ps(x, zero), yPos = _mm_cmpgt_ps(y, zero),
+                 zPos = _mm_cmpgt_ps(z, zero);
+    const __m128 nx = _mm_sub_ps(zero, x), ny = _mm_sub_ps(zero, y),
+                 nz = _mm_sub_ps(zero, z);
+
+    const __m128 ma = select4(isX, ax, select4(isY, ay, az));
+    const __m128 sc = select4(isX, select4(xPos, nz, z),
+                              select4(isY, x, select4(zPos, x, nx)));
+    const __m128 tc = select4(isY, select4(yPos, z, nz), ny);
+    const __m128 f =
+        select4(isX, select4(xPos, zero, one),
+                select4(isY, select4(yPos, _mm_set1_ps(2), _mm_set1_ps(3)),
+                        select4(zPos, _mm_set1_ps(4), _mm_set1_ps(5))));
+
+    const __m128 invMa = _mm_div_ps(one, ma);
+    _mm_storeu_ps(s, _mm_mul_ps(half, _mm_add_ps(_mm_mul_ps(sc, invMa), one)));
+    _mm_storeu_ps(t, _mm_mul_ps(half, _mm_add_ps(_mm_mul_ps(tc, invMa), one)));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(face), _mm_cvttps_epi32(f));
+}
+
+#endif
+
+// Weighted sum of cube lookups along the samples of `set' rotated into the
+// frame (tx, ty, tz). Returns sum(env(dir_i) * w_i).
+static Cvec3f integrateSamples(const CpuCubemap &env, const SampleSet &set,
+                               const Cvec3f &tx, const Cvec3f &ty,
+                               const Cvec3f &tz) {
+    Cvec3f sum;
+    int face[4];
+    float s[4], t[4];
+    for (int i = 0, n = set.size(); i < n; i += 4) {
+#if defined(__SSE2__)
+        const __m128 sx = _mm_loadu_ps(&set.x[i]), sy = _mm_loadu_ps(&set.y[i]),
+                     sz = _mm_loadu_ps(&set.z[i]);
+        __m128 d[3];
+        for (int c = 0; c < 3; ++c) {
+            d[c] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(tx[c]), sx),
+                                         _mm_mul_ps(_mm_set1_ps(ty[c]), sy)),
+                              _mm_mul_ps(_mm_set1_ps(tz[c]), sz));
+        }
+        projectToCubeFace4(d[0], d[1], d[2], face, s, t);
+#else
+        for (int k = 0; k < 4; ++k) {
+            const Cvec3f d = tx * set.x[i + k] + ty * set.y[i + k] + tz * set.z[i + k];
+            face[k] = projectToCubeFace(d[0], d[1], d[2], s[k], t[k]);
+        }
+#endif
+        for (int k = 0; k < 4; ++k) {
+            if (set.w[i + k] > 0.0f)
+                sum += fetchCubeFace(env, face[k], s[k], t[k]) * set.w[i + k];
+        }
+    }
+    return sum;
+}
+
+// The light directions used by prefilter.fshader for a given roughness,
+// expressed in the tangent frame of N, weighted by NdotL. With V = R = N the
+// reflected direction only depends on the GGX halfway vector, so the set is
+// shared by all texels.
+static void makePrefilterSamples(float roughness, int sampleCount,
+                                 SampleSet &set) {
+    const float a = roughness * roughness;
+    vector<float> cosTheta(sampleCount + 3), phi(sampleCount + 3);
+
+#if defined(__SSE2__)
+    const __m128 one = _mm_set1_ps(1.0f), a2m1 = _mm_set1_ps(a * a - 1.0f);
+    for (int i = 0; i < sampleCount; i += 4) {
+        const __m128i idx = _mm_add_epi32(_mm_set1_epi32(i), _mm_set_epi32(3, 2, 1, 0));
+        const __m128 xi0 = _mm_div_ps(_mm_cvtepi32_ps(idx), _mm_set1_ps(float(sampleCount)));
+        const __m128 xi1 = radicalInverseVdC4(idx);
+        _mm_storeu_ps(&phi[i], _mm_mul_ps(_mm_set1_ps(2.0f * PI), xi0));
+        _mm_storeu_ps(&cosTheta[i],
+                      _mm_sqrt_ps(_mm_div_ps(_mm_sub_ps(one, xi1),
+                                             _mm_add_ps(one, _mm_mul_ps(a2m1, xi1)))));
+    }
+#else
+    for (int i = 0; i < sampleCount; ++i) {
+        const Cvec2f xi = hammersley(i, sampleCount);
+        phi[i] = 2.0f * PI * xi[0];
+        cosTheta[i] = sqrt((1.0f - xi[1]) / (1.0f + (a * a - 1.0f) * xi[1]));
+    }
+#endif
+
+    for (int i = 0; i < sampleCount; ++i) {
+        const float sinTheta = sqrt(max(0.0f, 1.0f - cosTheta[i] * cosTheta[i]));
+        const Cvec3f h = normalize(Cvec3f(cos(phi[i]) * sinTheta, sin(phi[i]) * sinTheta, cosTheta[i]));
+
+        // L = reflect(-V, H) with V = N = +Z
+        const Cvec3f l = h * (2.0f * h[2]) - Cvec3f(0, 0, 1);
+        if (l[2] > 0.0f)
+            set.push(l[0], l[1], l[2], l[2]);
+    }
+    set.pad();
+}
+
+// The hemisphere samples of irradiance_conv.fshader, weighted by
+// cos(theta) * sin(theta). Uses the same float stepping as the shader so
+// that both end up with the same sample count.
+static void makeIrradianceSamples(SampleSet &set) {
+    const float sampleDelta = 0.025f;
+    for (float phi = 0.0f; phi < 2.0f * PI; phi += sampleDelta) {
+        for (float theta = 0.0f; theta < 0.5f * PI; theta += sampleDelta) {
+            set.push(sin(theta) * cos(phi), sin(theta) * sin(phi), cos(theta),
+                     cos(theta) * sin(theta));
+        }
+    }
+}
+
+// Runs texelFn(face, x, y, texel) for every texel of a size x size cubemap,
+// spread over the pool in tiles. `texel' points to the RGB output.
+template <typename TexelFn>
+static void forEachCubemapTexel(CpuCubemap &dst, ThreadPool &pool,
+                                TexelFn texelFn) {
+    const int size = dst.size;
+    const int tilesPerSide = (size + TILE_SIZE - 1) / TILE_SIZE;
+    const int tilesPerFace = tilesPerSide * tilesPerSide;
+
+    pool.parallelFor(6 * tilesPerFace, [&](int task, int) {
+        const int face = task / tilesPerFace, tile = task % tilesPerFace;
+        const int x0 = (tile % tilesPerSide) * TILE_SIZE;
+        const int y0 = (tile / tilesPerSide) * TILE_SIZE;
+        for (int y = y0; y < min(y0 + TILE_SIZE, size); ++y) {
+            for (int x = x0; x < min(x0 + TILE_SIZE, size); ++x) {
+                texelFn(face, x, y, &dst.faces[face][3 * (size_t(y) * size + x)]);
+            }
+        }
+    });
+}
+
+//---------------------------------------------------------------------------
+// The bake passes
+//---------------------------------------------------------------------------
+
+void bakeEnvCubemap(const EquirectImage &src, int size, CpuCubemap &dst,
+                    ThreadPool &pool) {
+    dst.resize(size);
+    forEachCubemapTexel(dst, pool, [&](int face, int x, int y, float *texel) {
+        const Cvec3f c = src.sample(CpuCubemap::getTexelDir(face, x, y, size));
+        texel[0] = c[0], texel[1] = c[1], texel[2] = c[2];
+    });
+}
+
+void bakeIrradianceMap(const CpuCubemap &env, int size, CpuCubemap &dst,
+                       ThreadPool &pool) {
+    SampleSet samples;
+    makeIrradianceSamples(samples);
+    const float numSamples = samples.size();
+    samples.pad();
+
+    dst.resize(size);
+    forEachCubemapTexel(dst, pool, [&](int face, int x, int y, float *texel) {
+        // tangent space calculation from origin point
+        const Cvec3f n = normalize(CpuCubemap::getTexelDir(face, x, y, size));
+        const Cvec3f right = normalize(cross(Cvec3f(0, 1, 0), n));
+        const Cvec3f up = normalize(cross(n, right));
+
+        const Cvec3f c = integrateSamples(env, samples, right, up, n) * (PI / numSamples);
+        texel[0] = c[0], texel[1] = c[1], texel[2] = c[2];
+    });
+}
+
+void bakePrefilterMap(const CpuCubemap &env, int size, float roughness,
+                      CpuCubemap &dst, int sampleCount, ThreadPool &pool) {
+    SampleSet samples;
+    makePrefilterSamples(roughness, sampleCount, samples);
+    float totalWeight = 0.0f;
+    for (int i = 0; i < samples.size(); ++i) {
+        totalWeight += samples.w[i];
+    }
+
+    dst.resize(size);
+    forEachCubemapTexel(dst, pool, [&](int face, int x, int y, float *texel) {
+        // same tangent frame as ImportanceSampleGGX()
+        const Cvec3f n = normalize(CpuCubemap::getTexelDir(face, x, y, size));
+        const Cvec3f up = fabs(n[2]) < 0.999f ? Cvec3f(0, 0, 1) : Cvec3f(1, 0, 0);
+        const Cvec3f tangent = normalize(cross(up, n));
+        const Cvec3f bitangent = cross(n, tangent);
+
+        const Cvec3f c = integrateSamples(env, samples, tangent, bitangent, n) / totalWeight;
+        texel[0] = c[0], texel[1] = c[1], texel[2] = c[2];
+    });
+}
+
+void projectIrradianceSH(const EquirectImage &src, Cvec3f sh[9],
+                         ThreadPool &pool) {
+    const int width = src.width, height = src.height;
+
+    // per row partial sums, reduced in order below so the result does not
+    // depend on the number of threads
+    vector<Cvec3> rowSums(size_t(height) * 9);
+    pool.parallelFor(height, [&](int y, int) {
+        // inverse of the mapping in EquirectImage::sample
+        const double lat = ((y + 0.5) / height - 0.5) * PI;
+        const double dOmega = (2.0 * PI / width) * (PI / height) * cos(lat);
+        Cvec3 *sum = &rowSums[size_t(y) * 9];
+
+        for (int x = 0; x < width; ++x) {
+            const double phi = ((x + 0.5) / width - 0.5) * 2.0 * PI;
+            const double dx = cos(phi) * cos(lat), dy = sin(lat), dz = sin(phi) * cos(lat);
+            const float *p = &src.rgb[3 * (size_t(y) * width + x)];
+            const Cvec3 l = Cvec3(p[0], p[1], p[2]) * dOmega;
+
+            sum[0] += l * 0.282095;
+            sum[1] += l * (0.488603 * dy);
+            sum[2] += l * (0.488603 * dz);
+            sum[3] += l * (0.488603 * dx);
+            sum[4] += l * (1.092548 * dx * dy);
+            sum[5] += l * (1.092548 * dy * dz);
+            sum[6] += l * (0.315392 * (3.0 * dz * dz - 1.0));
+            sum[7] += l * (1.092548 * dx * dz);
+            sum[8] += l * (0.546274 * (dx * dx - dy * dy));
+        }
+    });
+
+    // cosine lobe convolution (Ramamoorthi & Hanrahan): A0 = PI, A1 = 2PI/3,
+    // A2 = PI/4, times the basis constant, divided by PI
+    static const double scale[9] = {
+        0.282095,
+        0.488603 * 2.0 / 3.0, 0.488603 * 2.0 / 3.0, 0.488603 * 2.0 / 3.0,
+        1.092548 / 4.0, 1.092548 / 4.0, 0.315392 / 4.0, 1.092548 / 4.0,
+        0.546274 / 4.0};
+    for (int i = 0; i < 9; ++i) {
+        Cvec3 c;
+        for (int y = 0; y < height; ++y) {
+            c += rowSums[size_t(y) * 9 + i];
+        }
+        sh[i] = Cvec3f(c[0] * scale[i], c[1] * scale[i], c[2] * scale[i]);
+    }
+}
@@ -0,0 +1,131 @@
+#include <stdexcept>
+
+#include "idpicker.h"
+
+using namespace std;
+
+IdPicker::IdPicker() : width_(0), height_(0), first_(0), numPending_(0) {
+    // the renderbuffers of fbo_ are attached by begin(), once they have
+    // storage of the window's size
+    glBindRenderbuffer(GL_RENDERBUFFER, resolvedId_);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_R32UI, 1, 1);
+    glBindFramebuffer(GL_FRAMEBUFFER, resolveFbo_);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, resolvedId_);
+    const GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    if (status != GL_FRAMEBUFFER_COMPLETE)
+        throw runtime_error("IdPicker: resolve framebuffer incomplete");
+
+    for (int i = 0; i < NUM_SLOTS; ++i) {
+        GlStateCache::getSingleton().bindBuffer(GL_PIXEL_PACK_BUFFER, slots_[i].pbo);
+        glBufferData(GL_PIXEL_PACK_BUFFER, sizeof(GLuint), NULL, GL_STREAM_READ);
+        slots_[i].fence = 0;
+    }
+    GlStateCache::getSingleton().bindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    checkGlErrors();
+}
+
+IdPicker::~IdPicker() {
+    for (int i = 0; i < NUM_SLOTS; ++i) {
+        if (slots_[i].fence)
+            glDeleteSync(slots_[i].fence);
+    }
+}
+
+void IdPicker::begin(int width, int height) {
+    if (width != width_ || height != height_) {
+        // all attachments need the sample count of the window for the blit
+        GLint samples = 0;
+        glGetIntegerv(GL_SAMPLES, &samples);
+
+        glBindRenderbuffer(GL_RENDERBUFFER, color_);
+        glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples, GL_RGBA8, width, height);
+        glBindRenderbuffer(GL_RENDERBUFFER, ids_);
+        glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples, GL_R32UI, width, height);
+        glBindRenderbuffer(GL_RENDERBUFFER, depth_);
+        glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples, GL_DEPTH_COMPONENT24, width, height);
+
+        // a renderbuffer name only becomes a renderbuffer once bound, so
+        // attaching them is left until they all are
+        glBindFramebuffer(GL_FRAMEBUFFER, fbo_);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, color_);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_RENDERBUFFER, ids_);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depth_);
+        width_ = width;
+        height_ = height;
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo_);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        throw runtime_error("IdPicker::begin: framebuffer incomplete");
+
+    // glClear would convert the clear color for the integer attachment, so
+    // that one is cleared on its own
+    const GLenum colorOnly = GL_COLOR_ATTACHMENT0;
+    glDrawBuffers(1, &colorOnly);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+    const GLenum both[] = {GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1};
+    glDrawBuffers(2, both);
+    const GLuint background[] = {0, 0, 0, 0};
+    glClearBufferuiv(GL_COLOR, 1, background);
+}
+
+void IdPicker::end() {
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo_);
+    glReadBuffer(GL_COLOR_ATTACHMENT0);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+    glBlitFramebuffer(0, 0, width_, height_, 0, 0, width_, height_,
+                      GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+bool IdPicker::read(int x, int y, int tag) {
+    if (numPending_ == NUM_SLOTS || x < 0 || y < 0 || x >= width_ || y >= height_)
+        return false;
+    Slot &slot = slots_[(first_ + numPending_) % NUM_SLOTS];
+
+    // resolves the one pixel, which takes a single sample of integer
+    // formats, then copies it into the buffer without waiting for it
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo_);
+    glReadBuffer(GL_COLOR_ATTACHMENT1);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, resolveFbo_);
+    glBlitFramebuffer(x, y, x + 1, y + 1, 0, 0, 1, 1, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, resolveFbo_);
+    glReadBuffer(GL_COLOR_ATTACHMENT0);
+    GlStateCache::getSingleton().bindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+    glReadPixels(0, 0, 1, 1, GL_RED_INTEGER, GL_UNSIGNED_INT, 0);
+    GlStateCache::getSingleton().bindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    slot.tag = tag;
+    ++numPending_;
+    return true;
+}
+
+bool IdPicker::pollResult(Result &result) {
+    if (numPending_ == 0)
+        return false;
+    Slot &slot = slots_[first_];
+    const GLenum status = glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+    if (status == GL_TIMEOUT_EXPIRED)
+        return false;
+    if (status == GL_WAIT_FAILED)
+        throw runtime_error("IdPicker::pollResult: waiting for the fence failed");
+    glDeleteSync(slot.fence);
+    slot.fence = 0;
+
+    GlStateCache::getSingleton().bindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+    const GLuint *id = static_cast<const GLuint *>(
+        glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, sizeof(GLuint), GL_MAP_READ_BIT));
+    result.pickId = id ? *id : 0;
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    GlStateCache::getSingleton().bindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    result.tag = slot.tag;
+    first_ = (first_ + 1) % NUM_SLOTS;
+    --numPending_;
+    return true;
+}
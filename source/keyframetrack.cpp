@@ -0,0 +1,82 @@
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+#include "keyframetrack.h"
+
+using namespace std;
+
+// Stores the power basis coefficients of the cubic Bezier curve with
+// control points p0..p3 to c[0], c[stride], c[2 * stride], c[3 * stride]
+static void storeBezier(double p0, double p1, double p2, double p3, double *c, int stride) {
+    c[0] = p0;
+    c[stride] = 3 * (p1 - p0);
+    c[2 * stride] = 3 * (p0 - 2 * p1 + p2);
+    c[3 * stride] = p3 - p0 + 3 * (p1 - p2);
+}
+
+void KeyFrameTrack::build(const list<vector<RigTForm>> &frames) {
+    vector<const vector<RigTForm> *> f;
+    for (auto i = frames.begin(); i != frames.end(); ++i) {
+        if (i->size() != frames.front().size())
+            throw runtime_error("KeyFrameTrack::build: key frames differ in number of rbts");
+        f.push_back(&*i);
+    }
+
+    numNodes_ = f.empty() ? 0 : f[0]->size();
+    numSegments_ = max(0, int(f.size()) - 3);
+    coeffs_.resize(size_t(numSegments_) * NUM_ROWS * numNodes_);
+
+    const int n = numNodes_;
+    for (int s = 0; s < numSegments_; ++s) {
+        double *block = &coeffs_[size_t(s) * NUM_ROWS * n];
+        for (int i = 0; i < n; ++i) {
+            // the control points of slerp()
+            const Cvec3 t_1 = (*f[s])[i].getTranslation();
+            const Cvec3 t1 = (*f[s + 1])[i].getTranslation();
+            const Cvec3 t2 = (*f[s + 2])[i].getTranslation();
+            const Cvec3 t_2 = (*f[s + 3])[i].getTranslation();
+            const Cvec3 t_d = (t2 - t_1) / 6 + t1;
+            const Cvec3 t_e = (t_2 - t1) / (-6) + t2;
+
+            const Quat r_1 = (*f[s])[i].getRotation();
+            const Quat r1 = (*f[s + 1])[i].getRotation();
+            const Quat r2 = (*f[s + 2])[i].getRotation();
+            const Quat r_2 = (*f[s + 3])[i].getRotation();
+            const Cvec4 sk1 = quat2sk(r1);
+            const Cvec4 sk_d = quat2sk(powerq(r2 * inv(r_1), double(1) / 6) * r1);
+            const Cvec4 sk_e = quat2sk(powerq(r_2 * inv(r1), -double(1) / 6) * r2);
+            const Cvec4 sk2 = quat2sk(r2);
+
+            for (int c = 0; c < 3; ++c) {
+                storeBezier(t1[c], t_d[c], t_e[c], t2[c], block + (TX + c) * 4 * n + i, n);
+            }
+            for (int c = 0; c < 4; ++c) {
+                storeBezier(sk1[c], sk_d[c], sk_e[c], sk2[c], block + (S + c) * 4 * n + i, n);
+            }
+        }
+    }
+}
+
+void KeyFrameTrack::evaluate(double t, vector<RigTForm> &rbts) const {
+    if (numSegments_ == 0)
+        throw runtime_error("KeyFrameTrack::evaluate: empty track");
+    t = max(0.0, t);
+    const int segment = min(int(t), numSegments_ - 1);
+    const double a = min(t - segment, 1.0);
+
+    const int n = numNodes_;
+    const double *block = &coeffs_[size_t(segment) * NUM_ROWS * n];
+    rbts.resize(n);
+    for (int i = 0; i < n; ++i) {
+        double v[NUM_CHANNELS];
+        for (int c = 0; c < NUM_CHANNELS; ++c) {
+            const double *p = block + c * 4 * n + i;
+            v[c] = p[0] + a * (p[n] + a * (p[2 * n] + a * p[3 * n]));
+        }
+        // sk2quat
+        const double sin_s = sin(v[S]);
+        rbts[i] = RigTForm(Cvec3(v[TX], v[TY], v[TZ]),
+                           Quat(cos(v[S]), sin_s * v[KX], sin_s * v[KY], sin_s * v[KZ]));
+    }
+}
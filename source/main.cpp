@@ -13,6 +13,13 @@
 #include <list>
 #include <iostream>
 #include <fstream>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <future>
+#include <cstdlib>
+#include <cstring>
 
 #define GLEW_STATIC
 
@@ -30,18 +37,27 @@
 #include "geometrymaker.h"
 #include "glsupport.h"
 #include "matrix4.h"
-#include "ppm.h"
 #include "quat.h"
 #include "rigtform.h"
 #include "arcball.h"
+#include "batch.h"
+#include "bench.h"
+#include "capture.h"
 
 #include "common.h"
 #include "scenegraph.h"
 #include "drawer.h"
+#include "flathierarchy.h"
+#include "idpicker.h"
+#include "keyframetrack.h"
 #include "picker.h"
+#include "renderqueue.h"
 #include "sgutils.h"
 #include "geometry.h"
 #include "model.h"
+#include "perframe.h"
+#include "iblcache.h"
+#include "iblcpu.h"
 
 using namespace std; // for string, vector, iostream, and other standard C++ stuff
 
@@ -53,6 +69,9 @@ static const string USER_PBR_TEX_IMG_TYPE = "tga";
 
 static const string ENV_HDR_DIR = "./resource/hdr";
 static const string ENV_HDRs[] = {"Arches.hdr", "Canyon.hdr", "CharlesRiver.hdr", "Loft.hdr", "MIT.hdr", "Ruins.hdr"};
+static const string IBL_CACHE_DIR = "./resource/cache";
+static const string MESH_CACHE_DIR = "./resource/cache";
+static const string BRDF_LUT_PATH = "./resource/brdf_lut.bin";
 static int g_curEnvIdx = 4;   // default to MIT.hdr
 static int g_prevEnvIdx = -1;
 static string g_items;  // used for ui display
@@ -83,7 +102,6 @@ const bool g_Gl2Compatible = false;
 
 static shared_ptr<Material>
         g_arcballMat,
-        g_pickingMat,
         g_lightMat;
 
 shared_ptr<Material> g_overridingMaterial;
@@ -91,6 +109,7 @@ shared_ptr<Material> g_overridingMaterial;
 // material for display purpose
 static shared_ptr<Material> g_skyboxMat;
 static shared_ptr<Material> g_pbrMat;
+static shared_ptr<Material> g_pbrShMat;  // same as g_pbrMat, but with SH diffuse irradiance
 
 // for precompute purpose
 static shared_ptr<Material> g_equirect2cubemap;
@@ -98,11 +117,19 @@ static shared_ptr<Material> g_irradiance;
 static shared_ptr<Material> g_prefilter;
 static shared_ptr<Material> g_brdf;
 
+// camera and lights, shared by all materials through the PerFrame block
+static shared_ptr<PerFrameBuffer> g_perFrameBuffer;
+
 // for storing precomputed results
 static shared_ptr<CubeMapTexture> g_envCubemap;
 static shared_ptr<CubeMapTexture> g_irradianceMap;
 static shared_ptr<CubeMapTexture> g_prefilterMap;
 static shared_ptr<ImageTexture> g_brdfLUT;
+static Cvec3f g_irradianceSH[9];
+
+// whether the diffuse IBL term comes from g_irradianceSH instead of
+// g_irradianceMap; in SH mode the irradiance convolution pass is skipped
+static bool g_useIrradianceSH = false;
 
 
 // --------- Geometry
@@ -115,8 +142,8 @@ static shared_ptr<Geometry> g_plane, g_cube, g_sphere, g_quad;
 static shared_ptr<SgRootNode> g_world;
 static shared_ptr<SgRbtNode> g_skyNode;
 static shared_ptr<SgRbtNode> g_currentPickedRbtNode = g_skyNode; // used later when you do picking
+static shared_ptr<MyShapeNode> g_pbrShapeNode;
 
-const int MAX_LIGHT = 4;
 static vector<shared_ptr<SgRbtNode>> g_lightNodes;
 Cvec3 g_lightPositions[] = {
 //        {-2.0, 5.0, 4.0},
@@ -128,16 +155,16 @@ Cvec3 g_lightColors[] = {
 };
 
 // --------- IBL
-static const int g_captureWidth = 1024;
-static const int g_captureHeight = 1024;
+static const int g_captureWidth = IBL_ENV_SIZE;
+static const int g_captureHeight = IBL_ENV_SIZE;
 
-static const int g_irradianceCaptureWidth = 32;
-static const int g_irradianceCaptureHeight = 32;
+static const int g_irradianceCaptureWidth = IBL_IRRADIANCE_SIZE;
+static const int g_irradianceCaptureHeight = IBL_IRRADIANCE_SIZE;
 
-static const int g_prefilterCaptureWidth = 128;
-static const int g_prefilterCaptureHeight = 128;
+static const int g_prefilterCaptureWidth = IBL_PREFILTER_SIZE;
+static const int g_prefilterCaptureHeight = IBL_PREFILTER_SIZE;
 
-static const int MAX_MIP_LEVELS = 5;
+static const int MAX_MIP_LEVELS = IBL_PREFILTER_MIPS;
 static const int g_brdfLUTWidth = 512;
 static const int g_brdfLUTHeight = 512;
 
@@ -150,6 +177,11 @@ list<vector<RigTForm> >::iterator g_current_key_frame = g_key_frames.end();
 
 string g_key_frame_file_name = "key_frame.dat";
 
+// g_key_frames compiled for playback, rebuilt after they change
+static KeyFrameTrack g_keyFrameTrack;
+static bool g_keyFramesChanged = true;
+static vector<RigTForm> g_animatedRbts; // reused by interpolate
+
 
 // Global variables for animation timing
 
@@ -172,6 +204,62 @@ int sky_mode = 0;
 double g_arcballScreenRadius = 0.20 * min(g_windowWidth, g_windowHeight);
 double g_arcballScale = 1;
 
+// draws of the scene, refilled every frame
+static RenderQueue g_renderQueue;
+
+// per draw values of drawStuff, kept across frames so that putting them
+// again does not allocate
+static Uniforms g_frameUniforms;
+
+// whether the queue is submitted sorted or in scene graph order
+static bool g_sortDraws = true;
+
+// whether sorted submission batches repeated shapes into instanced draws
+static bool g_instancing = true;
+
+// compiled copy of g_world, used instead of traversing it when enabled
+static shared_ptr<FlatHierarchy> g_flatHierarchy;
+static bool g_useFlatHierarchy = false;
+
+// whether shapes outside the view frustum are skipped, and how many shapes
+// the last frame drew and skipped
+static bool g_frustumCulling = true;
+static int g_numVisibleShapes = 0, g_numCulledShapes = 0;
+
+// time the last pick took, and the triangle it hit or -1
+static double g_pickMs = 0;
+static int g_pickTriangle = -1;
+
+// whether picks read the pick id buffer instead of casting rays, and the
+// pick id of the shape under the mouse, highlighted in the next frame
+static shared_ptr<IdPicker> g_idPicker;
+static bool g_rasterPicking = false;
+static unsigned int g_hoverPickId = 0;
+
+// what the reads of g_idPicker are for
+enum { ID_READ_HOVER, ID_READ_PICK };
+
+// a pick waiting for the next frame to be read, and when it was asked for
+static bool g_rasterPickRequested = false;
+static chrono::steady_clock::time_point g_rasterPickStart;
+
+// pixel of the last hover read
+static int g_hoverReadX = -1, g_hoverReadY = -1;
+
+// screenshots and recorded frames, in the format g_captureFormat indexes in
+// CAPTURE_EXTENSIONS
+static shared_ptr<FrameCapture> g_frameCapture;
+static const char *const CAPTURE_EXTENSIONS[] = {"ppm", "png", "pfm"};
+static int g_captureFormat = 0;
+static bool g_screenshotRequested = false;
+
+// frames to record, those left of the current recording and its frames per
+// second once done
+static int g_recordFrameCount = 120;
+static int g_recordFramesLeft = 0, g_recordFrameIndex = 0;
+static chrono::steady_clock::time_point g_recordStart;
+static double g_recordFps = 0;
+
 ///////////////// END OF G L O B A L S
 /////////////////////////////////////////////////////
 static void initPlane() {
@@ -236,105 +324,218 @@ static void updateFrustFovY() {
     }
 }
 
+// Size in pixels of what the scene is drawn to: the framebuffer of the
+// window, or without one (--batch) the size of the offscreen target
+static void getFramebufferSize(int &width, int &height) {
+    if (g_window) {
+        glfwGetFramebufferSize(g_window, &width, &height);
+    } else {
+        width = g_windowWidth;
+        height = g_windowHeight;
+    }
+}
+
 static Matrix4 makeProjectionMatrix() {
     return Matrix4::makeProjection(
             g_frustFovY, g_windowWidth / static_cast<double>(g_windowHeight),
             g_frustNear, g_frustFar);
 }
 
-static void drawStuff(bool picking) {
-    // short hand for current shader state
-    Uniforms uniforms;
-
-    // PerFrame context: projection matrix, view matrix, lights, camera position
+// Uploads the PerFrame context: projection matrix, view matrix, lights,
+// camera position. Returns the eye frame.
+static RigTForm updatePerFrameBuffer() {
+    PerFrameBlock block;
 
     // projection matrix
-    const Matrix4 projMat = makeProjectionMatrix();
-    sendProjectionMatrix(uniforms, projMat);
+    block.setProjMatrix(makeProjectionMatrix());
 
     // view matrix
     // use the skyRbt as the eyeRbt
     shared_ptr<SgRbtNode> eyeNode = g_skyNode;
 
     RigTForm eyeRbt = getPathAccumRbt(g_world, eyeNode);
-    RigTForm invEyeRbt = inv(eyeRbt);
-    Matrix4 viewMat = rigTFormToMatrix(invEyeRbt);
-    sendViewMatrix(uniforms, viewMat);
+    block.setViewMatrix(rigTFormToMatrix(inv(eyeRbt)));
 
     // camera position
-    uniforms.put("uCameraPos", eyeRbt.getTranslation());
+    block.setCameraPos(eyeRbt.getTranslation());
 
-    // lights
-    vector<Cvec3> lightPositions;
-    vector<Cvec3> lightColors;
+    // lights, beyond PER_FRAME_MAX_LIGHTS they are ignored
+    const int numLights = min(int(g_lightNodes.size()), PER_FRAME_MAX_LIGHTS);
     int i = 0;
-    for (; i < g_lightNodes.size(); i++) {
+    for (; i < numLights; i++) {
         Cvec3 lightPos = getPathAccumRbt(g_world, g_lightNodes[i]).getTranslation();
-        lightPositions.push_back(lightPos);
-        lightColors.push_back(g_lightColors[i]);
+        block.setLight(i, lightPos, g_lightColors[i]);
     }
     // fill the rest with dummy data
-    for (; i < MAX_LIGHT; i++) {
-        lightPositions.push_back({0., 0., 0.});
-        lightColors.push_back({0., 0., 0.});
+    for (; i < PER_FRAME_MAX_LIGHTS; i++) {
+        block.setLight(i, Cvec3(), Cvec3());
     }
+    block.numLights = numLights;
+
+    block.hoverPickId = g_rasterPicking ? g_hoverPickId : 0;
+
+    g_perFrameBuffer->update(block);
+
+    return eyeRbt;
+}
+
+static void drawStuff() {
+    // short hand for current shader state
+    Uniforms &uniforms = g_frameUniforms;
 
-    uniforms.put("uNumLights", (int)g_lightNodes.size());
-    uniforms.put("uLightPositions", lightPositions.data(), MAX_LIGHT);
-    uniforms.put("uLightColors", lightColors.data(), MAX_LIGHT);
+    RigTForm eyeRbt = updatePerFrameBuffer();
+    RigTForm invEyeRbt = inv(eyeRbt);
+    Matrix4 viewMat = rigTFormToMatrix(invEyeRbt);
 
-    if (!picking) {
-        Drawer drawer(RigTForm(), uniforms);
+    const Frustum frustum(makeProjectionMatrix() * viewMat);
+    const Frustum *culling = g_frustumCulling ? &frustum : NULL;
+    g_renderQueue.clear();
+    if (g_useFlatHierarchy) {
+        g_flatHierarchy->update();
+        g_flatHierarchy->pushShapes(g_renderQueue, uniforms, viewMat, culling);
+        g_numVisibleShapes = g_flatHierarchy->getNumVisible();
+        g_numCulledShapes = g_flatHierarchy->getNumCulled();
+    } else {
+        RenderQueueDrawer drawer(RigTForm(), uniforms, g_renderQueue, viewMat, culling);
         g_world->accept(drawer);
+        g_numVisibleShapes = drawer.getNumVisible();
+        g_numCulledShapes = drawer.getNumCulled();
+    }
+    g_renderQueue.sort();
+    g_renderQueue.submit(uniforms, g_sortDraws);
+
+    if (g_currentPickedRbtNode && *g_currentPickedRbtNode != *g_skyNode) {
+        RigTForm objectRbt = getPathAccumRbt(g_world, g_currentPickedRbtNode);
+        if (g_mouseMClickButton ||
+            (g_mouseLClickButton && g_mouseRClickButton) ||
+            (g_mouseLClickButton && !g_mouseRClickButton &&
+             g_spaceDown)) {}
+        else {
+            g_arcballScale = getScreenToEyeScale((invEyeRbt * objectRbt).getTranslation()[2],
+                                                 g_frustFovY, g_windowHeight);
+        }
+        Matrix4 modelMat = rigTFormToMatrix(objectRbt) * Matrix4::makeScale(Cvec3(1, 1, 1) * g_arcballScale * g_arcballScreenRadius);
+        Matrix4 normalMat = normalMatrix(viewMat * modelMat);
 
-        if (g_currentPickedRbtNode && *g_currentPickedRbtNode != *g_skyNode) {
-            RigTForm objectRbt = getPathAccumRbt(g_world, g_currentPickedRbtNode);
-            if (g_mouseMClickButton ||
-                (g_mouseLClickButton && g_mouseRClickButton) ||
-                (g_mouseLClickButton && !g_mouseRClickButton &&
-                 g_spaceDown)) {}
-            else {
-                g_arcballScale = getScreenToEyeScale((invEyeRbt * objectRbt).getTranslation()[2],
-                                                     g_frustFovY, g_windowHeight);
-            }
-            Matrix4 modelMat = rigTFormToMatrix(objectRbt) * Matrix4::makeScale(Cvec3(1, 1, 1) * g_arcballScale * g_arcballScreenRadius);
-            Matrix4 normalMat = normalMatrix(viewMat * modelMat);
+        sendModelMatrix(uniforms, modelMat);
+        sendPickId(uniforms, 0);
 
-            sendModelMatrix(uniforms, modelMat);
+        g_arcballMat->draw(*g_sphere, uniforms);
+    }
+}
+
+// Picks the rbt node of the shape under the mouse, by casting a ray from the
+// eye through the mouse position on the CPU, or with raster picking on, by
+// reading the pick id buffer of the next frame
+static void pick() {
+    const auto start = chrono::steady_clock::now();
+    if (g_rasterPicking) {
+        g_rasterPickRequested = true;
+        g_rasterPickStart = start;
+        return;
+    }
+
+    const RigTForm eyeRbt = getPathAccumRbt(g_world, g_skyNode);
+    // the mouse position in normalized device coordinates, then in eye space
+    // on the plane at z = -1
+    const double x = 2 * (g_mouseClickX + 0.5) / g_windowWidth - 1;
+    const double y = 2 * (g_mouseClickY + 0.5) / g_windowHeight - 1;
+    const double tanHalfFovY = tan(g_frustFovY * 0.5 * CS175_PI / 180);
+    const Cvec3 eyeDir(x * tanHalfFovY * g_windowWidth / g_windowHeight, y * tanHalfFovY, -1);
+
+    Picker picker(RigTForm(), eyeRbt.getTranslation(), eyeRbt.getRotation() * eyeDir);
+    g_world->accept(picker);
+    g_currentPickedRbtNode = picker.getRbtNode();
+    if (!g_currentPickedRbtNode)
+        g_currentPickedRbtNode = g_skyNode;   // set to NULL
+
+    g_pickMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    g_pickTriangle = picker.getTriangle();
+}
 
-            g_arcballMat->draw(*g_sphere, uniforms);
+// Takes the reads of g_idPicker that are done: hovers update the
+// highlighted shape, picks select the rbt node above the shape read
+static void pollIdPicker() {
+    IdPicker::Result result;
+    while (g_idPicker->pollResult(result)) {
+        if (result.tag == ID_READ_HOVER) {
+            g_hoverPickId = result.pickId;
+            continue;
         }
-    } else {
-        Picker picker(RigTForm(), uniforms);
-        g_overridingMaterial = g_pickingMat;
-        g_world->accept(picker);
-        g_overridingMaterial.reset();
-        glFlush();
-        g_currentPickedRbtNode = picker.getRbtNodeAtXY(g_mouseClickX * g_wScale,
-                                                       g_mouseClickY * g_hScale);
+
+        PickIdFinder finder(result.pickId);
+        if (result.pickId != 0)
+            g_world->accept(finder);
+        g_currentPickedRbtNode = finder.getRbtNode();
         if (!g_currentPickedRbtNode)
             g_currentPickedRbtNode = g_skyNode;   // set to NULL
+
+        g_pickMs = chrono::duration<double, milli>(chrono::steady_clock::now() -
+                                                   g_rasterPickStart).count();
+        g_pickTriangle = -1;
     }
 }
 
-static void pick() {
-    // We need to set the clear color to black, for pick rendering.
-    // so let's save the clear color
-    GLdouble clearColor[4];
-    glGetDoublev(GL_COLOR_CLEAR_VALUE, clearColor);
+// Queues the reads of g_idPicker for the frame just drawn: the pixel under
+// the mouse when it moved, or every frame of an animation, and a requested
+// pick
+static void readIdPicker() {
+    const int x = int(g_mouseClickX * g_wScale), y = int(g_mouseClickY * g_hScale);
+    if (g_rasterPickRequested && g_idPicker->read(x, y, ID_READ_PICK))
+        g_rasterPickRequested = false;
+    if ((x != g_hoverReadX || y != g_hoverReadY || g_playingAnimation) &&
+        g_idPicker->read(x, y, ID_READ_HOVER)) {
+        g_hoverReadX = x;
+        g_hoverReadY = y;
+    }
+}
 
-    glClearColor(0, 0, 0, 0);
+// Records the next g_recordFrameCount frames, playing the key frame
+// animation as the Y key does. Frames are drawn as fast as they can be
+// captured rather than at the animation rate, so none is skipped.
+static void startRecording() {
+    g_recordFramesLeft = g_recordFrameCount;
+    g_recordFrameIndex = 0;
+    g_recordStart = chrono::steady_clock::now();
+    g_recordFps = 0;
+    if (!g_playingAnimation && g_key_frames.size() >= 4)
+        g_playingAnimation = true;
+}
 
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-    drawStuff(true);
+// Captures the frame just drawn for a requested screenshot or a recording
+static void captureFrame() {
+    int width, height;
+    glfwGetFramebufferSize(g_window, &width, &height);
+    const string ext = CAPTURE_EXTENSIONS[g_captureFormat];
 
-    // uncomment the line below to see the scene rendered with id as color
-    // glfwSwapBuffers(g_window);
+    if (g_screenshotRequested) {
+        g_frameCapture->capture(width, height, "out." + ext);
+        g_screenshotRequested = false;
+    }
 
-    //Now set back the clear color
-    glClearColor(clearColor[0], clearColor[1], clearColor[2], clearColor[3]);
+    if (g_recordFramesLeft > 0) {
+        char filename[64];
+        snprintf(filename, sizeof(filename), "capture/frame_%05d.", g_recordFrameIndex++);
+        g_frameCapture->capture(width, height, filename + ext);
+        if (--g_recordFramesLeft == 0) {
+            g_frameCapture->flush();
+            const double seconds =
+                chrono::duration<double>(chrono::steady_clock::now() - g_recordStart).count();
+            g_recordFps = g_recordFrameIndex / seconds;
+        }
+    }
+}
 
-    checkGlErrors();
+static bool isIBLLoading();
+static float getIBLProgress();
+
+// Points the pbr model at the material for the current diffuse IBL mode. The
+// environment is set up again if it was loaded in SH mode and the irradiance
+// cubemap is needed now.
+static void updateIrradianceMode() {
+    g_pbrShapeNode->material = g_useIrradianceSH ? g_pbrShMat : g_pbrMat;
+    if (!g_useIrradianceSH && !g_irradianceMap)
+        g_prevEnvIdx = -1;
 }
 
 static void drawUI() {
@@ -358,8 +559,49 @@ static void drawUI() {
         }
     }
 
+    if (ImGui::Checkbox("SH irradiance", &g_useIrradianceSH))
+        updateIrradianceMode();
+
+    if (isIBLLoading())
+        ImGui::ProgressBar(getIBLProgress(), ImVec2(-1.0f, 0.0f), "Loading environment");
+
     ImGui::Text("Avg: %.3f ms/frame (%.1f FPS)", 1000.0f / ImGui::GetIO().Framerate, ImGui::GetIO().Framerate);
 
+    // binds of this frame so far, i.e. of the scene
+    const GlStateCache::Counters &glCalls = GlStateCache::getSingleton().getCounters();
+    ImGui::Text("GL binds: %u issued, %u skipped", glCalls.issued, glCalls.skipped);
+
+    ImGui::Checkbox("Sort draws", &g_sortDraws);
+    ImGui::SameLine();
+    if (ImGui::Checkbox("Instancing", &g_instancing))
+        g_renderQueue.setInstancing(g_instancing);
+    ImGui::SameLine();
+    ImGui::Checkbox("Flat hierarchy", &g_useFlatHierarchy);
+    ImGui::Checkbox("Frustum culling", &g_frustumCulling);
+    ImGui::SameLine();
+    ImGui::Text("%d shapes visible, %d culled", g_numVisibleShapes, g_numCulledShapes);
+    ImGui::Combo("Capture format", &g_captureFormat, "PPM\0PNG\0PFM\0");
+    ImGui::InputInt("Frames", &g_recordFrameCount);
+    g_recordFrameCount = max(1, g_recordFrameCount);
+    ImGui::SameLine();
+    if (ImGui::Button("Record") && g_recordFramesLeft == 0)
+        startRecording();
+    if (g_recordFramesLeft > 0)
+        ImGui::Text("Recording frame %d of %d", g_recordFrameIndex + 1, g_recordFrameCount);
+    else if (g_recordFps > 0)
+        ImGui::Text("Recorded %d frames at %.1f frames/sec", g_recordFrameIndex, g_recordFps);
+
+    ImGui::Checkbox("Raster picking", &g_rasterPicking);
+    ImGui::SameLine();
+    ImGui::Text("Last pick: triangle %d in %.3f ms", g_pickTriangle, g_pickMs);
+    const RenderQueue::Stats &unsorted = g_renderQueue.getUnsortedStats();
+    const RenderQueue::Stats &sorted = g_renderQueue.getSortedStats();
+    ImGui::Text("%d draws in %d draw calls, program/texture/material changes:",
+                sorted.draws, g_renderQueue.getNumDrawCalls());
+    ImGui::Text("  scene order %d/%d/%d, sorted %d/%d/%d",
+                unsorted.programChanges, unsorted.textureSetChanges, unsorted.materialChanges,
+                sorted.programChanges, sorted.textureSetChanges, sorted.materialChanges);
+
     ImGui::End();
 
     ImGui::Render();
@@ -367,10 +609,33 @@ static void drawUI() {
 }
 
 static void display() {
-    // clear framebuffer color&depth
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    GlStateCache::getSingleton().resetCounters();
+
+    pollIdPicker();
+
+    if (g_rasterPicking) {
+        // the scene goes through the id picker, which clears it
+        int width, height;
+        glfwGetFramebufferSize(g_window, &width, &height);
+        g_idPicker->begin(width, height);
+        drawStuff();
+        g_idPicker->end();
+        readIdPicker();
+    } else {
+        // clear framebuffer color&depth
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-    drawStuff(false);
+        drawStuff();
+    }
+
+    // frames are captured without the UI
+    try {
+        if (g_screenshotRequested || g_recordFramesLeft > 0)
+            captureFrame();
+        g_frameCapture->poll();
+    } catch (const runtime_error &e) {
+        cerr << e.what() << endl;
+    }
 
     drawUI();
 
@@ -537,6 +802,7 @@ void new_key_frame() {
     }
     g_key_frames.insert(g_current_key_frame, key_frame);
     --g_current_key_frame;
+    g_keyFramesChanged = true;
 }
 
 void update_key_frame() {
@@ -545,6 +811,7 @@ void update_key_frame() {
     for (int i = 0; i < n_node; ++i) {
         (*g_current_key_frame)[i] = g_rbtNodes[i]->getRbt();
     }
+    g_keyFramesChanged = true;
 }
 
 void previous_key_frame() {
@@ -562,6 +829,7 @@ void next_key_frame() {
 void delete_key_frame() {
     if (g_current_key_frame == g_key_frames.end() || g_key_frames.empty()) return;
     g_key_frames.erase(g_current_key_frame);
+    g_keyFramesChanged = true;
     if (g_key_frames.empty()) {
         g_current_key_frame = g_key_frames.end();
     } else if (g_current_key_frame != g_key_frames.begin()) {
@@ -601,6 +869,7 @@ void read_key_frame() {
         g_key_frames.push_back(frame);
     }
     file.close();
+    g_keyFramesChanged = true;
 }
 
 void write_key_frame() {
@@ -629,8 +898,7 @@ static void keyboard(GLFWwindow *window, int key, int scancode, int action, int
                      << endl;
                 break;
             case GLFW_KEY_S:
-                glFlush();
-                writePpmScreenshot(g_windowWidth, g_windowHeight, "out.ppm");
+                g_screenshotRequested = true;
                 break;
             case GLFW_KEY_SPACE:
                 g_spaceDown = true;
@@ -697,23 +965,15 @@ void error_callback(int error, const char *description) {
 }
 
 bool interpolate(double t) {
-    int max_frame = g_key_frames.size() - 3;
-    if (t >= max_frame)return true;
-    double alpha = t - floor(t);
-    int cnt = -1;
-    vector<RigTForm> F1, F2, F_1, F_2, d, e;
-    for (auto i = g_key_frames.begin(); i != g_key_frames.end(); ++i, ++cnt) {
-        if (cnt == floor(t) - 1) {
-            F_1 = *i;
-            F1 = *(++i);
-            F2 = *(++i);
-            F_2 = *(++i);
-            break;
-        }
+    if (g_keyFramesChanged) {
+        g_keyFrameTrack.build(g_key_frames);
+        g_keyFramesChanged = false;
     }
-    int n_node = g_rbtNodes.size();
+    if (t >= g_keyFrameTrack.getNumSegments())return true;
+    g_keyFrameTrack.evaluate(t, g_animatedRbts);
+    int n_node = min(g_rbtNodes.size(), g_animatedRbts.size());
     for (int i = 0; i < n_node; ++i) {
-        g_rbtNodes[i]->setRbt(slerp(alpha, F1[i], F2[i], F_1[i], F_2[i]));
+        g_rbtNodes[i]->setRbt(g_animatedRbts[i]);
     }
     return false;
 }
@@ -775,14 +1035,57 @@ static void initGLState() {
     glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
     glPixelStorei(GL_PACK_ALIGNMENT, 1);
     glEnable(GL_DEPTH_TEST);
-    glDepthFunc(GL_LEQUAL);
+    glDepthFunc(GL_LESS); // RenderStates default, the sky uses GL_LEQUAL
     glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
+
+    g_idPicker.reset(new IdPicker());
+    g_frameCapture.reset(new FrameCapture());
+}
+
+// Registers `variantFilename' as an in-memory copy of the shader `filename'
+// with a `#define' of each of `defines' inserted after its #version line
+static void addShaderVariant(const string &filename, const string &variantFilename,
+                             const vector<string> &defines) {
+    ifstream ifs(filename.c_str());
+    if (!ifs)
+        throw runtime_error("Cannot open shader " + filename);
+    string source((istreambuf_iterator<char>(ifs)), istreambuf_iterator<char>());
+
+    size_t pos = source.find('\n', source.find("#version"));
+    pos = pos == string::npos ? source.size() : pos + 1;
+    string defineLines;
+    for (size_t i = 0; i < defines.size(); ++i) {
+        defineLines += "#define " + defines[i] + "\n";
+    }
+    source.insert(pos, defineLines);
+
+    Material::addInlineSource(variantFilename, source.size(), source.data());
 }
 
 static void initMaterials() {
+    g_perFrameBuffer.reset(new PerFrameBuffer());
+    Material::setUniformBlockBinding("PerFrame", PER_FRAME_BINDING, sizeof(PerFrameBlock));
+
     // Create some prototype materials
     Material solid("./shaders/basic-gl3.vshader", "./shaders/solid-gl3.fshader");
-    Material pbr("./shaders/pbr.vshader", "./shaders/pbr.fshader");
+
+    // the model comes with per vertex tangents (see importObjMesh), and the
+    // SH variant takes the diffuse irradiance from g_irradianceSH
+    addShaderVariant("./shaders/pbr.vshader", "./shaders/pbr-tangent.vshader", {"VERTEX_TANGENTS"});
+    addShaderVariant("./shaders/pbr.fshader", "./shaders/pbr-tangent.fshader", {"VERTEX_TANGENTS"});
+    addShaderVariant("./shaders/pbr.fshader", "./shaders/pbr-tangent-sh.fshader",
+                     {"VERTEX_TANGENTS", "IRRADIANCE_SH"});
+    Material pbr("./shaders/pbr-tangent.vshader", "./shaders/pbr-tangent.fshader");
+    Material pbrSh("./shaders/pbr-tangent.vshader", "./shaders/pbr-tangent-sh.fshader");
+
+    // variants reading the model matrix per instance, for the render queue
+    // to batch repeated shapes
+    addShaderVariant("./shaders/basic-gl3.vshader", "./shaders/basic-gl3-instanced.vshader", {"INSTANCED"});
+    addShaderVariant("./shaders/pbr.vshader", "./shaders/pbr-tangent-instanced.vshader",
+                     {"VERTEX_TANGENTS", "INSTANCED"});
+    solid.setInstancedShaders("./shaders/basic-gl3-instanced.vshader", "./shaders/solid-gl3.fshader");
+    pbr.setInstancedShaders("./shaders/pbr-tangent-instanced.vshader", "./shaders/pbr-tangent.fshader");
+    pbrSh.setInstancedShaders("./shaders/pbr-tangent-instanced.vshader", "./shaders/pbr-tangent-sh.fshader");
 
     // copy solid prototype, and set to wireframed rendering
     g_arcballMat.reset(new Material(solid));
@@ -799,14 +1102,18 @@ static void initMaterials() {
     g_prefilter.reset(new Material("./shaders/cubemap.vshader", "./shaders/prefilter.fshader"));
     g_brdf.reset(new Material("./shaders/brdf.vshader", "./shaders/brdf.fshader"));
 
-    // pick shader
-    g_pickingMat.reset(new Material("./shaders/basic-gl3.vshader", "./shaders/pick-gl3.fshader"));
-
     // skybox material
     g_skyboxMat.reset(new Material("./shaders/skybox.vshader", "./shaders/skybox.fshader"));
+    // the sky is drawn last at the far plane, only where nothing else was
+    g_skyboxMat->setRenderPass(RENDER_PASS_SKY);
+    g_skyboxMat->getRenderStates().depthFunc(GL_LEQUAL);
 
     // user pbr materials
     g_pbrMat = loadPBRTextures(pbr, USER_PBR_TEX_DIR.c_str(), USER_PBR_TEX_IMG_TYPE.c_str());
+
+    // the SH variant shares the textures
+    g_pbrShMat.reset(new Material(pbrSh));
+    g_pbrShMat->getUniforms() = g_pbrMat->getUniforms();
 }
 
 static void initGeometry() {
@@ -842,74 +1149,212 @@ static void initScene() {
 
     // custom pbr model
     auto node = make_shared<SgRbtNode>(RigTForm(Cvec3(0,0,0), Quat::makeYRotation(-45)));
-    auto geoPtr = loadObj(USER_OBJ_PATH.c_str());
-    node->addChild(shared_ptr<MyShapeNode>(new MyShapeNode(geoPtr, g_pbrMat)));
+    auto geoPtr = loadObj(USER_OBJ_PATH.c_str(), MESH_CACHE_DIR);
+    g_pbrShapeNode.reset(new MyShapeNode(geoPtr, g_useIrradianceSH ? g_pbrShMat : g_pbrMat));
+    node->addChild(g_pbrShapeNode);
     g_world->addChild(node);
 
     dumpSgRbtNodes(g_world, g_rbtNodes);
+
+    g_flatHierarchy.reset(new FlatHierarchy(g_world));
 }
 
-static void initIBL() {
-    Uniforms *uniformsPtr;  // for convenience
+// Reads back all faces and mip levels of a RGB16F/RG16F texture as half
+// floats, waiting for the GPU
+static void downloadIblImage(const Texture &tex, int faces, int channels,
+                             int width, int height, int numMips, IblCacheImage &image) {
+    const GLenum format = channels == 3 ? GL_RGB : GL_RG;
+
+    image.faces = faces;
+    image.channels = channels;
+    image.width = width;
+    image.height = height;
+    image.mips.resize(numMips);
+
+    tex.bind();
+    for (int mip = 0; mip < numMips; mip++) {
+        image.mips[mip].resize(image.getMipSize(mip));
+        const size_t faceSize = image.getMipSize(mip) / faces;
+        for (int face = 0; face < faces; face++) {
+            const GLenum target = faces == 6 ? GL_TEXTURE_CUBE_MAP_POSITIVE_X + face : GL_TEXTURE_2D;
+            glGetTexImage(target, mip, format, GL_HALF_FLOAT, &image.mips[mip][face * faceSize]);
+        }
+    }
+    checkGlErrors();
+}
 
-    // pbr: setup framebuffer
-    // ----------------------
-    unsigned int captureFBO;
-    unsigned int captureRBO;
-    glGenFramebuffers(1, &captureFBO);
-    glGenRenderbuffers(1, &captureRBO);
+// Uploads all mip levels of one face of `image' into the bound texture
+static void uploadIblFace(const IblCacheImage &image, int face) {
+    const GLenum target = image.faces == 6 ? GL_TEXTURE_CUBE_MAP_POSITIVE_X + face : GL_TEXTURE_2D;
+    const GLenum internalFormat = image.channels == 3 ? GL_RGB16F : GL_RG16F;
+    const GLenum format = image.channels == 3 ? GL_RGB : GL_RG;
 
-    glBindFramebuffer(GL_FRAMEBUFFER, captureFBO);
-    glBindRenderbuffer(GL_RENDERBUFFER, captureRBO);
-    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, g_captureWidth, g_captureHeight);
-    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, captureRBO);
+    for (int mip = 0, numMips = image.mips.size(); mip < numMips; mip++) {
+        const int w = max(image.width >> mip, 1), h = max(image.height >> mip, 1);
+        const size_t faceSize = image.getMipSize(mip) / image.faces;
+        glTexImage2D(target, mip, internalFormat, w, h, 0, format, GL_HALF_FLOAT, &image.mips[mip][face * faceSize]);
+    }
+}
 
-    // pbr: load the HDR environment map
-    // ---------------------------------
-    string curEnvHdrPath = ENV_HDR_DIR;
-    curEnvHdrPath += "/";
-    curEnvHdrPath += ENV_HDRs[g_curEnvIdx];
+// Sets up wrapping and filtering of the bound texture the same way the GPU
+// precompute does
+static void setIblImageParams(const IblCacheImage &image) {
+    const GLenum texTarget = image.faces == 6 ? GL_TEXTURE_CUBE_MAP : GL_TEXTURE_2D;
+    const int numMips = image.mips.size();
+
+    glTexParameteri(texTarget, GL_TEXTURE_MAX_LEVEL, numMips - 1);
+    glTexParameteri(texTarget, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(texTarget, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    if (texTarget == GL_TEXTURE_CUBE_MAP)
+        glTexParameteri(texTarget, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+    glTexParameteri(texTarget, GL_TEXTURE_MIN_FILTER, numMips > 1 ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+    glTexParameteri(texTarget, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+}
 
-    stbi_set_flip_vertically_on_load(true);
-    int width, height, nrComponents;
-    float *data = stbi_loadf(curEnvHdrPath.c_str(), &width, &height, &nrComponents, 0);
+// Inverse of downloadIblImage
+static void uploadIblImage(const Texture &tex, const IblCacheImage &image) {
+    tex.bind();
+    for (int face = 0; face < image.faces; face++)
+        uploadIblFace(image, face);
+    setIblImageParams(image);
+    checkGlErrors();
+}
 
-    auto hdrTexture = make_shared<ImageTexture>();
-    if (data)
-    {
-        hdrTexture->bind();
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB16F, width, height, 0, GL_RGB, GL_FLOAT, data); // note how we specify the texture's data value to be float
+static void resetViewport() {
+    int width, height;
+    getFramebufferSize(width, height);
+    glViewport(0, 0, width, height);
+}
+
+// --------- Asynchronous environment switching
+//
+// Switching the environment never blocks the render loop. It is split in two
+// halves:
+// - prepareIBL runs on a worker thread: it hashes the HDR for the cache key,
+//   then either reads the cache entry or decodes the HDR and projects it onto
+//   the SH irradiance
+// - the GL work is queued as small steps, each uploading, rendering or
+//   reading back a single cubemap face, and updateIBL runs as many of them
+//   per frame as fit in IBL_STEP_BUDGET. A step waiting for the GPU returns
+//   false and is run again in a later frame.
+// Submitting GL commands takes the CPU far less time than the GPU takes to
+// run them, so the budget alone would let one frame queue every face. The
+// steps rendering or copying a face therefore wait for a fence on the
+// previous one, keeping at most one face of GPU work in flight.
+// The textures of the old environment stay in use until the last step swaps
+// the new ones in.
+
+// Result of the worker half
+struct IblPrepared {
+    string hdrPath;
+    bool useIrradianceSH;   // mode at the time of the request
+    uint64_t cacheKey;
+    string cachePath;       // empty if the results cannot be cached
+    bool cacheHit;
+    IblCacheEntry entry;    // valid on a cache hit
+    EquirectImage hdr;      // valid otherwise, empty if the HDR failed to load
+    Cvec3f irradianceSH[9];
+
+    IblPrepared() : useIrradianceSH(false), cacheKey(0), cacheHit(false) {}
+};
+
+// State shared by the GL steps of one switch
+struct IblBuild {
+    shared_ptr<IblPrepared> prepared;
+    shared_ptr<CubeMapTexture> envCubemap, irradianceMap, prefilterMap;
+    shared_ptr<ImageTexture> hdrTexture;
+    unsigned int captureFBO, captureRBO;
+    shared_ptr<IblCacheEntry> saveEntry;  // results read back for the cache, NULL if not cached
+    GLsync gpuFence;                      // after the last face rendered or copied
+
+    IblBuild() : captureFBO(0), captureRBO(0), gpuFence(0) {}
+    ~IblBuild() {
+        if (gpuFence)
+            glDeleteSync(gpuFence);
+    }
+};
+
+static const double IBL_STEP_BUDGET = 0.008;  // seconds of CPU time for GL steps per frame
+
+static future<shared_ptr<IblPrepared>> g_iblPrepare;  // worker half in flight
+static atomic<float> g_iblPrepareProgress(0.0f);      // its progress in [0, 1]
+static deque<function<bool()>> g_iblSteps;           // GL half in flight
+static int g_iblNumSteps = 0;
+static future<void> g_iblSave;                        // cache write in flight
+static shared_ptr<IblBuild> g_iblBuild;              // state of the steps in flight
+
+static bool isIBLLoading() {
+    return g_iblPrepare.valid() || !g_iblSteps.empty();
+}
 
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+// Progress of the switch in flight in [0, 1], the worker half counting for
+// the first half
+static float getIBLProgress() {
+    if (g_iblPrepare.valid())
+        return 0.5f * g_iblPrepareProgress;
+    return g_iblNumSteps ? 1.0f - 0.5f * g_iblSteps.size() / g_iblNumSteps : 1.0f;
+}
+
+static shared_ptr<IblPrepared> prepareIBL(const string &hdrPath, bool useIrradianceSH) {
+    auto prepared = make_shared<IblPrepared>();
+    prepared->hdrPath = hdrPath;
+    prepared->useIrradianceSH = useIrradianceSH;
 
-        stbi_image_free(data);
+    // look up the on-disk cache first, a hit turns the whole precompute
+    // into a single file read
+    try {
+        prepared->cacheKey = makeIblCacheKey(hdrPath);
+        prepared->cachePath = getIblCachePath(IBL_CACHE_DIR, prepared->cacheKey);
+    } catch (const runtime_error &e) {
+        cerr << "WARN: " << e.what() << ", IBL results will not be cached" << endl;
     }
-    else
-    {
-        std::cout << "Failed to load HDR image." << std::endl;
+    g_iblPrepareProgress = 0.3f;
+
+    // entries written in SH mode have no irradiance map
+    if (!prepared->cachePath.empty() &&
+        readIblCache(prepared->cachePath, prepared->cacheKey, prepared->entry) &&
+        (useIrradianceSH || !prepared->entry.irradianceMap.empty())) {
+        prepared->cacheHit = true;
+        const vector<float> &sh = prepared->entry.irradianceSH;
+        for (int i = 0; i < 9; i++)
+            prepared->irradianceSH[i] = Cvec3f(sh[3 * i], sh[3 * i + 1], sh[3 * i + 2]);
+    } else {
+        prepared->entry = IblCacheEntry();
+
+        // pbr: load the HDR environment map
+        // ---------------------------------
+        stbi_set_flip_vertically_on_load_thread(true);
+        int width, height, nrComponents;
+        float *data = stbi_loadf(hdrPath.c_str(), &width, &height, &nrComponents, 3);
+        g_iblPrepareProgress = 0.8f;
+
+        if (data) {
+            prepared->hdr.width = width;
+            prepared->hdr.height = height;
+            prepared->hdr.rgb.assign(data, data + size_t(width) * height * 3);
+            stbi_image_free(data);
+
+            projectIrradianceSH(prepared->hdr, prepared->irradianceSH);
+        } else {
+            cout << "Failed to load HDR image." << endl;
+        }
     }
 
-    // pbr: setup cubemap to render to and attach to framebuffer
-    // ---------------------------------------------------------
-    g_envCubemap = std::make_shared<CubeMapTexture>();
-    g_envCubemap->bind();
-    for (unsigned int i = 0; i < 6; ++i)
-    {
-        glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_RGB16F, g_captureWidth, g_captureHeight, 0, GL_RGB, GL_FLOAT, nullptr);
-    }
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    g_iblPrepareProgress = 1.0f;
+    if (g_window)
+        glfwPostEmptyEvent();  // wake up the render loop, there is none in --batch
+    return prepared;
+}
+
+// pbr: set up projection and view matrices for capturing data onto the 6 cubemap face directions
+// ----------------------------------------------------------------------------------------------
+static const Matrix4 &getCaptureProjection() {
+    static const Matrix4 captureProjection = Matrix4::makeProjection(90.0f, 1.0f, 0.1f, 10.0f);
+    return captureProjection;
+}
 
-    // pbr: set up projection and view matrices for capturing data onto the 6 cubemap face directions
-    // ----------------------------------------------------------------------------------------------
-    const Matrix4 captureProjection = Matrix4::makeProjection(90.0f, 1.0f, 0.1f, 10.0f);
-    const Matrix4 captureViews[] =
+static const Matrix4 &getCaptureView(int face) {
+    static const Matrix4 captureViews[] =
             {
                     Matrix4::lookAt(Cvec3(0.0f, 0.0f, 0.0f), Cvec3( 1.0f,  0.0f,  0.0f), Cvec3(0.0f, -1.0f,  0.0f)),
                     Matrix4::lookAt(Cvec3(0.0f, 0.0f, 0.0f), Cvec3(-1.0f,  0.0f,  0.0f), Cvec3(0.0f, -1.0f,  0.0f)),
@@ -918,106 +1363,408 @@ static void initIBL() {
                     Matrix4::lookAt(Cvec3(0.0f, 0.0f, 0.0f), Cvec3( 0.0f,  0.0f,  1.0f), Cvec3(0.0f, -1.0f,  0.0f)),
                     Matrix4::lookAt(Cvec3(0.0f, 0.0f, 0.0f), Cvec3( 0.0f,  0.0f, -1.0f), Cvec3(0.0f, -1.0f,  0.0f))
             };
+    return captureViews[face];
+}
 
-    // pbr: convert HDR equirectangular environment map to cubemap equivalent
-    // ----------------------------------------------------------------------
-    uniformsPtr = &g_equirect2cubemap->getUniforms();
-    uniformsPtr->put("uEquirectangularMap", hdrTexture);
-    sendProjectionMatrix(*uniformsPtr, captureProjection);
+// Renders `face' of mip level `mip' of `target' with `material' through the
+// capture framebuffer of `build'
+static void renderCaptureFace(IblBuild &build, Material &material, const CubeMapTexture &target,
+                              int face, int mip, int size) {
+    Uniforms &uniforms = material.getUniforms();
+    sendProjectionMatrix(uniforms, getCaptureProjection());
+    sendViewMatrix(uniforms, getCaptureView(face));
+
+    glViewport(0, 0, size, size); // don't forget to configure the viewport to the capture dimensions.
+    glBindFramebuffer(GL_FRAMEBUFFER, build.captureFBO);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, target.getGlTexture(), mip);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-    glViewport(0, 0, g_captureWidth, g_captureHeight); // don't forget to configure the viewport to the capture dimensions.
-    glBindFramebuffer(GL_FRAMEBUFFER, captureFBO);
-    for (int i = 0; i < 6; i++)
-    {
-        sendViewMatrix(*uniformsPtr, captureViews[i]);
-        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, g_envCubemap->getGlTexture(), 0);
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    material.draw(*g_cube, uniforms);
 
-        g_equirect2cubemap->draw(*g_cube, *uniformsPtr);
-    }
     glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    resetViewport();
+}
 
-     // pbr: create an irradiance cubemap, and re-scale capture FBO to irradiance scale.
-    // --------------------------------------------------------------------------------
-    g_irradianceMap = make_shared<CubeMapTexture>();
-    g_irradianceMap->bind();
+// Whether the GPU is done with the face the steps of `build' last rendered
+// or copied, without waiting
+static bool isIblGpuDone(IblBuild &build) {
+    if (!build.gpuFence)
+        return true;
+    const GLenum status = glClientWaitSync(build.gpuFence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+    if (status == GL_TIMEOUT_EXPIRED)
+        return false;
+    glDeleteSync(build.gpuFence);
+    build.gpuFence = 0;
+    if (status == GL_WAIT_FAILED)
+        throw runtime_error("isIblGpuDone: waiting for the fence failed");
+    return true;
+}
+
+// Fences the face the steps of `build' just rendered or copied
+static void fenceIblGpu(IblBuild &build) {
+    build.gpuFence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+// Resizes the depth buffer of the capture framebuffer
+static void resizeCaptureDepth(IblBuild &build, int size) {
+    glBindRenderbuffer(GL_RENDERBUFFER, build.captureRBO);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, size, size);
+}
+
+// Allocates a RGB16F cubemap of `size' texels per side, with mipmaps if
+// `mipmapped'
+static shared_ptr<CubeMapTexture> makeCaptureCubemap(int size, bool mipmapped) {
+    auto cubemap = make_shared<CubeMapTexture>();
+    cubemap->bind();
     for (unsigned int i = 0; i < 6; ++i)
     {
-        glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_RGB16F, g_irradianceCaptureWidth, g_irradianceCaptureHeight, 0, GL_RGB, GL_FLOAT, nullptr);
+        glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_RGB16F, size, size, 0, GL_RGB, GL_FLOAT, nullptr);
     }
     glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
     glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
     glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, mipmapped ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
     glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    // generate mipmaps for the cubemap so OpenGL automatically allocates the required memory.
+    if (mipmapped)
+        glGenerateMipmap(GL_TEXTURE_CUBE_MAP);
+    return cubemap;
+}
 
-    glBindFramebuffer(GL_FRAMEBUFFER, captureFBO);
-    glBindRenderbuffer(GL_RENDERBUFFER, captureRBO);
-    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, g_irradianceCaptureWidth, g_irradianceCaptureHeight);
+// Queues the uploads of a cache hit, one cubemap face per step
+static void queueCachedIBLSteps(const shared_ptr<IblBuild> &build) {
+    const IblCacheEntry &entry = build->prepared->entry;
+    const IblCacheImage *images[] = {&entry.envCubemap, &entry.irradianceMap, &entry.prefilterMap};
+    shared_ptr<CubeMapTexture> *textures[] = {&build->envCubemap, &build->irradianceMap, &build->prefilterMap};
+
+    for (int i = 0; i < 3; i++) {
+        const IblCacheImage *image = images[i];
+        shared_ptr<CubeMapTexture> *texture = textures[i];
+        if (image->empty())
+            continue;
+
+        g_iblSteps.push_back([build, texture] {
+            *texture = make_shared<CubeMapTexture>();
+            return true;
+        });
+        for (int face = 0; face < 6; face++) {
+            g_iblSteps.push_back([build, image, texture, face] {
+                (*texture)->bind();
+                uploadIblFace(*image, face);
+                if (face == 5)
+                    setIblImageParams(*image);
+                checkGlErrors();
+                return true;
+            });
+        }
+    }
+}
 
-    // pbr: solve diffuse integral by convolution to create an irradiance (cube)map.
-    // -----------------------------------------------------------------------------
-    uniformsPtr = &g_irradiance->getUniforms();
-    uniformsPtr->put("uEnvironmentMap", g_envCubemap);
-    sendProjectionMatrix(*uniformsPtr, captureProjection);
+// One cubemap face being read back through a pixel pack buffer
+struct IblReadback : Noncopyable {
+    GlBufferObject pbo;
+    GLsync fence;
 
-    glViewport(0, 0, g_irradianceCaptureWidth, g_irradianceCaptureHeight); // don't forget to configure the viewport to the capture dimensions.
-    glBindFramebuffer(GL_FRAMEBUFFER, captureFBO);
-    for (unsigned int i = 0; i < 6; ++i)
-    {
-        sendViewMatrix(*uniformsPtr, captureViews[i]);
-        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, g_irradianceMap->getGlTexture(), 0);
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    IblReadback() : fence(0) {}
+    ~IblReadback() {
+        if (fence)
+            glDeleteSync(fence);
+    }
+};
 
-        g_irradiance->draw(*g_cube, *uniformsPtr);
+// Queues the read back of all faces and mip levels of the RGB16F cubemap
+// `*texture' as half floats into `image', like downloadIblImage but without
+// stalling the render thread: one step per face starts copying it into a
+// pixel pack buffer, then one step per face maps the buffer once the copy
+// is done, in a later frame if need be
+static void queueReadbackIBLSteps(const shared_ptr<IblBuild> &build,
+                                  const shared_ptr<CubeMapTexture> *texture,
+                                  int width, int height, int numMips, IblCacheImage &image) {
+    image.faces = 6;
+    image.channels = 3;
+    image.width = width;
+    image.height = height;
+    image.mips.resize(numMips);
+
+    vector<shared_ptr<IblReadback>> readbacks;
+    for (int mip = 0; mip < numMips; mip++) {
+        // filled face by face by the map steps, reserving does not touch the
+        // memory yet
+        image.mips[mip].reserve(image.getMipSize(mip));
+        const GLsizeiptr faceBytes = image.getMipSize(mip) / 6 * sizeof(unsigned short);
+        for (int face = 0; face < 6; face++) {
+            auto readback = make_shared<IblReadback>();
+            readbacks.push_back(readback);
+            g_iblSteps.push_back([build, texture, readback, mip, face, faceBytes] {
+                if (!build->saveEntry)
+                    return true; // an earlier step failed, nothing is cached
+                if (!isIblGpuDone(*build))
+                    return false;
+                (*texture)->bind();
+                GlStateCache::getSingleton().bindBuffer(GL_PIXEL_PACK_BUFFER, readback->pbo);
+                glBufferData(GL_PIXEL_PACK_BUFFER, faceBytes, NULL, GL_STREAM_READ);
+                glGetTexImage(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, mip, GL_RGB, GL_HALF_FLOAT, 0);
+                GlStateCache::getSingleton().bindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+                readback->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+                fenceIblGpu(*build);
+                checkGlErrors();
+                return true;
+            });
+        }
     }
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
 
-    // pbr: create a pre-filter cubemap, and re-scale capture FBO to pre-filter scale.
-    // --------------------------------------------------------------------------------
-    g_prefilterMap = make_shared<CubeMapTexture>();
-    g_prefilterMap->bind();
-    for (unsigned int i = 0; i < 6; ++i)
-    {
-        glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_RGB16F, g_prefilterCaptureWidth, g_prefilterCaptureHeight, 0, GL_RGB, GL_FLOAT, nullptr);
+    IblCacheImage *dst = &image;
+    for (int mip = 0; mip < numMips; mip++) {
+        const size_t faceSize = image.getMipSize(mip) / 6;
+        for (int face = 0; face < 6; face++) {
+            const shared_ptr<IblReadback> readback = readbacks[mip * 6 + face];
+            g_iblSteps.push_back([build, dst, readback, mip, faceSize] {
+                if (!build->saveEntry || !readback->fence)
+                    return true; // `dst' is gone, or the copy failed
+                const GLenum status = glClientWaitSync(readback->fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+                if (status == GL_TIMEOUT_EXPIRED)
+                    return false;
+                if (status == GL_WAIT_FAILED)
+                    throw runtime_error("queueReadbackIBLSteps: waiting for the fence failed");
+
+                GlStateCache::getSingleton().bindBuffer(GL_PIXEL_PACK_BUFFER, readback->pbo);
+                const unsigned short *pixels = static_cast<const unsigned short *>(
+                    glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, faceSize * sizeof(unsigned short), GL_MAP_READ_BIT));
+                if (!pixels) {
+                    GlStateCache::getSingleton().bindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+                    throw runtime_error("queueReadbackIBLSteps: cannot map the pixel pack buffer");
+                }
+                dst->mips[mip].insert(dst->mips[mip].end(), pixels, pixels + faceSize);
+                glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+                GlStateCache::getSingleton().bindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+                return true;
+            });
+        }
+    }
+}
+
+// Queues the GPU precompute of the environment cubemap, irradiance map (not
+// in SH mode) and prefilter map, one cubemap face per step, followed by the
+// read back of the results for the cache
+static void queuePrecomputeIBLSteps(const shared_ptr<IblBuild> &build) {
+    // pbr: setup framebuffer, upload the HDR and the cubemap to render to
+    // -------------------------------------------------------------------
+    g_iblSteps.push_back([build] {
+        glGenFramebuffers(1, &build->captureFBO);
+        glGenRenderbuffers(1, &build->captureRBO);
+
+        glBindFramebuffer(GL_FRAMEBUFFER, build->captureFBO);
+        resizeCaptureDepth(*build, g_captureWidth);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, build->captureRBO);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+        const EquirectImage &hdr = build->prepared->hdr;
+        build->hdrTexture = make_shared<ImageTexture>();
+        if (!hdr.rgb.empty())
+        {
+            build->hdrTexture->bind();
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB16F, hdr.width, hdr.height, 0, GL_RGB, GL_FLOAT, &hdr.rgb[0]); // note how we specify the texture's data value to be float
+
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        }
+
+        build->envCubemap = makeCaptureCubemap(g_captureWidth, false);
+        g_equirect2cubemap->getUniforms().put("uEquirectangularMap", build->hdrTexture);
+        return true;
+    });
+
+    // pbr: convert HDR equirectangular environment map to cubemap equivalent
+    // ----------------------------------------------------------------------
+    for (int face = 0; face < 6; face++) {
+        g_iblSteps.push_back([build, face] {
+            if (!isIblGpuDone(*build))
+                return false;
+            renderCaptureFace(*build, *g_equirect2cubemap, *build->envCubemap, face, 0, g_captureWidth);
+            fenceIblGpu(*build);
+            return true;
+        });
+    }
+
+    // pbr: solve diffuse integral by convolution to create an irradiance (cube)map.
+    // -----------------------------------------------------------------------------
+    if (!build->prepared->useIrradianceSH) {
+        g_iblSteps.push_back([build] {
+            build->hdrTexture.reset();
+            build->irradianceMap = makeCaptureCubemap(g_irradianceCaptureWidth, false);
+            resizeCaptureDepth(*build, g_irradianceCaptureWidth);
+            g_irradiance->getUniforms().put("uEnvironmentMap", build->envCubemap);
+            return true;
+        });
+        for (int face = 0; face < 6; face++) {
+            g_iblSteps.push_back([build, face] {
+                if (!isIblGpuDone(*build))
+                    return false;
+                renderCaptureFace(*build, *g_irradiance, *build->irradianceMap, face, 0, g_irradianceCaptureWidth);
+                fenceIblGpu(*build);
+                return true;
+            });
+        }
     }
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR); // be sure to set minification filter to mip_linear
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    // generate mipmaps for the cubemap so OpenGL automatically allocates the required memory.
-    glGenerateMipmap(GL_TEXTURE_CUBE_MAP);
 
     // pbr: run a quasi monte-carlo simulation on the environment lighting to create a prefilter (cube)map.
     // ----------------------------------------------------------------------------------------------------
-    uniformsPtr = &g_prefilter->getUniforms();
-    uniformsPtr->put("uEnvironmentMap", g_envCubemap);
-    sendProjectionMatrix(*uniformsPtr, captureProjection);
-
-    glBindFramebuffer(GL_FRAMEBUFFER, captureFBO);
-    for (unsigned int mip = 0; mip < MAX_MIP_LEVELS; ++mip)
+    g_iblSteps.push_back([build] {
+        build->hdrTexture.reset();
+        build->prefilterMap = makeCaptureCubemap(g_prefilterCaptureWidth, true);
+        g_prefilter->getUniforms().put("uEnvironmentMap", build->envCubemap);
+        return true;
+    });
+    for (int mip = 0; mip < MAX_MIP_LEVELS; ++mip)
     {
-        // reisze framebuffer according to mip-level size.
-        unsigned int mipWidth  = 128 * std::pow(0.5, mip);
-        unsigned int mipHeight = 128 * std::pow(0.5, mip);
-        glBindRenderbuffer(GL_RENDERBUFFER, captureRBO);
-        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, mipWidth, mipHeight);
-        glViewport(0, 0, mipWidth, mipHeight);
-
-        float roughness = (float)mip / (float)(MAX_MIP_LEVELS - 1);
-        uniformsPtr->put("uRoughness", roughness);
-        for (unsigned int i = 0; i < 6; ++i)
+        for (int face = 0; face < 6; ++face)
         {
-            sendViewMatrix(*uniformsPtr, captureViews[i]);
-            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, g_prefilterMap->getGlTexture(), mip);
+            g_iblSteps.push_back([build, mip, face] {
+                if (!isIblGpuDone(*build))
+                    return false;
+                // reisze framebuffer according to mip-level size.
+                const int mipSize = g_prefilterCaptureWidth >> mip;
+                if (face == 0)
+                    resizeCaptureDepth(*build, mipSize);
+
+                const float roughness = (float)mip / (float)(MAX_MIP_LEVELS - 1);
+                g_prefilter->getUniforms().put("uRoughness", roughness);
+                renderCaptureFace(*build, *g_prefilter, *build->prefilterMap, face, mip, mipSize);
+                fenceIblGpu(*build);
+                return true;
+            });
+        }
+    }
+
+    g_iblSteps.push_back([build] {
+        glDeleteRenderbuffers(1, &build->captureRBO);
+        glDeleteFramebuffers(1, &build->captureFBO);
+        return true;
+    });
+
+    // read back the results and write them to the cache off the render thread
+    if (build->prepared->cachePath.empty())
+        return;
+
+    build->saveEntry = make_shared<IblCacheEntry>();
+    IblCacheEntry &entry = *build->saveEntry;
+    queueReadbackIBLSteps(build, &build->envCubemap, g_captureWidth, g_captureHeight, 1, entry.envCubemap);
+    if (!build->prepared->useIrradianceSH)
+        queueReadbackIBLSteps(build, &build->irradianceMap, g_irradianceCaptureWidth, g_irradianceCaptureHeight, 1, entry.irradianceMap);
+    queueReadbackIBLSteps(build, &build->prefilterMap, g_prefilterCaptureWidth, g_prefilterCaptureHeight, MAX_MIP_LEVELS, entry.prefilterMap);
+
+    g_iblSteps.push_back([build] {
+        if (!build->saveEntry)
+            return true;
+        IblCacheEntry &entry = *build->saveEntry;
+        for (int i = 0; i < 9; i++)
+            entry.irradianceSH.insert(entry.irradianceSH.end(), &build->prepared->irradianceSH[i][0], &build->prepared->irradianceSH[i][0] + 3);
+
+        const shared_ptr<IblCacheEntry> saveEntry = build->saveEntry;
+        const string cachePath = build->prepared->cachePath;
+        const uint64_t cacheKey = build->prepared->cacheKey;
+        if (g_iblSave.valid())
+            g_iblSave.wait();
+        g_iblSave = async(launch::async, [saveEntry, cachePath, cacheKey] {
+            try {
+                writeIblCache(cachePath, cacheKey, *saveEntry);
+            } catch (const runtime_error &e) {
+                cerr << "WARN: failed to write IBL cache: " << e.what() << endl;
+            }
+        });
+        return true;
+    });
+}
+
+// Last step of a switch: replaces the textures of the old environment
+static void swapInIBL(const IblBuild &build) {
+    g_envCubemap = build.envCubemap;
+    g_irradianceMap = build.irradianceMap;
+    g_prefilterMap = build.prefilterMap;
+    for (int i = 0; i < 9; i++)
+        g_irradianceSH[i] = build.prepared->irradianceSH[i];
+
+    // set skybox to the cube map converted from hdr
+    g_skyboxMat->getUniforms().put("uSkyBox", g_envCubemap);
+
+    // set irradiance map and SH in
+    if (g_irradianceMap)
+        g_pbrMat->getUniforms().put("uIrradianceMap", g_irradianceMap);
+    g_pbrShMat->getUniforms().put("uIrradianceSH", g_irradianceSH, 9);
+
+    // set prefilter map
+    g_pbrMat->getUniforms().put("uPrefilterMap", g_prefilterMap);
+    g_pbrShMat->getUniforms().put("uPrefilterMap", g_prefilterMap);
+
+    // the cubemap irradiance may have been selected while an SH only
+    // environment was loading
+    updateIrradianceMode();
+}
+
+// Starts switching to the environment selected in the UI
+static void startIBL() {
+    string curEnvHdrPath = ENV_HDR_DIR;
+    curEnvHdrPath += "/";
+    curEnvHdrPath += ENV_HDRs[g_curEnvIdx];
+
+    g_iblPrepareProgress = 0.0f;
+    g_iblPrepare = async(launch::async, prepareIBL, curEnvHdrPath, g_useIrradianceSH);
+}
 
-            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+// Advances the switch in flight, if any. Unless `block' is set, only runs the
+// GL steps that fit in IBL_STEP_BUDGET.
+static void updateIBL(bool block) {
+    if (g_iblPrepare.valid()) {
+        if (!block && g_iblPrepare.wait_for(chrono::seconds(0)) != future_status::ready)
+            return;
+
+        auto build = make_shared<IblBuild>();
+        build->prepared = g_iblPrepare.get();
+        if (build->prepared->cacheHit)
+            queueCachedIBLSteps(build);
+        else
+            queuePrecomputeIBLSteps(build);
+        g_iblSteps.push_back([build] {
+            swapInIBL(*build);
+            g_iblBuild.reset();
+            return true;
+        });
+        g_iblNumSteps = g_iblSteps.size();
+        g_iblBuild = build;
+    }
 
-            g_prefilter->draw(*g_cube, *uniformsPtr);
+    const double start = glfwGetTime();
+    while (!g_iblSteps.empty() && (block || glfwGetTime() - start < IBL_STEP_BUDGET)) {
+        const function<bool()> step = g_iblSteps.front();
+        bool done;
+        try {
+            done = step();
+        } catch (const runtime_error &e) {
+            // the switch goes on with the textures built so far, but its
+            // results may be wrong, so they are not cached
+            cerr << "WARN: environment switch step failed: " << e.what()
+                 << ", the results will not be cached" << endl;
+            g_iblBuild->saveEntry.reset();
+            GlStateCache::getSingleton().bindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+            glBindFramebuffer(GL_FRAMEBUFFER, 0);
+            resetViewport();
+            done = true;
         }
+        if (done)
+            g_iblSteps.pop_front();
+        else if (!block)
+            break; // waiting for the GPU, try again next frame
     }
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+// Renders the split-sum BRDF LUT with brdf.fshader
+static void renderBrdfLUT() {
+    unsigned int captureFBO;
+    unsigned int captureRBO;
+    glGenFramebuffers(1, &captureFBO);
+    glGenRenderbuffers(1, &captureRBO);
 
     // pbr: generate a 2D LUT from the BRDF equations used.
     // ----------------------------------------------------
@@ -1033,10 +1780,11 @@ static void initIBL() {
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 
-    // then re-configure capture framebuffer object and render screen-space quad with BRDF shader.
+    // then configure capture framebuffer object and render screen-space quad with BRDF shader.
     glBindFramebuffer(GL_FRAMEBUFFER, captureFBO);
     glBindRenderbuffer(GL_RENDERBUFFER, captureRBO);
     glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, g_brdfLUTWidth, g_brdfLUTHeight);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, captureRBO);
     glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, g_brdfLUT->getGlTexture(), 0);
 
     glViewport(0, 0, g_brdfLUTWidth, g_brdfLUTHeight);
@@ -1046,21 +1794,36 @@ static void initIBL() {
 
     glBindFramebuffer(GL_FRAMEBUFFER, 0);
 
-    // set skybox to the cube map converted from hdr
-    g_skyboxMat->getUniforms().put("uSkyBox", g_envCubemap);
+    glDeleteRenderbuffers(1, &captureRBO);
+    glDeleteFramebuffers(1, &captureFBO);
 
-    // set irradiance map in
-    g_pbrMat->getUniforms().put("uIrradianceMap", g_irradianceMap);
+    // convert viewport back to screen
+    resetViewport();
+}
 
-    // set prefilter map
-    g_pbrMat->getUniforms().put("uPrefilterMap", g_prefilterMap);
+// The BRDF LUT does not depend on the environment, so it is set up once per
+// process: loaded from the shipped asset, or rendered on the GPU (and saved
+// for the next run) if the asset is missing or outdated
+static void initBrdfLUT() {
+    IblCacheImage lut;
+    if (readBrdfLUT(BRDF_LUT_PATH, lut) && lut.mips.size() == 1 &&
+        lut.width == g_brdfLUTWidth && lut.height == g_brdfLUTHeight) {
+        g_brdfLUT = make_shared<ImageTexture>();
+        uploadIblImage(*g_brdfLUT, lut);
+    } else {
+        cerr << "WARN: " << BRDF_LUT_PATH << " missing or outdated, rendering the BRDF LUT" << endl;
+        renderBrdfLUT();
+
+        downloadIblImage(*g_brdfLUT, 1, 2, g_brdfLUTWidth, g_brdfLUTHeight, 1, lut);
+        try {
+            writeBrdfLUT(BRDF_LUT_PATH, lut);
+        } catch (const runtime_error &e) {
+            cerr << "WARN: failed to write BRDF LUT: " << e.what() << endl;
+        }
+    }
 
-    // set brdfLUT
     g_pbrMat->getUniforms().put("uBrdfLUT", g_brdfLUT);
-
-    // convert viewport back to screen
-    glfwGetFramebufferSize(g_window, &width, &height);
-    glViewport(0, 0, width, height);
+    g_pbrShMat->getUniforms().put("uBrdfLUT", g_brdfLUT);
 }
 
 void initImGui() {
@@ -1081,18 +1844,45 @@ void initUI() {
     }
 }
 
+// Waits for the environment switch in flight and releases what needs the GL
+// context before it goes
+static void releaseGLState() {
+    // the worker uses the thread pool, which may not outlive main
+    if (g_iblPrepare.valid())
+        g_iblPrepare.wait();
+    if (g_iblSave.valid())
+        g_iblSave.wait();
+    g_iblSteps.clear();
+    g_iblBuild.reset();
+    g_idPicker.reset();
+    g_frameCapture.reset(); // waits for the frames still being written
+}
+
+static void cleanup() {
+    releaseGLState();
+
+    ImGui_ImplOpenGL3_Shutdown();
+    ImGui_ImplGlfw_Shutdown();
+    ImGui::DestroyContext();
+
+    glfwDestroyWindow(g_window);
+    glfwTerminate();
+}
+
 void glfwLoop() {
     g_lastFrameClock = glfwGetTime();
     while (!glfwWindowShouldClose(g_window)) {
-        // if env hdr changes, reinitialize
-        if (g_curEnvIdx != g_prevEnvIdx) {
-            initIBL();
+        // if env hdr changes, switch to it once the previous switch is done
+        if (g_curEnvIdx != g_prevEnvIdx && !isIBLLoading()) {
+            startIBL();
             g_prevEnvIdx = g_curEnvIdx;
         }
+        // there is nothing to draw before the first environment is in
+        updateIBL(!g_envCubemap);
 
         if (g_playingAnimation) {
             double thisTime = glfwGetTime();
-            if (thisTime - g_lastFrameClock >= 1. / g_framesPerSecond) {
+            if (g_recordFramesLeft > 0 || thisTime - g_lastFrameClock >= 1. / g_framesPerSecond) {
                 animationUpdate();
                 display();
                 g_lastFrameClock = thisTime;
@@ -1102,22 +1892,120 @@ void glfwLoop() {
             if (g_isPicking) {
                 pick();
                 if (g_mouseLClickButton && !g_mouseRClickButton)g_isPicking = false;
-            } else display();
-            glfwWaitEvents();
+            }
+            display();
+
+            // keep drawing while a switch is in flight: every frame for its
+            // GL steps, and at a low rate for the progress bar while the
+            // worker runs (it wakes us up when done). Reads of the pick id
+            // buffer and captured frames are taken a frame or so later,
+            // and the frames of a recording are drawn back to back.
+            if (!g_iblSteps.empty() || g_recordFramesLeft > 0)
+                glfwPollEvents();
+            else if (g_idPicker->hasPendingReads() || g_rasterPickRequested ||
+                     g_frameCapture->hasFramesInFlight())
+                glfwWaitEventsTimeout(0.005);
+            else if (g_iblPrepare.valid())
+                glfwWaitEventsTimeout(0.1);
+            else
+                glfwWaitEvents();
         }
     }
     printf("end loop\n");
 
-    ImGui_ImplOpenGL3_Shutdown();
-    ImGui_ImplGlfw_Shutdown();
-    ImGui::DestroyContext();
+    cleanup();
+}
 
-    glfwDestroyWindow(g_window);
-    glfwTerminate();
+// Switches to environment `env' right away, waiting until it is loaded
+static void loadEnvironment(int env) {
+    g_curEnvIdx = env;
+    startIBL();
+    g_prevEnvIdx = g_curEnvIdx;
+    updateIBL(true);
+}
+
+// The scene as --batch and --bench-capture draw it, offscreen
+class AppBatchScene : public BatchScene {
+  public:
+    virtual void init() {
+        glewInit(); // load the OpenGL extensions
+        if (!GLEW_VERSION_3_0)
+            throw runtime_error("--batch: the context does not support OpenGL 3");
+
+        initGLState();
+        initMaterials();
+        initGeometry();
+        initBrdfLUT();
+        initScene();
+    }
+
+    virtual void cleanup() { releaseGLState(); }
+
+    virtual RigTForm getDefaultView() { return g_skyNode->getRbt(); }
+    virtual int getDefaultEnvironment() { return g_curEnvIdx; }
+    virtual void loadEnvironment(int env) { ::loadEnvironment(env); }
+
+    virtual void draw(const RigTForm &eye, int width, int height) {
+        g_windowWidth = width;
+        g_windowHeight = height;
+        updateFrustFovY();
+        g_skyNode->setRbt(eye);
+
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        drawStuff();
+    }
+};
+
+// Base names of ENV_HDRs, as the UI and --batch show them
+static vector<string> getEnvNames() {
+    vector<string> names;
+    for (auto str : ENV_HDRs) {
+        names.push_back(str.substr(0, str.find('.')));
+    }
+    return names;
 }
 
 int main(int argc, char *argv[]) {
     try {
+        // --bench-draw [N]: time N draws of each benchmark and exit
+        int benchDrawCount = 0;
+        if (argc >= 2 && strcmp(argv[1], "--bench-draw") == 0)
+            benchDrawCount = argc >= 3 ? atoi(argv[2]) : 10000;
+
+        // --bench-capture [N]: time capturing N frames at 1080p in each
+        // format and exit
+        int benchCaptureCount = 0;
+        if (argc >= 2 && strcmp(argv[1], "--bench-capture") == 0)
+            benchCaptureCount = argc >= 3 ? atoi(argv[2]) : 300;
+
+        // --batch OUT_DIR [options]: render views of the scene without a
+        // window and exit, see parseBatchOptions
+        if (argc >= 2 && strcmp(argv[1], "--batch") == 0) {
+            AppBatchScene scene;
+            return runBatch(parseBatchOptions(argc - 2, argv + 2, getEnvNames()), scene) ? 0 : -1;
+        }
+
+        // --test-alloc [N]: draw N frames without a window, after a few
+        // warm up ones, and fail if any of them allocates
+        if (argc >= 2 && strcmp(argv[1], "--test-alloc") == 0) {
+            AppBatchScene scene;
+            return testAllocations(scene, argc >= 3 ? atoi(argv[2]) : 10) ? 0 : 1;
+        }
+
+        // --bench-keyframes [N]: time evaluating key frames of N animated
+        // nodes and exit, needs no GL context
+        if (argc >= 2 && strcmp(argv[1], "--bench-keyframes") == 0) {
+            benchKeyFrames(argc >= 3 ? atoi(argv[2]) : 10000);
+            return 0;
+        }
+
+        // --bench-scene [N]: time world frame computations on an N node
+        // graph and exit, needs no GL context
+        if (argc >= 2 && strcmp(argv[1], "--bench-scene") == 0) {
+            benchScene(argc >= 3 ? atoi(argv[2]) : 100000);
+            return 0;
+        }
+
         initGlfwState();
 
         glewInit(); // load the OpenGL extensions
@@ -1130,10 +2018,34 @@ int main(int argc, char *argv[]) {
         initGLState();
         initMaterials();
         initGeometry();
+        initBrdfLUT();
         initScene();
         initImGui();
         initUI();
 
+        if (benchDrawCount > 0) {
+            // the same environment the first frame would load
+            loadEnvironment(g_curEnvIdx);
+            updatePerFrameBuffer();
+
+            BenchDrawScene scene;
+            scene.model = g_pbrShapeNode->geometry.get();
+            scene.modelMaterial = g_pbrShapeNode->material.get();
+            scene.modelMatrix = g_pbrShapeNode->getAffineMatrix();
+            scene.material = g_lightMat.get();
+            scene.cube = g_cube.get();
+            scene.sphere = g_sphere.get();
+            benchDraw(scene, benchDrawCount);
+            cleanup();
+            return 0;
+        }
+        if (benchCaptureCount > 0) {
+            AppBatchScene scene;
+            benchCapture(scene, benchCaptureCount);
+            cleanup();
+            return 0;
+        }
+
         glfwLoop();
         return 0;
     } catch (const runtime_error &e) {
@@ -0,0 +1,52 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mappedfile.h"
+
+using namespace std;
+
+MappedFile::MappedFile() : data_(NULL), size_(0), isOpen_(false) {}
+
+MappedFile::~MappedFile() { close(); }
+
+bool MappedFile::open(const string &filename) {
+    close();
+
+    const int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        ::close(fd);
+        return false;
+    }
+
+    if (st.st_size > 0) {
+        void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            ::close(fd);
+            return false;
+        }
+        data_ = data;
+        size_ = st.st_size;
+    }
+    ::close(fd); // the mapping keeps the file alive
+    isOpen_ = true;
+    return true;
+}
+
+void MappedFile::close() {
+    if (data_)
+        munmap(data_, size_);
+    data_ = NULL;
+    size_ = 0;
+    isOpen_ = false;
+}
+
+void MappedFile::willNeed() const {
+    if (data_)
+        posix_madvise(data_, size_, POSIX_MADV_WILLNEED);
+}
@@ -1,7 +1,9 @@
 #include <algorithm>
 #include <cassert>
 #include <sstream>
+#include <stdint.h>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "common.h"
@@ -25,36 +27,106 @@ struct GlProgramDesc {
         GLint location;
     };
 
+    struct UniformBlockDesc {
+        string name;
+        GLuint index;
+        GLint dataSize;
+        GLint binding; // -1 until bound with Material::setUniformBlockBinding
+    };
+
+    // Where the value of each active uniform comes from, for one pair of
+    // material and extra Uniforms layouts. Built by name on the first draw
+    // with the pair, after which draws only index arrays.
+    struct BindingPlan {
+        struct Binding {
+            int uniform; // index in uniforms
+            int source;  // 0 for the material's Uniforms, 1 for the extra ones
+            int entry;   // index of the value in the source's entries
+        };
+
+        int materialLayout, extraLayout;
+        vector<Binding> bindings;
+    };
+
+    // Shader attribute location for each vertex attribute of geometries
+    // with one layout of attribute names, see Geometry::draw
+    struct AttribWiring {
+        int geometryLayout;
+        vector<int> attribIndices;
+    };
+
     GlProgram program;
-    GlArrayObject vao;
 
-    vector<UniformDesc> uniforms;
+    vector<UniformDesc> uniforms; // excluding those in uniform blocks
     vector<AttribDesc> attribs;
+    vector<UniformBlockDesc> uniformBlocks;
+
+    // Usually few per program, and searched linearly. Past
+    // MAX_LINEAR_PLANS, e.g. for a program shared by many materials with
+    // different uniforms, they are found through planIndex instead, keyed
+    // by getPlanKey.
+    enum { MAX_LINEAR_PLANS = 8 };
+    vector<BindingPlan> plans;
+    unordered_map<uint64_t, int> planIndex;
+
+    vector<AttribWiring> attribWirings;
+
+    static uint64_t getPlanKey(int materialLayout, int extraLayout) {
+        return uint64_t(uint32_t(materialLayout)) << 32 | uint32_t(extraLayout);
+    }
 
     GlProgramDesc(GLuint vsHandle, GLuint fsHandle) {
         linkShader(program, vsHandle, fsHandle);
 
-        int numActiveUniforms, numActiveAttribs, uniformMaxLen, attribMaxLen;
+        int numActiveUniforms, numActiveAttribs, numActiveUniformBlocks,
+            uniformMaxLen, attribMaxLen, uniformBlockMaxLen;
 
         glGetProgramiv(program, GL_ACTIVE_UNIFORMS, &numActiveUniforms);
         glGetProgramiv(program, GL_ACTIVE_ATTRIBUTES, &numActiveAttribs);
+        glGetProgramiv(program, GL_ACTIVE_UNIFORM_BLOCKS,
+                       &numActiveUniformBlocks);
 
         glGetProgramiv(program, GL_ACTIVE_UNIFORM_MAX_LENGTH, &uniformMaxLen);
         glGetProgramiv(program, GL_ACTIVE_ATTRIBUTE_MAX_LENGTH, &attribMaxLen);
+        glGetProgramiv(program, GL_ACTIVE_UNIFORM_BLOCK_MAX_NAME_LENGTH,
+                       &uniformBlockMaxLen);
 
-        const int bufSize = max(uniformMaxLen, attribMaxLen) + 1;
+        const int bufSize =
+            max(max(uniformMaxLen, attribMaxLen), uniformBlockMaxLen) + 1;
         vector<GLchar> buffer(bufSize);
 
-        uniforms.resize(numActiveUniforms);
         for (int i = 0; i < numActiveUniforms; ++i) {
+            // members of uniform blocks are sourced from buffers, not from
+            // Uniforms
+            const GLuint index = i;
+            GLint blockIndex;
+            glGetActiveUniformsiv(program, 1, &index, GL_UNIFORM_BLOCK_INDEX,
+                                  &blockIndex);
+            if (blockIndex != -1)
+                continue;
+
+            UniformDesc ud;
+            GLsizei charsWritten;
+            glGetActiveUniform(program, i, bufSize, &charsWritten, &ud.size,
+                               &ud.type, &buffer[0]);
+            assert(charsWritten + 1 <= bufSize);
+            ud.name = string(buffer.begin(), buffer.begin() + charsWritten);
+            ud.location = glGetUniformLocation(program, &buffer[0]);
+            uniforms.push_back(ud);
+        }
+
+        uniformBlocks.resize(numActiveUniformBlocks);
+        for (int i = 0; i < numActiveUniformBlocks; ++i) {
             GLsizei charsWritten;
-            glGetActiveUniform(program, i, bufSize, &charsWritten,
-                               &(uniforms[i].size), &(uniforms[i].type),
-                               &buffer[0]);
+            glGetActiveUniformBlockName(program, i, bufSize, &charsWritten,
+                                        &buffer[0]);
             assert(charsWritten + 1 <= bufSize);
-            uniforms[i].name =
+            uniformBlocks[i].name =
                 string(buffer.begin(), buffer.begin() + charsWritten);
-            uniforms[i].location = glGetUniformLocation(program, &buffer[0]);
+            uniformBlocks[i].index = i;
+            glGetActiveUniformBlockiv(program, i, GL_UNIFORM_BLOCK_DATA_SIZE,
+                                      &uniformBlocks[i].dataSize);
+            uniformBlocks[i].binding = -1;
         }
 
         attribs.resize(numActiveAttribs);
@@ -82,9 +154,16 @@ class GlProgramLibrary {
     typedef map<pair<string, string>, shared_ptr<GlProgramDesc>>
         GlProgramDescMap;
 
+    struct UniformBlockBinding {
+        int bindingPoint;
+        int dataSize;
+    };
+    typedef map<string, UniformBlockBinding> UniformBlockBindingMap;
+
     FileMap fileMap;
     GlShaderMap shaderMap;
     GlProgramDescMap programMap;
+    UniformBlockBindingMap uniformBlockBindings;
 
     GlProgramLibrary() {}
 
@@ -103,6 +182,11 @@ class GlProgramLibrary {
             shared_ptr<GlProgramDesc> program(
                 new GlProgramDesc(*getShader(vsFilename, GL_VERTEX_SHADER),
                                   *getShader(fsFilename, GL_FRAGMENT_SHADER)));
+            for (UniformBlockBindingMap::iterator j =
+                     uniformBlockBindings.begin();
+                 j != uniformBlockBindings.end(); ++j) {
+                bindUniformBlock(*program, j->first, j->second);
+            }
             programMap[key] = program;
             return program;
         } else {
@@ -117,7 +201,38 @@ class GlProgramLibrary {
 
     void removeInlineSource(const string &filename) { fileMap.erase(filename); }
 
+    void setUniformBlockBinding(const string &blockName, int bindingPoint,
+                                int dataSize) {
+        UniformBlockBinding binding = {bindingPoint, dataSize};
+        uniformBlockBindings[blockName] = binding;
+        for (GlProgramDescMap::iterator i = programMap.begin();
+             i != programMap.end(); ++i) {
+            bindUniformBlock(*i->second, blockName, binding);
+        }
+    }
+
   protected:
+    static void bindUniformBlock(GlProgramDesc &programDesc,
+                                 const string &blockName,
+                                 const UniformBlockBinding &binding) {
+        for (size_t i = 0; i < programDesc.uniformBlocks.size(); ++i) {
+            GlProgramDesc::UniformBlockDesc &bd = programDesc.uniformBlocks[i];
+            if (bd.name != blockName)
+                continue;
+
+            if (bd.dataSize != binding.dataSize) {
+                stringstream s;
+                s << "Uniform block " << bd.name << ": declared with "
+                  << bd.dataSize << " bytes in the shader codes, but "
+                  << binding.dataSize << " bytes are supplied.";
+                throw runtime_error(s.str());
+            }
+            glUniformBlockBinding(programDesc.program, bd.index,
+                                  binding.bindingPoint);
+            bd.binding = binding.bindingPoint;
+        }
+    }
+
     shared_ptr<GlShader> getShader(const string &filename, GLenum shaderType) {
         string f = filename;
         if (g_Gl2Compatible) { // optionally change -gl3 to -gl3 in the end of
@@ -158,9 +273,57 @@ void Material::removeInlineSource(const std::string &filename) {
     GlProgramLibrary::getSingleton().removeInlineSource(filename);
 }
 
+void Material::setUniformBlockBinding(const std::string &blockName,
+                                      int bindingPoint, int dataSize) {
+    GlProgramLibrary::getSingleton().setUniformBlockBinding(
+        blockName, bindingPoint, dataSize);
+}
+
+int Material::nextId_ = 0;
+
 Material::Material(const string &vsFilename, const string &fsFilename)
     : programDesc_(GlProgramLibrary::getSingleton().getProgramDesc(
-          vsFilename, fsFilename)) {}
+          vsFilename, fsFilename)),
+      renderPass_(RENDER_PASS_OPAQUE), id_(nextId_++) {}
+
+Material::Material(const Material &m)
+    : programDesc_(m.programDesc_),
+      instancedProgramDesc_(m.instancedProgramDesc_), uniforms_(m.uniforms_),
+      renderStates_(m.renderStates_), renderPass_(m.renderPass_),
+      id_(nextId_++) {}
+
+Material &Material::operator=(const Material &m) {
+    programDesc_ = m.programDesc_;
+    instancedProgramDesc_ = m.instancedProgramDesc_;
+    uniforms_ = m.uniforms_;
+    renderStates_ = m.renderStates_;
+    renderPass_ = m.renderPass_;
+    return *this;
+}
+
+GLuint Material::getProgram() const { return programDesc_->program; }
+
+void Material::setInstancedShaders(const string &vsFilename,
+                                   const string &fsFilename) {
+    instancedProgramDesc_ = GlProgramLibrary::getSingleton().getProgramDesc(
+        vsFilename, fsFilename);
+}
+
+unsigned int Material::getTextureSetHash() const {
+    // FNV-1a over the names and GL textures of the sampler entries
+    unsigned int hash = 2166136261u;
+    for (int i = 0, n = uniforms_.entries_.size(); i < n; ++i) {
+        const Uniforms::Entry &e = uniforms_.entries_[i];
+        if (!Uniforms::isSamplerType(e.type))
+            continue;
+        const shared_ptr<Texture> *tex = uniforms_.getTextures(e);
+        hash = (hash ^ unsigned(e.id)) * 16777619u;
+        for (int j = 0; j < e.size; ++j) {
+            hash = (hash ^ tex[j]->getGlTexture()) * 16777619u;
+        }
+    }
+    return hash;
+}
 
 static const char *getGlConstantName(GLenum c) {
     struct ValueNamePair {
@@ -204,123 +367,104 @@ static const char *getGlConstantName(GLenum c) {
     return "Unkonwn";
 }
 
-void Material::draw(Geometry &geometry, const Uniforms &extraUniforms) {
-    static GLint maxTextureImageUnits = 0;
+bool Material::useBindingPlans_ = true;
 
-    // Initialize maxTextureImageUnits if this is called for the first time
-    if (maxTextureImageUnits == 0) {
-        glGetIntegerv(GL_MAX_COMBINED_TEXTURE_IMAGE_UNITS,
-                      &maxTextureImageUnits);
-        assert(maxTextureImageUnits >
-               0); // GL spec says this has to be at least 2
-    }
+void Material::setUseBindingPlans(bool enabled) { useBindingPlans_ = enabled; }
 
-    glUseProgram(programDesc_->program);
+void Material::findUniform(const GlProgramDesc &programDesc, int uniform,
+                           const Uniforms &extraUniforms, int &source,
+                           int &entry) const {
+    const GlProgramDesc::UniformDesc &ud = programDesc.uniforms[uniform];
+    const Uniforms *uniformsList[] = {&uniforms_, &extraUniforms};
 
-    renderStates_.apply(); // transit to current states
+    for (source = 0; source < 2; ++source) {
+        entry = uniformsList[source]->findEntry(ud.name);
 
-    // Step 1:
-    // set the uniforms and bind the textures
-    int textureUnit = 0;
-    for (int i = 0, n = programDesc_->uniforms.size(); i < n; ++i) {
-        const GlProgramDesc::UniformDesc &ud = programDesc_->uniforms[i];
-
-        const Uniforms *uniformsList[] = {&uniforms_, &extraUniforms};
-        int j = 0;
-        for (; j < 2; ++j) {
-            const Uniforms::Value *u = uniformsList[j]->get(ud.name);
-
-            // if the name looks like blah[0], and the uniform is not found, we
-            // also try stripping the '[0]'
-            if (u == NULL && ud.name.length() >= 3 &&
-                ud.name.compare(ud.name.length() - 3, 3, "[0]") == 0)
-                u = uniformsList[j]->get(
-                    ud.name.substr(0, ud.name.length() - 3));
-
-            if (u) {
-                if (u->type == ud.type && u->size >= ud.size) {
-                    switch (u->type) {
-                    case GL_SAMPLER_1D:
-                    case GL_SAMPLER_2D:
-                    case GL_SAMPLER_CUBE:
-                    case GL_SAMPLER_1D_SHADOW:
-                    case GL_SAMPLER_2D_SHADOW: {
-                        const shared_ptr<Texture> *tex = u->getTextures();
-
-                        // If this assert hits, the Uniform::Value is incorrectly implemented
-                        assert(tex != NULL);
-                        static const int MAX_TEX_UNITS = 1024;
-                        GLint texUnits[MAX_TEX_UNITS];
-                        int count = 0;
-                        for (; count < ud.size; ++count) {
-                            if (textureUnit == maxTextureImageUnits) {
-                                stringstream s;
-                                s << "System allows a maximum of "
-                                  << maxTextureImageUnits
-                                  << ". The current shader is trying to use "
-                                     "more than that.";
-                                throw runtime_error(s.str());
-                            }
-
-                            glActiveTexture(GL_TEXTURE0 + textureUnit);
-                            tex[count]->bind();
-                            texUnits[count] = textureUnit++;
-                        }
-                        u->apply(ud.location, ud.size, texUnits);
-                    } break;
-                    default:
-                        u->apply(ud.location, ud.size, NULL);
-                    }
-                } else {
-                    stringstream s;
-                    s << "Uniform variable " << ud.name
-                      << ": supplied value and declared variable do not match "
-                         "in type and/or size."
-                      << "\nSupplied value: type = "
-                      << getGlConstantName(u->type) << ", size = " << u->size
-                      << "\nDeclared in shader: type = "
-                      << getGlConstantName(ud.type) << ", size = " << ud.size;
-                    throw runtime_error(s.str());
-                }
-                break;
-            }
-        }
-        if (j == 2) {
-            stringstream s;
-            s << "Uniform variable " << ud.name
-              << ": used in the shader codes, but not supplied. Type = "
-              << getGlConstantName(ud.type) << ", Size = " << ud.size;
-            throw runtime_error(s.str());
-        }
+        // if the name looks like blah[0], and the uniform is not found, we
+        // also try stripping the '[0]'
+        if (entry < 0 && ud.name.length() >= 3 &&
+            ud.name.compare(ud.name.length() - 3, 3, "[0]") == 0)
+            entry = uniformsList[source]->findEntry(
+                ud.name.substr(0, ud.name.length() - 3));
+
+        if (entry >= 0)
+            return;
     }
 
-    // Step 2:
-    // see what attribs are provided by the geometry
-    const vector<string> &geoAttribNames = geometry.getVertexAttribNames();
+    stringstream s;
+    s << "Uniform variable " << ud.name
+      << ": used in the shader codes, but not supplied. Type = "
+      << getGlConstantName(ud.type) << ", Size = " << ud.size;
+    throw runtime_error(s.str());
+}
 
-    const static int MAX_ATTRIB = 64;
-    int attribIndices[MAX_ATTRIB];
-    const size_t numAttribs = geoAttribNames.size();
+int Material::getBindingPlan(GlProgramDesc &programDesc,
+                             const Uniforms &extraUniforms) {
+    const int materialLayout = uniforms_.getLayout();
+    const int extraLayout = extraUniforms.getLayout();
+
+    vector<GlProgramDesc::BindingPlan> &plans = programDesc.plans;
+    unordered_map<uint64_t, int> &planIndex = programDesc.planIndex;
+    const uint64_t key = GlProgramDesc::getPlanKey(materialLayout, extraLayout);
+    if (plans.size() > GlProgramDesc::MAX_LINEAR_PLANS) {
+        const unordered_map<uint64_t, int>::const_iterator i = planIndex.find(key);
+        if (i != planIndex.end())
+            return i->second;
+    } else {
+        for (int i = 0, n = plans.size(); i < n; ++i) {
+            if (plans[i].materialLayout == materialLayout &&
+                plans[i].extraLayout == extraLayout)
+                return i;
+        }
+    }
 
-    if (numAttribs > MAX_ATTRIB) {
-        throw runtime_error(
-            string("Number of attributes contained in geometry is greater than "
-                   "maximally supported number of attributes. Consider "
-                   "increasing MAX_ATTRIB."));
+    // first draw with these layouts, resolve every uniform by name
+    GlProgramDesc::BindingPlan plan;
+    plan.materialLayout = materialLayout;
+    plan.extraLayout = extraLayout;
+    plan.bindings.resize(programDesc.uniforms.size());
+    for (int i = 0, n = plan.bindings.size(); i < n; ++i) {
+        plan.bindings[i].uniform = i;
+        findUniform(programDesc, i, extraUniforms, plan.bindings[i].source,
+                    plan.bindings[i].entry);
+    }
+    plans.push_back(plan);
+    const int n = plans.size();
+    if (n == GlProgramDesc::MAX_LINEAR_PLANS + 1) {
+        for (int i = 0; i < n; ++i) {
+            planIndex[GlProgramDesc::getPlanKey(plans[i].materialLayout, plans[i].extraLayout)] = i;
+        }
+    } else if (n > GlProgramDesc::MAX_LINEAR_PLANS + 1) {
+        planIndex[key] = n - 1;
     }
+    return n - 1;
+}
+
+int Material::getAttribWiring(GlProgramDesc &programDesc,
+                              Geometry &geometry) {
+    const int geometryLayout = geometry.getVertexAttribLayout();
 
-    for (size_t i = 0; i < numAttribs; ++i) {
-        attribIndices[i] = -1;
+    vector<GlProgramDesc::AttribWiring> &wirings = programDesc.attribWirings;
+    for (int i = 0, n = wirings.size(); i < n; ++i) {
+        if (wirings[i].geometryLayout == geometryLayout)
+            return i;
     }
 
-    // simple and stupid O(n^2) wiring, should use a hashtable to reduce to O(n)
-    for (int i = 0, n = programDesc_->attribs.size(); i < n; ++i) {
-        const GlProgramDesc::AttribDesc &ad = programDesc_->attribs[i];
+    // first draw with this layout, match the attribs by name
+    const vector<string> &geoAttribNames = geometry.getVertexAttribNames();
+    const size_t numAttribs = geoAttribNames.size();
+
+    GlProgramDesc::AttribWiring wiring;
+    wiring.geometryLayout = geometryLayout;
+    wiring.attribIndices.assign(numAttribs, -1);
+
+    for (int i = 0, n = programDesc.attribs.size(); i < n; ++i) {
+        const GlProgramDesc::AttribDesc &ad = programDesc.attribs[i];
 
         size_t j = 0;
         for (; j < numAttribs; ++j) {
             if (geoAttribNames[j] == ad.name) {
-                attribIndices[j] = ad.location;
+                wiring.attribIndices[j] = ad.location;
                 break;
             }
         }
@@ -330,23 +474,159 @@ void Material::draw(Geometry &geometry, const Uniforms &extraUniforms) {
                 ": used in the shader codes, but not supplied.");
         }
     }
+    wirings.push_back(wiring);
+    return wirings.size() - 1;
+}
 
-    // enable the VAO associated with GL program desc
-    glBindVertexArray(programDesc_->vao);
+void Material::applyUniform(const GlProgramDesc &programDesc, int uniform,
+                            const Uniforms &uniforms, int entry,
+                            int &textureUnit, int maxTextureImageUnits) {
+    const GlProgramDesc::UniformDesc &ud = programDesc.uniforms[uniform];
+    const Uniforms::Entry &u = uniforms.getEntry(entry);
+
+    if (u.type != ud.type || u.size < ud.size) {
+        stringstream s;
+        s << "Uniform variable " << ud.name
+          << ": supplied value and declared variable do not match "
+             "in type and/or size."
+          << "\nSupplied value: type = " << getGlConstantName(u.type)
+          << ", size = " << u.size
+          << "\nDeclared in shader: type = " << getGlConstantName(ud.type)
+          << ", size = " << ud.size;
+        throw runtime_error(s.str());
+    }
 
-    for (size_t i = 0; i < numAttribs; ++i) {
-        if (attribIndices[i] >= 0)
-            glEnableVertexAttribArray(attribIndices[i]);
+    const GLuint *words =
+        Uniforms::isSamplerType(u.type) ? NULL : uniforms.getWords(u);
+    const GLint *iv = reinterpret_cast<const GLint *>(words);
+    const GLfloat *fv = reinterpret_cast<const GLfloat *>(words);
+
+    switch (u.type) {
+    case GL_SAMPLER_1D:
+    case GL_SAMPLER_2D:
+    case GL_SAMPLER_CUBE:
+    case GL_SAMPLER_1D_SHADOW:
+    case GL_SAMPLER_2D_SHADOW: {
+        const shared_ptr<Texture> *tex = uniforms.getTextures(u);
+        static const int MAX_TEX_UNITS = 1024;
+        GLint texUnits[MAX_TEX_UNITS];
+        int count = 0;
+        for (; count < ud.size; ++count) {
+            if (textureUnit == maxTextureImageUnits) {
+                stringstream s;
+                s << "System allows a maximum of " << maxTextureImageUnits
+                  << ". The current shader is trying to use "
+                     "more than that.";
+                throw runtime_error(s.str());
+            }
+
+            GlStateCache::getSingleton().bindTexture(
+                textureUnit, tex[count]->getTarget(),
+                tex[count]->getGlTexture());
+            texUnits[count] = textureUnit++;
+        }
+        glUniform1iv(ud.location, ud.size, texUnits);
+    } break;
+    case GL_INT:
+        glUniform1iv(ud.location, ud.size, iv);
+        break;
+    case GL_INT_VEC2:
+        glUniform2iv(ud.location, ud.size, iv);
+        break;
+    case GL_INT_VEC3:
+        glUniform3iv(ud.location, ud.size, iv);
+        break;
+    case GL_INT_VEC4:
+        glUniform4iv(ud.location, ud.size, iv);
+        break;
+    case GL_FLOAT:
+        glUniform1fv(ud.location, ud.size, fv);
+        break;
+    case GL_FLOAT_VEC2:
+        glUniform2fv(ud.location, ud.size, fv);
+        break;
+    case GL_FLOAT_VEC3:
+        glUniform3fv(ud.location, ud.size, fv);
+        break;
+    case GL_FLOAT_VEC4:
+        glUniform4fv(ud.location, ud.size, fv);
+        break;
+    case GL_FLOAT_MAT4:
+        glUniformMatrix4fv(ud.location, ud.size, GL_FALSE, fv);
+        break;
+    default:
+        // If this assert hits, Uniforms::put stores a type not handled here
+        assert(false);
     }
+}
 
-    // Now let the geometry draw its self
-    geometry.draw(attribIndices);
+void Material::draw(Geometry &geometry, const Uniforms &extraUniforms) {
+    draw(*programDesc_, geometry, extraUniforms, 0);
+}
 
-    for (size_t i = 0; i < numAttribs; ++i) {
-        if (attribIndices[i] >= 0)
-            glDisableVertexAttribArray(attribIndices[i]);
+void Material::drawInstanced(Geometry &geometry, const Uniforms &extraUniforms,
+                             int instanceCount) {
+    if (!instancedProgramDesc_)
+        throw runtime_error("Material::drawInstanced: no instanced shaders set");
+    draw(*instancedProgramDesc_, geometry, extraUniforms, instanceCount);
+}
+
+void Material::draw(GlProgramDesc &programDesc, Geometry &geometry,
+                    const Uniforms &extraUniforms, int instanceCount) {
+    static GLint maxTextureImageUnits = 0;
+
+    // Initialize maxTextureImageUnits if this is called for the first time
+    if (maxTextureImageUnits == 0) {
+        glGetIntegerv(GL_MAX_COMBINED_TEXTURE_IMAGE_UNITS,
+                      &maxTextureImageUnits);
+        assert(maxTextureImageUnits >
+               0); // GL spec says this has to be at least 2
     }
 
-    // set back to default vao
-    glBindVertexArray(0);
+    GlStateCache &glState = GlStateCache::getSingleton();
+    glState.useProgram(programDesc.program);
+
+    renderStates_.apply(); // transit to current states
+
+    // Step 1:
+    // set the uniforms and bind the textures. Uniform blocks read from
+    // buffers bound elsewhere, but must have been given a binding point.
+    for (int i = 0, n = programDesc.uniformBlocks.size(); i < n; ++i) {
+        if (programDesc.uniformBlocks[i].binding < 0) {
+            throw runtime_error(
+                string("Uniform block ") + programDesc.uniformBlocks[i].name +
+                ": used in the shader codes, but not bound to a binding point.");
+        }
+    }
+
+    const Uniforms *uniformsList[] = {&uniforms_, &extraUniforms};
+    int textureUnit = 0;
+
+    if (useBindingPlans_) {
+        const GlProgramDesc::BindingPlan &plan =
+            programDesc.plans[getBindingPlan(programDesc, extraUniforms)];
+
+        for (int i = 0, n = plan.bindings.size(); i < n; ++i) {
+            const GlProgramDesc::BindingPlan::Binding &b = plan.bindings[i];
+            applyUniform(programDesc, b.uniform, *uniformsList[b.source],
+                         b.entry, textureUnit, maxTextureImageUnits);
+        }
+    } else {
+        for (int i = 0, n = programDesc.uniforms.size(); i < n; ++i) {
+            int source, entry;
+            findUniform(programDesc, i, extraUniforms, source, entry);
+            applyUniform(programDesc, i, *uniformsList[source], entry,
+                         textureUnit, maxTextureImageUnits);
+        }
+    }
+
+    // Step 2:
+    // wire the attribs to those provided by the geometry, and let the
+    // geometry draw its self
+    const GlProgramDesc::AttribWiring &wiring =
+        programDesc.attribWirings[getAttribWiring(programDesc, geometry)];
+    if (instanceCount > 0)
+        geometry.drawInstanced(wiring.attribIndices.data(), instanceCount);
+    else
+        geometry.draw(wiring.attribIndices.data());
 }
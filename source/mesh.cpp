@@ -0,0 +1,175 @@
+#include <algorithm>
+#include <cmath>
+#include <unordered_map>
+#include <vector>
+
+#include "mesh.h"
+
+using namespace std;
+
+namespace {
+// Hash and equality of the (position, normal, texcoord) index triples of
+// .obj face corners. Corners with the same triple refer to the same vertex.
+struct ObjIndexHash {
+    size_t operator()(const ObjIndex &i) const {
+        size_t h = size_t(i.vertex) * 73856093u;
+        h ^= size_t(i.normal) * 19349663u;
+        h ^= size_t(i.texcoord) * 83492791u;
+        return h;
+    }
+};
+
+struct ObjIndexEqual {
+    bool operator()(const ObjIndex &a, const ObjIndex &b) const {
+        return a.vertex == b.vertex && a.normal == b.normal && a.texcoord == b.texcoord;
+    }
+};
+} // namespace
+
+void loadObjMesh(const char *filePath, MeshData &mesh) {
+    ObjData obj;
+    parseObj(filePath, obj);
+    makeMeshData(obj, mesh);
+}
+
+void makeMeshData(const ObjData &obj, MeshData &mesh) {
+    mesh.vertices.clear();
+    mesh.indices.clear();
+    mesh.indices.reserve(obj.indices.size());
+
+    typedef unordered_map<ObjIndex, unsigned int, ObjIndexHash, ObjIndexEqual> CornerMap;
+    CornerMap corners(obj.indices.size() / 2);
+
+    for (size_t i = 0; i < obj.indices.size(); ++i) {
+        const ObjIndex &index = obj.indices[i];
+
+        pair<CornerMap::iterator, bool> ins =
+            corners.insert(make_pair(index, (unsigned int)mesh.vertices.size()));
+        if (ins.second) {
+            VertexPNX vertex;
+            vertex.p = Cvec3f(obj.vertices[3 * index.vertex + 0],
+                              obj.vertices[3 * index.vertex + 1],
+                              obj.vertices[3 * index.vertex + 2]);
+
+            // missing normals and texture coordinates stay zero
+            if (index.normal >= 0)
+                vertex.n = Cvec3f(obj.normals[3 * index.normal + 0],
+                                  obj.normals[3 * index.normal + 1],
+                                  obj.normals[3 * index.normal + 2]);
+            if (index.texcoord >= 0)
+                vertex.x = Cvec2f(obj.texcoords[2 * index.texcoord + 0],
+                                  obj.texcoords[2 * index.texcoord + 1]);
+
+            mesh.vertices.push_back(vertex);
+        }
+        mesh.indices.push_back(ins.first->second);
+    }
+}
+
+// Projects `v' into the plane orthogonal to the unit vector `n' and
+// normalizes it, returns false if nothing is left
+static bool orthonormalize(const Cvec3f &n, Cvec3f &v) {
+    v -= n * dot(n, v);
+    const float length2 = dot(v, v);
+    if (!(length2 > 1e-20f))
+        return false;
+    v /= sqrt(length2);
+    return true;
+}
+
+// Angle between the unit vectors `a' and `b'
+static float getAngle(const Cvec3f &a, const Cvec3f &b) {
+    return acos(max(-1.0f, min(1.0f, dot(a, b))));
+}
+
+void generateTangents(MeshData &mesh) {
+    const size_t numCorners = mesh.indices.size();
+    const size_t numTriangles = numCorners / 3;
+
+    // tangent along +u of every corner, and the handedness of the mapping
+    vector<Cvec3f> cornerTangents(numCorners);
+    vector<float> cornerWeights(numCorners, 0.0f);
+    vector<char> cornerMirrored(numCorners, 0);
+
+    for (size_t t = 0; t < numTriangles; ++t) {
+        const VertexPNX *v[3];
+        for (int k = 0; k < 3; ++k) {
+            v[k] = &mesh.vertices[mesh.indices[3 * t + k]];
+        }
+
+        const Cvec3f e1 = v[1]->p - v[0]->p, e2 = v[2]->p - v[0]->p;
+        const Cvec2f d1 = v[1]->x - v[0]->x, d2 = v[2]->x - v[0]->x;
+        const float det = d1[0] * d2[1] - d2[0] * d1[1];
+        if (det == 0.0f)
+            continue; // degenerate mapping, no information
+
+        // dP/du and dP/dv of the triangle
+        const Cvec3f dPdu = (e1 * d2[1] - e2 * d1[1]) / det;
+        const Cvec3f dPdv = (e2 * d1[0] - e1 * d2[0]) / det;
+
+        for (int k = 0; k < 3; ++k) {
+            const float normalLength2 = dot(v[k]->n, v[k]->n);
+            if (!(normalLength2 > 0.0f))
+                continue;
+            const Cvec3f n = v[k]->n / sqrt(normalLength2);
+            Cvec3f tangent = dPdu;
+            if (!orthonormalize(n, tangent))
+                continue;
+
+            Cvec3f toNext = v[(k + 1) % 3]->p - v[k]->p, toPrev = v[(k + 2) % 3]->p - v[k]->p;
+            const float lengthNext = dot(toNext, toNext), lengthPrev = dot(toPrev, toPrev);
+            if (!(lengthNext > 0.0f) || !(lengthPrev > 0.0f))
+                continue;
+
+            const size_t c = 3 * t + k;
+            cornerTangents[c] = tangent;
+            cornerWeights[c] = getAngle(toNext / sqrt(lengthNext), toPrev / sqrt(lengthPrev));
+            cornerMirrored[c] = dot(cross(n, tangent), dPdv) < 0.0f;
+        }
+    }
+
+    // a vertex used with both handedness gets a copy for its mirrored corners
+    const size_t numVertices = mesh.vertices.size();
+    vector<char> hasMirrored(numVertices, 0), hasRegular(numVertices, 0);
+    for (size_t c = 0; c < numCorners; ++c) {
+        if (cornerWeights[c] > 0.0f)
+            (cornerMirrored[c] ? hasMirrored : hasRegular)[mesh.indices[c]] = 1;
+    }
+
+    vector<unsigned int> mirroredCopy(numVertices);
+    vector<char> isMirrored(numVertices, 0);
+    for (size_t i = 0; i < numVertices; ++i) {
+        mirroredCopy[i] = i;
+        if (hasMirrored[i] && hasRegular[i]) {
+            mirroredCopy[i] = mesh.vertices.size();
+            mesh.vertices.push_back(mesh.vertices[i]);
+            isMirrored.push_back(1);
+        } else if (hasMirrored[i]) {
+            isMirrored[i] = 1;
+        }
+    }
+
+    vector<Cvec3f> sums(mesh.vertices.size());
+    for (size_t c = 0; c < numCorners; ++c) {
+        if (cornerMirrored[c])
+            mesh.indices[c] = mirroredCopy[mesh.indices[c]];
+        sums[mesh.indices[c]] += cornerTangents[c] * cornerWeights[c];
+    }
+
+    mesh.tangents.resize(mesh.vertices.size());
+    mesh.binormals.resize(mesh.vertices.size());
+    for (size_t i = 0; i < mesh.vertices.size(); ++i) {
+        const Cvec3f &normal = mesh.vertices[i].n;
+        const float length2 = dot(normal, normal);
+        const Cvec3f n = length2 > 0.0f ? normal / sqrt(length2) : Cvec3f(0, 0, 1);
+
+        Cvec3f tangent = sums[i];
+        if (!orthonormalize(n, tangent)) {
+            // no usable mapping, any frame around the normal will do
+            tangent = abs(n[0]) < 0.9f ? Cvec3f(1, 0, 0) : Cvec3f(0, 1, 0);
+            orthonormalize(n, tangent);
+        }
+        mesh.tangents[i] = tangent;
+        mesh.binormals[i] = cross(n, tangent) * (isMirrored[i] ? 1.0f : -1.0f);
+    }
+}
@@ -0,0 +1,292 @@
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+#include "meshbvh.h"
+
+using namespace std;
+
+namespace {
+const int NUM_BINS = 16;
+
+// deepest node, which bounds the traversal stack
+const int MAX_DEPTH = 64;
+
+// leaves hold at most this many triangles unless they cannot be split
+const int MAX_LEAF_SIZE = 8;
+
+// cost of visiting a node relative to intersecting a triangle
+const float TRAVERSAL_COST = 1;
+
+struct Box {
+    float mn[3], mx[3];
+
+    Box() {
+        for (int k = 0; k < 3; ++k) {
+            mn[k] = numeric_limits<float>::max();
+            mx[k] = -numeric_limits<float>::max();
+        }
+    }
+
+    void grow(const Cvec3f &p) {
+        for (int k = 0; k < 3; ++k) {
+            mn[k] = min(mn[k], p[k]);
+            mx[k] = max(mx[k], p[k]);
+        }
+    }
+
+    void grow(const Box &b) {
+        for (int k = 0; k < 3; ++k) {
+            mn[k] = min(mn[k], b.mn[k]);
+            mx[k] = max(mx[k], b.mx[k]);
+        }
+    }
+
+    // half the surface area, 0 if empty
+    float getArea() const {
+        if (mn[0] > mx[0])
+            return 0;
+        const float x = mx[0] - mn[0], y = mx[1] - mn[1], z = mx[2] - mn[2];
+        return x * y + y * z + z * x;
+    }
+};
+} // namespace
+
+struct MeshBvh::Builder {
+    vector<Node> &nodes;
+    vector<Box> boxes;         // of each triangle
+    vector<Cvec3f> centroids;  // of each triangle box
+    vector<int> order;         // triangle ids, grouped by leaf once built
+
+    explicit Builder(vector<Node> &_nodes) : nodes(_nodes) {}
+
+    static int getBin(float c, float mn, float scale) {
+        return min(NUM_BINS - 1, int((c - mn) * scale));
+    }
+
+    // Fills in nodes[node] for order[first, first + count) and builds its
+    // children
+    void build(int node, int first, int count, int depth) {
+        Box box, centroidBox;
+        for (int i = first; i < first + count; ++i) {
+            box.grow(boxes[order[i]]);
+            centroidBox.grow(centroids[order[i]]);
+        }
+        for (int k = 0; k < 3; ++k) {
+            nodes[node].boxMin[k] = box.mn[k];
+            nodes[node].boxMax[k] = box.mx[k];
+        }
+        nodes[node].first = first;
+        nodes[node].count = count;
+        if (count <= 2 || depth >= MAX_DEPTH - 1)
+            return;
+
+        // the cheapest split: triangles whose centroid falls in a bin below
+        // `bestSplit' along `bestAxis' go left
+        float bestCost = numeric_limits<float>::max();
+        int bestAxis = -1, bestSplit = 0;
+        for (int axis = 0; axis < 3; ++axis) {
+            const float extent = centroidBox.mx[axis] - centroidBox.mn[axis];
+            if (extent <= 0)
+                continue;
+            const float scale = NUM_BINS / extent;
+
+            Box binBoxes[NUM_BINS];
+            int binCounts[NUM_BINS] = {0};
+            for (int i = first; i < first + count; ++i) {
+                const int b = getBin(centroids[order[i]][axis], centroidBox.mn[axis], scale);
+                binBoxes[b].grow(boxes[order[i]]);
+                ++binCounts[b];
+            }
+
+            // area times count of the bins left of each split, then right
+            float leftCosts[NUM_BINS];
+            Box left, right;
+            int leftCount = 0, rightCount = 0;
+            for (int split = 1; split < NUM_BINS; ++split) {
+                left.grow(binBoxes[split - 1]);
+                leftCount += binCounts[split - 1];
+                leftCosts[split] = leftCount ? left.getArea() * leftCount : -1;
+            }
+            for (int split = NUM_BINS - 1; split > 0; --split) {
+                right.grow(binBoxes[split]);
+                rightCount += binCounts[split];
+                if (leftCosts[split] < 0 || rightCount == 0)
+                    continue;
+                const float cost = leftCosts[split] + right.getArea() * rightCount;
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestSplit = split;
+                }
+            }
+        }
+
+        if (bestAxis < 0)
+            return; // all centroids coincide
+        const float area = box.getArea();
+        if (count <= MAX_LEAF_SIZE && TRAVERSAL_COST * area + bestCost >= count * area)
+            return;
+
+        const float mn = centroidBox.mn[bestAxis];
+        const float scale = NUM_BINS / (centroidBox.mx[bestAxis] - mn);
+        const int *mid = partition(&order[first], &order[first] + count, [&](int t) {
+            return getBin(centroids[t][bestAxis], mn, scale) < bestSplit;
+        });
+        const int leftCount = mid - &order[first];
+
+        const int children = nodes.size();
+        nodes.resize(children + 2);
+        nodes[node].first = children;
+        nodes[node].count = 0;
+        build(children, first, leftCount, depth + 1);
+        build(children + 1, first + leftCount, count - leftCount, depth + 1);
+    }
+};
+
+MeshBvh::MeshBvh(const vector<Cvec3f> &positions, const vector<unsigned int> &indices) {
+    const bool indexed = !indices.empty();
+    const int numTriangles = (indexed ? indices.size() : positions.size()) / 3;
+    if (numTriangles == 0)
+        return;
+
+    vector<unsigned int> corners(3 * numTriangles);
+    for (int i = 0; i < 3 * numTriangles; ++i) {
+        corners[i] = indexed ? indices[i] : i;
+        if (corners[i] >= positions.size())
+            throw runtime_error("MeshBvh: vertex index out of range");
+    }
+
+    Builder builder(nodes_);
+    builder.boxes.resize(numTriangles);
+    builder.centroids.resize(numTriangles);
+    builder.order.resize(numTriangles);
+    for (int t = 0; t < numTriangles; ++t) {
+        Box &box = builder.boxes[t];
+        for (int c = 0; c < 3; ++c) {
+            box.grow(positions[corners[3 * t + c]]);
+        }
+        builder.centroids[t] = Cvec3f((box.mn[0] + box.mx[0]) * 0.5f,
+                                      (box.mn[1] + box.mx[1]) * 0.5f,
+                                      (box.mn[2] + box.mx[2]) * 0.5f);
+        builder.order[t] = t;
+    }
+
+    nodes_.resize(1);
+    builder.build(0, 0, numTriangles, 0);
+
+    triangles_.resize(numTriangles);
+    for (int i = 0; i < numTriangles; ++i) {
+        const int t = builder.order[i];
+        const Cvec3f &v0 = positions[corners[3 * t]];
+        triangles_[i].v0 = v0;
+        triangles_[i].e1 = positions[corners[3 * t + 1]] - v0;
+        triangles_[i].e2 = positions[corners[3 * t + 2]] - v0;
+        triangles_[i].id = t;
+    }
+}
+
+// Distance at which the ray enters the box, if it does before `tMax',
+// negative otherwise
+static inline float hitBox(const float boxMin[3], const float boxMax[3],
+                           const float origin[3], const float invDir[3], float tMax) {
+    float tNear = 0, tFar = tMax;
+    for (int k = 0; k < 3; ++k) {
+        const float t1 = (boxMin[k] - origin[k]) * invDir[k];
+        const float t2 = (boxMax[k] - origin[k]) * invDir[k];
+        tNear = max(tNear, min(t1, t2));
+        tFar = min(tFar, max(t1, t2));
+    }
+    return tNear <= tFar ? tNear : -1;
+}
+
+bool MeshBvh::intersect(const Cvec3 &origin, const Cvec3 &dir, double tMax,
+                        Hit &hit) const {
+    if (nodes_.empty())
+        return false;
+
+    const float o[3] = {float(origin[0]), float(origin[1]), float(origin[2])};
+    const float d[3] = {float(dir[0]), float(dir[1]), float(dir[2])};
+    // an axis the ray is parallel to gets an infinite inverse, which the
+    // slab test handles
+    const float invDir[3] = {1 / d[0], 1 / d[1], 1 / d[2]};
+    const Cvec3f fo(o[0], o[1], o[2]), fd(d[0], d[1], d[2]);
+
+    float best = float(tMax);
+    int bestTriangle = -1;
+    float bestU = 0, bestV = 0;
+
+    struct Entry {
+        int node;
+        float t;
+    } stack[MAX_DEPTH];
+    int size = 0;
+
+    if (hitBox(nodes_[0].boxMin, nodes_[0].boxMax, o, invDir, best) < 0)
+        return false;
+    int current = 0;
+    for (;;) {
+        const Node &node = nodes_[current];
+        if (node.count > 0) {
+            // Moller-Trumbore
+            for (int i = node.first, end = node.first + node.count; i < end; ++i) {
+                const Triangle &tri = triangles_[i];
+                const Cvec3f p = cross(fd, tri.e2);
+                const float det = dot(tri.e1, p);
+                if (det == 0)
+                    continue;
+                const float invDet = 1 / det;
+                const Cvec3f s = fo - tri.v0;
+                const float u = dot(s, p) * invDet;
+                if (u < 0 || u > 1)
+                    continue;
+                const Cvec3f q = cross(s, tri.e1);
+                const float v = dot(fd, q) * invDet;
+                if (v < 0 || u + v > 1)
+                    continue;
+                const float t = dot(tri.e2, q) * invDet;
+                if (t > 0 && t < best) {
+                    best = t;
+                    bestTriangle = tri.id;
+                    bestU = u;
+                    bestV = v;
+                }
+            }
+        } else {
+            const Node &a = nodes_[node.first], &b = nodes_[node.first + 1];
+            float ta = hitBox(a.boxMin, a.boxMax, o, invDir, best);
+            float tb = hitBox(b.boxMin, b.boxMax, o, invDir, best);
+            int near = node.first, far = node.first + 1;
+            if (tb >= 0 && (ta < 0 || tb < ta)) {
+                swap(near, far);
+                swap(ta, tb);
+            }
+            if (ta >= 0) {
+                if (tb >= 0) {
+                    stack[size].node = far;
+                    stack[size].t = tb;
+                    ++size;
+                }
+                current = near;
+                continue;
+            }
+        }
+
+        // the next node on the stack the ray still enters before the best hit
+        while (size > 0 && stack[size - 1].t >= best) {
+            --size;
+        }
+        if (size == 0)
+            break;
+        current = stack[--size].node;
+    }
+
+    if (bestTriangle < 0)
+        return false;
+    hit.t = best;
+    hit.triangle = bestTriangle;
+    hit.u = bestU;
+    hit.v = bestV;
+    return true;
+}
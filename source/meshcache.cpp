@@ -0,0 +1,247 @@
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+
+#include "iblcache.h"
+#include "meshcache.h"
+#include "meshopt.h"
+
+using namespace std;
+
+static const char kMagic[8] = {'P', 'B', 'R', 'M', 'E', 'S', 'H', '\0'};
+static const char kStampMagic[8] = {'P', 'B', 'R', 'S', 'T', 'A', 'M', 'P'};
+
+// Bump whenever the layout of the file, or importObjMesh and the passes it
+// runs, change
+static const uint32_t kVersion = 3;
+
+struct MeshCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t vertexFormat; // MeshCacheVertexFormat
+    uint64_t sourceHash;   // the key
+    uint32_t vertexCount, vertexSize;
+    uint32_t indexCount, indexSize;
+    uint64_t vertexOffset, indexOffset; // from the start of the file
+    float boundsMin[3], boundsMax[3];
+    float boundsRadius; // rounded up
+    uint32_t padding;
+};
+
+// The content of a stamp file: the key of an .obj of the given size and
+// modification time
+struct MeshCacheStamp {
+    char magic[8];
+    uint32_t version;
+    uint32_t padding;
+    uint64_t size;
+    int64_t mtimeSec, mtimeNsec;
+    uint64_t key;
+};
+
+// Vertex arrays start at a multiple of this
+static const size_t kDataAlignment = 16;
+
+uint64_t hashMeshSource(const string &objPath) {
+    IblCacheKey key;
+    key.addFile(objPath.c_str());
+    key.add(int(kVersion));
+    return key.value();
+}
+
+uint64_t makeMeshCacheKey(const string &objPath, const string &dir) {
+    struct stat st;
+    if (stat(objPath.c_str(), &st) != 0)
+        throw runtime_error("Cannot open file " + objPath);
+
+    MeshCacheStamp stamp;
+    memset(&stamp, 0, sizeof(stamp));
+    memcpy(stamp.magic, kStampMagic, sizeof(kStampMagic));
+    stamp.version = kVersion;
+    stamp.size = st.st_size;
+    stamp.mtimeSec = st.st_mtim.tv_sec;
+    stamp.mtimeNsec = st.st_mtim.tv_nsec;
+
+    // named after the absolute path, so that every spelling of it shares
+    // the stamp
+    char *absolutePath = realpath(objPath.c_str(), NULL);
+    const uint64_t pathHash = IblCacheKey().add(absolutePath ? string(absolutePath) : objPath).value();
+    free(absolutePath);
+    char name[32];
+    snprintf(name, sizeof(name), "mesh-%016llx.stamp", (unsigned long long)pathHash);
+    const string stampPath = dir + "/" + name;
+
+    MeshCacheStamp stored;
+    ifstream ifs(stampPath.c_str(), ios::binary);
+    if (ifs.read(reinterpret_cast<char *>(&stored), sizeof(stored)) &&
+        memcmp(&stored, &stamp, offsetof(MeshCacheStamp, key)) == 0)
+        return stored.key;
+    ifs.close();
+
+    stamp.key = hashMeshSource(objPath);
+    try {
+        writeCacheFile(stampPath, [&](ostream &os) {
+            os.write(reinterpret_cast<const char *>(&stamp), sizeof(stamp));
+        });
+    } catch (const runtime_error &e) {
+        cerr << "WARN: " << e.what() << ", " << objPath << " will be hashed again" << endl;
+    }
+    return stamp.key;
+}
+
+string getMeshCachePath(const string &dir, uint64_t key) {
+    char name[32];
+    snprintf(name, sizeof(name), "mesh-%016llx.bin", (unsigned long long)key);
+    return dir + "/" + name;
+}
+
+void importObjMesh(const char *objPath, MeshData &mesh) {
+    loadObjMesh(objPath, mesh);
+    generateTangents(mesh);
+
+    // the unindexed equivalent stores one vertex per triangle corner
+    const size_t unindexedBytes = mesh.indices.size() * mesh.getVertexSize();
+    const size_t indexedBytes = mesh.getVboBytes() + mesh.getIboBytes();
+    cout << objPath << ": " << mesh.vertices.size() << " vertices for "
+         << mesh.indices.size() << " corners, " << indexedBytes / 1024 << " KB in VBO+IBO instead of "
+         << unindexedBytes / 1024 << " KB unindexed ("
+         << int(100.0 - 100.0 * indexedBytes / unindexedBytes) << "% saved)" << endl;
+
+    const float acmrBefore = computeACMR(mesh);
+    optimizeVertexCache(mesh);
+    optimizeOverdraw(mesh);
+    optimizeVertexFetch(mesh);
+    cout << objPath << ": ACMR " << acmrBefore << " -> " << computeACMR(mesh) << endl;
+}
+
+static void writePadding(ostream &os, size_t count) {
+    static const char zeros[kDataAlignment] = {0};
+    os.write(zeros, count);
+}
+
+void writeMeshCache(const string &filename, uint64_t key, const MeshData &mesh) {
+    MeshCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.version = kVersion;
+    header.vertexFormat = mesh.hasTangents() ? MESH_CACHE_PNTBX : MESH_CACHE_PNX;
+    header.sourceHash = key;
+    header.vertexCount = mesh.vertices.size();
+    header.vertexSize = mesh.getVertexSize();
+    header.indexCount = mesh.indices.size();
+    header.indexSize = mesh.vertices.size() <= 0x10000 ? 2 : 4;
+
+    const size_t vertexPadding = (kDataAlignment - sizeof(header) % kDataAlignment) % kDataAlignment;
+    header.vertexOffset = sizeof(header) + vertexPadding;
+    header.indexOffset = header.vertexOffset + mesh.getVboBytes();
+
+    // the box is exact in floats, being made of vertex positions
+    const Bounds bounds = Bounds::make(mesh.vertices.data(), mesh.vertices.size());
+    for (int i = 0; i < 3; ++i) {
+        header.boundsMin[i] = bounds.isEmpty() ? 0.0f : float(bounds.boxMin[i]);
+        header.boundsMax[i] = bounds.isEmpty() ? 0.0f : float(bounds.boxMax[i]);
+    }
+    header.boundsRadius = float(bounds.radius);
+    if (header.boundsRadius < bounds.radius)
+        header.boundsRadius = nextafterf(header.boundsRadius, HUGE_VALF);
+
+    writeCacheFile(filename, [&](ostream &os) {
+        os.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        writePadding(os, vertexPadding);
+        if (mesh.hasTangents()) {
+            vector<VertexPNTBX> vertices;
+            mesh.getTangentVertices(vertices);
+            os.write(reinterpret_cast<const char *>(&vertices[0]), mesh.getVboBytes());
+        } else if (!mesh.vertices.empty()) {
+            os.write(reinterpret_cast<const char *>(&mesh.vertices[0]), mesh.getVboBytes());
+        }
+        if (header.indexSize == 2) {
+            const vector<unsigned short> indices(mesh.indices.begin(), mesh.indices.end());
+            if (!indices.empty())
+                os.write(reinterpret_cast<const char *>(&indices[0]), mesh.getIboBytes());
+        } else if (!mesh.indices.empty()) {
+            os.write(reinterpret_cast<const char *>(&mesh.indices[0]), mesh.getIboBytes());
+        }
+    });
+}
+
+MeshCacheFile::MeshCacheFile() : header_(NULL) {}
+
+MeshCacheFile::~MeshCacheFile() { close(); }
+
+bool MeshCacheFile::open(const string &filename, uint64_t key) {
+    close();
+
+    if (!file_.open(filename) || file_.getSize() < sizeof(MeshCacheHeader)) {
+        file_.close();
+        return false;
+    }
+    const size_t size = file_.getSize();
+
+    const MeshCacheHeader &header = *reinterpret_cast<const MeshCacheHeader *>(file_.getData());
+    const size_t vertexSize = header.vertexFormat == MESH_CACHE_PNX     ? sizeof(VertexPNX)
+                              : header.vertexFormat == MESH_CACHE_PNTBX ? sizeof(VertexPNTBX)
+                                                                        : 0;
+    const bool valid =
+        memcmp(header.magic, kMagic, sizeof(kMagic)) == 0 && header.version == kVersion &&
+        header.sourceHash == key && vertexSize != 0 && header.vertexSize == vertexSize &&
+        (header.indexSize == 2 || header.indexSize == 4) &&
+        header.vertexOffset % kDataAlignment == 0 && header.vertexOffset >= sizeof(MeshCacheHeader) &&
+        header.vertexOffset + uint64_t(header.vertexCount) * vertexSize <= header.indexOffset &&
+        header.indexOffset + uint64_t(header.indexCount) * header.indexSize == size;
+    if (!valid) {
+        file_.close();
+        return false;
+    }
+    header_ = &header;
+
+    // the whole file is about to be uploaded
+    file_.willNeed();
+    return true;
+}
+
+void MeshCacheFile::close() {
+    file_.close();
+    header_ = NULL;
+}
+
+MeshCacheVertexFormat MeshCacheFile::getVertexFormat() const {
+    return MeshCacheVertexFormat(header_->vertexFormat);
+}
+
+int MeshCacheFile::getVertexCount() const { return header_->vertexCount; }
+
+int MeshCacheFile::getIndexCount() const { return header_->indexCount; }
+
+int MeshCacheFile::getIndexSize() const { return header_->indexSize; }
+
+const void *MeshCacheFile::getVertices() const {
+    return file_.getData() + header_->vertexOffset;
+}
+
+const void *MeshCacheFile::getIndices() const {
+    return file_.getData() + header_->indexOffset;
+}
+
+Bounds MeshCacheFile::getBounds() const {
+    Bounds bounds;
+    if (header_->boundsRadius < 0)
+        return bounds;
+    for (int i = 0; i < 3; ++i) {
+        bounds.boxMin[i] = header_->boundsMin[i];
+        bounds.boxMax[i] = header_->boundsMax[i];
+    }
+    bounds.center = (bounds.boxMin + bounds.boxMax) * 0.5;
+    bounds.radius = header_->boundsRadius;
+    return bounds;
+}
+
+uint64_t MeshCacheFile::getSourceHash() const { return header_->sourceHash; }
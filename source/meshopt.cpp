@@ -0,0 +1,320 @@
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <vector>
+
+#include "meshopt.h"
+
+using namespace std;
+
+// Simulates a FIFO cache of `cacheSize' entries over the triangles
+// [begin, end) and returns the number of misses. `stamps' holds, per vertex,
+// the miss counter value at which it entered the cache, and `time' is that
+// counter; both carry over between calls so a simulation can be continued.
+static int simulateFifo(const vector<unsigned int> &indices, size_t begin,
+                        size_t end, int cacheSize, vector<int> &stamps,
+                        int &time) {
+    int misses = 0;
+    for (size_t i = 3 * begin; i < 3 * end; ++i) {
+        const unsigned int v = indices[i];
+        if (time - stamps[v] > cacheSize) {
+            stamps[v] = time++;
+            ++misses;
+        }
+    }
+    return misses;
+}
+
+float computeACMR(const MeshData &mesh, int cacheSize) {
+    const size_t numTriangles = mesh.indices.size() / 3;
+    if (numTriangles == 0)
+        return 0.0f;
+
+    vector<int> stamps(mesh.vertices.size(), -cacheSize - 1);
+    int time = 0;
+    return float(simulateFifo(mesh.indices, 0, numTriangles, cacheSize, stamps, time)) / numTriangles;
+}
+
+//---------------------------------------------------------------------------
+// Vertex cache optimization
+//---------------------------------------------------------------------------
+
+// Parameters of the paper
+static const int FORSYTH_CACHE_SIZE = 32;
+static const float FORSYTH_CACHE_DECAY_POWER = 1.5f;
+static const float FORSYTH_LAST_TRI_SCORE = 0.75f;
+static const float FORSYTH_VALENCE_BOOST_SCALE = 2.0f;
+static const float FORSYTH_VALENCE_BOOST_POWER = 0.5f;
+
+static float getForsythScore(int cachePosition, int remainingValence) {
+    if (remainingValence == 0)
+        return -1.0f; // no triangles left, never picked again
+
+    float score = 0.0f;
+    if (cachePosition >= 0) {
+        if (cachePosition < 3) {
+            // used by the last triangle, fixed score so there is no
+            // preference among its three vertices
+            score = FORSYTH_LAST_TRI_SCORE;
+        } else {
+            const float scaler = 1.0f / (FORSYTH_CACHE_SIZE - 3);
+            score = pow(1.0f - (cachePosition - 3) * scaler, FORSYTH_CACHE_DECAY_POWER);
+        }
+    }
+
+    // bonus for vertices with few triangles left, so lone triangles get
+    // cleared out instead of left behind
+    score += FORSYTH_VALENCE_BOOST_SCALE * pow(float(remainingValence), -FORSYTH_VALENCE_BOOST_POWER);
+    return score;
+}
+
+void optimizeVertexCache(MeshData &mesh) {
+    const vector<unsigned int> &indices = mesh.indices;
+    const size_t numVertices = mesh.vertices.size();
+    const size_t numTriangles = indices.size() / 3;
+    if (numTriangles == 0)
+        return;
+
+    // vertex -> triangles adjacency, in compressed rows
+    vector<int> adjacencyOffsets(numVertices + 1, 0);
+    for (size_t i = 0; i < indices.size(); ++i) {
+        ++adjacencyOffsets[indices[i] + 1];
+    }
+    for (size_t v = 0; v < numVertices; ++v) {
+        adjacencyOffsets[v + 1] += adjacencyOffsets[v];
+    }
+    vector<int> adjacency(indices.size());
+    {
+        vector<int> fill(adjacencyOffsets.begin(), adjacencyOffsets.end() - 1);
+        for (size_t i = 0; i < indices.size(); ++i) {
+            adjacency[fill[indices[i]]++] = int(i / 3);
+        }
+    }
+
+    // remaining valence and cache position of each vertex, and the scores
+    vector<int> valence(numVertices), cachePosition(numVertices, -1);
+    vector<float> vertexScore(numVertices);
+    for (size_t v = 0; v < numVertices; ++v) {
+        valence[v] = adjacencyOffsets[v + 1] - adjacencyOffsets[v];
+        vertexScore[v] = getForsythScore(-1, valence[v]);
+    }
+
+    vector<float> triangleScore(numTriangles);
+    vector<char> emitted(numTriangles, 0);
+    for (size_t t = 0; t < numTriangles; ++t) {
+        triangleScore[t] = vertexScore[indices[3 * t]] + vertexScore[indices[3 * t + 1]] +
+                           vertexScore[indices[3 * t + 2]];
+    }
+
+    // LRU cache of the model, with room for the 3 vertices pushed per step
+    vector<int> cache, newCache;
+    cache.reserve(FORSYTH_CACHE_SIZE + 3);
+    newCache.reserve(FORSYTH_CACHE_SIZE + 3);
+
+    vector<unsigned int> result;
+    result.reserve(indices.size());
+
+    int bestTriangle = -1;
+    size_t nextUnemitted = 0;
+    for (size_t emittedCount = 0; emittedCount < numTriangles; ++emittedCount) {
+        if (bestTriangle < 0) {
+            // nothing in the cache neighbourhood, continue with the first
+            // triangle left in input order
+            while (emitted[nextUnemitted])
+                ++nextUnemitted;
+            bestTriangle = int(nextUnemitted);
+        }
+
+        const int t = bestTriangle;
+        emitted[t] = 1;
+
+        // emit, and move the triangle's vertices to the front of the cache
+        newCache.clear();
+        for (int k = 0; k < 3; ++k) {
+            const int v = indices[3 * t + k];
+            result.push_back(v);
+            newCache.push_back(v);
+
+            // drop the triangle from the vertex's adjacency
+            int *begin = &adjacency[adjacencyOffsets[v]];
+            int *end = begin + valence[v];
+            *find(begin, end, t) = end[-1];
+            --valence[v];
+        }
+        for (size_t i = 0; i < cache.size(); ++i) {
+            const int v = cache[i];
+            if (v != newCache[0] && v != newCache[1] && v != newCache[2])
+                newCache.push_back(v);
+        }
+        for (size_t i = FORSYTH_CACHE_SIZE; i < newCache.size(); ++i) {
+            cachePosition[newCache[i]] = -1; // fell out of the cache
+        }
+        if (newCache.size() > size_t(FORSYTH_CACHE_SIZE))
+            newCache.resize(FORSYTH_CACHE_SIZE);
+        cache.swap(newCache);
+
+        // rescore the vertices in the cache, and their triangles, picking
+        // the next best triangle on the way
+        for (size_t i = 0; i < cache.size(); ++i) {
+            const int v = cache[i];
+            cachePosition[v] = int(i);
+            const float delta = getForsythScore(int(i), valence[v]) - vertexScore[v];
+            vertexScore[v] += delta;
+            for (int j = adjacencyOffsets[v], e = adjacencyOffsets[v] + valence[v]; j < e; ++j) {
+                triangleScore[adjacency[j]] += delta;
+            }
+        }
+
+        bestTriangle = -1;
+        float bestScore = -1.0f;
+        for (size_t i = 0; i < cache.size(); ++i) {
+            const int v = cache[i];
+            for (int j = adjacencyOffsets[v], e = adjacencyOffsets[v] + valence[v]; j < e; ++j) {
+                const int candidate = adjacency[j];
+                if (triangleScore[candidate] > bestScore) {
+                    bestScore = triangleScore[candidate];
+                    bestTriangle = candidate;
+                }
+            }
+        }
+    }
+
+    mesh.indices.swap(result);
+}
+
+//---------------------------------------------------------------------------
+// Overdraw optimization
+//---------------------------------------------------------------------------
+
+// Cache size used to find the cluster boundaries
+static const int OVERDRAW_CACHE_SIZE = 16;
+
+void optimizeOverdraw(MeshData &mesh, float threshold) {
+    const vector<unsigned int> &indices = mesh.indices;
+    const size_t numTriangles = indices.size() / 3;
+    if (numTriangles == 0)
+        return;
+
+    const float meshACMR = computeACMR(mesh, OVERDRAW_CACHE_SIZE);
+
+    // hard boundaries: triangles that miss on all 3 vertices, where the
+    // cache is cold anyway and a new cluster costs nothing
+    vector<size_t> hardStarts;
+    {
+        vector<int> stamps(mesh.vertices.size(), -OVERDRAW_CACHE_SIZE - 1);
+        int time = 0;
+        for (size_t t = 0; t < numTriangles; ++t) {
+            if (simulateFifo(indices, t, t + 1, OVERDRAW_CACHE_SIZE, stamps, time) == 3 || t == 0)
+                hardStarts.push_back(t);
+        }
+        hardStarts.push_back(numTriangles);
+    }
+
+    // soft boundaries: simulating each cluster with a cold cache, end it as
+    // soon as its ACMR is within `threshold' of the whole mesh's
+    vector<size_t> clusterStarts;
+    {
+        vector<int> stamps(mesh.vertices.size(), -OVERDRAW_CACHE_SIZE - 1);
+        int time = 0;
+        for (size_t h = 0; h + 1 < hardStarts.size(); ++h) {
+            const size_t regionEnd = hardStarts[h + 1];
+            size_t clusterStart = hardStarts[h];
+            int clusterMisses = 0;
+            clusterStarts.push_back(clusterStart);
+            time += OVERDRAW_CACHE_SIZE + 1;
+
+            for (size_t t = clusterStart; t < regionEnd; ++t) {
+                clusterMisses += simulateFifo(indices, t, t + 1, OVERDRAW_CACHE_SIZE, stamps, time);
+                if (t + 1 < regionEnd &&
+                    clusterMisses <= threshold * meshACMR * (t + 1 - clusterStart)) {
+                    clusterStart = t + 1;
+                    clusterMisses = 0;
+                    clusterStarts.push_back(clusterStart);
+                    time += OVERDRAW_CACHE_SIZE + 1;
+                }
+            }
+
+            // the tail of the region never got efficient enough on its own,
+            // keep it with the cluster before it
+            if (clusterStart != hardStarts[h] &&
+                clusterMisses > threshold * meshACMR * (regionEnd - clusterStart))
+                clusterStarts.pop_back();
+        }
+    }
+    const size_t numClusters = clusterStarts.size();
+    clusterStarts.push_back(numTriangles);
+
+    // area weighted centroid and normal of each cluster, and of the mesh
+    vector<Cvec3f> centroids(numClusters), normals(numClusters);
+    vector<float> areas(numClusters, 0.0f);
+    Cvec3f meshCentroid;
+    float meshArea = 0.0f;
+    for (size_t c = 0; c < numClusters; ++c) {
+        for (size_t t = clusterStarts[c]; t < clusterStarts[c + 1]; ++t) {
+            const Cvec3f &p0 = mesh.vertices[indices[3 * t]].p;
+            const Cvec3f &p1 = mesh.vertices[indices[3 * t + 1]].p;
+            const Cvec3f &p2 = mesh.vertices[indices[3 * t + 2]].p;
+            const Cvec3f n = cross(p1 - p0, p2 - p0); // length = 2 * area
+            const float area = 0.5f * sqrt(dot(n, n));
+
+            centroids[c] += (p0 + p1 + p2) * (area / 3.0f);
+            normals[c] += n;
+            areas[c] += area;
+        }
+        meshCentroid += centroids[c];
+        meshArea += areas[c];
+        if (areas[c] > 0.0f)
+            centroids[c] /= areas[c];
+    }
+    if (meshArea > 0.0f)
+        meshCentroid /= meshArea;
+
+    // draw clusters facing away from the center first: from most viewpoints
+    // they are in front of the ones facing inward
+    vector<float> sortKeys(numClusters);
+    vector<int> order(numClusters);
+    for (size_t c = 0; c < numClusters; ++c) {
+        const float length = sqrt(dot(normals[c], normals[c]));
+        sortKeys[c] = length > 0.0f ? dot(centroids[c] - meshCentroid, normals[c]) / length : 0.0f;
+        order[c] = int(c);
+    }
+    stable_sort(order.begin(), order.end(), [&](int a, int b) { return sortKeys[a] > sortKeys[b]; });
+
+    vector<unsigned int> result;
+    result.reserve(indices.size());
+    for (size_t i = 0; i < numClusters; ++i) {
+        const int c = order[i];
+        result.insert(result.end(), indices.begin() + 3 * clusterStarts[c],
+                      indices.begin() + 3 * clusterStarts[c + 1]);
+    }
+    mesh.indices.swap(result);
+}
+
+//---------------------------------------------------------------------------
+// Vertex fetch optimization
+//---------------------------------------------------------------------------
+
+void optimizeVertexFetch(MeshData &mesh) {
+    const unsigned int UNUSED = ~0u;
+    vector<unsigned int> remap(mesh.vertices.size(), UNUSED);
+    vector<VertexPNX> vertices;
+    vector<Cvec3f> tangents, binormals;
+    vertices.reserve(mesh.vertices.size());
+
+    for (size_t i = 0; i < mesh.indices.size(); ++i) {
+        const unsigned int oldIndex = mesh.indices[i];
+        unsigned int &newIndex = remap[oldIndex];
+        if (newIndex == UNUSED) {
+            newIndex = vertices.size();
+            vertices.push_back(mesh.vertices[oldIndex]);
+            if (mesh.hasTangents()) {
+                tangents.push_back(mesh.tangents[oldIndex]);
+                binormals.push_back(mesh.binormals[oldIndex]);
+            }
+        }
+        mesh.indices[i] = newIndex;
+    }
+    mesh.vertices.swap(vertices);
+    mesh.tangents.swap(tangents);
+    mesh.binormals.swap(binormals);
+}
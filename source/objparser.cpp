@@ -0,0 +1,377 @@
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "mappedfile.h"
+#include "objparser.h"
+#include "tiny_obj_loader.h"
+
+using namespace std;
+
+// The number parsing below mirrors tinyobj 1.0.6 operation by operation,
+// since any other rounding would break bit exactness with parseObjTinyObj.
+// Tokens are [p, end) ranges of a mapped line instead of C strings.
+
+static inline bool isSpace(char c) { return c == ' ' || c == '\t'; }
+
+static inline bool isDigit(char c) { return (unsigned int)(c - '0') < 10u; }
+
+// strspn(p, " \t")
+static inline const char *skipSpaces(const char *p, const char *end) {
+    while (p != end && isSpace(*p))
+        ++p;
+    return p;
+}
+
+// strcspn(p, " \t\r"), lines do not contain '\r'
+static inline const char *skipToken(const char *p, const char *end) {
+    while (p != end && !isSpace(*p))
+        ++p;
+    return p;
+}
+
+// strcspn(p, "/ \t\r")
+static inline const char *skipIndex(const char *p, const char *end) {
+    while (p != end && *p != '/' && !isSpace(*p))
+        ++p;
+    return p;
+}
+
+// 10^-i for the fractional digits: the literals of tinyobj's table, then
+// std::pow like tinyobj falls back to
+static const int kNumFractionPowers = 32;
+
+static const double *getFractionPowers() {
+    static const struct Table {
+        double values[kNumFractionPowers];
+        Table() {
+            static const double lut[] = {1.0,    0.1,     0.01,     0.001,
+                                         0.0001, 0.00001, 0.000001, 0.0000001};
+            const int lutEntries = sizeof(lut) / sizeof(lut[0]);
+            for (int i = 0; i < kNumFractionPowers; ++i) {
+                values[i] = i < lutEntries ? lut[i] : pow(10.0, -i);
+            }
+        }
+    } table;
+    return table.values;
+}
+
+// tinyobj's tryParseDouble
+static bool parseDouble(const char *s, const char *end, const double *fractionPowers,
+                        double *result) {
+    if (s >= end)
+        return false;
+
+    double mantissa = 0.0;
+    int exponent = 0;
+    char sign = '+', expSign = '+';
+    const char *curr = s;
+    int read = 0;
+
+    if (*curr == '+' || *curr == '-') {
+        sign = *curr++;
+    } else if (!isDigit(*curr)) {
+        return false;
+    }
+
+    // integer part
+    while (curr != end && isDigit(*curr)) {
+        mantissa *= 10;
+        mantissa += static_cast<int>(*curr - 0x30);
+        ++curr;
+        ++read;
+    }
+    if (read == 0)
+        return false;
+
+    if (curr != end) {
+        // fractional part
+        if (*curr == '.') {
+            ++curr;
+            read = 1;
+            while (curr != end && isDigit(*curr)) {
+                mantissa += static_cast<int>(*curr - 0x30) *
+                            (read < kNumFractionPowers ? fractionPowers[read] : pow(10.0, -read));
+                ++read;
+                ++curr;
+            }
+        } else if (*curr != 'e' && *curr != 'E') {
+            curr = end; // trailing garbage is ignored
+        }
+
+        // exponent
+        if (curr != end && (*curr == 'e' || *curr == 'E')) {
+            ++curr;
+            if (curr != end && (*curr == '+' || *curr == '-')) {
+                expSign = *curr++;
+            } else if (curr == end || !isDigit(*curr)) {
+                return false; // empty exponent
+            }
+
+            read = 0;
+            while (curr != end && isDigit(*curr)) {
+                exponent *= 10;
+                exponent += static_cast<int>(*curr - 0x30);
+                ++curr;
+                ++read;
+            }
+            exponent *= (expSign == '+' ? 1 : -1);
+            if (read == 0)
+                return false;
+        }
+    }
+
+    *result = (sign == '+' ? 1 : -1) *
+              (exponent ? ldexp(mantissa * pow(5.0, exponent), exponent) : mantissa);
+    return true;
+}
+
+// tinyobj's parseReal
+static inline float parseFloat(const char *&p, const char *end, const double *fractionPowers) {
+    p = skipSpaces(p, end);
+    const char *tokenEnd = skipToken(p, end);
+    double value = 0.0;
+    parseDouble(p, tokenEnd, fractionPowers, &value);
+    p = tokenEnd;
+    return static_cast<float>(value);
+}
+
+// atoi
+static inline int parseInt(const char *p, const char *end) {
+    while (p != end && (isSpace(*p) || *p == '\v' || *p == '\f'))
+        ++p;
+    bool negative = false;
+    if (p != end && (*p == '+' || *p == '-'))
+        negative = *p++ == '-';
+    unsigned int value = 0;
+    while (p != end && isDigit(*p))
+        value = value * 10 + (*p++ - '0');
+    return int(negative ? 0u - value : value);
+}
+
+namespace {
+// Results of one chunk of lines
+struct ObjChunk {
+    vector<float> vertices, normals, texcoords;
+    vector<ObjIndex> indices;
+
+    // Relative (negative) indices are resolved against the attribute counts
+    // of the chunk, and corrected by the counts of the chunks before it when
+    // merging. These are the corners holding one, and which of their indices
+    // are relative (RELATIVE_* bits).
+    vector<unsigned int> relativeCorners;
+    vector<unsigned char> relativeMasks;
+};
+
+enum { RELATIVE_VERTEX = 1, RELATIVE_NORMAL = 2, RELATIVE_TEXCOORD = 4 };
+} // namespace
+
+// tinyobj's fixIndex, with the count `n' of the chunk so far
+static inline int fixIndex(int idx, int n, unsigned char relativeBit, unsigned char &mask) {
+    if (idx > 0)
+        return idx - 1;
+    if (idx == 0)
+        return 0;
+    mask |= relativeBit;
+    return n + idx;
+}
+
+// tinyobj's parseTriple: i, i/j/k, i//k or i/j
+static ObjIndex parseCorner(const char *&p, const char *end, const ObjChunk &chunk,
+                            unsigned char &mask) {
+    const int numVertices = chunk.vertices.size() / 3;
+    const int numNormals = chunk.normals.size() / 3;
+    const int numTexcoords = chunk.texcoords.size() / 2;
+    ObjIndex index = {-1, -1, -1};
+    mask = 0;
+
+    index.vertex = fixIndex(parseInt(p, end), numVertices, RELATIVE_VERTEX, mask);
+    p = skipIndex(p, end);
+    if (p == end || *p != '/')
+        return index;
+    ++p;
+
+    // i//k
+    if (p != end && *p == '/') {
+        ++p;
+        index.normal = fixIndex(parseInt(p, end), numNormals, RELATIVE_NORMAL, mask);
+        p = skipIndex(p, end);
+        return index;
+    }
+
+    // i/j/k or i/j
+    index.texcoord = fixIndex(parseInt(p, end), numTexcoords, RELATIVE_TEXCOORD, mask);
+    p = skipIndex(p, end);
+    if (p == end || *p != '/')
+        return index;
+    ++p;
+
+    index.normal = fixIndex(parseInt(p, end), numNormals, RELATIVE_NORMAL, mask);
+    p = skipIndex(p, end);
+    return index;
+}
+
+static void parseLine(const char *p, const char *end, const double *fractionPowers,
+                      vector<ObjIndex> &face, vector<unsigned char> &faceMasks, ObjChunk &chunk) {
+    p = skipSpaces(p, end);
+    const ptrdiff_t length = end - p;
+
+    if (length >= 2 && p[0] == 'v' && isSpace(p[1])) {
+        p += 2;
+        for (int i = 0; i < 3; ++i) {
+            chunk.vertices.push_back(parseFloat(p, end, fractionPowers));
+        }
+    } else if (length >= 3 && p[0] == 'v' && p[1] == 'n' && isSpace(p[2])) {
+        p += 3;
+        for (int i = 0; i < 3; ++i) {
+            chunk.normals.push_back(parseFloat(p, end, fractionPowers));
+        }
+    } else if (length >= 3 && p[0] == 'v' && p[1] == 't' && isSpace(p[2])) {
+        p += 3;
+        for (int i = 0; i < 2; ++i) {
+            chunk.texcoords.push_back(parseFloat(p, end, fractionPowers));
+        }
+    } else if (length >= 2 && p[0] == 'f' && isSpace(p[1])) {
+        p = skipSpaces(p + 2, end);
+        face.clear();
+        faceMasks.clear();
+        while (p != end) {
+            unsigned char mask;
+            face.push_back(parseCorner(p, end, chunk, mask));
+            faceMasks.push_back(mask);
+            p = skipSpaces(p, end);
+        }
+
+        // triangle fan, as tinyobj triangulates
+        for (size_t k = 2; k < face.size(); ++k) {
+            const size_t corners[3] = {0, k - 1, k};
+            for (int i = 0; i < 3; ++i) {
+                if (faceMasks[corners[i]]) {
+                    chunk.relativeCorners.push_back(chunk.indices.size());
+                    chunk.relativeMasks.push_back(faceMasks[corners[i]]);
+                }
+                chunk.indices.push_back(face[corners[i]]);
+            }
+        }
+    }
+}
+
+static inline bool isLineEnd(char c) { return c == '\n' || c == '\r'; }
+
+// Parses the lines in [p, end), which starts at a line start
+static void parseChunk(const char *p, const char *end, ObjChunk &chunk) {
+    const double *fractionPowers = getFractionPowers();
+    vector<ObjIndex> face;
+    vector<unsigned char> faceMasks;
+
+    while (p < end) {
+        const char *lineEnd = static_cast<const char *>(memchr(p, '\n', end - p));
+        if (!lineEnd)
+            lineEnd = end;
+        // like tinyobj, a lone '\r' ends a line too
+        const char *cr = static_cast<const char *>(memchr(p, '\r', lineEnd - p));
+        if (cr)
+            lineEnd = cr;
+
+        parseLine(p, lineEnd, fractionPowers, face, faceMasks, chunk);
+        p = lineEnd + 1;
+    }
+}
+
+// Chunks are at least this large, so small files are not split needlessly
+static const size_t kMinChunkSize = 1 << 16;
+
+void parseObj(const string &filename, ObjData &obj, ThreadPool &pool) {
+    MappedFile file;
+    if (!file.open(filename))
+        throw runtime_error("Cannot open file " + filename);
+    file.willNeed();
+
+    const char *data = file.getData();
+    const size_t size = file.getSize();
+
+    // a few chunks per thread, so stealing can even out the load
+    const int numChunks = int(max<size_t>(1, min<size_t>(size / kMinChunkSize, pool.getNumThreads() * 4)));
+    vector<size_t> chunkStarts(numChunks + 1, size);
+    for (int i = 0; i < numChunks; ++i) {
+        size_t start = size * i / numChunks;
+        while (start > 0 && start < size && !isLineEnd(data[start - 1]))
+            ++start;
+        chunkStarts[i] = start;
+    }
+
+    vector<ObjChunk> chunks(numChunks);
+    pool.parallelFor(numChunks, [&](int i, int) {
+        if (chunkStarts[i] < chunkStarts[i + 1])
+            parseChunk(data + chunkStarts[i], data + chunkStarts[i + 1], chunks[i]);
+    });
+
+    // offsets of every chunk in the merged arrays
+    vector<size_t> vertexOffsets(numChunks + 1, 0), normalOffsets(numChunks + 1, 0),
+        texcoordOffsets(numChunks + 1, 0), indexOffsets(numChunks + 1, 0);
+    for (int i = 0; i < numChunks; ++i) {
+        vertexOffsets[i + 1] = vertexOffsets[i] + chunks[i].vertices.size();
+        normalOffsets[i + 1] = normalOffsets[i] + chunks[i].normals.size();
+        texcoordOffsets[i + 1] = texcoordOffsets[i] + chunks[i].texcoords.size();
+        indexOffsets[i + 1] = indexOffsets[i] + chunks[i].indices.size();
+    }
+
+    obj.vertices.resize(vertexOffsets[numChunks]);
+    obj.normals.resize(normalOffsets[numChunks]);
+    obj.texcoords.resize(texcoordOffsets[numChunks]);
+    obj.indices.resize(indexOffsets[numChunks]);
+
+    pool.parallelFor(numChunks, [&](int i, int) {
+        const ObjChunk &chunk = chunks[i];
+        copy(chunk.vertices.begin(), chunk.vertices.end(), obj.vertices.begin() + vertexOffsets[i]);
+        copy(chunk.normals.begin(), chunk.normals.end(), obj.normals.begin() + normalOffsets[i]);
+        copy(chunk.texcoords.begin(), chunk.texcoords.end(), obj.texcoords.begin() + texcoordOffsets[i]);
+
+        // data(), as a file without faces has no indices
+        ObjIndex *indices = obj.indices.data() + indexOffsets[i];
+        copy(chunk.indices.begin(), chunk.indices.end(), indices);
+        for (size_t j = 0; j < chunk.relativeCorners.size(); ++j) {
+            ObjIndex &index = indices[chunk.relativeCorners[j]];
+            const unsigned char mask = chunk.relativeMasks[j];
+            if (mask & RELATIVE_VERTEX)
+                index.vertex += int(vertexOffsets[i] / 3);
+            if (mask & RELATIVE_NORMAL)
+                index.normal += int(normalOffsets[i] / 3);
+            if (mask & RELATIVE_TEXCOORD)
+                index.texcoord += int(texcoordOffsets[i] / 2);
+        }
+    });
+}
+
+void parseObjTinyObj(const string &filename, ObjData &obj) {
+    tinyobj::attrib_t attrib;
+    vector<tinyobj::shape_t> shapes;
+    vector<tinyobj::material_t> materials;
+
+    string err;
+    const bool ret = tinyobj::LoadObj(&attrib, &shapes, &materials, &err, filename.c_str());
+
+    if (!err.empty())
+        cerr << "ERR: " << err << endl;
+
+    if (!ret)
+        throw runtime_error("Failed to load/parse " + filename);
+
+    obj.vertices.swap(attrib.vertices);
+    obj.normals.swap(attrib.normals);
+    obj.texcoords.swap(attrib.texcoords);
+    obj.indices.clear();
+    for (size_t s = 0; s < shapes.size(); ++s) {
+        const vector<tinyobj::index_t> &indices = shapes[s].mesh.indices;
+        for (size_t i = 0; i < indices.size(); ++i) {
+            const ObjIndex index = {indices[i].vertex_index, indices[i].normal_index,
+                                    indices[i].texcoord_index};
+            obj.indices.push_back(index);
+        }
+    }
+}
@@ -1,84 +1,77 @@
-#ifndef __MAC__
-#include <GL/glew.h>
-#endif
+#include <limits>
 
 #include "picker.h"
-#include "uniforms.h"
 
 using namespace std;
 
-Picker::Picker(const RigTForm &initialRbt, Uniforms &uniforms)
-    : drawer_(initialRbt, uniforms), idCounter_(0) {}
+// The nearest rbt node in `nodeStack', from the back
+static shared_ptr<SgRbtNode> findRbtNode(const vector<SgTransformNode *> &nodeStack) {
+    for (int i = nodeStack.size() - 1; i >= 0; --i) {
+        SgRbtNode *rbtNode = dynamic_cast<SgRbtNode *>(nodeStack[i]);
+        if (rbtNode)
+            return dynamic_pointer_cast<SgRbtNode>(rbtNode->shared_from_this());
+    }
+    return shared_ptr<SgRbtNode>();
+}
+
+Picker::Picker(const RigTForm &initialRbt, const Cvec3 &origin, const Cvec3 &dir)
+    : rbtStack_(1, initialRbt), origin_(origin), dir_(dir), hit_(false) {
+    nearest_.t = 0;
+    nearest_.triangle = -1;
+}
 
 bool Picker::visit(SgTransformNode &node) {
-    nodeStack_.push_back(node.shared_from_this());
-    return drawer_.visit(node);
+    nodeStack_.push_back(&node);
+    rbtStack_.push_back(rbtStack_.back() * node.getRbt());
+    return true;
 }
 
 bool Picker::postVisit(SgTransformNode &node) {
     nodeStack_.pop_back();
-    return drawer_.postVisit(node);
+    rbtStack_.pop_back();
+    return true;
 }
 
 bool Picker::visit(SgShapeNode &node) {
-    idCounter_++;
-    for (int i = nodeStack_.size() - 1; i >= 0; --i) {
-        shared_ptr<SgRbtNode> asRbtNode =
-            dynamic_pointer_cast<SgRbtNode>(nodeStack_[i]);
-        if (asRbtNode) {
-            addToMap(idCounter_, asRbtNode);
-            break;
-        }
-    }
-    const Cvec3 idColor = idToColor(idCounter_);
-
-    drawer_.getUniforms().put("uIdColor", idColor);
-    return drawer_.visit(node);
+    const Geometry *geometry = node.getGeometry();
+    const Material *material = node.getMaterial();
+    // the sky is drawn around the eye whatever its model matrix
+    if (!geometry || !geometry->getBvh() ||
+        (material && material->getRenderPass() == RENDER_PASS_SKY))
+        return true;
+
+    // t is the same along the ray in object space, as the direction is
+    // transformed without being normalized
+    const Matrix4 invModelMat =
+        inv(rigTFormToMatrix(rbtStack_.back()) * node.getAffineMatrix());
+    const Cvec3 origin(invModelMat * Cvec4(origin_, 1));
+    const Cvec3 dir(invModelMat * Cvec4(dir_, 0));
+
+    MeshBvh::Hit hit;
+    const double tMax = hit_ ? nearest_.t : numeric_limits<double>::max();
+    if (!geometry->getBvh()->intersect(origin, dir, tMax, hit))
+        return true;
+
+    hit_ = true;
+    nearest_ = hit;
+    rbtNode_ = findRbtNode(nodeStack_);
+    return true;
 }
 
-bool Picker::postVisit(SgShapeNode &node) { return drawer_.postVisit(node); }
-
-shared_ptr<SgRbtNode> Picker::getRbtNodeAtXY(int x, int y) {
-    PackedPixel query;
-    glReadPixels(x, y, 1, 1, GL_RGB, GL_UNSIGNED_BYTE, &query);
-    const int id = colorToId(query);
-
-    return find(id);
+bool PickIdFinder::visit(SgTransformNode &node) {
+    nodeStack_.push_back(&node);
+    return true;
 }
 
-//------------------
-// Helper functions
-//------------------
-//
-void Picker::addToMap(int id, shared_ptr<SgRbtNode> node) {
-    idToRbtNode_[id] = node;
-}
-
-shared_ptr<SgRbtNode> Picker::find(int id) {
-    IdToRbtNodeMap::iterator it = idToRbtNode_.find(id);
-    if (it != idToRbtNode_.end())
-        return it->second;
-    else
-        return shared_ptr<SgRbtNode>(); // set to null
-}
-
-// encode 2^4 = 16 IDs in each of R, G, B channel, for a total of 16^3 number of
-// objects
-static const int NBITS = 4, N = 1 << NBITS, MASK = N - 1;
-
-Cvec3 Picker::idToColor(int id) {
-    assert(id > 0 && id < N * N * N);
-    Cvec3 framebufferColor =
-        Cvec3(id & MASK, (id >> NBITS) & MASK, (id >> (NBITS + NBITS)) & MASK);
-    framebufferColor = framebufferColor / N + Cvec3(0.5 / N);
-
-    return framebufferColor;
+bool PickIdFinder::postVisit(SgTransformNode &node) {
+    nodeStack_.pop_back();
+    return true;
 }
 
-int Picker::colorToId(const PackedPixel &p) {
-    const int UNUSED_BITS = 8 - NBITS;
-    int id = p.r >> UNUSED_BITS;
-    id |= ((p.g >> UNUSED_BITS) << NBITS);
-    id |= ((p.b >> UNUSED_BITS) << (NBITS + NBITS));
-    return id;
+bool PickIdFinder::visit(SgShapeNode &node) {
+    if (node.getPickId() != pickId_)
+        return true;
+    found_ = true;
+    rbtNode_ = findRbtNode(nodeStack_);
+    return false; // stops the traversal
 }
@@ -0,0 +1,205 @@
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "renderqueue.h"
+
+using namespace std;
+
+uint64_t RenderQueue::makeSortKey(int renderPass, GLuint program,
+                                  unsigned int textureSetHash, int materialId,
+                                  float depth) {
+    // non-negative floats order like their bit patterns, so the top 24 bits
+    // give a front to back order without knowing the depth range
+    uint32_t depthBits = 0;
+    if (depth > 0)
+        memcpy(&depthBits, &depth, sizeof(depthBits));
+
+    return uint64_t(renderPass & 0x3) << 62 |
+           uint64_t(program & 0x3ff) << 52 |
+           uint64_t(textureSetHash & 0xfff) << 40 |
+           uint64_t(materialId & 0xffff) << 24 |
+           uint64_t(depthBits >> 8);
+}
+
+void RenderQueue::clear() {
+    packets_.clear();
+    order_.clear();
+}
+
+void RenderQueue::push(Geometry &geometry, Material &material,
+                       const Matrix4 &modelMatrix, float depth, unsigned int pickId) {
+    DrawPacket p;
+    // the sky is at the far plane whatever its model matrix
+    p.sortKey = makeSortKey(
+        material.getRenderPass(), material.getProgram(),
+        material.getTextureSetHash(), material.getId(),
+        material.getRenderPass() == RENDER_PASS_OPAQUE ? depth : 0);
+    p.modelMatrix = modelMatrix;
+    p.geometry = &geometry;
+    p.material = &material;
+    p.pickId = pickId;
+    packets_.push_back(p);
+}
+
+void RenderQueue::sort() {
+    const int n = packets_.size();
+    order_.resize(n);
+    scratch_.resize(n);
+    for (int i = 0; i < n; ++i) {
+        order_[i].key = packets_[i].sortKey;
+        order_[i].packet = i;
+    }
+    countChanges(order_, unsortedStats_);
+
+    // LSD radix sort, one byte per pass. Passes where every key has the
+    // same byte are skipped, which for a small scene is most of them.
+    for (int shift = 0; shift < 64; shift += 8) {
+        int counts[256] = {0};
+        for (int i = 0; i < n; ++i) {
+            ++counts[(order_[i].key >> shift) & 0xff];
+        }
+        if (n == 0 || counts[(order_[0].key >> shift) & 0xff] == n)
+            continue;
+
+        int offset = 0;
+        for (int b = 0; b < 256; ++b) {
+            const int count = counts[b];
+            counts[b] = offset;
+            offset += count;
+        }
+        for (int i = 0; i < n; ++i) {
+            scratch_[counts[(order_[i].key >> shift) & 0xff]++] = order_[i];
+        }
+        order_.swap(scratch_);
+    }
+    countChanges(order_, sortedStats_);
+}
+
+void RenderQueue::submit(Uniforms &uniforms, bool sorted) {
+    const int n = packets_.size();
+    // push order if the packets were not sorted since clear
+    const bool useOrder = sorted && int(order_.size()) == n;
+    const bool instanced = useOrder && instancing_;
+    drawn_.assign(n, 0);
+    drawCalls_ = 0;
+    if (instanced)
+        findInstanceRuns();
+
+    for (int i = 0; i < n; ++i) {
+        const int packet = useOrder ? order_[i].packet : i;
+        if (drawn_[packet])
+            continue;
+        if (instanced && runs_[i] >= 0) {
+            submitInstanced(uniforms, runs_[i]);
+            continue;
+        }
+
+        const DrawPacket &p = packets_[packet];
+        sendModelMatrix(uniforms, p.modelMatrix);
+        sendPickId(uniforms, p.pickId);
+        p.material->draw(*p.geometry, uniforms);
+        drawn_[packet] = 1;
+        ++drawCalls_;
+    }
+}
+
+void RenderQueue::findInstanceRuns() {
+    const int n = order_.size();
+    instanceItems_.clear();
+    runs_.assign(n, -1);
+
+    // the packets of a material are contiguous once sorted, the geometries
+    // drawn with it may alternate
+    for (int first = 0, last; first < n; first = last) {
+        const uint64_t group = order_[first].key >> 24;
+        for (last = first + 1; last < n && order_[last].key >> 24 == group; ++last) {}
+
+        const int begin = instanceItems_.size();
+        for (int i = first; i < last; ++i) {
+            const DrawPacket &p = packets_[order_[i].packet];
+            if (p.material->isInstanceable() && dynamic_cast<BufferObjectGeometry *>(p.geometry)) {
+                const InstanceItem item = {p.geometry, p.material, i};
+                instanceItems_.push_back(item);
+            }
+        }
+        const int end = instanceItems_.size();
+        // std::, RenderQueue::sort hides it
+        std::sort(instanceItems_.begin() + begin, instanceItems_.end(),
+                  [](const InstanceItem &a, const InstanceItem &b) {
+                      const less<const void *> before;
+                      if (a.geometry != b.geometry)
+                          return before(a.geometry, b.geometry);
+                      if (a.material != b.material)
+                          return before(a.material, b.material);
+                      return a.position < b.position;
+                  });
+
+        for (int run = begin, next; run < end; run = next) {
+            for (next = run + 1; next < end && instanceItems_[next].batchesWith(instanceItems_[run]); ++next) {}
+            if (next - run >= 2)
+                runs_[instanceItems_[run].position] = run;
+        }
+    }
+}
+
+void RenderQueue::submitInstanced(Uniforms &uniforms, int run) {
+    static const string INSTANCE_ATTRIB = "aModelMatrix", PICK_ID_ATTRIB = "aPickId";
+
+    const InstanceItem &item = instanceItems_[run];
+    BufferObjectGeometry *geometry = static_cast<BufferObjectGeometry *>(item.geometry);
+
+    instances_.clear();
+    instancePickIds_.clear();
+    const int numItems = instanceItems_.size();
+    for (int i = run; i < numItems && instanceItems_[i].batchesWith(item); ++i) {
+        const int packet = order_[instanceItems_[i].position].packet;
+        instances_.push_back(InstanceModelMatrix(packets_[packet].modelMatrix));
+        instancePickIds_.push_back(InstancePickId(packets_[packet].pickId));
+        drawn_[packet] = 1;
+    }
+
+    shared_ptr<FormattedVbo> vbo = geometry->getWiredVbo(INSTANCE_ATTRIB);
+    if (!vbo) {
+        vbo.reset(new FormattedVbo(InstanceModelMatrix::FORMAT));
+        geometry->wire(vbo);
+    } else if (&vbo->getVertexFormat() != &InstanceModelMatrix::FORMAT) {
+        throw runtime_error("RenderQueue: " + INSTANCE_ATTRIB +
+                            " of the geometry is not an InstanceModelMatrix");
+    }
+    vbo->upload(&instances_[0], instances_.size(), true);
+
+    shared_ptr<FormattedVbo> pickIdVbo = geometry->getWiredVbo(PICK_ID_ATTRIB);
+    if (!pickIdVbo) {
+        pickIdVbo.reset(new FormattedVbo(InstancePickId::FORMAT));
+        geometry->wire(pickIdVbo);
+    } else if (&pickIdVbo->getVertexFormat() != &InstancePickId::FORMAT) {
+        throw runtime_error("RenderQueue: " + PICK_ID_ATTRIB +
+                            " of the geometry is not an InstancePickId");
+    }
+    pickIdVbo->upload(&instancePickIds_[0], instancePickIds_.size(), true);
+    item.material->drawInstanced(*geometry, uniforms, instances_.size());
+    ++drawCalls_;
+}
+
+void RenderQueue::countChanges(const vector<SortItem> &items,
+                               Stats &stats) const {
+    stats.draws = items.size();
+    stats.programChanges = stats.textureSetChanges = stats.materialChanges = 0;
+
+    const DrawPacket *prev = NULL;
+    for (size_t i = 0; i < items.size(); ++i) {
+        const DrawPacket &p = packets_[items[i].packet];
+        if (!prev || p.material->getProgram() != prev->material->getProgram())
+            ++stats.programChanges;
+        if (!prev || (p.sortKey >> 40 & 0xfff) != (prev->sortKey >> 40 & 0xfff))
+            ++stats.textureSetChanges;
+        if (!prev || p.material != prev->material)
+            ++stats.materialChanges;
+        prev = &p;
+    }
+}
@@ -9,7 +9,8 @@ static const unsigned int kBlendBit = 1, kCullFaceBit = 2;
 
 RenderStates::RenderStates()
     : glFrontAndBack(GL_FILL), glBlendSrcFactor(GL_ONE),
-      glBlendDstFactor(GL_ZERO), glCullFaceMode(GL_BACK), flags(kCullFaceBit) {}
+      glBlendDstFactor(GL_ZERO), glCullFaceMode(GL_BACK), glDepthFuncMode(GL_LESS),
+      flags(kCullFaceBit) {}
 
 RenderStates &RenderStates::polygonMode(GLenum face, GLenum mode) {
     switch (mode) {
@@ -40,6 +41,11 @@ RenderStates &RenderStates::cullFace(GLenum mode) {
     return *this;
 }
 
+RenderStates &RenderStates::depthFunc(GLenum func) {
+    glDepthFuncMode = func;
+    return *this;
+}
+
 RenderStates &RenderStates::enable(GLenum target) {
     switch (target) {
     case GL_BLEND:
@@ -90,6 +96,11 @@ void RenderStates::apply() const {
         currentRs.glCullFaceMode = glCullFaceMode;
     }
 
+    if (glDepthFuncMode != currentRs.glDepthFuncMode) {
+        ::glDepthFunc(glDepthFuncMode);
+        currentRs.glDepthFuncMode = glDepthFuncMode;
+    }
+
     if ((flags & kBlendBit) != (currentRs.flags & kBlendBit)) {
         if (flags & kBlendBit)
             ::glEnable(GL_BLEND);
@@ -125,6 +136,9 @@ void RenderStates::captureFromGl() {
     ::glGetIntegerv(GL_CULL_FACE_MODE, values);
     glCullFaceMode = values[0];
 
+    ::glGetIntegerv(GL_DEPTH_FUNC, values);
+    glDepthFuncMode = values[0];
+
     flags = 0;
     if (::glIsEnabled(GL_BLEND))
         flags |= kBlendBit;
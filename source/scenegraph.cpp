@@ -15,13 +15,66 @@ bool SgTransformNode::accept(SgNodeVisitor &visitor) {
 }
 
 void SgTransformNode::addChild(shared_ptr<SgNode> child) {
+    if (child->parent_)
+        throw runtime_error("SgTransformNode::addChild: node already has a parent");
     children_.push_back(child);
+    child->parent_ = this;
+
+    SgTransformNode *transformChild = dynamic_cast<SgTransformNode *>(child.get());
+    if (transformChild)
+        transformChild->invalidateWorldRbt();
+
+    SgTopologyListener *listener = findTopologyListener();
+    if (listener)
+        listener->onChildAdded(*this, *child);
 }
 
 void SgTransformNode::removeChild(shared_ptr<SgNode> child) {
     children_.erase(find(children_.begin(), children_.end(), child));
+    child->parent_ = NULL;
+
+    SgTransformNode *transformChild = dynamic_cast<SgTransformNode *>(child.get());
+    if (transformChild)
+        transformChild->invalidateWorldRbt();
+
+    SgTopologyListener *listener = findTopologyListener();
+    if (listener)
+        listener->onChildRemoved(*this, *child);
+}
+
+SgTopologyListener *SgTransformNode::findTopologyListener() {
+    SgTransformNode *root = this;
+    while (root->getParent())
+        root = root->getParent();
+    return root->topologyListener_;
+}
+
+const RigTForm &SgTransformNode::getWorldRbt() {
+    if (worldRbtDirty_) {
+        worldRbt_ = parent_ ? parent_->getWorldRbt() * getRbt() : getRbt();
+        worldRbtDirty_ = false;
+    }
+    return worldRbt_;
+}
+
+void SgTransformNode::invalidateWorldRbt() {
+    rbtChanged_ = true;
+    markWorldRbtDirty();
 }
 
+void SgTransformNode::markWorldRbtDirty() {
+    if (worldRbtDirty_)
+        return; // and so are the descendants
+    worldRbtDirty_ = true;
+    for (int i = 0, n = children_.size(); i < n; ++i) {
+        SgTransformNode *child = dynamic_cast<SgTransformNode *>(children_[i].get());
+        if (child)
+            child->markWorldRbtDirty();
+    }
+}
+
+unsigned int SgShapeNode::nextPickId_ = 1;
+
 bool SgShapeNode::accept(SgNodeVisitor &visitor) {
     if (!visitor.visit(*this))
         return false;
@@ -65,6 +118,27 @@ class RbtAccumVisitor : public SgNodeVisitor {
 RigTForm getPathAccumRbt(shared_ptr<SgTransformNode> source,
                          shared_ptr<SgTransformNode> destination,
                          int offsetFromDestination) {
+    // levels from source down to destination
+    int depth = 0;
+    SgTransformNode *node = destination.get();
+    for (; node && node != source.get(); node = node->getParent()) {
+        ++depth;
+    }
+    if (!node || offsetFromDestination > depth)
+        throw runtime_error("getPathAccumRbt: target not below source");
+
+    node = destination.get();
+    for (int i = 0; i < offsetFromDestination; ++i) {
+        node = node->getParent();
+    }
+    if (node == source.get())
+        return RigTForm();
+    return inv(source->getWorldRbt()) * node->getWorldRbt();
+}
+
+RigTForm getPathAccumRbtByTraversal(shared_ptr<SgTransformNode> source,
+                                    shared_ptr<SgTransformNode> destination,
+                                    int offsetFromDestination) {
 
     RbtAccumVisitor accum(*destination);
     source->accept(accum);
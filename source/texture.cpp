@@ -26,7 +26,7 @@ ImageTexture::ImageTexture(const char *filename) {
             assert(false);
         }
 
-        glBindTexture(GL_TEXTURE_2D, tex);
+        bind();
 
         if (g_Gl2Compatible)
             glTexParameteri(GL_TEXTURE_2D, GL_GENERATE_MIPMAP, GL_TRUE);
@@ -60,7 +60,7 @@ CubeMapTexture::CubeMapTexture(std::vector<std::string> faces) {
     // +Z (front)
     // -Z (back)
 
-    glBindTexture(GL_TEXTURE_CUBE_MAP, tex);
+    bind();
 
     int width, height, nrComponents;
     for (unsigned int i = 0; i < faces.size(); i++)
@@ -0,0 +1,107 @@
+#include <algorithm>
+#include <cassert>
+#include <stdint.h>
+
+#include "threadpool.h"
+
+using namespace std;
+
+ThreadPool::ThreadPool(int numThreads)
+    : numThreads_(numThreads > 0
+                      ? numThreads
+                      : max(1, int(thread::hardware_concurrency()))),
+      chunks_(new Chunk[numThreads_]), job_(NULL), generation_(0),
+      pendingWorkers_(0), quit_(false) {
+    for (int i = 0; i < numThreads_; ++i) {
+        chunks_[i].next = 0;
+        chunks_[i].end = 0;
+    }
+    // worker 0 is whoever calls parallelFor
+    for (int i = 1; i < numThreads_; ++i) {
+        threads_.push_back(thread(&ThreadPool::workerLoop, this, i));
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        lock_guard<mutex> lock(mutex_);
+        quit_ = true;
+    }
+    wakeCv_.notify_all();
+    for (size_t i = 0; i < threads_.size(); ++i) {
+        threads_[i].join();
+    }
+}
+
+ThreadPool &ThreadPool::getSingleton() {
+    static ThreadPool pool;
+    return pool;
+}
+
+void ThreadPool::parallelFor(int numTasks,
+                             const function<void(int, int)> &fn) {
+    if (numTasks <= 0)
+        return;
+
+    lock_guard<mutex> callLock(callMutex_);
+
+    if (numThreads_ == 1 || numTasks == 1) {
+        for (int i = 0; i < numTasks; ++i) {
+            fn(i, 0);
+        }
+        return;
+    }
+
+    // hand every worker an equal contiguous chunk
+    for (int i = 0; i < numThreads_; ++i) {
+        chunks_[i].next = int(int64_t(numTasks) * i / numThreads_);
+        chunks_[i].end = int(int64_t(numTasks) * (i + 1) / numThreads_);
+    }
+
+    {
+        lock_guard<mutex> lock(mutex_);
+        job_ = &fn;
+        pendingWorkers_ = numThreads_ - 1;
+        ++generation_;
+    }
+    wakeCv_.notify_all();
+
+    runTasks(0);
+
+    unique_lock<mutex> lock(mutex_);
+    doneCv_.wait(lock, [this] { return pendingWorkers_ == 0; });
+    job_ = NULL;
+}
+
+void ThreadPool::workerLoop(int worker) {
+    unsigned int seenGeneration = 0;
+    for (;;) {
+        {
+            unique_lock<mutex> lock(mutex_);
+            wakeCv_.wait(lock, [&] {
+                return quit_ || generation_ != seenGeneration;
+            });
+            if (quit_)
+                return;
+            seenGeneration = generation_;
+        }
+
+        runTasks(worker);
+
+        lock_guard<mutex> lock(mutex_);
+        if (--pendingWorkers_ == 0)
+            doneCv_.notify_one();
+    }
+}
+
+void ThreadPool::runTasks(int worker) {
+    const function<void(int, int)> &fn = *job_;
+
+    // own chunk first, then steal from the others round robin
+    for (int k = 0; k < numThreads_; ++k) {
+        Chunk &chunk = chunks_[(worker + k) % numThreads_];
+        for (int task = chunk.next++; task < chunk.end; task = chunk.next++) {
+            fn(task, worker);
+        }
+    }
+}
@@ -0,0 +1,160 @@
+#include <algorithm>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "uniforms.h"
+
+using namespace std;
+
+namespace {
+// Process wide intern tables, only used from the GL thread
+struct UniformIdTable {
+    unordered_map<string, int> ids;
+    map<vector<int>, int> layouts;
+
+    // sorted ids of every layout, by layout id. Layout 0 is the empty set.
+    vector<vector<int>> layoutIds;
+
+    // layout reached by adding an id to a layout, so that a Uniforms
+    // gaining a name it held in an earlier frame finds its layout without
+    // building the id set again
+    map<pair<int, int>, int> transitions;
+
+    UniformIdTable() { getLayout(vector<int>()); }
+
+    int getLayout(const vector<int> &ids) {
+        map<vector<int>, int>::iterator i = layouts.find(ids);
+        if (i == layouts.end()) {
+            i = layouts.insert(make_pair(ids, int(layoutIds.size()))).first;
+            layoutIds.push_back(ids);
+        }
+        return i->second;
+    }
+
+    static UniformIdTable &getSingleton() {
+        static UniformIdTable table;
+        return table;
+    }
+};
+
+struct EntryIdLess {
+    template <typename Entry> bool operator()(const Entry &e, int id) const {
+        return e.id < id;
+    }
+};
+} // namespace
+
+UniformKey::UniformKey(const char *name) : id_(Uniforms::getId(name)) {}
+
+UniformKey::UniformKey(const string &name) : id_(Uniforms::getId(name)) {}
+
+int Uniforms::getId(const string &name) {
+    unordered_map<string, int> &ids = UniformIdTable::getSingleton().ids;
+    // find first, insert would build a node even for a known name
+    unordered_map<string, int>::const_iterator i = ids.find(name);
+    if (i != ids.end())
+        return i->second;
+    return ids.insert(make_pair(name, int(ids.size()))).first->second;
+}
+
+int Uniforms::findId(const string &name) {
+    const unordered_map<string, int> &ids = UniformIdTable::getSingleton().ids;
+    unordered_map<string, int>::const_iterator i = ids.find(name);
+    return i == ids.end() ? -1 : i->second;
+}
+
+bool Uniforms::isSamplerType(GLenum type) {
+    switch (type) {
+    case GL_SAMPLER_1D:
+    case GL_SAMPLER_2D:
+    case GL_SAMPLER_CUBE:
+    case GL_SAMPLER_1D_SHADOW:
+    case GL_SAMPLER_2D_SHADOW:
+        return true;
+    default:
+        return false;
+    }
+}
+
+int Uniforms::getEntryIndex(int id) {
+    const Entry *i = lower_bound(entries_.begin(), entries_.end(), id, EntryIdLess());
+    const int index = int(i - entries_.begin());
+    if (i != entries_.end() && i->id == id)
+        return index;
+
+    Entry e;
+    e.id = id;
+    e.type = 0;
+    e.size = e.offset = e.capacity = 0;
+    entries_.insert(index, e);
+
+    UniformIdTable &table = UniformIdTable::getSingleton();
+    const pair<int, int> transition(layout_, id);
+    map<pair<int, int>, int>::const_iterator t = table.transitions.find(transition);
+    if (t != table.transitions.end()) {
+        layout_ = t->second;
+    } else {
+        vector<int> ids(table.layoutIds[layout_]);
+        ids.insert(lower_bound(ids.begin(), ids.end(), id), id);
+        layout_ = table.transitions[transition] = table.getLayout(ids);
+    }
+    return index;
+}
+
+GLuint *Uniforms::putWords(const UniformKey &key, GLenum type, int size,
+                           int numWords) {
+    assert(size > 0);
+    Entry &e = entries_[getEntryIndex(key.getId())];
+    if (isSamplerType(e.type) || e.capacity < numWords) {
+        if (isSamplerType(e.type))
+            fill(getTextures(e), getTextures(e) + e.capacity, shared_ptr<Texture>());
+        // the old words, if any, are left unused
+        e.offset = words_.size();
+        e.capacity = numWords;
+        words_.resize(words_.size() + numWords);
+    }
+    e.type = type;
+    e.size = size;
+    return &words_[e.offset];
+}
+
+Uniforms &Uniforms::put(const UniformKey &key, const shared_ptr<Texture> *values,
+                        int count) {
+    assert(count > 0);
+    const GLenum type = values[0]->getSamplerType();
+    for (int i = 0; i < count; ++i) {
+        assert(values[i]->getSamplerType() == type);
+    }
+
+    Entry &e = entries_[getEntryIndex(key.getId())];
+    if (!isSamplerType(e.type) || e.capacity < count)
+        reserveTextures(e, count);
+    e.type = type;
+    e.size = count;
+    copy(values, values + count, getTextures(e));
+    return *this;
+}
+
+void Uniforms::reserveTextures(Entry &e, int count) {
+    if (isSamplerType(e.type))
+        fill(getTextures(e), getTextures(e) + e.capacity, shared_ptr<Texture>());
+    if (numInlineTextures_ + count <= INLINE_TEXTURES) {
+        e.offset = numInlineTextures_;
+        numInlineTextures_ += count;
+    } else {
+        e.offset = INLINE_TEXTURES + moreTextures_.size();
+        moreTextures_.resize(moreTextures_.size() + count);
+    }
+    e.capacity = count;
+}
+
+int Uniforms::findEntry(const string &name) const {
+    const int id = findId(name);
+    if (id < 0)
+        return -1;
+    const Entry *i = lower_bound(entries_.begin(), entries_.end(), id, EntryIdLess());
+    return i == entries_.end() || i->id != id ? -1 : int(i - entries_.begin());
+}
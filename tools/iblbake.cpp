@@ -0,0 +1,241 @@
+////////////////////////////////////////////////////////////////////////
+//
+//   iblbake: offline baking of image based lighting data
+//
+//   Usage:
+//     iblbake [--threads N] --brdf-lut [output]
+//         bake the split-sum BRDF LUT (default ./resource/brdf_lut.bin)
+//     iblbake [--threads N] [--cache-dir dir] hdr...
+//         bake the environment cubemap, irradiance map and SH, and the
+//         prefilter mip chain of each equirectangular .hdr into the IBL cache (default
+//         ./resource/cache), where the renderer picks them up instead of
+//         running the GPU precompute
+//     iblbake [--threads N] --bench hdr
+//         time every stage with 1 thread and with N threads and report
+//         texels/sec
+//
+//   N defaults to the number of hardware threads.
+//
+////////////////////////////////////////////////////////////////////////
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "iblcache.h"
+#include "iblcpu.h"
+#include "stb_image.h"
+#include "threadpool.h"
+
+using namespace std;
+
+static const int g_brdfLUTWidth = 512;
+static const int g_brdfLUTHeight = 512;
+
+static const string BRDF_LUT_PATH = "./resource/brdf_lut.bin";
+static const string IBL_CACHE_DIR = "./resource/cache";
+
+// Samples per texel of the prefilter pass, as in shaders/prefilter.fshader
+static const int PREFILTER_SAMPLE_COUNT = 1024;
+
+static void usage() {
+    cerr << "Usage: iblbake [--threads N] --brdf-lut [output]\n"
+         << "       iblbake [--threads N] [--cache-dir dir] hdr...\n"
+         << "       iblbake [--threads N] --bench hdr" << endl;
+}
+
+static double getSeconds() {
+    return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void bakeBrdfLUT(const string &outPath, ThreadPool &pool) {
+    vector<float> rg;
+    generateBrdfLUT(g_brdfLUTWidth, g_brdfLUTHeight, rg, pool);
+
+    IblCacheImage lut;
+    lut.faces = 1;
+    lut.channels = 2;
+    lut.width = g_brdfLUTWidth;
+    lut.height = g_brdfLUTHeight;
+    lut.mips.resize(1);
+    lut.mips[0].resize(rg.size());
+    for (size_t i = 0; i < rg.size(); ++i) {
+        lut.mips[0][i] = floatToHalf(rg[i]);
+    }
+
+    writeBrdfLUT(outPath, lut);
+    cout << "Wrote " << g_brdfLUTWidth << "x" << g_brdfLUTHeight
+         << " BRDF LUT to " << outPath << endl;
+}
+
+static void loadHdr(const string &hdrPath, EquirectImage &image) {
+    // same orientation as prepareIBL in main.cpp
+    stbi_set_flip_vertically_on_load(true);
+    int nrComponents;
+    float *data = stbi_loadf(hdrPath.c_str(), &image.width, &image.height, &nrComponents, 3);
+    if (!data)
+        throw runtime_error("Failed to load HDR image " + hdrPath);
+    image.rgb.assign(data, data + size_t(image.width) * image.height * 3);
+    stbi_image_free(data);
+}
+
+// Appends the faces of `cube' as mip `mip' of `image'
+static void storeCubemap(const CpuCubemap &cube, int mip, IblCacheImage &image) {
+    if (mip == 0) {
+        image.faces = 6;
+        image.channels = 3;
+        image.width = image.height = cube.size;
+    }
+    image.mips.resize(mip + 1);
+    vector<unsigned short> &dst = image.mips[mip];
+    dst.reserve(image.getMipSize(mip));
+    for (int face = 0; face < 6; ++face) {
+        for (size_t i = 0; i < cube.faces[face].size(); ++i) {
+            dst.push_back(floatToHalf(cube.faces[face][i]));
+        }
+    }
+}
+
+static void bakeEnvironment(const string &hdrPath, const string &cacheDir,
+                            ThreadPool &pool) {
+    const uint64_t key = makeIblCacheKey(hdrPath);
+    const double start = getSeconds();
+
+    EquirectImage hdr;
+    loadHdr(hdrPath, hdr);
+
+    IblCacheEntry entry;
+    Cvec3f sh[9];
+    projectIrradianceSH(hdr, sh, pool);
+    for (int i = 0; i < 9; ++i) {
+        entry.irradianceSH.insert(entry.irradianceSH.end(), &sh[i][0], &sh[i][0] + 3);
+    }
+
+    CpuCubemap env, cube;
+    bakeEnvCubemap(hdr, IBL_ENV_SIZE, env, pool);
+    storeCubemap(env, 0, entry.envCubemap);
+
+    bakeIrradianceMap(env, IBL_IRRADIANCE_SIZE, cube, pool);
+    storeCubemap(cube, 0, entry.irradianceMap);
+
+    for (int mip = 0; mip < IBL_PREFILTER_MIPS; ++mip) {
+        const float roughness = float(mip) / float(IBL_PREFILTER_MIPS - 1);
+        bakePrefilterMap(env, IBL_PREFILTER_SIZE >> mip, roughness, cube,
+                         PREFILTER_SAMPLE_COUNT, pool);
+        storeCubemap(cube, mip, entry.prefilterMap);
+    }
+
+    const string cachePath = getIblCachePath(cacheDir, key);
+    writeIblCache(cachePath, key, entry);
+    cout << "Baked " << hdrPath << " to " << cachePath << " in " << fixed
+         << setprecision(2) << getSeconds() - start << "s" << endl;
+}
+
+// Runs `stage' and returns the number of texels it produced per second
+template <typename Stage>
+static double measure(double texels, Stage stage) {
+    const double start = getSeconds();
+    stage();
+    return texels / (getSeconds() - start);
+}
+
+static void benchStage(const char *name, double texels, int numThreads,
+                       const function<void(ThreadPool &)> &stage) {
+    ThreadPool single(1), multi(numThreads);
+    const double rate1 = measure(texels, [&] { stage(single); });
+    const double rateN = measure(texels, [&] { stage(multi); });
+    cout << left << setw(12) << name << right << fixed << setprecision(0)
+         << setw(14) << rate1 << setw(14) << rateN << setprecision(2)
+         << setw(10) << rateN / rate1 << "x" << endl;
+}
+
+static void bench(const string &hdrPath, int numThreads) {
+    EquirectImage hdr;
+    loadHdr(hdrPath, hdr);
+
+    CpuCubemap env, cube;
+    bakeEnvCubemap(hdr, IBL_ENV_SIZE, env);
+
+    cout << "texels/sec" << setw(16) << "1 thread" << setw(11) << numThreads
+         << " threads" << setw(11) << "speedup" << endl;
+
+    benchStage("env", 6.0 * IBL_ENV_SIZE * IBL_ENV_SIZE, numThreads,
+               [&](ThreadPool &pool) {
+                   bakeEnvCubemap(hdr, IBL_ENV_SIZE, cube, pool);
+               });
+    benchStage("irradiance", 6.0 * IBL_IRRADIANCE_SIZE * IBL_IRRADIANCE_SIZE,
+               numThreads, [&](ThreadPool &pool) {
+                   bakeIrradianceMap(env, IBL_IRRADIANCE_SIZE, cube, pool);
+               });
+    // roughness 0.5 keeps most GGX samples above the horizon, like the
+    // middle mips of the real chain
+    benchStage("prefilter", 6.0 * IBL_PREFILTER_SIZE * IBL_PREFILTER_SIZE,
+               numThreads, [&](ThreadPool &pool) {
+                   bakePrefilterMap(env, IBL_PREFILTER_SIZE, 0.5f, cube,
+                                    PREFILTER_SAMPLE_COUNT, pool);
+               });
+    benchStage("sh9", double(hdr.width) * hdr.height, numThreads,
+               [&](ThreadPool &pool) {
+                   Cvec3f sh[9];
+                   projectIrradianceSH(hdr, sh, pool);
+               });
+    benchStage("brdf-lut", double(g_brdfLUTWidth) * g_brdfLUTHeight,
+               numThreads, [&](ThreadPool &pool) {
+                   vector<float> rg;
+                   generateBrdfLUT(g_brdfLUTWidth, g_brdfLUTHeight, rg, pool);
+               });
+}
+
+int main(int argc, char *argv[]) {
+    try {
+        int numThreads = 0;
+        bool brdfLUT = false, benchmark = false;
+        string cacheDir = IBL_CACHE_DIR;
+        vector<string> args;
+
+        for (int i = 1; i < argc; ++i) {
+            if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+                numThreads = atoi(argv[++i]);
+            } else if (strcmp(argv[i], "--cache-dir") == 0 && i + 1 < argc) {
+                cacheDir = argv[++i];
+            } else if (strcmp(argv[i], "--brdf-lut") == 0) {
+                brdfLUT = true;
+            } else if (strcmp(argv[i], "--bench") == 0) {
+                benchmark = true;
+            } else if (argv[i][0] == '-') {
+                usage();
+                return 1;
+            } else {
+                args.push_back(argv[i]);
+            }
+        }
+
+        ThreadPool pool(numThreads);
+
+        if (brdfLUT && args.size() <= 1) {
+            bakeBrdfLUT(args.empty() ? BRDF_LUT_PATH : args[0], pool);
+            return 0;
+        }
+        if (benchmark && args.size() == 1) {
+            bench(args[0], pool.getNumThreads());
+            return 0;
+        }
+        if (!brdfLUT && !benchmark && !args.empty()) {
+            for (size_t i = 0; i < args.size(); ++i) {
+                bakeEnvironment(args[i], cacheDir, pool);
+            }
+            return 0;
+        }
+        usage();
+        return 1;
+    } catch (const runtime_error &e) {
+        cout << "Exception caught: " << e.what() << endl;
+        return -1;
+    }
+}
@@ -0,0 +1,244 @@
+////////////////////////////////////////////////////////////////////////
+//
+//   meshconv: offline conversion of .obj meshes to the binary mesh cache
+//
+//   Usage:
+//     meshconv [--cache-dir dir] obj...
+//         import each .obj (see importObjMesh in meshcache.h) and write
+//         the result into the mesh cache (default ./resource/cache), where
+//         the renderer maps it instead of parsing the .obj
+//     meshconv [--cache-dir dir] --bench obj [runs]
+//         compare the startup cost of importing the .obj with that of
+//         mapping its cache entry, best of `runs' (default 5)
+//     meshconv --verify obj...
+//         check that parseObj gives bit for bit the result of tinyobj
+//     meshconv --parse-bench obj [runs]
+//         parse throughput of parseObj at 1, 2, 4 and 8 threads, and of
+//         tinyobj, best of `runs' (default 5)
+//
+////////////////////////////////////////////////////////////////////////
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "meshcache.h"
+#include "objparser.h"
+#include "threadpool.h"
+
+using namespace std;
+
+static const string MESH_CACHE_DIR = "./resource/cache";
+
+static void usage() {
+    cerr << "Usage: meshconv [--cache-dir dir] obj...\n"
+         << "       meshconv [--cache-dir dir] --bench obj [runs]\n"
+         << "       meshconv --verify obj...\n"
+         << "       meshconv --parse-bench obj [runs]" << endl;
+}
+
+static double getSeconds() {
+    return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void convert(const string &objPath, const string &cacheDir) {
+    const double start = getSeconds();
+    const uint64_t key = makeMeshCacheKey(objPath, cacheDir);
+    MeshData mesh;
+    importObjMesh(objPath.c_str(), mesh);
+
+    const string cachePath = getMeshCachePath(cacheDir, key);
+    writeMeshCache(cachePath, key, mesh);
+    cout << "Converted " << objPath << " to " << cachePath << " in " << fixed
+         << setprecision(2) << getSeconds() - start << "s" << endl;
+}
+
+// Stands in for glBufferData, which copies the buffers before the loader
+// returns
+static void stage(vector<char> &staging, const void *data, size_t bytes) {
+    staging.resize(bytes);
+    memcpy(&staging[0], data, bytes);
+}
+
+// Best time of `runs' calls of `load'
+template <typename Load>
+static double measure(int runs, Load load) {
+    double best = 0.0;
+    for (int i = 0; i < runs; ++i) {
+        const double start = getSeconds();
+        load();
+        const double elapsed = getSeconds() - start;
+        if (i == 0 || elapsed < best)
+            best = elapsed;
+    }
+    return best;
+}
+
+static void bench(const string &objPath, const string &cacheDir, int runs) {
+    const uint64_t key = makeMeshCacheKey(objPath, cacheDir);
+    const string cachePath = getMeshCachePath(cacheDir, key);
+    {
+        MeshCacheFile file;
+        if (!file.open(cachePath, key))
+            convert(objPath, cacheDir);
+    }
+
+    vector<char> vbo, ibo;
+
+    // silence the import report while timing
+    streambuf *coutBuf = cout.rdbuf(NULL);
+    // a cache miss hashes the .obj
+    const double objTime = measure(runs, [&] {
+        hashMeshSource(objPath);
+        MeshData mesh;
+        importObjMesh(objPath.c_str(), mesh);
+        vector<VertexPNTBX> vertices;
+        mesh.getTangentVertices(vertices);
+        stage(vbo, &vertices[0], mesh.getVboBytes());
+        if (mesh.vertices.size() <= 0x10000) {
+            const vector<unsigned short> indices(mesh.indices.begin(), mesh.indices.end());
+            stage(ibo, &indices[0], mesh.getIboBytes());
+        } else {
+            stage(ibo, &mesh.indices[0], mesh.getIboBytes());
+        }
+    });
+    cout.rdbuf(coutBuf);
+
+    size_t vboBytes = 0, iboBytes = 0;
+    const double binTime = measure(runs, [&] {
+        MeshCacheFile file;
+        if (!file.open(cachePath, makeMeshCacheKey(objPath, cacheDir)))
+            throw runtime_error("Cannot map " + cachePath);
+        vboBytes = size_t(static_cast<const char *>(file.getIndices()) -
+                          static_cast<const char *>(file.getVertices()));
+        iboBytes = size_t(file.getIndexCount()) * file.getIndexSize();
+        stage(vbo, file.getVertices(), vboBytes);
+        stage(ibo, file.getIndices(), iboBytes);
+    });
+
+    const double keyTime = measure(runs, [&] { makeMeshCacheKey(objPath, cacheDir); });
+    const double hashTime = measure(runs, [&] { hashMeshSource(objPath); });
+
+    cout << objPath << ": " << (vboBytes + iboBytes) / 1024 << " KB of buffers, best of "
+         << runs << " runs\n"
+         << fixed << setprecision(2)
+         << "  obj import   " << setw(9) << objTime * 1000.0 << " ms\n"
+         << "  binary cache " << setw(9) << binTime * 1000.0 << " ms  ("
+         << keyTime * 1000.0 << " ms of it finding the key, instead of "
+         << hashTime * 1000.0 << " ms hashing the .obj)\n"
+         << "  speedup      " << setw(9) << objTime / binTime << "x" << endl;
+}
+
+template <typename T>
+static bool sameBits(const vector<T> &a, const vector<T> &b) {
+    return a.size() == b.size() && (a.empty() || memcmp(&a[0], &b[0], a.size() * sizeof(T)) == 0);
+}
+
+// Returns whether parseObj and tinyobj agree on `objPath'
+static bool verify(const string &objPath) {
+    ObjData parsed, reference;
+    parseObj(objPath, parsed);
+    parseObjTinyObj(objPath, reference);
+
+    const char *mismatch = !sameBits(parsed.vertices, reference.vertices)   ? "positions"
+                           : !sameBits(parsed.normals, reference.normals)     ? "normals"
+                           : !sameBits(parsed.texcoords, reference.texcoords) ? "texture coordinates"
+                           : !sameBits(parsed.indices, reference.indices)     ? "faces"
+                                                                              : NULL;
+    if (mismatch) {
+        cout << objPath << ": FAILED, " << mismatch << " differ from tinyobj" << endl;
+        return false;
+    }
+    cout << objPath << ": OK, " << parsed.vertices.size() / 3 << " positions, "
+         << parsed.normals.size() / 3 << " normals, " << parsed.texcoords.size() / 2
+         << " texture coordinates and " << parsed.indices.size() / 3
+         << " triangles match tinyobj" << endl;
+    return true;
+}
+
+static void parseBench(const string &objPath, int runs) {
+    ifstream ifs(objPath.c_str(), ios::binary | ios::ate);
+    if (!ifs)
+        throw runtime_error("Cannot open file " + objPath);
+    const double megabytes = double(ifs.tellg()) / (1024.0 * 1024.0);
+
+    cout << objPath << ": " << fixed << setprecision(2) << megabytes << " MB, best of "
+         << runs << " runs" << endl;
+
+    const double referenceTime = measure(runs, [&] {
+        ObjData obj;
+        parseObjTinyObj(objPath, obj);
+    });
+    cout << "  tinyobj    " << setw(9) << setprecision(1) << megabytes / referenceTime
+         << " MB/s" << endl;
+
+    const int threadCounts[] = {1, 2, 4, 8};
+    for (int i = 0; i < 4; ++i) {
+        ThreadPool pool(threadCounts[i]);
+        const double time = measure(runs, [&] {
+            ObjData obj;
+            parseObj(objPath, obj, pool);
+        });
+        cout << "  " << threadCounts[i] << (threadCounts[i] == 1 ? " thread   " : " threads  ")
+             << setw(9) << megabytes / time << " MB/s  (" << setprecision(2)
+             << referenceTime / time << "x tinyobj)" << setprecision(1) << endl;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    try {
+        bool benchmark = false, verifyParser = false, parseBenchmark = false;
+        string cacheDir = MESH_CACHE_DIR;
+        vector<string> args;
+
+        for (int i = 1; i < argc; ++i) {
+            if (strcmp(argv[i], "--cache-dir") == 0 && i + 1 < argc) {
+                cacheDir = argv[++i];
+            } else if (strcmp(argv[i], "--bench") == 0) {
+                benchmark = true;
+            } else if (strcmp(argv[i], "--verify") == 0) {
+                verifyParser = true;
+            } else if (strcmp(argv[i], "--parse-bench") == 0) {
+                parseBenchmark = true;
+            } else if (argv[i][0] == '-') {
+                usage();
+                return 1;
+            } else {
+                args.push_back(argv[i]);
+            }
+        }
+
+        if (benchmark && (args.size() == 1 || args.size() == 2)) {
+            bench(args[0], cacheDir, args.size() == 2 ? max(1, atoi(args[1].c_str())) : 5);
+            return 0;
+        }
+        if (parseBenchmark && (args.size() == 1 || args.size() == 2)) {
+            parseBench(args[0], args.size() == 2 ? max(1, atoi(args[1].c_str())) : 5);
+            return 0;
+        }
+        if (verifyParser && !args.empty()) {
+            bool ok = true;
+            for (size_t i = 0; i < args.size(); ++i) {
+                ok = verify(args[i]) && ok;
+            }
+            return ok ? 0 : 1;
+        }
+        if (!benchmark && !verifyParser && !parseBenchmark && !args.empty()) {
+            for (size_t i = 0; i < args.size(); ++i) {
+                convert(args[i], cacheDir);
+            }
+            return 0;
+        }
+        usage();
+        return 1;
+    } catch (const runtime_error &e) {
+        cout << "Exception caught: " << e.what() << endl;
+        return -1;
+    }
+}